@@ -93,8 +93,18 @@ static int LuaWrapper_Render(lua_State *L)
 	const char* filename = lua_tolstring(L, 3, &str_len);
 	KRT_RenderStatistic stat;
 	int success = KRT_RenderToImage(w, h, kRGB_8, filename, stat) ? 1 : 0;
-	if (success)
+	if (success) {
 		printf("Render time : %f\n", stat.render_time);
+		if (stat.mailbox_skip_count > 0)
+			printf("Mailbox info: tests %llu, skipped %llu\n",
+				stat.leaf_tri_test_count,
+				stat.mailbox_skip_count);
+		if (stat.pass_count > 0)
+			printf("Progressive info: passes %u, spp %u, noise %f\n",
+				stat.pass_count,
+				stat.sample_per_pixel,
+				stat.noise_estimate);
+	}
 
 	lua_pushnumber(L, success);
 	lua_pushnumber(L, stat.render_time);
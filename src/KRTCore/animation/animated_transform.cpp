@@ -3,38 +3,131 @@
 
 namespace KAnimation {
 
+// How many times the bounding box is sampled between two key frames
+static const UINT32 BBOX_SAMPLES_PER_FRAME = 8;
+
 void LocalTRSFrame::Reset(const KMatrix4& single_trans)
 {
 	mIsMoving = false;
 
-	mStartingFrame.trs.setMatrix(single_trans);
-	mEndingFrame.trs = mStartingFrame.trs;
+	mFrames.resize(1);
+	mFrames[0].trs.setMatrix(single_trans);
 }
 
 void LocalTRSFrame::Reset(const KMatrix4& starting, const KMatrix4& ending)
 {
-	mIsMoving = true;
+	KMatrix4 frames[2] = {starting, ending};
+	Reset(frames, 2);
+}
+
+void LocalTRSFrame::Reset(const KMatrix4* frames, UINT32 frame_cnt)
+{
+	mIsMoving = false;
+	for (UINT32 i = 1; i < frame_cnt; ++i) {
+		if (!(frames[i] == frames[0]))
+			mIsMoving = true;
+	}
 
-	mStartingFrame.trs.setMatrix(starting);
-	mEndingFrame.trs.setMatrix(ending);
+	if (!mIsMoving) {
+		Reset(frames[0]);
+		return;
+	}
 
-	if (starting == ending)
-		mIsMoving = false;
+	mFrames.resize(frame_cnt);
+	for (UINT32 i = 0; i < frame_cnt; ++i)
+		mFrames[i].trs.setMatrix(frames[i]);
 }
 
+void LocalTRSFrame::SampleBBox(const KBBox& in_box, std::vector<KBBox>& out_boxes, float& out_pad) const
+{
+	UINT32 sampleCnt = (UINT32)(mFrames.size() - 1) * BBOX_SAMPLES_PER_FRAME + 1;
+	out_boxes.resize(sampleCnt);
+	out_pad = 0;
+
+	KVec3 lastCorner[8];
+	for (UINT32 i = 0; i < sampleCnt; ++i) {
+		LclTRS trs;
+		Interpolate(float(i) / float(sampleCnt - 1), trs);
+		KMatrix4 mat = trs.trs.getMatrix();
+
+		// The motion of any point of the box between two samples is no longer than the one of a corner.
+		// The path is an arc at worst, which bulges out less than a quarter of its chord when the rotation
+		// between two samples is under 90 degrees.
+		out_boxes[i].SetEmpty();
+		for (int c = 0; c < 8; ++c) {
+			KVec3 corner(in_box[c & 1][0], in_box[(c >> 1) & 1][1], in_box[(c >> 2) & 1][2]);
+			KVec4 pos = KVec4(corner, 1.0f) * mat;
+			corner = KVec3(pos[0] / pos[3], pos[1] / pos[3], pos[2] / pos[3]);
+			out_boxes[i].ContainVert(corner);
+			if (i > 0) {
+				float chord = nvmath::length(corner - lastCorner[c]) * 0.25f;
+				if (chord > out_pad)
+					out_pad = chord;
+			}
+			lastCorner[c] = corner;
+		}
+	}
+}
 
 void LocalTRSFrame::ComputeTotalBBox(const KBBox& in_box, KBBox& out_box) const
 {
 	out_box.SetEmpty();
 
-	KBBox frameBBox(in_box);
-	frameBBox.TransformByMatrix(mStartingFrame.trs.getMatrix());
-	out_box.Add(frameBBox);
+	if (!mIsMoving) {
+		out_box = in_box;
+		out_box.TransformByMatrix(mFrames[0].trs.getMatrix());
+		return;
+	}
 
-	if (mIsMoving) {
-		KBBox frameBBox(in_box);
-		frameBBox.TransformByMatrix(mEndingFrame.trs.getMatrix());
-		out_box.Add(frameBBox);
+	std::vector<KBBox> boxes;
+	float pad = 0;
+	SampleBBox(in_box, boxes, pad);
+	for (size_t i = 0; i < boxes.size(); ++i)
+		out_box.Add(boxes[i]);
+	for (int axis = 0; axis < 3; ++axis) {
+		out_box.mMin[axis] -= pad;
+		out_box.mMax[axis] += pad;
+	}
+}
+
+void LocalTRSFrame::ComputeMotionBBox(const KBBox& in_start, const KBBox& in_end, KBBox& out_start, KBBox& out_end) const
+{
+	if (!mIsMoving) {
+		// An affine transform keeps the corners of the lerped box on the lerp of the transformed corners
+		out_start = in_start;
+		out_start.TransformByMatrix(mFrames[0].trs.getMatrix());
+		out_end = in_end;
+		out_end.TransformByMatrix(mFrames[0].trs.getMatrix());
+		return;
+	}
+
+	KBBox inBox = in_start;
+	inBox.Add(in_end);
+	std::vector<KBBox> boxes;
+	float pad = 0;
+	SampleBBox(inBox, boxes, pad);
+
+	// Start from the boxes at both ends, then push the bounds out until they contain all the samples
+	out_start = boxes.front();
+	out_end = boxes.back();
+	KVec3 minShift(pad, pad, pad), maxShift(pad, pad, pad);
+	float rcpCnt = 1.0f / float(boxes.size() - 1);
+	for (size_t i = 1; i + 1 < boxes.size(); ++i) {
+		float t = float(i) * rcpCnt;
+		for (int axis = 0; axis < 3; ++axis) {
+			float lo = out_start.mMin[axis] + (out_end.mMin[axis] - out_start.mMin[axis]) * t;
+			float hi = out_start.mMax[axis] + (out_end.mMax[axis] - out_start.mMax[axis]) * t;
+			if (lo - boxes[i].mMin[axis] + pad > minShift[axis])
+				minShift[axis] = lo - boxes[i].mMin[axis] + pad;
+			if (boxes[i].mMax[axis] - hi + pad > maxShift[axis])
+				maxShift[axis] = boxes[i].mMax[axis] - hi + pad;
+		}
+	}
+	for (int axis = 0; axis < 3; ++axis) {
+		out_start.mMin[axis] -= minShift[axis];
+		out_end.mMin[axis] -= minShift[axis];
+		out_start.mMax[axis] += maxShift[axis];
+		out_end.mMax[axis] += maxShift[axis];
 	}
 }
 
@@ -42,10 +135,15 @@ void LocalTRSFrame::Interpolate(float cur_t, LocalTRSFrame::LclTRS& out_TRS) con
 {
 	if (mIsMoving) {
 
-		out_TRS.trs = nvmath::lerp(cur_t, mStartingFrame.trs, mEndingFrame.trs);
+		// Find the two key frames around the time
+		float framePos = cur_t * float(mFrames.size() - 1);
+		int frame = (int)framePos;
+		if (frame < 0) frame = 0;
+		if (frame > (int)mFrames.size() - 2) frame = (int)mFrames.size() - 2;
+		out_TRS.trs = nvmath::lerp(framePos - float(frame), mFrames[frame].trs, mFrames[frame + 1].trs);
 	}
 	else {
-		out_TRS = mStartingFrame;
+		out_TRS = mFrames[0];
 	}
 }
 
@@ -64,4 +162,4 @@ void LocalTRSFrame::TransformRay(KRay& out_ray, const KRay& in_ray, const LocalT
 	out_ray.Init(newOrig, newDir, NULL);
 }
 
-}
\ No newline at end of file
+}
@@ -8,7 +8,7 @@ namespace KAnimation {
 /** This class is to handle rigid body animation, it will take a bounding box and
 	a sequence of translation, rotation and scaling, then its responsibility is to interpolate the transform
 	at a given time and compute the total bounding box that will overlap the object during 
-	the animation.
+	the animation. The key frames are evenly spaced over the shutter interval [0, 1].
 **/
 class LocalTRSFrame {
 public:
@@ -18,15 +18,22 @@ public:
 
 	void Reset(const KMatrix4& single_trans);
 	void Reset(const KMatrix4& starting, const KMatrix4& ending);
+	void Reset(const KMatrix4* frames, UINT32 frame_cnt);
+	bool IsMoving() const {return mIsMoving;}
 	void ComputeTotalBBox(const KBBox& in_box, KBBox& out_box) const;
+	// Linear bounds over the shutter interval, the transformed box at time t is inside the lerp of
+	// out_start and out_end. The input box may move linearly too, from in_start to in_end.
+	void ComputeMotionBBox(const KBBox& in_start, const KBBox& in_end, KBBox& out_start, KBBox& out_end) const;
 	void Interpolate(float cur_t, LclTRS& out_TRS) const;
 	static void TransformRay(KRay& out_ray, const KRay& in_ray, const LclTRS& trs);
 	static void Decompose(LclTRS& out_trs, const KMatrix4& mat);
 
 private:
+	// Transformed boxes at the evenly spaced times, pad bounds how far the box can bulge out between them
+	void SampleBBox(const KBBox& in_box, std::vector<KBBox>& out_boxes, float& out_pad) const;
+
 	bool mIsMoving;
-	LclTRS mStartingFrame;
-	LclTRS mEndingFrame;
+	std::vector<LclTRS> mFrames;
 };
 
 }
\ No newline at end of file
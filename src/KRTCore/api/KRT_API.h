@@ -49,7 +49,11 @@ struct KRT_SceneStatistic
 struct KRT_RenderStatistic
 {
 	double render_time;
-
+	unsigned long long leaf_tri_test_count;	// triangles tested by the leaf kernels
+	unsigned long long mailbox_skip_count;	// triangle tests skipped since the ray had tested them in another leaf
+	unsigned pass_count;	// passes of the progressive rendering, 0 if it's not progressive
+	unsigned sample_per_pixel;
+	float noise_estimate;	// estimated relative error of the pixels after the last pass
 };
 
 typedef void* SubSceneHandle;
@@ -95,6 +99,9 @@ extern "C" {
 	KRT_API void KRT_AddNodeToSubScene(SubSceneHandle subScene, const char* nodeName, unsigned meshIdx, ShaderHandle hShader, float* matrix);
 
 	KRT_API unsigned KRT_AddSubScene(TopSceneHandle scene);
+	// 0 follows ACCEL_STRUCT_TYPE, 1 kd-tree, 2 BVH. It's used when the acceleration structures are built
+	// the next time, returns false for any other type.
+	KRT_API bool KRT_SetSubSceneAccelType(SubSceneHandle subScene, unsigned accelType);
 	KRT_API SubSceneHandle KRT_GetSubSceneByIndex(TopSceneHandle scene, unsigned idx);
 	KRT_API unsigned KRT_AddNodeToScene(TopSceneHandle scene, unsigned sceneIdx, float* matrix);
 	KRT_API void KRT_ResetSubSceneNodeTransform(TopSceneHandle scene, unsigned nodeIdx);
@@ -17,13 +17,41 @@ extern UINT32 MAX_KD_DEPTH;
 extern float  COLOR_DIFF_THRESH_HOLD;
 extern UINT32 MAX_REFLECTION_BOUNCE;
 extern UINT32 USE_TEX_MAP;
+extern UINT32 THREAD_AFFINITY;
+extern UINT32 NUMA_INTERLEAVE;
 extern UINT32 ENABLE_DOF;
 extern UINT32 ENABLE_MB;
+extern UINT32 RAY_PACKET_SIZE;
+extern UINT32 SECONDARY_RAY_BATCH;
+extern UINT32 TILE_SIZE;
+extern UINT32 TILE_SIZE_MIN;
+extern UINT32 EDGE_PIPELINE;
+extern UINT32 PROGRESSIVE;
+extern UINT32 PROGRESSIVE_MAX_SPP;
+extern float  PROGRESSIVE_TIME_BUDGET;
+extern float  PROGRESSIVE_NOISE;
+
+extern UINT32 KD_BUILD_MODE;
+extern UINT32 SAH_BIN_CNT;
+extern float  SAH_TRAVERSAL_COST;
+extern float  SAH_INTERSECT_COST;
+extern float  SAH_PAIR_INTERSECT_COST;
+extern UINT32 ACCEL_STRUCT_TYPE;
+extern float  ACCEL_REFIT_THRESHOLD;
+extern UINT32 SPATIAL_SPLIT;
+extern float  SPATIAL_SPLIT_BUDGET;
+extern UINT32 WATERTIGHT_TRI_TEST;
+extern UINT32 LEAF_TRI_QUANTIZE;
+extern UINT32 LEAF_TRI_PAIR;
+extern UINT32 LEAF_MAILBOX;
+extern UINT32 ACCEL_CACHE;
+extern UINT32 MOTION_TRANSFORM_SAMPLES;
 
 
 
 // Common constants
 #define SQRT_TWO 1.4142135623730950488016887242097f
+#define MAX_RAY_PACKET_SIZE 16
 
 
 // Render options and global constants
@@ -43,21 +43,55 @@ KMatrix4d ToMatrix4d(const KMatrix4& ref)
 
 void KRay::Init(const KVec3d& o, const KVec3d& d)
 {
-	mOrign = o;
-	mDir = d;
+	mOrign = ToVec3f(o);
+	mDir = ToVec3f(d);
 
-	mRcpDir = KVec3d(1/d[0], 1/d[1], 1/d[2]);
+	// The derived values are computed in double precision before rounding
+	mRcpDir = KVec3((float)(1/d[0]), (float)(1/d[1]), (float)(1/d[2]));
+	// The sign comes from the reciprocal, a -0 component gives -inf and must pick the far slab first
 	mSign[0] = (mRcpDir[0] < 0) ? 1 : 0;
 	mSign[1] = (mRcpDir[1] < 0) ? 1 : 0;
 	mSign[2] = (mRcpDir[2] < 0) ? 1 : 0;
 
-	mNormDir = mDir;
-	mDirLen = mNormDir.normalize();
+	KVec3d normDir = d;
+	mDirLen = (float)normDir.normalize();
+	mNormDir = ToVec3f(normDir);
 
 	mExcludeBBoxNode = INVALID_INDEX;
 	mExcludeTriID = INVALID_INDEX;
 }
 
+void KRay::InitTransformed(const KRay& in_ray, const KMatrix4& inv_trans)
+{
+	// The transform is affine, the origin is transformed as a point and the direction as a vector,
+	// so there's no divide by w and no round trip through the double precision.
+	const KVec3& o = in_ray.mOrign;
+	const KVec3& d = in_ray.mDir;
+	for (int i = 0; i < 3; ++i) {
+		mOrign[i] = o[0] * inv_trans[0][i] + o[1] * inv_trans[1][i] + o[2] * inv_trans[2][i] + inv_trans[3][i];
+		mDir[i] = d[0] * inv_trans[0][i] + d[1] * inv_trans[1][i] + d[2] * inv_trans[2][i];
+		mRcpDir[i] = 1.0f / mDir[i];
+		mSign[i] = (mRcpDir[i] < 0) ? 1 : 0;	// see Init, -0 must count as negative
+	}
+
+	mDirLen = sqrtf(mDir * mDir);
+	mNormDir = mDir * (1.0f / mDirLen);
+
+	mExcludeBBoxNode = INVALID_INDEX;
+	mExcludeTriID = INVALID_INDEX;
+}
+
+bool KRayPacket::IsCoherent() const
+{
+	for (UINT32 i = 1; i < ray_cnt; ++i) {
+		if (rays[i].mSign[0] != rays[0].mSign[0] || 
+			rays[i].mSign[1] != rays[0].mSign[1] || 
+			rays[i].mSign[2] != rays[0].mSign[2])
+			return false;
+	}
+	return true;
+}
+
 void KRay::Init(const KVec3d& o, const KVec3d& d, const KBBox* clamp_bbox) 
 {
 	Init(o, d);
@@ -105,45 +139,44 @@ void KScene::SetNodeTM(UINT32 nodeIdx, const KMatrix4& tm)
 	}
 }
 
-void KScene::InitAccelTriangleCache(std::vector<KTriDesc>& triCache) const
+UINT32 KScene::InitAccelTriangleCache(std::vector<KTriInstance>& instances) const
 {
-	// 1.caculate the total triangle count, instanced mesh will be taken into acount
+	// Each node-mesh pair with faces gets one entry, instanced mesh will be taken into acount
+	instances.clear();
 	UINT32 totalTriCnt = 0; 
-	for (std::vector<KNode*>::const_iterator it = mpNode.begin(); it != mpNode.end(); ++it) {
-		for (std::vector<UINT32>::iterator it_mesh = (*it)->mMesh.begin(); 
-			it_mesh != (*it)->mMesh.end(); ++it_mesh) {
-			
-			totalTriCnt += mpMesh[*it_mesh]->FaceCount();
-		}
-	}
-	// 2. pre-allocate the memory for KTriDesc array
-	triCache.resize(totalTriCnt);
-
-	// 3. fill the data of each KTriDesc objects
-	UINT32 fillPos = 0;
 	for (UINT32 i_node = 0; i_node < mpNode.size(); ++i_node) {
 		for (std::vector<UINT32>::iterator it_mesh = mpNode[i_node]->mMesh.begin(); 
 			it_mesh != mpNode[i_node]->mMesh.end(); ++it_mesh) {
-			if (mpMesh[*it_mesh]->FaceCount() == 0)
+			UINT32 faceCnt = mpMesh[*it_mesh]->FaceCount();
+			if (faceCnt == 0)
 				continue;
-			fillPos += GenAccelTriangle(i_node, *it_mesh, &triCache[fillPos]);
+			KTriInstance inst;
+			inst.node_idx = i_node;
+			inst.mesh_idx = *it_mesh;
+			inst.first_tri = totalTriCnt;
+			instances.push_back(inst);
+			totalTriCnt += faceCnt;
 		}
 	}
+	return totalTriCnt;
 }
 
-UINT32 KScene::GenAccelTriangle(UINT32 nodeIdx, UINT32 subMeshIdx, KTriDesc* accelTri) const
+KTriDesc ResolveAccelTriangle(const std::vector<KTriInstance>& instances, UINT32 tri_idx)
 {
-	KNode* pNode = mpNode[nodeIdx];
-	KTriMesh* pMesh = mpMesh[subMeshIdx];
-	UINT32 faceCnt = pMesh->FaceCount();
-	if (accelTri) {
-		for (UINT32 i = 0; i < faceCnt; ++i) {
-
-			accelTri[i].SetNodeMeshIdx(nodeIdx, subMeshIdx);
-			accelTri[i].mTriIdx = i;
-		}
+	// The last instance starting at or before the triangle
+	UINT32 lo = 0, hi = (UINT32)instances.size();
+	while (hi - lo > 1) {
+		UINT32 mid = (lo + hi) / 2;
+		if (instances[mid].first_tri <= tri_idx)
+			lo = mid;
+		else
+			hi = mid;
 	}
-	return faceCnt;
+
+	KTriDesc tri;
+	tri.SetNodeMeshIdx(instances[lo].node_idx, instances[lo].mesh_idx);
+	tri.mTriIdx = tri_idx - instances[lo].first_tri;
+	return tri;
 }
 
 bool KScene::IsTriPosAnimated(const KTriDesc& tri) const
@@ -253,7 +286,7 @@ UINT32 KScene::AddNode()
 
 KScene::KScene()
 {
-
+	mAccelType = eAccel_Default;
 }
 
 KScene::~KScene()
@@ -279,6 +312,15 @@ void KScene::ResetScene()
 	Clean();
 }
 
+bool KScene::HasAnimatedVertex() const
+{
+	for (size_t i = 0; i < mpMesh.size(); ++i) {
+		if (mpMesh[i]->mHasPNAnim)
+			return true;
+	}
+	return false;
+}
+
 
 void KTriMesh::InterpolateTT(UINT32 faceIdx, const IntersectContext& ctx, TT_Data& out_tt, float cur_t) const
 {
@@ -317,6 +359,35 @@ void KTriMesh::MakeAsStatic()
 	mHasPNAnim = false;
 }
 
+UINT64 KScene::ComputeHash(UINT64 seed) const
+{
+	UINT64 hash = HashBytes(&mAccelType, sizeof(mAccelType), seed);
+	for (size_t i = 0; i < mpMesh.size(); ++i)
+		hash = mpMesh[i]->ComputeHash(hash);
+	for (size_t i = 0; i < mpNode.size(); ++i) {
+		const KNode* pNode = mpNode[i];
+		hash = HashBytes(&pNode->GetObjectTM(), sizeof(KMatrix4), hash);
+		if (!pNode->mMesh.empty())
+			hash = HashBytes(&pNode->mMesh[0], pNode->mMesh.size() * sizeof(UINT32), hash);
+	}
+	return hash;
+}
+
+UINT64 KScene::ComputeTopologyHash(UINT64 seed) const
+{
+	UINT64 hash = seed;
+	for (size_t i = 0; i < mpMesh.size(); ++i)
+		hash = mpMesh[i]->ComputeTopologyHash(hash);
+	for (size_t i = 0; i < mpNode.size(); ++i) {
+		const KNode* pNode = mpNode[i];
+		UINT32 meshCnt = (UINT32)pNode->mMesh.size();
+		hash = HashBytes(&meshCnt, sizeof(meshCnt), hash);
+		if (meshCnt > 0)
+			hash = HashBytes(&pNode->mMesh[0], meshCnt * sizeof(UINT32), hash);
+	}
+	return hash;
+}
+
 UINT32 KScene::GetTriangleCnt() const
 {
 	UINT32 tri_cnt = 0;
@@ -443,6 +514,25 @@ void KTriMesh::ComputeBBoxAll(KBBox& bbox) const
 		bbox.ContainVert(mVertPNData[i].pos);
 }
 
+UINT64 KTriMesh::ComputeTopologyHash(UINT64 seed) const
+{
+	UINT32 faceCnt = (UINT32)mFaces.size();
+	UINT64 hash = HashBytes(&faceCnt, sizeof(faceCnt), seed);
+	if (faceCnt > 0)
+		hash = HashBytes(&mFaces[0], faceCnt * sizeof(KTriangle), hash);
+	return hash;
+}
+
+UINT64 KTriMesh::ComputeHash(UINT64 seed) const
+{
+	UINT64 hash = HashBytes(&mHasPNAnim, sizeof(mHasPNAnim), seed);
+	if (!mFaces.empty())
+		hash = HashBytes(&mFaces[0], mFaces.size() * sizeof(KTriangle), hash);
+	for (size_t i = 0; i < mVertPNData.size(); ++i)
+		hash = HashBytes(&mVertPNData[i].pos, sizeof(KVec3), hash);
+	return hash;
+}
+
 void KTriMesh::ComputeBBox(KBBox& bbox, float cur_t) const
 {
 	bbox.SetEmpty();
@@ -488,11 +578,11 @@ public:
 // this can improve the floating point precision.
 bool ClampRayByBBox(KRay& in_out_ray, const KBBox& bbox)
 {
-	double t0, t1;
+	float t0, t1;
 	if (IntersectBBox(in_out_ray, bbox, t0, t1)) {
 		if (t0 < 0) t0 = 0;  // for the case the ray originate from inside the bbox
 
-		KVec3d newPos = in_out_ray.GetOrg() + in_out_ray.GetDir() * t0;
+		KVec3d newPos = in_out_ray.GetOrg() + in_out_ray.GetDir() * (double)t0;
 		in_out_ray.Init(newPos, in_out_ray.GetDir());
 		return true;
 	}
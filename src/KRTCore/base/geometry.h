@@ -63,21 +63,30 @@ struct IntersectContext
 	UINT32 kd_leaf_idx;
 	UINT32 bbox_node_idx;
 
-	KVec3 walkVec;
 	IntersectContext();
 	void Reset();
 };
 
+// Far child postponed during the kd-tree traversal, with the ray interval inside it
+struct KDTraversalEntry
+{
+	UINT32 node_idx;
+	float t_min;
+	float t_max;
+};
+
+// The ray is stored in single precision for the traversal, the double precision accessors are kept
+// for the instance transform and the shading code.
 class KRay 
 {
 private:
-	KVec3d mOrign;
-	KVec3d mDir;
+	KVec3 mOrign;
+	KVec3 mDir;
 public:
 
-	KVec3d mRcpDir;
-	KVec3d mNormDir;
-	double mDirLen;
+	KVec3 mRcpDir;
+	KVec3 mNormDir;
+	float mDirLen;
 	int mSign[4];
 
 	// triangle ID used to exclude the hit testing
@@ -89,10 +98,36 @@ public:
 	void InitTranslucentRay(const ShadingContext& shadingCtx, const KBBox* bbox);
 	void InitReflectionRay(const ShadingContext& shadingCtx, const KVec3& in_dir, const KBBox* bbox);
 	
-	KVec3d GetOrg() const {return mOrign;}
-	KVec3d GetDir() const {return mDir;}
+	KVec3d GetOrg() const {return ToVec3d(mOrign);}
+	KVec3d GetDir() const {return ToVec3d(mDir);}
+	const KVec3& GetOrgF() const {return mOrign;}
+	const KVec3& GetDirF() const {return mDir;}
 
 	void Init(const KVec3d& o, const KVec3d& d);
+	// Ray in the local space of an instance, inv_trans is the affine world to local transform
+	void InitTransformed(const KRay& in_ray, const KMatrix4& inv_trans);
+};
+
+// Rays traced together by the packet queries, see KAccelStruct_BVH::IntersectPacket.
+// Each ray has its own hit context and motion time.
+struct KRayPacket
+{
+	KRay rays[MAX_RAY_PACKET_SIZE];
+	IntersectContext ctx[MAX_RAY_PACKET_SIZE];
+	float motion_time[MAX_RAY_PACKET_SIZE];
+	UINT32 ray_cnt;
+
+	// The rays can share the traversal only if they go toward the same octant
+	bool IsCoherent() const;
+};
+
+// Far child postponed during the packet traversal of the kd-tree, with the interval of each ray
+struct KDPacketTraversalEntry
+{
+	UINT32 node_idx;
+	UINT32 ray_mask;
+	float t_min[MAX_RAY_PACKET_SIZE];
+	float t_max[MAX_RAY_PACKET_SIZE];
 };
 
 class KTriDesc;
@@ -172,19 +207,32 @@ struct KTriVertPos2
 	bool		mIsMoving;
 };
 
-// Data structure to accelerate ray-triangle intersection
+// Data structure to accelerate ray-triangle intersection. The acceleration structures only keep the
+// index of the triangle in the scene, this is resolved from it with ResolveAccelTriangle.
 class KTriDesc
 {
 public:
-	UINT32	mNodeMeshIdx;
+	UINT32	mNodeIdx;
+	UINT32	mMeshIdx;
 	UINT32	mTriIdx;
 
-	UINT32 GetMeshIdx() const {return (mNodeMeshIdx & 0x0000ffff);}
-	UINT32 GetNodeIdx() const {return ((mNodeMeshIdx & 0xffff0000) >> 16);}
+	UINT32 GetMeshIdx() const {return mMeshIdx;}
+	UINT32 GetNodeIdx() const {return mNodeIdx;}
 
-	void SetNodeMeshIdx(UINT32 nodeIdx, UINT32 meshIdx) {mNodeMeshIdx = ((nodeIdx << 16) | (meshIdx & 0x0000ffff));}
+	void SetNodeMeshIdx(UINT32 nodeIdx, UINT32 meshIdx) {mNodeIdx = nodeIdx; mMeshIdx = meshIdx;}
 };
 
+// A mesh placed by a node. The triangles of the scene are numbered one instance after another,
+// so first_tri is the prefix sum of the face counts.
+struct KTriInstance
+{
+	UINT32 node_idx;
+	UINT32 mesh_idx;
+	UINT32 first_tri;
+};
+
+KTriDesc ResolveAccelTriangle(const std::vector<KTriInstance>& instances, UINT32 tri_idx);
+
 class KTriMesh
 {
 
@@ -242,6 +290,10 @@ public:
 
 	// this function computes the whole bounding box along all the frames
 	void ComputeBBoxAll(KBBox& bbox) const;
+	// hash of the geometry data that affects the acceleration structure
+	UINT64 ComputeHash(UINT64 seed) const;
+	// hash of the faces only, the vertex positions may change without changing it
+	UINT64 ComputeTopologyHash(UINT64 seed) const;
 };
 
 
@@ -280,6 +332,15 @@ protected:
 	std::vector<KNode*>		mpNode;
 
 public:
+	// Which acceleration structure is built for this scene, eAccel_Default follows ACCEL_STRUCT_TYPE.
+	// The values match KRT_SetSubSceneAccelType.
+	enum AccelType {
+		eAccel_Default,
+		eAccel_KDTree,
+		eAccel_BVH
+	};
+	AccelType mAccelType;
+
 	KScene();
 	~KScene();
 	void Clean();
@@ -293,20 +354,21 @@ public:
 	const KTriMesh* GetMesh(UINT32 idx) const {return mpMesh[idx];}
 	UINT32 GetNodeCnt() const {return (UINT32)mpNode.size();}
 	UINT32 GetMeshCnt() const {return (UINT32)mpMesh.size();}
+	bool HasAnimatedVertex() const;
+	UINT64 ComputeHash(UINT64 seed) const;
+	// Faces and node meshes, what a refitted structure must keep unchanged
+	UINT64 ComputeTopologyHash(UINT64 seed) const;
 	void SetNodeTM(UINT32 nodeIdx, const KMatrix4& tm);
 	void GetAccelTriPos(const KTriDesc& tri, KTriVertPos2& triPos, const KBoxNormalizer* pNorm = NULL) const;
 	bool IsTriPosAnimated(const KTriDesc& tri) const;
 	void GetTriPosData(const KTriDesc& tri, bool anim, float* out_data, const KBoxNormalizer* pNorm = NULL) const;
 
-	// Functions used to calculate accelerated data structure for ray tracing
-	void InitAccelTriangleCache(std::vector<KTriDesc>& triCache) const;
+	// Functions used to calculate accelerated data structure for ray tracing, returns the triangle count
+	UINT32 InitAccelTriangleCache(std::vector<KTriInstance>& instances) const;
 
 
 	virtual void InitAccelData() {};
 	virtual void ResetScene();
-
-private:
-	UINT32 GenAccelTriangle(UINT32 nodeIdx, UINT32 subMeshIdx, KTriDesc* accelTri) const;
 };
 
 void Vec3TransformCoord(KVec3& res, const KVec3& v, const KMatrix4& mat);
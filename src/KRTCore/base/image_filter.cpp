@@ -6,13 +6,11 @@
 KImageFilterBase::KImageFilterBase(const BitmapObject* bitmap, UINT32 threadCnt)
 {
 	mpBitmapObj = bitmap;
-	mFilterTasks.resize(threadCnt);
-	for (UINT32 i = 0; i < threadCnt; ++i) {
-		mFilterTasks[i].mpParent = this;
-	}
+	mThreadCnt = threadCnt;
+	mFilterTask.mpParent = this;
 }
 
-void KImageFilterBase::FilterTask::Execute()
+void KImageFilterBase::FilterTask::Execute(UINT32 worker_idx)
 {
 	Tile2DSet::TileDesc desc;
 	while (mpParent->mTile2D.GetNextTile(desc)) {
@@ -25,17 +23,23 @@ KImageFilterBase::~KImageFilterBase()
 
 }
 
-bool KImageFilterBase::RunFilter(ThreadModel::ThreadBucket* pThreadBucket)
+UINT32 KImageFilterBase::AddFilterTask(ThreadModel::TaskGraph& graph)
+{
+	// The filter costs the same everywhere, so the tiles are never split
+	mTile2D.Reset(mpBitmapObj->mWidth, mpBitmapObj->mHeight, 64, 64, mThreadCnt);
+	return graph.AddTask(&mFilterTask, mThreadCnt);
+}
+
+bool KImageFilterBase::RunFilter(ThreadModel::WorkStealingPool* pPool)
 {
 	if (!mpBitmapObj)
 		return false;
 
-	mTile2D.Reset(mpBitmapObj->mWidth, mpBitmapObj->mHeight, 64);
-	assert(pThreadBucket->GetThreadCnt() == mFilterTasks.size());
-	for (UINT32 i = 0; i < (UINT32)mFilterTasks.size(); ++i)
-		pThreadBucket->SetThreadTask(i, &mFilterTasks[i]);
-	
-	return pThreadBucket->Run();
+	assert(pPool->GetWorkerCnt() == mThreadCnt);
+	ThreadModel::TaskGraph graph(*pPool);
+	AddFilterTask(graph);
+	pPool->Run(&graph);
+	return true;
 }
 
 KRBG32F_EdgeDetecter::KRBG32F_EdgeDetecter(const BitmapObject* bitmap, UINT32 threadCnt) : KImageFilterBase(bitmap, threadCnt)
@@ -82,4 +86,15 @@ void KRBG32F_EdgeDetecter::DoFilter(UINT32 sx, UINT32 sy, UINT32 w, UINT32 h)
 bool KRBG32F_EdgeDetecter::IsEdge(UINT32 x, UINT32 y) const
 {
 	return mResult.IsSet(x + y *  mpBitmapObj->mWidth);
+}
+
+bool KRBG32F_EdgeDetecter::HasEdge(UINT32 sx, UINT32 sy, UINT32 w, UINT32 h) const
+{
+	for (UINT32 y = sy; y < sy + h; ++y) {
+		for (UINT32 x = sx; x < sx + w; ++x) {
+			if (IsEdge(x, y))
+				return true;
+		}
+	}
+	return false;
 }
\ No newline at end of file
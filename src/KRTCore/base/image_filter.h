@@ -13,21 +13,24 @@ public:
 
 	virtual void DoFilter(UINT32 sx, UINT32 sy, UINT32 w, UINT32 h) = 0;
 
-	class FilterTask : public ThreadModel::IThreadTask
+	class FilterTask : public ThreadModel::IForkJoinTask
 	{
 	public:
 		KImageFilterBase* mpParent;
 		
-		virtual void Execute();
+		virtual void Execute(UINT32 worker_idx);
 	};
-	bool RunFilter(ThreadModel::ThreadBucket* pThreadBucket);
+	bool RunFilter(ThreadModel::WorkStealingPool* pPool);
+	// Add the filtering to the graph as one node, so it can run right after the tasks producing the image
+	UINT32 AddFilterTask(ThreadModel::TaskGraph& graph);
 
 protected:
 	const BitmapObject* mpBitmapObj;
 
 private:
 	Tile2DSet mTile2D;
-	std::vector<FilterTask> mFilterTasks;
+	FilterTask mFilterTask;
+	UINT32 mThreadCnt;
 };
 
 class KRBG32F_EdgeDetecter : public KImageFilterBase
@@ -37,6 +40,7 @@ public:
 	virtual void DoFilter(UINT32 sx, UINT32 sy, UINT32 w, UINT32 h);
 
 	bool IsEdge(UINT32 x, UINT32 y) const;
+	bool HasEdge(UINT32 sx, UINT32 sy, UINT32 w, UINT32 h) const;
 private:
 	SPIN_LOCK_FLAG mWritingLocker;
 	KBitArray mResult;
@@ -61,6 +61,8 @@ public:
 	// Evaluate the shading for the given screen coordinates and time,
 	// it will also respect the settings in input EvalContext instance.
 	bool EvaluateShading(TracingInstance& tracingInstance, KColor& out_clr);
+	// Generate the eye ray only, so that the rays of several samples can be traced together.
+	void GenerateEyeRay(EvalContext& evalCtx, KRay& out_ray);
 
 	// Get pixel position(suppose the ray is shot from the center of aperture)
 	bool GetScreenPosition(const KVec3& pos, KVec2& outScrPos) const;
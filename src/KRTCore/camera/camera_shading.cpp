@@ -4,9 +4,8 @@
 #include "../shader/surface_shader.h"
 
 
-bool KCamera::EvaluateShading(TracingInstance& tracingInstance, KColor& out_clr)
+void KCamera::GenerateEyeRay(EvalContext& evalCtx, KRay& out_ray)
 {
-	EvalContext& evalCtx = tracingInstance.mCameraContext;
 	MotionState ts;
 	ConfigEyeRayGen(evalCtx.mEyeRayGen, ts, evalCtx.inMotionTime);
 
@@ -17,9 +16,13 @@ bool KCamera::EvaluateShading(TracingInstance& tracingInstance, KColor& out_clr)
 	eyePos += ts.pos;
 	KVec3d eyeLookAt;
 	evalCtx.mEyeRayGen.GenerateEyeRayFocal(evalCtx.inScreenPos[0], evalCtx.inScreenPos[1], eyeLookAt);
-	KRay ray;
-	ray.Init(eyePos, eyeLookAt - eyePos, NULL);
+	out_ray.Init(eyePos, eyeLookAt - eyePos, NULL);
+}
 
+bool KCamera::EvaluateShading(TracingInstance& tracingInstance, KColor& out_clr)
+{
+	KRay ray;
+	GenerateEyeRay(tracingInstance.mCameraContext, ray);
 	return CalcuShadingByRay(&tracingInstance, ray, out_clr, NULL);
 }
 
@@ -9,9 +9,28 @@ UINT32 LEAF_TRIANGLE_CNT = 32;
 UINT32 MAX_KD_DEPTH = 40;
 float  COLOR_DIFF_THRESH_HOLD = 0.05f;
 UINT32 CPU_COUNT = 0;
+UINT32 THREAD_AFFINITY = 0;	// pin the worker threads, 0: no, 1: each to one cpu, 2: each to the cpus of one NUMA node
+UINT32 NUMA_INTERLEAVE = 1;	// 1: spread the pages of the scene data and the render buffers over the NUMA nodes
 UINT32 MAX_REFLECTION_BOUNCE = 10;
 UINT32 USE_TEX_MAP = 1;
 
+// KD-tree build settings
+UINT32 KD_BUILD_MODE = 1;	// 0: pigeon-hole split, 1: binned SAH, 2: SAH event sweep
+UINT32 SAH_BIN_CNT = 32;
+float  SAH_TRAVERSAL_COST = 1.0f;
+float  SAH_INTERSECT_COST = 1.5f;	// cost of one SIMD batch of ray-triangle tests
+float  SAH_PAIR_INTERSECT_COST = 2.4f;	// cost of one SIMD batch of triangle pairs, see LEAF_TRI_PAIR
+UINT32 ACCEL_STRUCT_TYPE = 2;	// 0: kd-tree, 1: BVH, 2: BVH for animated sub-scenes only
+float  ACCEL_REFIT_THRESHOLD = 1.5f;	// rebuild instead of refit when the SAH cost grows more than this ratio, 0 disables refit
+UINT32 SPATIAL_SPLIT = 0;	// 1: bound the triangles clipped by the nodes, and allow spatial splits in BVH
+float  SPATIAL_SPLIT_BUDGET = 0.3f;	// extra triangle references the spatial splits can create, relative to the triangle count
+UINT32 WATERTIGHT_TRI_TEST = 1;	// 1: shear based ray-triangle test on world space leaf data, no gaps along the shared edges, 0: Moller-Trumbore
+UINT32 LEAF_TRI_QUANTIZE = 0;	// 1: store the static leaf triangles with 16-bit coordinates relative to the leaf bounds
+UINT32 LEAF_TRI_PAIR = 1;	// 1: pack the static leaf triangles sharing an edge into pairs tested by one SIMD lane
+UINT32 LEAF_MAILBOX = 1;	// 1: skip the triangles a ray has tested in the leaves visited before, only for the world space leaf data of WATERTIGHT_TRI_TEST
+UINT32 ACCEL_CACHE = 0;	// 1: save the built acceleration structures next to the scene file and reuse them
+UINT32 MOTION_TRANSFORM_SAMPLES = 2;	// key frames of the moving transforms sampled over the shutter interval
+
 #ifdef __GNUC__
 #define sscanf_s(str, format, ref, buf_size) sscanf(str, format, ref)
 #endif
@@ -23,6 +42,15 @@ UINT32 PIXEL_SAMPLE_CNT_EDGE = 4;
 UINT32 AREA_LIGHT_SAMP_CNT = 10;
 UINT32 ENABLE_DOF = 0;
 UINT32 ENABLE_MB = 1;
+UINT32 RAY_PACKET_SIZE = 16;	// camera rays traced together, 1 disables the packet tracing
+UINT32 SECONDARY_RAY_BATCH = 0;	// 1: trace the first bounce secondary rays of a tile as a sorted batch
+UINT32 TILE_SIZE = 64;	// size of the tiles handed to the threads, the expensive ones and the ones at the end of a pass are split
+UINT32 TILE_SIZE_MIN = 8;	// the tiles are split down to this size
+UINT32 PROGRESSIVE = 0;	// 1: render in passes doubling the samples per pixel until one of the limits below is reached
+UINT32 PROGRESSIVE_MAX_SPP = 256;	// samples per pixel, 0 means no limit. Either this or the time budget has to be set
+float  PROGRESSIVE_TIME_BUDGET = 0;	// seconds, 0 means no limit
+float  PROGRESSIVE_NOISE = 0;	// estimated relative error of the pixels, 0 means no limit
+UINT32 EDGE_PIPELINE = 1;	// 1: detect and refine the edges of a block as soon as it and its neighbours are sampled
 
 #define CLAMP(value, min, max) {if (value < min) value = min;  if (value > max) value = max;}
 bool SetGlobalConstant(const char* name, const char* value)
@@ -49,9 +77,77 @@ bool SetGlobalConstant(const char* name, const char* value)
 	else if (var == "CPU_COUNT") {
 		sscanf_s(value, "%d", &CPU_COUNT, sizeof(UINT32));
 	}
+	else if (var == "THREAD_AFFINITY") {
+		sscanf_s(value, "%d", &THREAD_AFFINITY, sizeof(UINT32));
+		CLAMP(THREAD_AFFINITY, 0, 2);
+	}
+	else if (var == "NUMA_INTERLEAVE") {
+		sscanf_s(value, "%d", &NUMA_INTERLEAVE, sizeof(UINT32));
+		CLAMP(NUMA_INTERLEAVE, 0, 1);
+	}
 	else if (var == "USE_TEX_MAP") {
 		sscanf_s(value, "%d", &USE_TEX_MAP, sizeof(UINT32));
 	}
+	else if (var == "KD_BUILD_MODE") {
+		sscanf_s(value, "%d", &KD_BUILD_MODE, sizeof(UINT32));
+		CLAMP(KD_BUILD_MODE, 0, 2);
+	}
+	else if (var == "SAH_BIN_CNT") {
+		sscanf_s(value, "%d", &SAH_BIN_CNT, sizeof(UINT32));
+		CLAMP(SAH_BIN_CNT, 4, 256);
+	}
+	else if (var == "SAH_TRAVERSAL_COST") {
+		sscanf_s(value, "%f", &SAH_TRAVERSAL_COST, sizeof(float));
+		CLAMP(SAH_TRAVERSAL_COST, 0.01f, 100.0f);
+	}
+	else if (var == "ACCEL_STRUCT_TYPE") {
+		sscanf_s(value, "%d", &ACCEL_STRUCT_TYPE, sizeof(UINT32));
+		CLAMP(ACCEL_STRUCT_TYPE, 0, 2);
+	}
+	else if (var == "SPATIAL_SPLIT") {
+		sscanf_s(value, "%d", &SPATIAL_SPLIT, sizeof(UINT32));
+		CLAMP(SPATIAL_SPLIT, 0, 1);
+	}
+	else if (var == "SPATIAL_SPLIT_BUDGET") {
+		sscanf_s(value, "%f", &SPATIAL_SPLIT_BUDGET, sizeof(float));
+		CLAMP(SPATIAL_SPLIT_BUDGET, 0.0f, 4.0f);
+	}
+	else if (var == "WATERTIGHT_TRI_TEST") {
+		sscanf_s(value, "%d", &WATERTIGHT_TRI_TEST, sizeof(UINT32));
+		CLAMP(WATERTIGHT_TRI_TEST, 0, 1);
+	}
+	else if (var == "LEAF_TRI_QUANTIZE") {
+		sscanf_s(value, "%d", &LEAF_TRI_QUANTIZE, sizeof(UINT32));
+		CLAMP(LEAF_TRI_QUANTIZE, 0, 1);
+	}
+	else if (var == "LEAF_TRI_PAIR") {
+		sscanf_s(value, "%d", &LEAF_TRI_PAIR, sizeof(UINT32));
+		CLAMP(LEAF_TRI_PAIR, 0, 1);
+	}
+	else if (var == "LEAF_MAILBOX") {
+		sscanf_s(value, "%d", &LEAF_MAILBOX, sizeof(UINT32));
+		CLAMP(LEAF_MAILBOX, 0, 1);
+	}
+	else if (var == "ACCEL_CACHE") {
+		sscanf_s(value, "%d", &ACCEL_CACHE, sizeof(UINT32));
+		CLAMP(ACCEL_CACHE, 0, 1);
+	}
+	else if (var == "MOTION_TRANSFORM_SAMPLES") {
+		sscanf_s(value, "%d", &MOTION_TRANSFORM_SAMPLES, sizeof(UINT32));
+		CLAMP(MOTION_TRANSFORM_SAMPLES, 2, 16);
+	}
+	else if (var == "ACCEL_REFIT_THRESHOLD") {
+		sscanf_s(value, "%f", &ACCEL_REFIT_THRESHOLD, sizeof(float));
+		CLAMP(ACCEL_REFIT_THRESHOLD, 0.0f, 100.0f);
+	}
+	else if (var == "SAH_INTERSECT_COST") {
+		sscanf_s(value, "%f", &SAH_INTERSECT_COST, sizeof(float));
+		CLAMP(SAH_INTERSECT_COST, 0.01f, 100.0f);
+	}
+	else if (var == "SAH_PAIR_INTERSECT_COST") {
+		sscanf_s(value, "%f", &SAH_PAIR_INTERSECT_COST, sizeof(float));
+		CLAMP(SAH_PAIR_INTERSECT_COST, 0.01f, 100.0f);
+	}
 	else {
 		return false;
 	}
@@ -83,6 +179,50 @@ bool SetRenderOptions(const char* name, const char* value)
 	else if (var == "ENABLE_DOF") {
 		sscanf_s(value, "%d", &ENABLE_DOF, sizeof(UINT32));
 	}
+	else if (var == "RAY_PACKET_SIZE") {
+		sscanf_s(value, "%d", &RAY_PACKET_SIZE, sizeof(UINT32));
+		CLAMP(RAY_PACKET_SIZE, 1, MAX_RAY_PACKET_SIZE);
+	}
+	else if (var == "SECONDARY_RAY_BATCH") {
+		sscanf_s(value, "%d", &SECONDARY_RAY_BATCH, sizeof(UINT32));
+		CLAMP(SECONDARY_RAY_BATCH, 0, 1);
+	}
+	else if (var == "TILE_SIZE") {
+		sscanf_s(value, "%d", &TILE_SIZE, sizeof(UINT32));
+		CLAMP(TILE_SIZE, 4, 1024);
+	}
+	else if (var == "TILE_SIZE_MIN") {
+		sscanf_s(value, "%d", &TILE_SIZE_MIN, sizeof(UINT32));
+		CLAMP(TILE_SIZE_MIN, 1, 1024);
+	}
+	else if (var == "PROGRESSIVE") {
+		sscanf_s(value, "%d", &PROGRESSIVE, sizeof(UINT32));
+		CLAMP(PROGRESSIVE, 0, 1);
+	}
+	else if (var == "PROGRESSIVE_MAX_SPP") {
+		// Read as signed so that a negative count isn't taken as a huge one
+		int spp = 0;
+		if (sscanf_s(value, "%d", &spp, sizeof(int)) == 1) {
+			CLAMP(spp, 0, 65536);
+			PROGRESSIVE_MAX_SPP = (UINT32)spp;
+		}
+	}
+	else if (var == "PROGRESSIVE_TIME_BUDGET") {
+		sscanf_s(value, "%f", &PROGRESSIVE_TIME_BUDGET, sizeof(float));
+		if (PROGRESSIVE_TIME_BUDGET != PROGRESSIVE_TIME_BUDGET)
+			PROGRESSIVE_TIME_BUDGET = 0;
+		CLAMP(PROGRESSIVE_TIME_BUDGET, 0.0f, 1.0e6f);
+	}
+	else if (var == "PROGRESSIVE_NOISE") {
+		sscanf_s(value, "%f", &PROGRESSIVE_NOISE, sizeof(float));
+		if (PROGRESSIVE_NOISE != PROGRESSIVE_NOISE)
+			PROGRESSIVE_NOISE = 0;
+		CLAMP(PROGRESSIVE_NOISE, 0.0f, 1.0f);
+	}
+	else if (var == "EDGE_PIPELINE") {
+		sscanf_s(value, "%d", &EDGE_PIPELINE, sizeof(UINT32));
+		CLAMP(EDGE_PIPELINE, 0, 1);
+	}
 	else if (var == "ENABLE_MB") {
 		sscanf_s(value, "%d", &ENABLE_MB, sizeof(UINT32));
 	}
@@ -1,6 +1,7 @@
 #include "entry.h"
 #include "constants.h"
 #include "../util/helper_func.h"
+#include "../util/thread_model.h"
 #include "../camera/camera_manager.h"
 #include "../material/material_library.h"
 #include "../base/raw_geometry.h"
@@ -41,6 +42,9 @@ KRayTracer_Root::KRayTracer_Root()
 
 KRayTracer_Root::~KRayTracer_Root()
 {
+	mpTracingEntry.reset();
+	// Stop the worker threads after nothing uses them
+	ThreadModel::WorkStealingPool::ReleaseShared();
 }
 
 bool KRayTracer_Root::SetConstant(const char* name, const char* value)
@@ -78,13 +82,13 @@ void KRayTracer_Root::CloseScene()
 	mpSceneLoader.reset(NULL);
 }
 
-const BitmapObject* KRayTracer_Root::Render(UINT32 w, UINT32 h, KRT_ImageFormat destFormat, void* pUserBuf, double& render_time)
+const BitmapObject* KRayTracer_Root::Render(UINT32 w, UINT32 h, KRT_ImageFormat destFormat, void* pUserBuf, KRT_RenderStatistic& outStatistic)
 {
 	if (mpTracingEntry.get() == NULL)
 		mpTracingEntry.reset(new SamplingThreadContainer);
 
 	RenderParam param;
-	param.is_refining = false;
+	param.is_refining = (PROGRESSIVE != 0);
 	param.want_motion_blur = false;
 	param.want_depth_of_field = false;
 	param.want_global_illumination = false;
@@ -92,16 +96,26 @@ const BitmapObject* KRayTracer_Root::Render(UINT32 w, UINT32 h, KRT_ImageFormat
 	param.sample_cnt_eval = PIXEL_SAMPLE_CNT_EVAL;
 	param.sample_cnt_more = PIXEL_SAMPLE_CNT_MORE;
 	param.sample_cnt_edge = PIXEL_SAMPLE_CNT_EDGE;
+	param.max_spp = PROGRESSIVE_MAX_SPP;
+	param.time_budget = PROGRESSIVE_TIME_BUDGET;
+	param.noise_target = PROGRESSIVE_NOISE;
 
 	param.image_width = w;
 	param.image_height = h;
 	param.user_buffer = pUserBuf;
 	param.pixel_format = destFormat;
 
+	// The render fails on the same check
+	const char* limitError = param.is_refining ? param.GetProgressiveLimitError() : NULL;
+	if (limitError)
+		printf("Progressive rendering: %s.\n", limitError);
+
 	KTimer stop_watch(true);
 		
 	bool res = mpTracingEntry->Render(param, &mEventCB, NULL, mpSceneLoader.get());
-	render_time = stop_watch.Stop();
+	outStatistic.render_time = stop_watch.Stop();
+	mpTracingEntry->GetTracingStatistics(outStatistic.leaf_tri_test_count, outStatistic.mailbox_skip_count);
+	mpTracingEntry->GetProgressiveStatistics(outStatistic.pass_count, outStatistic.sample_per_pixel, outStatistic.noise_estimate);
 
 	if (res) 
 		return mpTracingEntry->mRenderBuffers.GetOutputImagePtr();
@@ -433,6 +447,632 @@ bool KRT_Initialize()
 "		tuv[2] = is_valid ? tmpV : tuv[2];\n"
 "		hit_idx[0] = is_valid ? tri_id[tri_i] : hit_idx[0];\n"
 
+"	}\n"
+"}\n"
+
+	// Any-hit versions for the occlusion test, only the distance is kept and it starts from max_t,
+	// so a lane hits if its distance is less than max_t.
+"void RayOccludeStaticTriArray(\
+	float% ray_org[], float% ray_dir[], float max_t, \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% hit_t[], int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	hit_t[0] = max_t;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], ray_dir_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[0];\n"
+"	ray_org_n[1] = ray_org[1];\n"
+"	ray_org_n[2] = ray_org[2];\n"
+"	ray_dir_n[0] = ray_dir[0];\n"
+"	ray_dir_n[1] = ray_dir[1];\n"
+"	ray_dir_n[2] = ray_dir[2];\n"
+
+"	for (int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {\n"
+"		pos_idx = tri_i * 9;\n"
+"		bool_n is_valid;\n"
+"		float_n edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];\n"
+"		float_n det,inv_det;\n"
+
+"		is_valid = (tri_id[tri_i] != exc_tri_id_n);\n"
+"		edge1[0] = tri_pos[pos_idx+3] - tri_pos[pos_idx+0];\n"
+"		edge1[1] = tri_pos[pos_idx+4] - tri_pos[pos_idx+1];\n"
+"		edge1[2] = tri_pos[pos_idx+5] - tri_pos[pos_idx+2];\n"
+"		edge2[0] = tri_pos[pos_idx+6] - tri_pos[pos_idx+0];\n"
+"		edge2[1] = tri_pos[pos_idx+7] - tri_pos[pos_idx+1];\n"
+"		edge2[2] = tri_pos[pos_idx+8] - tri_pos[pos_idx+2];\n"
+
+"		pvec[0] = ray_dir_n[1]*edge2[2] - ray_dir_n[2]*edge2[1];\n"
+"		pvec[1] = ray_dir_n[2]*edge2[0] - ray_dir_n[0]*edge2[2];\n"
+"		pvec[2] = ray_dir_n[0]*edge2[1] - ray_dir_n[1]*edge2[0];\n"
+"		det = edge1[0]*pvec[0] + edge1[1]*pvec[1] + edge1[2]*pvec[2];\n"
+"		is_valid = (det <= -0.000001 || det >= 0.000001) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+
+"		tvec[0] = ray_org_n[0] - tri_pos[pos_idx+0];\n"
+"		tvec[1] = ray_org_n[1] - tri_pos[pos_idx+1];\n"
+"		tvec[2] = ray_org_n[2] - tri_pos[pos_idx+2];\n"
+"		float_n tmpU = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inv_det;\n"
+"		is_valid = (tmpU >= 0.0 && tmpU <= 1.0) && is_valid;\n"
+
+"		qvec[0] = tvec[1]*edge1[2] - tvec[2]*edge1[1];\n"
+"		qvec[1] = tvec[2]*edge1[0] - tvec[0]*edge1[2];\n"
+"		qvec[2] = tvec[0]*edge1[1] - tvec[1]*edge1[0];\n"
+"		float_n tmpV = (ray_dir_n[0]*qvec[0] + ray_dir_n[1]*qvec[1] + ray_dir_n[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpV >= 0.0 && tmpU + tmpV <= 1.0) && is_valid;\n"
+
+"		float_n tmpT = (edge2[0]*qvec[0] + edge2[1]*qvec[1] + edge2[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+"	}\n"
+"}\n"
+
+"void RayOccludeAnimTriArray(\
+	float% ray_org[], float% ray_dir[], \
+	float cur_t, float max_t, float_n% tri_pos[], int_n% tri_id[], \
+	float_n% hit_t[], int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	hit_t[0] = max_t;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], ray_dir_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[0];\n"
+"	ray_org_n[1] = ray_org[1];\n"
+"	ray_org_n[2] = ray_org[2];\n"
+"	ray_dir_n[0] = ray_dir[0];\n"
+"	ray_dir_n[1] = ray_dir[1];\n"
+"	ray_dir_n[2] = ray_dir[2];\n"
+
+"	for (int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {\n"
+"		pos_idx = tri_i * 18;\n"
+"		bool_n is_valid;\n"
+"		float_n edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];\n"
+"		float_n det,inv_det;\n"
+
+"		is_valid = (tri_id[tri_i] != exc_tri_id_n);\n"
+"		float_n vert0[3];\n"
+"		vert0[0] = tri_pos[pos_idx+0] + tri_pos[pos_idx+9 ]*cur_t;\n"
+"		vert0[1] = tri_pos[pos_idx+1] + tri_pos[pos_idx+10]*cur_t;\n"
+"		vert0[2] = tri_pos[pos_idx+2] + tri_pos[pos_idx+11]*cur_t;\n"
+"		edge1[0] = tri_pos[pos_idx+3] + tri_pos[pos_idx+3+9]*cur_t - vert0[0];\n"
+"		edge1[1] = tri_pos[pos_idx+4] + tri_pos[pos_idx+4+9]*cur_t - vert0[1];\n"
+"		edge1[2] = tri_pos[pos_idx+5] + tri_pos[pos_idx+5+9]*cur_t - vert0[2];\n"
+"		edge2[0] = tri_pos[pos_idx+6] + tri_pos[pos_idx+6+9]*cur_t - vert0[0];\n"
+"		edge2[1] = tri_pos[pos_idx+7] + tri_pos[pos_idx+7+9]*cur_t - vert0[1];\n"
+"		edge2[2] = tri_pos[pos_idx+8] + tri_pos[pos_idx+8+9]*cur_t - vert0[2];\n"
+
+"		pvec[0] = ray_dir_n[1]*edge2[2] - ray_dir_n[2]*edge2[1];\n"
+"		pvec[1] = ray_dir_n[2]*edge2[0] - ray_dir_n[0]*edge2[2];\n"
+"		pvec[2] = ray_dir_n[0]*edge2[1] - ray_dir_n[1]*edge2[0];\n"
+"		det = edge1[0]*pvec[0] + edge1[1]*pvec[1] + edge1[2]*pvec[2];\n"
+"		is_valid = (det <= -0.000001 || det >= 0.000001) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+
+"		tvec[0] = ray_org_n[0] - vert0[0];\n"
+"		tvec[1] = ray_org_n[1] - vert0[1];\n"
+"		tvec[2] = ray_org_n[2] - vert0[2];\n"
+"		float_n tmpU = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inv_det;\n"
+"		is_valid = (tmpU >= 0.0 && tmpU <= 1.0) && is_valid;\n"
+
+"		qvec[0] = tvec[1]*edge1[2] - tvec[2]*edge1[1];\n"
+"		qvec[1] = tvec[2]*edge1[0] - tvec[0]*edge1[2];\n"
+"		qvec[2] = tvec[0]*edge1[1] - tvec[1]*edge1[0];\n"
+"		float_n tmpV = (ray_dir_n[0]*qvec[0] + ray_dir_n[1]*qvec[1] + ray_dir_n[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpV >= 0.0 && tmpU + tmpV <= 1.0) && is_valid;\n"
+
+"		float_n tmpT = (edge2[0]*qvec[0] + edge2[1]*qvec[1] + edge2[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+"	}\n"
+"}\n"
+
+	// Watertight versions, see Woop et al. "Watertight Ray/Triangle Intersection", JCGT 2013.
+	// The ray axes are permuted by kx, ky, kz and the shear constants come from ComputeRayShear.
+"void RayIntersectStaticTriArrayWT(\
+	float% ray_org[], float% ray_shear[], int kx, int ky, int kz, \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% tuv[], int_n% hit_idx[], \
+	int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	tuv[0] = 3.402823466e+38F;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], shear_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[kx];\n"
+"	ray_org_n[1] = ray_org[ky];\n"
+"	ray_org_n[2] = ray_org[kz];\n"
+"	shear_n[0] = ray_shear[0];\n"
+"	shear_n[1] = ray_shear[1];\n"
+"	shear_n[2] = ray_shear[2];\n"
+
+"	for (int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {\n"
+"		pos_idx = tri_i * 9;\n"
+"		bool_n is_valid;\n"
+"		float_n ax, ay, az, bx, by, bz, cx, cy, cz;\n"
+"		is_valid = (tri_id[tri_i] != exc_tri_id_n);\n"
+		// vertices relative to the ray origin, in the permuted axis order
+"		az = tri_pos[pos_idx+0+kz] - ray_org_n[2];\n"
+"		bz = tri_pos[pos_idx+3+kz] - ray_org_n[2];\n"
+"		cz = tri_pos[pos_idx+6+kz] - ray_org_n[2];\n"
+		// shear the vertices so that the ray goes along +z
+"		ax = tri_pos[pos_idx+0+kx] - ray_org_n[0] - shear_n[0]*az;\n"
+"		ay = tri_pos[pos_idx+0+ky] - ray_org_n[1] - shear_n[1]*az;\n"
+"		bx = tri_pos[pos_idx+3+kx] - ray_org_n[0] - shear_n[0]*bz;\n"
+"		by = tri_pos[pos_idx+3+ky] - ray_org_n[1] - shear_n[1]*bz;\n"
+"		cx = tri_pos[pos_idx+6+kx] - ray_org_n[0] - shear_n[0]*cz;\n"
+"		cy = tri_pos[pos_idx+6+ky] - ray_org_n[1] - shear_n[1]*cz;\n"
+
+		// the edge functions of the shared edges are computed the same way for both triangles,
+		// so a ray can't pass between them
+"		float_n e0 = cx*by - cy*bx;\n"
+"		float_n e1 = ax*cy - ay*cx;\n"
+"		float_n e2 = bx*ay - by*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		float_n det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		float_n inv_det = f_one_n / det;\n"
+"		float_n tmpT = (e0*az + e1*bz + e2*cz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < tuv[0]) && is_valid;\n"
+"		tuv[0] = is_valid ? tmpT : tuv[0];\n"
+"		tuv[1] = is_valid ? e1 * inv_det : tuv[1];\n"
+"		tuv[2] = is_valid ? e2 * inv_det : tuv[2];\n"
+"		hit_idx[0] = is_valid ? tri_id[tri_i] : hit_idx[0];\n"
+"	}\n"
+"}\n"
+
+"void RayIntersectAnimTriArrayWT(\
+	float% ray_org[], float% ray_shear[], int kx, int ky, int kz, \
+	float cur_t, float_n% tri_pos[], int_n% tri_id[], \
+	float_n% tuv[], int_n% hit_idx[], \
+	int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	tuv[0] = 3.402823466e+38F;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], shear_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[kx];\n"
+"	ray_org_n[1] = ray_org[ky];\n"
+"	ray_org_n[2] = ray_org[kz];\n"
+"	shear_n[0] = ray_shear[0];\n"
+"	shear_n[1] = ray_shear[1];\n"
+"	shear_n[2] = ray_shear[2];\n"
+
+"	for (int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {\n"
+"		pos_idx = tri_i * 18;\n"
+"		bool_n is_valid;\n"
+"		float_n ax, ay, az, bx, by, bz, cx, cy, cz;\n"
+"		is_valid = (tri_id[tri_i] != exc_tri_id_n);\n"
+		// vertices at the current time relative to the ray origin, in the permuted axis order
+"		az = tri_pos[pos_idx+0+kz] + tri_pos[pos_idx+9+kz]*cur_t - ray_org_n[2];\n"
+"		bz = tri_pos[pos_idx+3+kz] + tri_pos[pos_idx+12+kz]*cur_t - ray_org_n[2];\n"
+"		cz = tri_pos[pos_idx+6+kz] + tri_pos[pos_idx+15+kz]*cur_t - ray_org_n[2];\n"
+		// shear the vertices so that the ray goes along +z
+"		ax = tri_pos[pos_idx+0+kx] + tri_pos[pos_idx+9+kx]*cur_t - ray_org_n[0] - shear_n[0]*az;\n"
+"		ay = tri_pos[pos_idx+0+ky] + tri_pos[pos_idx+9+ky]*cur_t - ray_org_n[1] - shear_n[1]*az;\n"
+"		bx = tri_pos[pos_idx+3+kx] + tri_pos[pos_idx+12+kx]*cur_t - ray_org_n[0] - shear_n[0]*bz;\n"
+"		by = tri_pos[pos_idx+3+ky] + tri_pos[pos_idx+12+ky]*cur_t - ray_org_n[1] - shear_n[1]*bz;\n"
+"		cx = tri_pos[pos_idx+6+kx] + tri_pos[pos_idx+15+kx]*cur_t - ray_org_n[0] - shear_n[0]*cz;\n"
+"		cy = tri_pos[pos_idx+6+ky] + tri_pos[pos_idx+15+ky]*cur_t - ray_org_n[1] - shear_n[1]*cz;\n"
+
+		// the edge functions of the shared edges are computed the same way for both triangles,
+		// so a ray can't pass between them
+"		float_n e0 = cx*by - cy*bx;\n"
+"		float_n e1 = ax*cy - ay*cx;\n"
+"		float_n e2 = bx*ay - by*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		float_n det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		float_n inv_det = f_one_n / det;\n"
+"		float_n tmpT = (e0*az + e1*bz + e2*cz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < tuv[0]) && is_valid;\n"
+"		tuv[0] = is_valid ? tmpT : tuv[0];\n"
+"		tuv[1] = is_valid ? e1 * inv_det : tuv[1];\n"
+"		tuv[2] = is_valid ? e2 * inv_det : tuv[2];\n"
+"		hit_idx[0] = is_valid ? tri_id[tri_i] : hit_idx[0];\n"
+"	}\n"
+"}\n"
+
+"void RayOccludeStaticTriArrayWT(\
+	float% ray_org[], float% ray_shear[], int kx, int ky, int kz, \
+	float max_t, \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% hit_t[], int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	hit_t[0] = max_t;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], shear_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[kx];\n"
+"	ray_org_n[1] = ray_org[ky];\n"
+"	ray_org_n[2] = ray_org[kz];\n"
+"	shear_n[0] = ray_shear[0];\n"
+"	shear_n[1] = ray_shear[1];\n"
+"	shear_n[2] = ray_shear[2];\n"
+
+"	for (int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {\n"
+"		pos_idx = tri_i * 9;\n"
+"		bool_n is_valid;\n"
+"		float_n ax, ay, az, bx, by, bz, cx, cy, cz;\n"
+"		is_valid = (tri_id[tri_i] != exc_tri_id_n);\n"
+		// vertices relative to the ray origin, in the permuted axis order
+"		az = tri_pos[pos_idx+0+kz] - ray_org_n[2];\n"
+"		bz = tri_pos[pos_idx+3+kz] - ray_org_n[2];\n"
+"		cz = tri_pos[pos_idx+6+kz] - ray_org_n[2];\n"
+		// shear the vertices so that the ray goes along +z
+"		ax = tri_pos[pos_idx+0+kx] - ray_org_n[0] - shear_n[0]*az;\n"
+"		ay = tri_pos[pos_idx+0+ky] - ray_org_n[1] - shear_n[1]*az;\n"
+"		bx = tri_pos[pos_idx+3+kx] - ray_org_n[0] - shear_n[0]*bz;\n"
+"		by = tri_pos[pos_idx+3+ky] - ray_org_n[1] - shear_n[1]*bz;\n"
+"		cx = tri_pos[pos_idx+6+kx] - ray_org_n[0] - shear_n[0]*cz;\n"
+"		cy = tri_pos[pos_idx+6+ky] - ray_org_n[1] - shear_n[1]*cz;\n"
+
+		// the edge functions of the shared edges are computed the same way for both triangles,
+		// so a ray can't pass between them
+"		float_n e0 = cx*by - cy*bx;\n"
+"		float_n e1 = ax*cy - ay*cx;\n"
+"		float_n e2 = bx*ay - by*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		float_n det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		float_n inv_det = f_one_n / det;\n"
+"		float_n tmpT = (e0*az + e1*bz + e2*cz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+"	}\n"
+"}\n"
+
+"void RayOccludeAnimTriArrayWT(\
+	float% ray_org[], float% ray_shear[], int kx, int ky, int kz, \
+	float cur_t, float max_t, float_n% tri_pos[], int_n% tri_id[], \
+	float_n% hit_t[], int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	hit_t[0] = max_t;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], shear_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[kx];\n"
+"	ray_org_n[1] = ray_org[ky];\n"
+"	ray_org_n[2] = ray_org[kz];\n"
+"	shear_n[0] = ray_shear[0];\n"
+"	shear_n[1] = ray_shear[1];\n"
+"	shear_n[2] = ray_shear[2];\n"
+
+"	for (int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {\n"
+"		pos_idx = tri_i * 18;\n"
+"		bool_n is_valid;\n"
+"		float_n ax, ay, az, bx, by, bz, cx, cy, cz;\n"
+"		is_valid = (tri_id[tri_i] != exc_tri_id_n);\n"
+		// vertices at the current time relative to the ray origin, in the permuted axis order
+"		az = tri_pos[pos_idx+0+kz] + tri_pos[pos_idx+9+kz]*cur_t - ray_org_n[2];\n"
+"		bz = tri_pos[pos_idx+3+kz] + tri_pos[pos_idx+12+kz]*cur_t - ray_org_n[2];\n"
+"		cz = tri_pos[pos_idx+6+kz] + tri_pos[pos_idx+15+kz]*cur_t - ray_org_n[2];\n"
+		// shear the vertices so that the ray goes along +z
+"		ax = tri_pos[pos_idx+0+kx] + tri_pos[pos_idx+9+kx]*cur_t - ray_org_n[0] - shear_n[0]*az;\n"
+"		ay = tri_pos[pos_idx+0+ky] + tri_pos[pos_idx+9+ky]*cur_t - ray_org_n[1] - shear_n[1]*az;\n"
+"		bx = tri_pos[pos_idx+3+kx] + tri_pos[pos_idx+12+kx]*cur_t - ray_org_n[0] - shear_n[0]*bz;\n"
+"		by = tri_pos[pos_idx+3+ky] + tri_pos[pos_idx+12+ky]*cur_t - ray_org_n[1] - shear_n[1]*bz;\n"
+"		cx = tri_pos[pos_idx+6+kx] + tri_pos[pos_idx+15+kx]*cur_t - ray_org_n[0] - shear_n[0]*cz;\n"
+"		cy = tri_pos[pos_idx+6+ky] + tri_pos[pos_idx+15+ky]*cur_t - ray_org_n[1] - shear_n[1]*cz;\n"
+
+		// the edge functions of the shared edges are computed the same way for both triangles,
+		// so a ray can't pass between them
+"		float_n e0 = cx*by - cy*bx;\n"
+"		float_n e1 = ax*cy - ay*cx;\n"
+"		float_n e2 = bx*ay - by*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		float_n det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		float_n inv_det = f_one_n / det;\n"
+"		float_n tmpT = (e0*az + e1*bz + e2*cz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+"	}\n"
+"}\n"
+
+	// Triangle pair versions for the static leaves, see AccelLeaves::BuildTriData. Each lane holds two
+	// triangles (p0, p1, p2) and (p0, p2, p3) sharing the edge p0-p2, tri_id has the two ids of each pair.
+"void RayIntersectStaticPairArray(\
+	float% ray_org[], float% ray_dir[], \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% tuv[], int_n% hit_idx[], \
+	int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	tuv[0] = 3.402823466e+38F;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], ray_dir_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[0];\n"
+"	ray_org_n[1] = ray_org[1];\n"
+"	ray_org_n[2] = ray_org[2];\n"
+"	ray_dir_n[0] = ray_dir[0];\n"
+"	ray_dir_n[1] = ray_dir[1];\n"
+"	ray_dir_n[2] = ray_dir[2];\n"
+
+"	for (int pair_i = 0; pair_i < cnt; pair_i = pair_i+1) {\n"
+"		pos_idx = pair_i * 12;\n"
+"		bool_n is_valid;\n"
+"		float_n edge0[3], edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];\n"
+"		float_n det, inv_det, tmpU, tmpV, tmpT;\n"
+		// the edges from p0 and the ray origin relative to p0 are shared by the two triangles
+"		edge0[0] = tri_pos[pos_idx+3] - tri_pos[pos_idx+0];\n"
+"		edge0[1] = tri_pos[pos_idx+4] - tri_pos[pos_idx+1];\n"
+"		edge0[2] = tri_pos[pos_idx+5] - tri_pos[pos_idx+2];\n"
+"		edge1[0] = tri_pos[pos_idx+6] - tri_pos[pos_idx+0];\n"
+"		edge1[1] = tri_pos[pos_idx+7] - tri_pos[pos_idx+1];\n"
+"		edge1[2] = tri_pos[pos_idx+8] - tri_pos[pos_idx+2];\n"
+"		edge2[0] = tri_pos[pos_idx+9] - tri_pos[pos_idx+0];\n"
+"		edge2[1] = tri_pos[pos_idx+10] - tri_pos[pos_idx+1];\n"
+"		edge2[2] = tri_pos[pos_idx+11] - tri_pos[pos_idx+2];\n"
+"		tvec[0] = ray_org_n[0] - tri_pos[pos_idx+0];\n"
+"		tvec[1] = ray_org_n[1] - tri_pos[pos_idx+1];\n"
+"		tvec[2] = ray_org_n[2] - tri_pos[pos_idx+2];\n"
+
+		// the first triangle
+"		is_valid = (tri_id[pair_i*2] != exc_tri_id_n);\n"
+"		pvec[0] = ray_dir_n[1]*edge1[2] - ray_dir_n[2]*edge1[1];\n"
+"		pvec[1] = ray_dir_n[2]*edge1[0] - ray_dir_n[0]*edge1[2];\n"
+"		pvec[2] = ray_dir_n[0]*edge1[1] - ray_dir_n[1]*edge1[0];\n"
+"		det = edge0[0]*pvec[0] + edge0[1]*pvec[1] + edge0[2]*pvec[2];\n"
+"		is_valid = (det <= -0.000001 || det >= 0.000001) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpU = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inv_det;\n"
+"		is_valid = (tmpU >= 0.0 && tmpU <= 1.0) && is_valid;\n"
+"		qvec[0] = tvec[1]*edge0[2] - tvec[2]*edge0[1];\n"
+"		qvec[1] = tvec[2]*edge0[0] - tvec[0]*edge0[2];\n"
+"		qvec[2] = tvec[0]*edge0[1] - tvec[1]*edge0[0];\n"
+"		tmpV = (ray_dir_n[0]*qvec[0] + ray_dir_n[1]*qvec[1] + ray_dir_n[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpV >= 0.0 && tmpU + tmpV <= 1.0) && is_valid;\n"
+"		tmpT = (edge1[0]*qvec[0] + edge1[1]*qvec[1] + edge1[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < tuv[0]) && is_valid;\n"
+"		tuv[0] = is_valid ? tmpT : tuv[0];\n"
+"		tuv[1] = is_valid ? tmpU : tuv[1];\n"
+"		tuv[2] = is_valid ? tmpV : tuv[2];\n"
+"		hit_idx[0] = is_valid ? tri_id[pair_i*2] : hit_idx[0];\n"
+
+		// the second triangle, a lone triangle has a degenerated one that never passes the determinant test
+"		is_valid = (tri_id[pair_i*2+1] != exc_tri_id_n);\n"
+"		pvec[0] = ray_dir_n[1]*edge2[2] - ray_dir_n[2]*edge2[1];\n"
+"		pvec[1] = ray_dir_n[2]*edge2[0] - ray_dir_n[0]*edge2[2];\n"
+"		pvec[2] = ray_dir_n[0]*edge2[1] - ray_dir_n[1]*edge2[0];\n"
+"		det = edge1[0]*pvec[0] + edge1[1]*pvec[1] + edge1[2]*pvec[2];\n"
+"		is_valid = (det <= -0.000001 || det >= 0.000001) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpU = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inv_det;\n"
+"		is_valid = (tmpU >= 0.0 && tmpU <= 1.0) && is_valid;\n"
+"		qvec[0] = tvec[1]*edge1[2] - tvec[2]*edge1[1];\n"
+"		qvec[1] = tvec[2]*edge1[0] - tvec[0]*edge1[2];\n"
+"		qvec[2] = tvec[0]*edge1[1] - tvec[1]*edge1[0];\n"
+"		tmpV = (ray_dir_n[0]*qvec[0] + ray_dir_n[1]*qvec[1] + ray_dir_n[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpV >= 0.0 && tmpU + tmpV <= 1.0) && is_valid;\n"
+"		tmpT = (edge2[0]*qvec[0] + edge2[1]*qvec[1] + edge2[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < tuv[0]) && is_valid;\n"
+"		tuv[0] = is_valid ? tmpT : tuv[0];\n"
+"		tuv[1] = is_valid ? tmpU : tuv[1];\n"
+"		tuv[2] = is_valid ? tmpV : tuv[2];\n"
+"		hit_idx[0] = is_valid ? tri_id[pair_i*2+1] : hit_idx[0];\n"
+"	}\n"
+"}\n"
+
+"void RayOccludeStaticPairArray(\
+	float% ray_org[], float% ray_dir[], float max_t, \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% hit_t[], int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	hit_t[0] = max_t;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], ray_dir_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[0];\n"
+"	ray_org_n[1] = ray_org[1];\n"
+"	ray_org_n[2] = ray_org[2];\n"
+"	ray_dir_n[0] = ray_dir[0];\n"
+"	ray_dir_n[1] = ray_dir[1];\n"
+"	ray_dir_n[2] = ray_dir[2];\n"
+
+"	for (int pair_i = 0; pair_i < cnt; pair_i = pair_i+1) {\n"
+"		pos_idx = pair_i * 12;\n"
+"		bool_n is_valid;\n"
+"		float_n edge0[3], edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];\n"
+"		float_n det, inv_det, tmpU, tmpV, tmpT;\n"
+"		edge0[0] = tri_pos[pos_idx+3] - tri_pos[pos_idx+0];\n"
+"		edge0[1] = tri_pos[pos_idx+4] - tri_pos[pos_idx+1];\n"
+"		edge0[2] = tri_pos[pos_idx+5] - tri_pos[pos_idx+2];\n"
+"		edge1[0] = tri_pos[pos_idx+6] - tri_pos[pos_idx+0];\n"
+"		edge1[1] = tri_pos[pos_idx+7] - tri_pos[pos_idx+1];\n"
+"		edge1[2] = tri_pos[pos_idx+8] - tri_pos[pos_idx+2];\n"
+"		edge2[0] = tri_pos[pos_idx+9] - tri_pos[pos_idx+0];\n"
+"		edge2[1] = tri_pos[pos_idx+10] - tri_pos[pos_idx+1];\n"
+"		edge2[2] = tri_pos[pos_idx+11] - tri_pos[pos_idx+2];\n"
+"		tvec[0] = ray_org_n[0] - tri_pos[pos_idx+0];\n"
+"		tvec[1] = ray_org_n[1] - tri_pos[pos_idx+1];\n"
+"		tvec[2] = ray_org_n[2] - tri_pos[pos_idx+2];\n"
+
+"		is_valid = (tri_id[pair_i*2] != exc_tri_id_n);\n"
+"		pvec[0] = ray_dir_n[1]*edge1[2] - ray_dir_n[2]*edge1[1];\n"
+"		pvec[1] = ray_dir_n[2]*edge1[0] - ray_dir_n[0]*edge1[2];\n"
+"		pvec[2] = ray_dir_n[0]*edge1[1] - ray_dir_n[1]*edge1[0];\n"
+"		det = edge0[0]*pvec[0] + edge0[1]*pvec[1] + edge0[2]*pvec[2];\n"
+"		is_valid = (det <= -0.000001 || det >= 0.000001) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpU = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inv_det;\n"
+"		is_valid = (tmpU >= 0.0 && tmpU <= 1.0) && is_valid;\n"
+"		qvec[0] = tvec[1]*edge0[2] - tvec[2]*edge0[1];\n"
+"		qvec[1] = tvec[2]*edge0[0] - tvec[0]*edge0[2];\n"
+"		qvec[2] = tvec[0]*edge0[1] - tvec[1]*edge0[0];\n"
+"		tmpV = (ray_dir_n[0]*qvec[0] + ray_dir_n[1]*qvec[1] + ray_dir_n[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpV >= 0.0 && tmpU + tmpV <= 1.0) && is_valid;\n"
+"		tmpT = (edge1[0]*qvec[0] + edge1[1]*qvec[1] + edge1[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+
+"		is_valid = (tri_id[pair_i*2+1] != exc_tri_id_n);\n"
+"		pvec[0] = ray_dir_n[1]*edge2[2] - ray_dir_n[2]*edge2[1];\n"
+"		pvec[1] = ray_dir_n[2]*edge2[0] - ray_dir_n[0]*edge2[2];\n"
+"		pvec[2] = ray_dir_n[0]*edge2[1] - ray_dir_n[1]*edge2[0];\n"
+"		det = edge1[0]*pvec[0] + edge1[1]*pvec[1] + edge1[2]*pvec[2];\n"
+"		is_valid = (det <= -0.000001 || det >= 0.000001) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpU = (tvec[0]*pvec[0] + tvec[1]*pvec[1] + tvec[2]*pvec[2]) * inv_det;\n"
+"		is_valid = (tmpU >= 0.0 && tmpU <= 1.0) && is_valid;\n"
+"		qvec[0] = tvec[1]*edge1[2] - tvec[2]*edge1[1];\n"
+"		qvec[1] = tvec[2]*edge1[0] - tvec[0]*edge1[2];\n"
+"		qvec[2] = tvec[0]*edge1[1] - tvec[1]*edge1[0];\n"
+"		tmpV = (ray_dir_n[0]*qvec[0] + ray_dir_n[1]*qvec[1] + ray_dir_n[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpV >= 0.0 && tmpU + tmpV <= 1.0) && is_valid;\n"
+"		tmpT = (edge2[0]*qvec[0] + edge2[1]*qvec[1] + edge2[2]*qvec[2]) * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+"	}\n"
+"}\n"
+
+"void RayIntersectStaticPairArrayWT(\
+	float% ray_org[], float% ray_shear[], int kx, int ky, int kz, \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% tuv[], int_n% hit_idx[], \
+	int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	tuv[0] = 3.402823466e+38F;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], shear_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[kx];\n"
+"	ray_org_n[1] = ray_org[ky];\n"
+"	ray_org_n[2] = ray_org[kz];\n"
+"	shear_n[0] = ray_shear[0];\n"
+"	shear_n[1] = ray_shear[1];\n"
+"	shear_n[2] = ray_shear[2];\n"
+
+"	for (int pair_i = 0; pair_i < cnt; pair_i = pair_i+1) {\n"
+"		pos_idx = pair_i * 12;\n"
+"		bool_n is_valid;\n"
+"		float_n ax, ay, az, bx, by, bz, cx, cy, cz, dx, dy, dz;\n"
+"		float_n e0, e1, e2, det, inv_det, tmpT;\n"
+		// the four vertices are sheared once for both triangles
+"		az = tri_pos[pos_idx+0+kz] - ray_org_n[2];\n"
+"		bz = tri_pos[pos_idx+3+kz] - ray_org_n[2];\n"
+"		cz = tri_pos[pos_idx+6+kz] - ray_org_n[2];\n"
+"		dz = tri_pos[pos_idx+9+kz] - ray_org_n[2];\n"
+"		ax = tri_pos[pos_idx+0+kx] - ray_org_n[0] - shear_n[0]*az;\n"
+"		ay = tri_pos[pos_idx+0+ky] - ray_org_n[1] - shear_n[1]*az;\n"
+"		bx = tri_pos[pos_idx+3+kx] - ray_org_n[0] - shear_n[0]*bz;\n"
+"		by = tri_pos[pos_idx+3+ky] - ray_org_n[1] - shear_n[1]*bz;\n"
+"		cx = tri_pos[pos_idx+6+kx] - ray_org_n[0] - shear_n[0]*cz;\n"
+"		cy = tri_pos[pos_idx+6+ky] - ray_org_n[1] - shear_n[1]*cz;\n"
+"		dx = tri_pos[pos_idx+9+kx] - ray_org_n[0] - shear_n[0]*dz;\n"
+"		dy = tri_pos[pos_idx+9+ky] - ray_org_n[1] - shear_n[1]*dz;\n"
+
+		// the first triangle (a, b, c)
+"		is_valid = (tri_id[pair_i*2] != exc_tri_id_n);\n"
+"		e0 = cx*by - cy*bx;\n"
+"		e1 = ax*cy - ay*cx;\n"
+"		e2 = bx*ay - by*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpT = (e0*az + e1*bz + e2*cz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < tuv[0]) && is_valid;\n"
+"		tuv[0] = is_valid ? tmpT : tuv[0];\n"
+"		tuv[1] = is_valid ? e1 * inv_det : tuv[1];\n"
+"		tuv[2] = is_valid ? e2 * inv_det : tuv[2];\n"
+"		hit_idx[0] = is_valid ? tri_id[pair_i*2] : hit_idx[0];\n"
+
+		// the second triangle (a, c, d), the edge function of a-c is the negated e1 of the first one
+"		is_valid = (tri_id[pair_i*2+1] != exc_tri_id_n);\n"
+"		e0 = dx*cy - dy*cx;\n"
+"		e1 = ax*dy - ay*dx;\n"
+"		e2 = cx*ay - cy*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpT = (e0*az + e1*cz + e2*dz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < tuv[0]) && is_valid;\n"
+"		tuv[0] = is_valid ? tmpT : tuv[0];\n"
+"		tuv[1] = is_valid ? e1 * inv_det : tuv[1];\n"
+"		tuv[2] = is_valid ? e2 * inv_det : tuv[2];\n"
+"		hit_idx[0] = is_valid ? tri_id[pair_i*2+1] : hit_idx[0];\n"
+"	}\n"
+"}\n"
+
+"void RayOccludeStaticPairArrayWT(\
+	float% ray_org[], float% ray_shear[], int kx, int ky, int kz, \
+	float max_t, \
+	float_n% tri_pos[], int_n% tri_id[], \
+	float_n% hit_t[], int cnt, int excluding_tri_id)\n"
+"{\n"
+"	int pos_idx = 0;\n"
+"	hit_t[0] = max_t;\n"
+"	int_n exc_tri_id_n;\n"
+"	exc_tri_id_n = excluding_tri_id;\n"
+"	float_n f_one_n, ray_org_n[3], shear_n[3];\n"
+"	f_one_n = 1.0f;\n"
+"	ray_org_n[0] = ray_org[kx];\n"
+"	ray_org_n[1] = ray_org[ky];\n"
+"	ray_org_n[2] = ray_org[kz];\n"
+"	shear_n[0] = ray_shear[0];\n"
+"	shear_n[1] = ray_shear[1];\n"
+"	shear_n[2] = ray_shear[2];\n"
+
+"	for (int pair_i = 0; pair_i < cnt; pair_i = pair_i+1) {\n"
+"		pos_idx = pair_i * 12;\n"
+"		bool_n is_valid;\n"
+"		float_n ax, ay, az, bx, by, bz, cx, cy, cz, dx, dy, dz;\n"
+"		float_n e0, e1, e2, det, inv_det, tmpT;\n"
+"		az = tri_pos[pos_idx+0+kz] - ray_org_n[2];\n"
+"		bz = tri_pos[pos_idx+3+kz] - ray_org_n[2];\n"
+"		cz = tri_pos[pos_idx+6+kz] - ray_org_n[2];\n"
+"		dz = tri_pos[pos_idx+9+kz] - ray_org_n[2];\n"
+"		ax = tri_pos[pos_idx+0+kx] - ray_org_n[0] - shear_n[0]*az;\n"
+"		ay = tri_pos[pos_idx+0+ky] - ray_org_n[1] - shear_n[1]*az;\n"
+"		bx = tri_pos[pos_idx+3+kx] - ray_org_n[0] - shear_n[0]*bz;\n"
+"		by = tri_pos[pos_idx+3+ky] - ray_org_n[1] - shear_n[1]*bz;\n"
+"		cx = tri_pos[pos_idx+6+kx] - ray_org_n[0] - shear_n[0]*cz;\n"
+"		cy = tri_pos[pos_idx+6+ky] - ray_org_n[1] - shear_n[1]*cz;\n"
+"		dx = tri_pos[pos_idx+9+kx] - ray_org_n[0] - shear_n[0]*dz;\n"
+"		dy = tri_pos[pos_idx+9+ky] - ray_org_n[1] - shear_n[1]*dz;\n"
+
+"		is_valid = (tri_id[pair_i*2] != exc_tri_id_n);\n"
+"		e0 = cx*by - cy*bx;\n"
+"		e1 = ax*cy - ay*cx;\n"
+"		e2 = bx*ay - by*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpT = (e0*az + e1*bz + e2*cz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
+
+"		is_valid = (tri_id[pair_i*2+1] != exc_tri_id_n);\n"
+"		e0 = dx*cy - dy*cx;\n"
+"		e1 = ax*dy - ay*dx;\n"
+"		e2 = cx*ay - cy*ax;\n"
+"		is_valid = ((e0 >= 0.0 && e1 >= 0.0 && e2 >= 0.0) || (e0 <= 0.0 && e1 <= 0.0 && e2 <= 0.0)) && is_valid;\n"
+"		det = e0 + e1 + e2;\n"
+"		is_valid = (det < 0.0 || det > 0.0) && is_valid;\n"
+"		inv_det = f_one_n / det;\n"
+"		tmpT = (e0*az + e1*cz + e2*dz) * shear_n[2] * inv_det;\n"
+"		is_valid = (tmpT > 0 && tmpT < hit_t[0]) && is_valid;\n"
+"		hit_t[0] = is_valid ? tmpT : hit_t[0];\n"
 "	}\n"
 "}\n"
 ;
@@ -455,6 +1095,66 @@ bool KRT_Initialize()
 				void* pFuncTriRay = KSC_GetFunctionPtr(hRayIntersectAnimTriArray);
 				KAccelStruct_KDTree::s_pPFN_RayIntersectAnimTriArray = (KAccelStruct_KDTree::PFN_RayIntersectAnimTriArray)pFuncTriRay;
 			}
+
+			FunctionHandle hRayOccludeStaticTriArray = KSC_GetFunctionHandleByName("RayOccludeStaticTriArray", hTriRay);
+			if (hRayOccludeStaticTriArray) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayOccludeStaticTriArray);
+				KAccelStruct_KDTree::s_pPFN_RayOccludeStaticTriArray = (KAccelStruct_KDTree::PFN_RayOccludeStaticTriArray)pFuncTriRay;
+			}
+
+			FunctionHandle hRayOccludeAnimTriArray = KSC_GetFunctionHandleByName("RayOccludeAnimTriArray", hTriRay);
+			if (hRayOccludeAnimTriArray) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayOccludeAnimTriArray);
+				KAccelStruct_KDTree::s_pPFN_RayOccludeAnimTriArray = (KAccelStruct_KDTree::PFN_RayOccludeAnimTriArray)pFuncTriRay;
+			}
+
+			FunctionHandle hRayIntersectStaticTriArrayWT = KSC_GetFunctionHandleByName("RayIntersectStaticTriArrayWT", hTriRay);
+			if (hRayIntersectStaticTriArrayWT) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayIntersectStaticTriArrayWT);
+				KAccelStruct_KDTree::s_pPFN_RayIntersectStaticTriArrayWT = (KAccelStruct_KDTree::PFN_RayIntersectStaticTriArrayWT)pFuncTriRay;
+			}
+
+			FunctionHandle hRayIntersectAnimTriArrayWT = KSC_GetFunctionHandleByName("RayIntersectAnimTriArrayWT", hTriRay);
+			if (hRayIntersectAnimTriArrayWT) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayIntersectAnimTriArrayWT);
+				KAccelStruct_KDTree::s_pPFN_RayIntersectAnimTriArrayWT = (KAccelStruct_KDTree::PFN_RayIntersectAnimTriArrayWT)pFuncTriRay;
+			}
+
+			FunctionHandle hRayOccludeStaticTriArrayWT = KSC_GetFunctionHandleByName("RayOccludeStaticTriArrayWT", hTriRay);
+			if (hRayOccludeStaticTriArrayWT) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayOccludeStaticTriArrayWT);
+				KAccelStruct_KDTree::s_pPFN_RayOccludeStaticTriArrayWT = (KAccelStruct_KDTree::PFN_RayOccludeStaticTriArrayWT)pFuncTriRay;
+			}
+
+			FunctionHandle hRayOccludeAnimTriArrayWT = KSC_GetFunctionHandleByName("RayOccludeAnimTriArrayWT", hTriRay);
+			if (hRayOccludeAnimTriArrayWT) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayOccludeAnimTriArrayWT);
+				KAccelStruct_KDTree::s_pPFN_RayOccludeAnimTriArrayWT = (KAccelStruct_KDTree::PFN_RayOccludeAnimTriArrayWT)pFuncTriRay;
+			}
+
+			FunctionHandle hRayIntersectStaticPairArray = KSC_GetFunctionHandleByName("RayIntersectStaticPairArray", hTriRay);
+			if (hRayIntersectStaticPairArray) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayIntersectStaticPairArray);
+				KAccelStruct_KDTree::s_pPFN_RayIntersectStaticPairArray = (KAccelStruct_KDTree::PFN_RayIntersectStaticTriArray)pFuncTriRay;
+			}
+
+			FunctionHandle hRayOccludeStaticPairArray = KSC_GetFunctionHandleByName("RayOccludeStaticPairArray", hTriRay);
+			if (hRayOccludeStaticPairArray) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayOccludeStaticPairArray);
+				KAccelStruct_KDTree::s_pPFN_RayOccludeStaticPairArray = (KAccelStruct_KDTree::PFN_RayOccludeStaticTriArray)pFuncTriRay;
+			}
+
+			FunctionHandle hRayIntersectStaticPairArrayWT = KSC_GetFunctionHandleByName("RayIntersectStaticPairArrayWT", hTriRay);
+			if (hRayIntersectStaticPairArrayWT) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayIntersectStaticPairArrayWT);
+				KAccelStruct_KDTree::s_pPFN_RayIntersectStaticPairArrayWT = (KAccelStruct_KDTree::PFN_RayIntersectStaticTriArrayWT)pFuncTriRay;
+			}
+
+			FunctionHandle hRayOccludeStaticPairArrayWT = KSC_GetFunctionHandleByName("RayOccludeStaticPairArrayWT", hTriRay);
+			if (hRayOccludeStaticPairArrayWT) {
+				void* pFuncTriRay = KSC_GetFunctionPtr(hRayOccludeStaticPairArrayWT);
+				KAccelStruct_KDTree::s_pPFN_RayOccludeStaticPairArrayWT = (KAccelStruct_KDTree::PFN_RayOccludeStaticTriArrayWT)pFuncTriRay;
+			}
 		}
 		else {
 			// Compilation failed...
@@ -462,7 +1162,17 @@ bool KRT_Initialize()
 		}
 
 		if (KAccelStruct_KDTree::s_pPFN_RayIntersectStaticTriArray == NULL || 
-			KAccelStruct_KDTree::s_pPFN_RayIntersectAnimTriArray == NULL) {
+			KAccelStruct_KDTree::s_pPFN_RayIntersectAnimTriArray == NULL ||
+			KAccelStruct_KDTree::s_pPFN_RayOccludeStaticTriArray == NULL || 
+			KAccelStruct_KDTree::s_pPFN_RayOccludeAnimTriArray == NULL ||
+			KAccelStruct_KDTree::s_pPFN_RayIntersectStaticTriArrayWT == NULL || 
+			KAccelStruct_KDTree::s_pPFN_RayIntersectAnimTriArrayWT == NULL ||
+			KAccelStruct_KDTree::s_pPFN_RayOccludeStaticTriArrayWT == NULL || 
+			KAccelStruct_KDTree::s_pPFN_RayOccludeAnimTriArrayWT == NULL ||
+			KAccelStruct_KDTree::s_pPFN_RayIntersectStaticPairArray == NULL || 
+			KAccelStruct_KDTree::s_pPFN_RayOccludeStaticPairArray == NULL ||
+			KAccelStruct_KDTree::s_pPFN_RayIntersectStaticPairArrayWT == NULL || 
+			KAccelStruct_KDTree::s_pPFN_RayOccludeStaticPairArrayWT == NULL) {
 			ret = false;
 		}
 		
@@ -542,7 +1252,7 @@ bool KRT_SetRenderOption(const char* name, const char* value)
 
 bool KRT_RenderToMemory(unsigned w, unsigned h, KRT_ImageFormat format, void* pOutData, KRT_RenderStatistic& outStatistic)
 {
-	const void* renderData = KRayTracer::g_pRoot->Render(w, h, format, pOutData, outStatistic.render_time);
+	const void* renderData = KRayTracer::g_pRoot->Render(w, h, format, pOutData, outStatistic);
 	BitmapObject bmpOrg;
 	bmpOrg.mAutoFreeMem = false;
 	bmpOrg.mFormat = BitmapObject::eRGB32F;
@@ -569,7 +1279,7 @@ bool KRT_RenderToMemory(unsigned w, unsigned h, KRT_ImageFormat format, void* pO
 
 bool KRT_RenderToImage(unsigned w, unsigned h, KRT_ImageFormat format, const char* fileName, KRT_RenderStatistic& outStatistic)
 {
-	const BitmapObject* outBitmap = KRayTracer::g_pRoot->Render(w, h, kRGB_8, NULL, outStatistic.render_time);
+	const BitmapObject* outBitmap = KRayTracer::g_pRoot->Render(w, h, kRGB_8, NULL, outStatistic);
 
 	if (outBitmap) {
 		outBitmap->Save(fileName);
@@ -674,6 +1384,15 @@ unsigned KRT_AddSubScene(TopSceneHandle scene)
 	return newSceneIdx;
 }
 
+bool KRT_SetSubSceneAccelType(SubSceneHandle subScene, unsigned accelType)
+{
+	if (accelType > KScene::eAccel_BVH)
+		return false;
+	KScene* pScene = (KScene*)subScene;
+	pScene->mAccelType = (KScene::AccelType)accelType;
+	return true;
+}
+
 unsigned KRT_AddNodeToScene(TopSceneHandle scene, unsigned sceneIdx, float* matrix)
 {
 	KSceneSet* pScene = (KSceneSet*)scene;
@@ -158,6 +158,11 @@ bool SceneLoader::LoadFromFile(const char* file_name)
 
 	// End of file reading, now build the acceleration structure
 	mpAccelData = new KAccelStruct_BVH(mpScene);
+	if (ret && ACCEL_CACHE) {
+		std::string cacheFile = file_name;
+		cacheFile += ".kac";
+		mpAccelData->SetAccelCacheFile(cacheFile.c_str());
+	}
 	mpAccelData->SceneNode_BuildAccelData(NULL);
 
 	KBBox scene_box = mpAccelData->GetSceneBBox();
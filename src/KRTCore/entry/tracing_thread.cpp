@@ -10,9 +10,11 @@ namespace KRayTracer {
 
 
 ImageSampler::ImageSampler() : 
-	mTempSamplingRes(16)
+	mTempSamplingRes(16),
+	mTempSamplingHit(16)
 {
-
+	mNoiseSum = 0;
+	mNoisePixelCnt = 0;
 }
 
 ImageSampler::~ImageSampler()
@@ -22,110 +24,247 @@ ImageSampler::~ImageSampler()
 
 void ImageSampler::DoPixelSampling(UINT32 x, UINT32 y, UINT32 sample_count, PixelSamplingResult& result)
 {
-	IntersectContext tempCtx;
-	if (mTempSamplingRes.size() < sample_count)
-		mTempSamplingRes.resize(sample_count);
-	float sampleCnt = (float)sample_count;
-	float hitCnt = 0;
-	KColor sum(0,0,0);
+	DoPacketSampling(&x, &y, 1, sample_count, &result);
+}
+
+void ImageSampler::DoPacketSampling(const UINT32* pX, const UINT32* pY, UINT32 pixelCnt, UINT32 sample_count, PixelSamplingResult* results)
+{
+	UINT32 totalCnt = pixelCnt * sample_count;
+	if (mTempSamplingRes.size() < totalCnt)
+		mTempSamplingRes.resize(totalCnt);
+	if (mTempSamplingHit.size() < totalCnt)
+		mTempSamplingHit.resize(totalCnt);
+	if (mTempRays.size() < totalCnt)
+		mTempRays.resize(totalCnt);
+	if (mTempHitCtx.size() < totalCnt)
+		mTempHitCtx.resize(totalCnt);
+	if (mTempMotionTime.size() < totalCnt)
+		mTempMotionTime.resize(totalCnt);
 	RenderBuffers* pRBufs = mpInputData->pRenderBuffers;
+	KCamera* pCamera = mpInputData->pCurrentCamera;
+	TracingInstance& tracingInst = *mTracingThreadData.get();
+
+	KRayPacket packet;
+	for (UINT32 start = 0; start < totalCnt; start += RAY_PACKET_SIZE) {
 
-	for (UINT32 si = 0; si < sample_count; ++si) {
+		// Generate the eye rays, the samples of the same pixel are consecutive so they keep
+		// the same random sequence as sampling the pixel alone.
+		packet.ray_cnt = std::min(RAY_PACKET_SIZE, totalCnt - start);
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			UINT32 pi = (start + i) / sample_count;
+			UINT32 x = pX[pi];
+			UINT32 y = pY[pi];
+			tracingInst.mCameraContext.inScreenPos = pRBufs->RS_Image(x, y);
+			float motionTime = ENABLE_MB ? pRBufs->RS_MotionBlur(x, y) : 0;
+			tracingInst.mCameraContext.inMotionTime = motionTime;
+			tracingInst.mCameraContext.inAperturePos = ENABLE_DOF ? pRBufs->RS_DOF(x, y) : KVec2(0,0);
 
-		TracingInstance& tracingInst = *mTracingThreadData.get();
-		tracingInst.mCameraContext.inScreenPos = pRBufs->RS_Image(x, y);
-		float motionTime = ENABLE_MB ? pRBufs->RS_MotionBlur(x, y) : 0;
-		tracingInst.mCameraContext.inMotionTime = motionTime;
-		tracingInst.mCameraContext.inAperturePos = ENABLE_DOF ? pRBufs->RS_DOF(x, y) : KVec2(0,0);
+			pCamera->GenerateEyeRay(tracingInst.mCameraContext, packet.rays[i]);
+			packet.ctx[i].Reset();
+			packet.motion_time[i] = motionTime;
 
-		KColor out_clr;
-		bool isHit = mpInputData->pCurrentCamera->EvaluateShading(tracingInst, mTempSamplingRes[si]);
-		sum.Add(mTempSamplingRes[si]);
+			pRBufs->IncreaseSampledCount(x, y, 1);
+		}
 
-		mpInputData->pRenderBuffers->IncreaseSampledCount(x, y, 1);
+		UINT32 hitMask;
+		if (packet.ray_cnt == 1) {
+			tracingInst.mCameraContext.inMotionTime = packet.motion_time[0];
+			hitMask = tracingInst.CastRay(packet.rays[0], packet.ctx[0]) ? 1 : 0;
+		}
+		else
+			hitMask = tracingInst.CastRayPacket(packet);
 
-		if (isHit)
-			hitCnt += 1.0f;
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			mTempRays[start + i] = packet.rays[i];
+			mTempHitCtx[start + i] = packet.ctx[i];
+			mTempMotionTime[start + i] = packet.motion_time[i];
+			mTempSamplingHit[start + i] = (hitMask & (1 << i)) ? 1 : 0;
+		}
 	}
 
-	result.alpha = hitCnt / sampleCnt;
-	result.variance = 0;
-	result.average = sum;
-	result.average.Scale(1.0f / sampleCnt);
+	// Shade the samples, the secondary rays are traced depth first unless they are batched
+	bool batchSecondary = SECONDARY_RAY_BATCH && MAX_REFLECTION_BOUNCE > 1;
+	if (batchSecondary) {
+		tracingInst.BeginSecondaryBatch();
+		KColor discard;
+		for (UINT32 si = 0; si < totalCnt; ++si) {
+			tracingInst.SetSecondaryBatchSample(si);
+			if (!mTempSamplingHit[si])
+				continue;
+			tracingInst.mCameraContext.inMotionTime = mTempMotionTime[si];
+			CalcuShadingByHit(&tracingInst, mTempRays[si], &mTempHitCtx[si], discard);
+		}
+		tracingInst.TraceSecondaryBatch();
+	}
 
-	for (UINT32 si = 0; si < sample_count; ++si) {
-		result.variance += mTempSamplingRes[si].DiffRatio(result.average);
+	for (UINT32 si = 0; si < totalCnt; ++si) {
+		if (batchSecondary)
+			tracingInst.SetSecondaryBatchSample(si);
+		tracingInst.mCameraContext.inMotionTime = mTempMotionTime[si];
+		const IntersectContext* pHit = mTempSamplingHit[si] ? &mTempHitCtx[si] : NULL;
+		mTempSamplingHit[si] = CalcuShadingByHit(&tracingInst, mTempRays[si], pHit, mTempSamplingRes[si]) ? 1 : 0;
 	}
+
+	if (batchSecondary)
+		tracingInst.EndSecondaryBatch();
+
+	float sampleCnt = (float)sample_count;
+	for (UINT32 pi = 0; pi < pixelCnt; ++pi) {
+		const KColor* pSampleRes = &mTempSamplingRes[pi * sample_count];
+		const BYTE* pSampleHit = &mTempSamplingHit[pi * sample_count];
+		PixelSamplingResult& result = results[pi];
+
+		float hitCnt = 0;
+		KColor sum(0,0,0);
+		for (UINT32 si = 0; si < sample_count; ++si) {
+			sum.Add(pSampleRes[si]);
+			if (pSampleHit[si])
+				hitCnt += 1.0f;
+		}
+
+		result.alpha = hitCnt / sampleCnt;
+		result.variance = 0;
+		result.average = sum;
+		result.average.Scale(1.0f / sampleCnt);
+
+		for (UINT32 si = 0; si < sample_count; ++si) {
+			result.variance += pSampleRes[si].DiffRatio(result.average);
+		}
 	
-	result.variance /= sampleCnt;
+		result.variance /= sampleCnt;
+	}
 }
 
-bool ImageSampler::SampleTile()
+void ImageSampler::AccumPassNoise(UINT32 x, UINT32 y, const KColor& passClr)
+{
+	// The samples of this pass are counted already
+	UINT32 passCnt = mpRenderParam->sample_cnt_eval;
+	UINT32 prevCnt = mpInputData->pRenderBuffers->GetSampledCount(x, y) - passCnt;
+	if (prevCnt == 0)
+		return;
+
+	// The pass and the samples before it are two independent estimates, their difference scaled
+	// this way tracks the error of the merged one
+	KColor prevClr = mpInputData->pRenderBuffers->GetOutputImagePtr()->GetPixel(x, y).color;
+	float diff = std::min(passClr.DiffRatio(prevClr), 1.0f);
+	mNoiseSum += diff * sqrtf(float(prevCnt) * float(passCnt)) / float(prevCnt + passCnt);
+	++mNoisePixelCnt;
+}
+
+bool ImageSampler::SampleTile(Tile2DSet::TileDesc& tileDesc)
 {
-	UINT32 line_width;
-	UINT32 out_w, out_h;
-	Tile2DSet::TileDesc tileDesc;
 	if (!mpInputData->pImageTile2D->GetNextTile(tileDesc))
 		return false;  // Finished with all the tile sampling
+	KTimer tileTimer(true);
+
+	if (!SampleRegion(tileDesc))
+		return false;
 
-	line_width = mpRenderParam->image_width;
+	// The time is used to split the tiles of the next pass
+	mpInputData->pImageTile2D->SetTileCost(tileDesc, tileTimer.Stop());
+	return true;
+}
+
+UINT32 ImageSampler::GetGroupSize(UINT32 sampleCnt, UINT32 pixelTotal) const
+{
+	// Enough pixels for their eye rays to fill a packet, or all of them if their secondary rays are batched
+	if (SECONDARY_RAY_BATCH)
+		return std::max(1u, pixelTotal);
+	return std::max(1u, RAY_PACKET_SIZE / std::max(1u, sampleCnt));
+}
+
+void ImageSampler::SamplePixelList(const UINT32* pX, const UINT32* pY, UINT32 pixelTotal, UINT32 sampleCnt)
+{
+	UINT32 groupSize = GetGroupSize(sampleCnt, pixelTotal);
+	if (mGroupRes.size() < groupSize)
+		mGroupRes.resize(groupSize);
+
+	for (UINT32 p = 0; p < pixelTotal; p += groupSize) {
+		UINT32 pixelCnt = std::min(groupSize, pixelTotal - p);
+		DoPacketSampling(pX + p, pY + p, pixelCnt, sampleCnt, &mGroupRes[0]);
+		for (UINT32 pi = 0; pi < pixelCnt; ++pi)
+			mpInputData->pRenderBuffers->AddSamples(pX[p + pi], pY[p + pi], sampleCnt, mGroupRes[pi].average, mGroupRes[pi].alpha);
+
+		if (mpInputData->stopSignal)
+			break;
+	}
+}
+
+bool ImageSampler::SampleRegion(const Tile2DSet::TileDesc& tileDesc)
+{
+	UINT32 out_w, out_h;
 	out_w = tileDesc.tile_w;
 	out_h = tileDesc.tile_h;
-	
-	UINT32 offset_pass0 = tileDesc.start_y * line_width + tileDesc.start_x;
-		
-	for (UINT32 y = 0; y < out_h; ++y) {
-	UINT32 line_start = y * line_width + offset_pass0;
-	for (UINT32 x = 0; x < out_w; ++x) {
-		IntersectContext ctxDest;
-		// Cast the ray into the scene
-		PixelSamplingResult res;
-		UINT32 curX = tileDesc.start_x + x;
-		UINT32 curY = tileDesc.start_y + y;
-
-		bool isEdgeSampling = false;
-		if (mpInputData->pEdgeFlag) {
-			// when edge flag is set, only pixels on the edge will get sampled.
-			if (!mpInputData->pEdgeFlag->IsEdge(curX, curY)) 
-				continue;
+	UINT32 pixelTotal = out_w * out_h;
+	if (mListX.size() < pixelTotal) {
+		mListX.resize(pixelTotal);
+		mListY.resize(pixelTotal);
+	}
 
-			isEdgeSampling = true;
+	if (mpInputData->pEdgeFlag) {
+		// when edge flag is set, only pixels on the edge will get sampled.
+		UINT32 edgeCnt = 0;
+		for (UINT32 y = 0; y < out_h; ++y) {
+			UINT32 curY = tileDesc.start_y + y;
+			for (UINT32 x = 0; x < out_w; ++x) {
+				UINT32 curX = tileDesc.start_x + x;
+				if (!mpInputData->pEdgeFlag->IsEdge(curX, curY)) 
+					continue;
+				mListX[edgeCnt] = curX;
+				mListY[edgeCnt] = curY;
+				++edgeCnt;
+			}
 		}
+		if (edgeCnt > 0)
+			SamplePixelList(&mListX[0], &mListY[0], edgeCnt, mpRenderParam->sample_cnt_edge);
+	}
+	else {
+		// Neighbouring pixels of the evaluation pass are sampled together so their eye rays fill a packet,
+		// the whole tile is sampled at once if its secondary rays are batched.
+		UINT32 groupSize = GetGroupSize(mpRenderParam->sample_cnt_eval, pixelTotal);
+		if (mGroupX.size() < groupSize) {
+			mGroupX.resize(groupSize);
+			mGroupY.resize(groupSize);
+		}
+		if (mGroupRes.size() < groupSize)
+			mGroupRes.resize(groupSize);
 
+		for (UINT32 p = 0; p < pixelTotal; p += groupSize) {
+			UINT32 pixelCnt = std::min(groupSize, pixelTotal - p);
+			for (UINT32 pi = 0; pi < pixelCnt; ++pi) {
+				mGroupX[pi] = tileDesc.start_x + (p + pi) % out_w;
+				mGroupY[pi] = tileDesc.start_y + (p + pi) / out_w;
+			}
 
-		if (isEdgeSampling) {
-			DoPixelSampling(curX, curY, mpRenderParam->sample_cnt_edge, res);
-			//AccumCurrentPixel(curX, curY, mpRenderParam->sample_cnt_edge, res.average);
-			mpInputData->pRenderBuffers->AddSamples(curX, curY, mpRenderParam->sample_cnt_edge, res.average, res.alpha);
-		}
-		else {
-			DoPixelSampling(curX, curY, mpRenderParam->sample_cnt_eval, res);
-			//AccumCurrentPixel(curX, curY, mpRenderParam->sample_cnt_eval, res.average);
-			mpInputData->pRenderBuffers->AddSamples(curX, curY, mpRenderParam->sample_cnt_eval, res.average, res.alpha);
+			DoPacketSampling(&mGroupX[0], &mGroupY[0], pixelCnt, mpRenderParam->sample_cnt_eval, &mGroupRes[0]);
+			UINT32 moreCnt = 0;
+			for (UINT32 pi = 0; pi < pixelCnt; ++pi) {
+				UINT32 curX = mGroupX[pi];
+				UINT32 curY = mGroupY[pi];
+				const PixelSamplingResult& res = mGroupRes[pi];
+				if (mpRenderParam->is_refining)
+					AccumPassNoise(curX, curY, res.average);
+				//AccumCurrentPixel(curX, curY, mpRenderParam->sample_cnt_eval, res.average);
+				mpInputData->pRenderBuffers->AddSamples(curX, curY, mpRenderParam->sample_cnt_eval, res.average, res.alpha);
 
-			if (mpRenderParam->sample_cnt_eval > 1 && res.variance > COLOR_DIFF_THRESH_HOLD) {
 				// Only do the extra sampling when the evaluation sample count is > 1 AND the previous sampling variance is above the threshold
-				DoPixelSampling(curX, curY, mpRenderParam->sample_cnt_more, res);
-				//AccumCurrentPixel(curX, curY, mpRenderParam->sample_cnt_more, res.average);
-				mpInputData->pRenderBuffers->AddSamples(curX, curY, mpRenderParam->sample_cnt_more, res.average, res.alpha);
+				if (mpRenderParam->sample_cnt_eval > 1 && res.variance > COLOR_DIFF_THRESH_HOLD) {
+					mListX[moreCnt] = curX;
+					mListY[moreCnt] = curY;
+					++moreCnt;
+				}
 			}
-		}
 
+			// The extra samples of the noisy pixels are grouped into packets too
+			if (moreCnt > 0 && !mpInputData->stopSignal)
+				SamplePixelList(&mListX[0], &mListY[0], moreCnt, mpRenderParam->sample_cnt_more);
 
-		if (mpInputData->stopSignal)
-			break;
-	}
+			if (mpInputData->stopSignal)
+				break;
+		}
 	}
 
-	if (mpInputData->stopSignal)
-		return false;
-
-	return true;
-}
-
-void ImageSampler::Execute()
-{
-	while (SampleTile());
+	return (mpInputData->stopSignal == 0);
 }
 
 
@@ -20,7 +20,7 @@
 
 namespace KRayTracer {
 
-	class ImageSampler : public ThreadModel::IThreadTask
+	class ImageSampler
 	{
 	public:
 		class EventCallBack
@@ -47,6 +47,9 @@ namespace KRayTracer {
 		InputData*			mpInputData;
 		std::vector<KVec2>	mAreaLightUnifiedSamples;
 		std::auto_ptr<TracingInstance> mTracingThreadData;
+		// Error estimate of the progressive passes, summed over the pixels sampled before the pass
+		double				mNoiseSum;
+		UINT32				mNoisePixelCnt;
 
 	protected:
 		struct PixelSamplingResult {
@@ -58,6 +61,16 @@ namespace KRayTracer {
 	private:
 	
 		std::vector<KColor>		mTempSamplingRes;
+		std::vector<BYTE>		mTempSamplingHit;
+		std::vector<KRay>		mTempRays;
+		std::vector<IntersectContext> mTempHitCtx;
+		std::vector<float>		mTempMotionTime;
+		std::vector<UINT32>		mGroupX;
+		std::vector<UINT32>		mGroupY;
+		std::vector<PixelSamplingResult> mGroupRes;
+		// The edge pixels or the noisy pixels of a tile picked for more samples
+		std::vector<UINT32>		mListX;
+		std::vector<UINT32>		mListY;
 		// Current bounce depth of the ray
 		UINT32					mCurBounceDepth;
 
@@ -66,7 +79,10 @@ namespace KRayTracer {
 		ImageSampler();
 		virtual ~ImageSampler();
 
-		virtual void Execute();
+		// Sample the next tile of the input tile set, it returns false when there's no tile left
+		bool SampleTile(Tile2DSet::TileDesc& tileDesc);
+		// Sample the pixels of a region, only the edge pixels if the edge flag is set
+		bool SampleRegion(const Tile2DSet::TileDesc& tileDesc);
 
 		void SetOutputImage(UINT32 totalWidth, UINT32 totalHeight,
 			UINT32 sx, UINT32 sy, 
@@ -74,8 +90,13 @@ namespace KRayTracer {
 			BitmapObject* pBmp);
 
 		void DoPixelSampling(UINT32 x, UINT32 y, UINT32 sample_count, PixelSamplingResult& result);
-		bool SampleTile();
+		// Sample several pixels at once, the eye rays of the samples are traced in packets of RAY_PACKET_SIZE.
+		void DoPacketSampling(const UINT32* pX, const UINT32* pY, UINT32 pixelCnt, UINT32 sample_count, PixelSamplingResult* results);
+		// Sample a list of pixels in groups of GetGroupSize and add the samples to the render buffers
+		void SamplePixelList(const UINT32* pX, const UINT32* pY, UINT32 pixelTotal, UINT32 sampleCnt);
+		UINT32 GetGroupSize(UINT32 sampleCnt, UINT32 pixelTotal) const;
 		void AccumCurrentPixel(UINT32 x, UINT32 y, UINT32 sample_count, const KColor& clr);
+		void AccumPassNoise(UINT32 x, UINT32 y, const KColor& passClr);
 	};
 
 } // namespace KRayTracer
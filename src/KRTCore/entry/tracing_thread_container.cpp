@@ -7,8 +7,10 @@ namespace KRayTracer {
 
 SamplingThreadContainer::SamplingThreadContainer()
 {
-	UINT32 threadCnt = GetConfigedThreadCount();
-	mpSharedThreadBucket.reset(new ThreadModel::ThreadBucket(threadCnt));
+	mpWorkerPool = NULL;
+	mPassCnt = 0;
+	mPassSpp = 0;
+	mNoiseEstimate = 0;
 }
 
 SamplingThreadContainer::~SamplingThreadContainer()
@@ -23,6 +25,8 @@ bool SamplingThreadContainer::Render(
 			const char* camera_name, 
 			SceneLoader* scene)
 {
+	if (param.is_refining && param.GetProgressiveLimitError())
+		return false;
 	mRenderParam = param;
 
 	mRenderInputData.pScene = scene;
@@ -39,41 +43,299 @@ bool SamplingThreadContainer::Render(
 
 	// allocate the internal buffers for rendering
 	mRenderBuffers.SetImageSize(param.image_width, param.image_height, param.pixel_format, param.user_buffer);
-	mTile2D.Reset(param.image_width, param.image_height, 32);
+	mpWorkerPool = ThreadModel::WorkStealingPool::GetShared(GetConfigedThreadCount());
+	UINT32 threadCnt = mpWorkerPool->GetWorkerCnt();
+	mTile2D.Reset(param.image_width, param.image_height, TILE_SIZE, TILE_SIZE_MIN, threadCnt);
 	mRenderInputData.pRenderBuffers = &mRenderBuffers;
 	mRenderInputData.pImageTile2D = &mTile2D;
 	mRenderInputData.pEventCB = pCB;
 	
 
-	mImageSamplerThreads.resize(mpSharedThreadBucket->GetThreadCnt());
+	mImageSamplerThreads.resize(threadCnt);
 	for (UINT32 i = 0; i < mImageSamplerThreads.size(); ++i) {
 		mImageSamplerThreads[i].mpRenderParam = &mRenderParam;
 		mImageSamplerThreads[i].mpInputData = &mRenderInputData;
 		mImageSamplerThreads[i].mTracingThreadData.reset(new TracingInstance(mRenderInputData.pScene->mpAccelData, mRenderInputData.pRenderBuffers));
-		mpSharedThreadBucket->SetThreadTask(i, &mImageSamplerThreads[i]);
 	}
 
-	// Do the first pass of sampling 
+	mPassCnt = 0;
+	mPassSpp = 0;
+	mNoiseEstimate = 0;
+	if (param.is_refining)
+		return RenderProgressive(threadCnt);
+
+	// The first pass of sampling, then the edge detection and the second pass on the edges. They run
+	// as one task graph, so the workers go from one pass to the next without being put to sleep.
+	ThreadModel::TaskGraph graph(*mpWorkerPool);
 	mRenderInputData.pEdgeFlag = NULL;
-	mpSharedThreadBucket->Run();
+	SamplingPassTask firstPass;
+	firstPass.mpParent = this;
+	firstPass.mpInputData = &mRenderInputData;
+	firstPass.mpPipeline = NULL;
+	UINT32 firstNode = graph.AddTask(&firstPass, threadCnt);
 
-	if (param.sample_cnt_edge > 0 && param.want_edge_sampling) {
-		mTile2D.Reset(param.image_width, param.image_height, 32);
-		// Perform the edge detection for further sampling
-		std::auto_ptr<KRBG32F_EdgeDetecter> pEdgeFlag(new KRBG32F_EdgeDetecter(mRenderBuffers.GetOutputImagePtr(), mpSharedThreadBucket->GetThreadCnt()));
-		mRenderInputData.pEdgeFlag = pEdgeFlag.get();
-		pEdgeFlag->RunFilter(mpSharedThreadBucket.get());
+	std::auto_ptr<KRBG32F_EdgeDetecter> pEdgeFlag;
+	SamplingPassTask edgePass;
+	if (param.sample_cnt_edge > 0 && param.want_edge_sampling && EDGE_PIPELINE) {
+		// The first pass feeds the sampled tiles to the pipeline, there's no barrier before the edges
+		pEdgeFlag.reset(new KRBG32F_EdgeDetecter(mRenderBuffers.GetOutputImagePtr(), threadCnt));
+		mEdgeInputData = mRenderInputData;
+		mEdgeInputData.pImageTile2D = NULL;
+		mEdgeInputData.pEdgeFlag = pEdgeFlag.get();
+		mEdgePipeline.Reset(mpWorkerPool, &mImageSamplerThreads, &mEdgeInputData, pEdgeFlag.get(),
+			param.image_width, param.image_height, mTile2D.GetTileSize());
+		firstPass.mpPipeline = &mEdgePipeline;
+	}
+	else if (param.sample_cnt_edge > 0 && param.want_edge_sampling) {
+		mEdgeTile2D.Reset(param.image_width, param.image_height, TILE_SIZE, TILE_SIZE_MIN, threadCnt);
+		pEdgeFlag.reset(new KRBG32F_EdgeDetecter(mRenderBuffers.GetOutputImagePtr(), threadCnt));
+		mEdgeInputData = mRenderInputData;
+		mEdgeInputData.pImageTile2D = &mEdgeTile2D;
+		mEdgeInputData.pEdgeFlag = pEdgeFlag.get();
+		edgePass.mpParent = this;
+		edgePass.mpInputData = &mEdgeInputData;
+		edgePass.mpPipeline = NULL;
 
-		for (UINT32 i = 0; i < mImageSamplerThreads.size(); ++i) 
-			mpSharedThreadBucket->SetThreadTask(i, &mImageSamplerThreads[i]);
-	
-		// Do the second pass of sampling
-		mpSharedThreadBucket->Run();
+		UINT32 filterNode = pEdgeFlag->AddFilterTask(graph);
+		UINT32 edgeNode = graph.AddTask(&edgePass, threadCnt);
+		graph.AddDependency(firstNode, filterNode);
+		graph.AddDependency(filterNode, edgeNode);
+	}
+
+	mpWorkerPool->Run(&graph);
+
+	return true;
+}
+
+bool SamplingThreadContainer::RenderProgressive(UINT32 threadCnt)
+{
+	// Each pass takes as many samples as all the passes before it, so the first preview costs one
+	// sample per pixel and the sample count doubles. The running average of the render buffers merges
+	// the passes and the sample sequence of a pixel goes on from its sample count.
+	KTimer stop_watch(true);
+	mRenderInputData.pEdgeFlag = NULL;
+	mRenderParam.sample_cnt_more = 0;
+	UINT32 passSpp = 1;
+	while (passSpp > 0) {
+		mRenderParam.sample_cnt_eval = passSpp;
+		mTile2D.Reset(mRenderParam.image_width, mRenderParam.image_height, TILE_SIZE, TILE_SIZE_MIN, threadCnt);
+		for (UINT32 i = 0; i < mImageSamplerThreads.size(); ++i) {
+			mImageSamplerThreads[i].mNoiseSum = 0;
+			mImageSamplerThreads[i].mNoisePixelCnt = 0;
+		}
+
+		ThreadModel::TaskGraph graph(*mpWorkerPool);
+		SamplingPassTask pass;
+		pass.mpParent = this;
+		pass.mpInputData = &mRenderInputData;
+		pass.mpPipeline = NULL;
+		graph.AddTask(&pass, threadCnt);
+		mpWorkerPool->Run(&graph);
+		if (mRenderInputData.stopSignal)
+			break;
+
+		++mPassCnt;
+		mPassSpp += passSpp;
+		double noiseSum = 0;
+		UINT32 noisePixelCnt = 0;
+		for (UINT32 i = 0; i < mImageSamplerThreads.size(); ++i) {
+			noiseSum += mImageSamplerThreads[i].mNoiseSum;
+			noisePixelCnt += mImageSamplerThreads[i].mNoisePixelCnt;
+		}
+		if (noisePixelCnt > 0)
+			mNoiseEstimate = float(noiseSum / noisePixelCnt);
+		// The whole image is updated
+		if (mRenderInputData.pEventCB)
+			mRenderInputData.pEventCB->OnTileFinished(0, 0, mRenderParam.image_width, mRenderParam.image_height);
+
+		if (mRenderParam.noise_target > 0 && noisePixelCnt > 0 && mNoiseEstimate <= mRenderParam.noise_target)
+			break;
+		passSpp = mPassSpp;
+		if (mRenderParam.max_spp > 0)
+			passSpp = std::min(passSpp, mRenderParam.max_spp > mPassSpp ? mRenderParam.max_spp - mPassSpp : 0);
+		if (mRenderParam.time_budget > 0) {
+			// Shrink the next pass to the samples that fit in the time left
+			double elapsed = stop_watch.Stop();
+			double sppTime = elapsed / mPassSpp;
+			double fitSpp = elapsed < mRenderParam.time_budget ? (mRenderParam.time_budget - elapsed) / sppTime : 0;
+			if (fitSpp < passSpp)
+				passSpp = UINT32(fitSpp);
+		}
 	}
 
 	return true;
 }
 
+void SamplingThreadContainer::SamplingPassTask::Execute(UINT32 worker_idx)
+{
+	// The worker finished its part of the previous pass before taking this one
+	ImageSampler& sampler = mpParent->mImageSamplerThreads[worker_idx];
+	sampler.mpInputData = mpInputData;
+	Tile2DSet::TileDesc tileDesc;
+	while (sampler.SampleTile(tileDesc)) {
+		if (mpPipeline)
+			mpPipeline->OnTileSampled(worker_idx, tileDesc);
+	}
+	if (mpPipeline)
+		mpPipeline->Wait(worker_idx);
+}
+
+void SamplingThreadContainer::GetProgressiveStatistics(UINT32& passCnt, UINT32& spp, float& noise) const
+{
+	passCnt = mPassCnt;
+	spp = mPassSpp;
+	noise = mNoiseEstimate;
+}
+
+void SamplingThreadContainer::GetTracingStatistics(UINT64& leafTriTests, UINT64& mailboxSkips) const
+{
+	leafTriTests = 0;
+	mailboxSkips = 0;
+	for (UINT32 i = 0; i < mImageSamplerThreads.size(); ++i) {
+		const TracingInstance* inst = mImageSamplerThreads[i].mTracingThreadData.get();
+		if (inst) {
+			leafTriTests += inst->mLeafTriTestCnt;
+			mailboxSkips += inst->mMailboxSkipCnt;
+		}
+	}
+}
+
+EdgeRefinePipeline::EdgeRefinePipeline()
+{
+	mpPool = NULL;
+	mpSamplers = NULL;
+	mpEdgeInput = NULL;
+	mpEdgeFlag = NULL;
+	mWidth = mHeight = 0;
+	mBlockSize = 1;
+	mBlockX = mBlockY = 0;
+}
+
+void EdgeRefinePipeline::Reset(ThreadModel::WorkStealingPool* pPool, 
+			std::vector<ImageSampler>* pSamplers, 
+			ImageSampler::InputData* pEdgeInput, 
+			KRBG32F_EdgeDetecter* pEdgeFlag, 
+			UINT32 width, UINT32 height, UINT32 blockSize)
+{
+	mpPool = pPool;
+	mpSamplers = pSamplers;
+	mpEdgeInput = pEdgeInput;
+	mpEdgeFlag = pEdgeFlag;
+	mWidth = width;
+	mHeight = height;
+	mBlockSize = blockSize > 0 ? blockSize : 1;
+	mBlockX = (width + mBlockSize - 1) / mBlockSize;
+	mBlockY = (height + mBlockSize - 1) / mBlockSize;
+
+	UINT32 blockCnt = mBlockX * mBlockY;
+	mPixelsLeft.resize(blockCnt);
+	mDetectDep.resize(blockCnt);
+	mRefineDep.resize(blockCnt);
+	mDetectTasks.resize(blockCnt);
+	mRefineTasks.resize(blockCnt);
+	for (UINT32 by = 0; by < mBlockY; ++by) {
+		for (UINT32 bx = 0; bx < mBlockX; ++bx) {
+			UINT32 idx = by * mBlockX + bx;
+			Tile2DSet::TileDesc desc;
+			GetBlockDesc(bx, by, desc);
+			mPixelsLeft[idx] = long(desc.tile_w * desc.tile_h);
+			// The detection waits for the blocks right and below, the refinement for the ones left and above
+			long nextX = (bx + 1 < mBlockX) ? 1 : 0;
+			long nextY = (by + 1 < mBlockY) ? 1 : 0;
+			long prevX = (bx > 0) ? 1 : 0;
+			long prevY = (by > 0) ? 1 : 0;
+			mDetectDep[idx] = (1 + nextX) * (1 + nextY);
+			mRefineDep[idx] = (1 + prevX) * (1 + prevY);
+
+			mDetectTasks[idx].mpParent = this;
+			mDetectTasks[idx].mBlockIdx = idx;
+			mDetectTasks[idx].mIsRefine = false;
+			mRefineTasks[idx].mpParent = this;
+			mRefineTasks[idx].mBlockIdx = idx;
+			mRefineTasks[idx].mIsRefine = true;
+		}
+	}
+	mGroup.mPendingCnt = 0;
+}
 
+void EdgeRefinePipeline::GetBlockDesc(UINT32 bx, UINT32 by, Tile2DSet::TileDesc& desc) const
+{
+	desc.start_x = bx * mBlockSize;
+	desc.start_y = by * mBlockSize;
+	desc.tile_w = std::min(mBlockSize, mWidth - desc.start_x);
+	desc.tile_h = std::min(mBlockSize, mHeight - desc.start_y);
+	desc.grid_x = bx;
+	desc.grid_y = by;
+}
+
+void EdgeRefinePipeline::OnTileSampled(UINT32 worker_idx, const Tile2DSet::TileDesc& tileDesc)
+{
+	// Each tile of the first pass lies in one block
+	UINT32 bx = tileDesc.start_x / mBlockSize;
+	UINT32 by = tileDesc.start_y / mBlockSize;
+	long area = long(tileDesc.tile_w * tileDesc.tile_h);
+	if (atomic_exchange_add(&mPixelsLeft[by * mBlockX + bx], -area) > 0)
+		return;
+
+	// The block is sampled, it's the right or lower neighbour of the blocks left and above it
+	for (UINT32 dy = 0; dy < 2 && dy <= by; ++dy) {
+		for (UINT32 dx = 0; dx < 2 && dx <= bx; ++dx) {
+			UINT32 idx = (by - dy) * mBlockX + (bx - dx);
+			if (atomic_decrement(&mDetectDep[idx]) == 0)
+				mpPool->Spawn(worker_idx, &mDetectTasks[idx], mGroup);
+		}
+	}
+}
+
+void EdgeRefinePipeline::Wait(UINT32 worker_idx)
+{
+	mpPool->Wait(worker_idx, mGroup);
 }
 
+void EdgeRefinePipeline::DetectBlock(UINT32 worker_idx, UINT32 idx)
+{
+	UINT32 bx = idx % mBlockX;
+	UINT32 by = idx / mBlockX;
+	Tile2DSet::TileDesc desc;
+	GetBlockDesc(bx, by, desc);
+	// One more pixel to the right and below to cover the seams
+	UINT32 w = std::min(desc.tile_w + 1, mWidth - desc.start_x);
+	UINT32 h = std::min(desc.tile_h + 1, mHeight - desc.start_y);
+	mpEdgeFlag->DoFilter(desc.start_x, desc.start_y, w, h);
+
+	for (UINT32 dy = 0; dy < 2 && by + dy < mBlockY; ++dy) {
+		for (UINT32 dx = 0; dx < 2 && bx + dx < mBlockX; ++dx) {
+			UINT32 next = (by + dy) * mBlockX + (bx + dx);
+			if (atomic_decrement(&mRefineDep[next]) != 0)
+				continue;
+			// All the detections reaching into the block are done, skip it if it has no edge
+			Tile2DSet::TileDesc nextDesc;
+			GetBlockDesc(bx + dx, by + dy, nextDesc);
+			if (mpEdgeFlag->HasEdge(nextDesc.start_x, nextDesc.start_y, nextDesc.tile_w, nextDesc.tile_h))
+				mpPool->Spawn(worker_idx, &mRefineTasks[next], mGroup);
+		}
+	}
+}
+
+void EdgeRefinePipeline::RefineBlock(UINT32 worker_idx, UINT32 idx)
+{
+	Tile2DSet::TileDesc desc;
+	GetBlockDesc(idx % mBlockX, idx / mBlockX, desc);
+
+	// The sampler of this worker is between two tiles of the first pass or done with them
+	ImageSampler& sampler = (*mpSamplers)[worker_idx];
+	ImageSampler::InputData* pInput = sampler.mpInputData;
+	sampler.mpInputData = mpEdgeInput;
+	sampler.SampleRegion(desc);
+	sampler.mpInputData = pInput;
+}
+
+void EdgeRefinePipeline::BlockTask::Execute(UINT32 worker_idx)
+{
+	if (mIsRefine)
+		mpParent->RefineBlock(worker_idx, mBlockIdx);
+	else
+		mpParent->DetectBlock(worker_idx, mBlockIdx);
+}
+
+}
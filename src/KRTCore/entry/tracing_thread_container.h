@@ -5,7 +5,57 @@
 
 namespace KRayTracer {
 
-	
+	// Pipelined edge pass. The image is cut into blocks of the large tiles of the first pass. A block
+	// is edge detected once it and the blocks right and below it are sampled, so the detection covers
+	// the seams to them. It's refined once the blocks left and above it are detected too, because
+	// their edges can reach into it. The blocks without any edge pixel are never queued.
+	class EdgeRefinePipeline
+	{
+	public:
+		EdgeRefinePipeline();
+
+		void Reset(ThreadModel::WorkStealingPool* pPool, 
+			std::vector<ImageSampler>* pSamplers, 
+			ImageSampler::InputData* pEdgeInput, 
+			KRBG32F_EdgeDetecter* pEdgeFlag, 
+			UINT32 width, UINT32 height, UINT32 blockSize);
+		// Called by the first pass after sampling a tile
+		void OnTileSampled(UINT32 worker_idx, const Tile2DSet::TileDesc& tileDesc);
+		// Help with the detection and refinement until all the queued ones are done
+		void Wait(UINT32 worker_idx);
+
+	private:
+		class BlockTask : public ThreadModel::IForkJoinTask
+		{
+		public:
+			EdgeRefinePipeline* mpParent;
+			UINT32 mBlockIdx;
+			bool mIsRefine;
+
+			virtual void Execute(UINT32 worker_idx);
+		};
+
+		void GetBlockDesc(UINT32 bx, UINT32 by, Tile2DSet::TileDesc& desc) const;
+		void DetectBlock(UINT32 worker_idx, UINT32 idx);
+		void RefineBlock(UINT32 worker_idx, UINT32 idx);
+
+		ThreadModel::WorkStealingPool* mpPool;
+		std::vector<ImageSampler>* mpSamplers;
+		ImageSampler::InputData* mpEdgeInput;
+		KRBG32F_EdgeDetecter* mpEdgeFlag;
+		UINT32 mWidth;
+		UINT32 mHeight;
+		UINT32 mBlockSize;
+		UINT32 mBlockX;
+		UINT32 mBlockY;
+
+		std::vector<long> mPixelsLeft;	// pixels of the block not sampled by the first pass
+		std::vector<long> mDetectDep;	// blocks to sample before the detection
+		std::vector<long> mRefineDep;	// blocks to detect before the refinement
+		std::vector<BlockTask> mDetectTasks;
+		std::vector<BlockTask> mRefineTasks;
+		ThreadModel::TaskGroup mGroup;
+	};
 
 	class SamplingThreadContainer
 	{
@@ -18,19 +68,42 @@ namespace KRayTracer {
 			ImageSampler::EventCallBack* pCB, 
 			const char* camera_name, 
 			SceneLoader* scene);
+		// Leaf triangle tests of the last render summed over the threads
+		void GetTracingStatistics(UINT64& leafTriTests, UINT64& mailboxSkips) const;
+		void GetProgressiveStatistics(UINT32& passCnt, UINT32& spp, float& noise) const;
 
 		// Input & output buffers that need external access
 		RenderBuffers mRenderBuffers;
 	protected:
-				
+		// Render in passes until the limits of the render param are reached
+		bool RenderProgressive(UINT32 threadCnt);
+
+		// One sampling pass, each worker samples the tiles with its own ImageSampler
+		class SamplingPassTask : public ThreadModel::IForkJoinTask
+		{
+		public:
+			SamplingThreadContainer* mpParent;
+			ImageSampler::InputData* mpInputData;
+			EdgeRefinePipeline* mpPipeline;	// fed with the sampled tiles if it's set
+
+			virtual void Execute(UINT32 worker_idx);
+		};
 
 	protected:
-		// Shared thread bucket to perform the tasks in RenderTaskQueue
-		std::auto_ptr<ThreadModel::ThreadBucket> mpSharedThreadBucket;
+		// The shared work stealing pool running the passes, the samplers are indexed by its workers
+		ThreadModel::WorkStealingPool* mpWorkerPool;
 
 		RenderParam	mRenderParam;
 		ImageSampler::InputData		mRenderInputData;
+		ImageSampler::InputData		mEdgeInputData;
 		Tile2DSet					mTile2D;
+		Tile2DSet					mEdgeTile2D;	// the edge pass keeps its own tile costs
+		EdgeRefinePipeline			mEdgePipeline;
+
+		// Result of the last progressive rendering
+		UINT32						mPassCnt;
+		UINT32						mPassSpp;
+		float						mNoiseEstimate;
 		std::vector<ImageSampler> mImageSamplerThreads;
 		
 	};
@@ -201,11 +201,11 @@ KScene* AbcLoader::GetXformStaticScene(const Abc::IObject& obj, KMatrix4& out_ma
 
 			// Compute the transform matrix(beginning & ending) for the xform node
 			AbcG::IXform xform(animNode, Abc::kWrapExisting);
-			KMatrix4 sceneNodeFrames[2];
+			std::vector<KMatrix4> sceneNodeFrames(MOTION_TRANSFORM_SAMPLES);
 			bool isAnim = false;
-			GetObjectWorldTransform(xform, sceneNodeFrames, isAnim);
+			GetObjectWorldTransform(xform, &sceneNodeFrames[0], MOTION_TRANSFORM_SAMPLES, isAnim);
 			if (isAnim)
-				mpScene->SceneNodeTM_SetMovingNode(sceneNodeIdx, sceneNodeFrames[0], sceneNodeFrames[1]);
+				mpScene->SceneNodeTM_SetMovingNode(sceneNodeIdx, &sceneNodeFrames[0], MOTION_TRANSFORM_SAMPLES);
 			else
 				assert(0);
 		}
@@ -237,15 +237,15 @@ void AbcLoader::ProcessMesh(const AbcG::IPolyMesh& mesh)
 	else {
 		// For animatable(morphable) mesh, create its own SubScene object and SubNode.
 		//
-		KMatrix4 trans[2];
+		std::vector<KMatrix4> trans(MOTION_TRANSFORM_SAMPLES);
 		bool isAnim = false;
-		GetObjectWorldTransform(mesh, trans, isAnim);
+		GetObjectWorldTransform(mesh, &trans[0], MOTION_TRANSFORM_SAMPLES, isAnim);
 		UINT32 sceneIdx;
 		KScene* subScene = mpScene->AddKDScene(sceneIdx);
 		assert(subScene);
 		UINT32 sceneNodeIdx = mpScene->SceneNode_Create(sceneIdx);
 		if (isAnim) 
-			mpScene->SceneNodeTM_SetMovingNode(sceneNodeIdx, trans[0], trans[1]);
+			mpScene->SceneNodeTM_SetMovingNode(sceneNodeIdx, &trans[0], MOTION_TRANSFORM_SAMPLES);
 		else
 			mpScene->SceneNodeTM_SetStaticNode(sceneNodeIdx, trans[0]);
 
@@ -313,9 +313,10 @@ void AbcLoader::ProcessCamera(const AbcG::ICamera& camera, bool& out_isAnim)
 {
 	KCamera* pCamera = CameraManager::GetInstance()->OpenCamera(camera.getName().c_str(), true);
 	assert(pCamera);
+	// The camera motion only has the starting and ending state
 	KMatrix4 trans[2];
 	bool isAnim = false;
-	GetObjectWorldTransform(camera, trans, isAnim);
+	GetObjectWorldTransform(camera, trans, 2, isAnim);
 	const AbcG::ICameraSchema& cameraSchema = camera.getSchema();
 	
 	if (!cameraSchema.isConstant() || isAnim) {
@@ -642,7 +643,7 @@ bool AbcLoader::ConvertMesh(const AbcG::IPolyMeshSchema& meshSchema, Abc::chrono
 	return true;
 }
 
-void AbcLoader::GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4 trans[2], bool& isAnim)
+void AbcLoader::GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4* trans, UINT32 frameCnt, bool& isAnim)
 {
 	bool isAniminated = false;
 	Abc::IObject node;
@@ -659,8 +660,8 @@ void AbcLoader::GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4 trans
 	if (isAniminated) {
 
 		isAnim = true;
-		trans[0] = nvmath::cIdentity44f;
-		trans[1] = nvmath::cIdentity44f;
+		for (UINT32 i = 0; i < frameCnt; ++i)
+			trans[i] = nvmath::cIdentity44f;
 
 		for (; node.valid(); node = node.getParent()) {
 			if (AbcG::IXform::matches(node.getHeader())) {
@@ -668,9 +669,9 @@ void AbcLoader::GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4 trans
 
 				KMatrix4 localTransform;
 
-				for (int i = 0; i < 2; ++i) {
+				for (UINT32 i = 0; i < frameCnt; ++i) {
 					
-					Abc::chrono_t sampleTime = mCurTime + mSampleDuration * (double)i;
+					Abc::chrono_t sampleTime = mCurTime + mSampleDuration * double(i) / double(frameCnt - 1);
 					// Do two samples, one with floor index and the other with ceiling index, then
 					// lerp between these two samples with the current time.
 					Abc::ISampleSelector ss0(sampleTime, Abc::ISampleSelector::kFloorIndex);
@@ -717,7 +718,8 @@ void AbcLoader::GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4 trans
 		}
 
 		isAnim = false;
-		trans[1] = trans[0];
+		for (UINT32 i = 1; i < frameCnt; ++i)
+			trans[i] = trans[0];
 	}
 
 	
@@ -766,11 +768,11 @@ void AbcLoader::UpdateXformNode(std::vector<size_t>::const_iterator nodeIdIt, st
             AbcG::IPolyMesh xform_mesh(parentObj, ohead.getName());
             if (xform_mesh) {
 				std::cout << "updating mesh's xform: " << xform_mesh.getName() << std::endl;
-				KMatrix4 trans[2];
+				std::vector<KMatrix4> trans(MOTION_TRANSFORM_SAMPLES);
 				bool isAnim = false;
-				GetObjectWorldTransform(xform_mesh, trans, isAnim);
+				GetObjectWorldTransform(xform_mesh, &trans[0], MOTION_TRANSFORM_SAMPLES, isAnim);
 				if (isAnim)
-					mpScene->SceneNodeTM_SetMovingNode(nodeIdx, trans[0], trans[1]);
+					mpScene->SceneNodeTM_SetMovingNode(nodeIdx, &trans[0], MOTION_TRANSFORM_SAMPLES);
 				else
 					assert(0);
             }
@@ -36,7 +36,8 @@ private:
 	void ProcessMesh(const AbcG::IPolyMesh& mesh);
 	void ProcessCamera(const AbcG::ICamera& camera, bool& out_isAnim);
 
-	void GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4 trans[2], bool& isAnim);
+	// Sample the world transform at frameCnt evenly spaced times over the sample duration
+	void GetObjectWorldTransform(const AbcG::IObject& obj, KMatrix4* trans, UINT32 frameCnt, bool& isAnim);
 	KScene* GetXformStaticScene(const Abc::IObject& obj, KMatrix4& out_mat);
 
 	bool ConvertMesh(const AbcG::IPolyMeshSchema& meshSchema, Abc::chrono_t t, KTriMesh& outMesh);
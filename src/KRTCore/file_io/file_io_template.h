@@ -2,6 +2,25 @@
 #include <common/defines/typedefs.h>
 #include "../base/base_header.h"
 #include <typeinfo>
+#include <stdio.h>
+
+// Bytes from the current position to the end of the file, a count read from the file is checked
+// against it before anything is allocated for it.
+inline UINT64 GetFileBytesLeft(FILE* pFile)
+{
+#ifdef __GNUC__
+	off_t cur = ftello(pFile);
+	fseeko(pFile, 0, SEEK_END);
+	off_t end = ftello(pFile);
+	fseeko(pFile, cur, SEEK_SET);
+#else
+	__int64 cur = _ftelli64(pFile);
+	_fseeki64(pFile, 0, SEEK_END);
+	__int64 end = _ftelli64(pFile);
+	_fseeki64(pFile, cur, SEEK_SET);
+#endif
+	return (cur >= 0 && end > cur) ? (UINT64)(end - cur) : 0;
+}
 
 template <typename ByteWiseCopyArray>
 bool SaveArrayToFile(ByteWiseCopyArray& pArray, FILE* pFile)
@@ -25,6 +44,8 @@ bool LoadArrayFromFile(ByteWiseCopyArray& pArray, FILE* pFile)
 	UINT64 elementCnt = 0;
 	if (1 != fread(&elementCnt, sizeof(UINT64), 1, pFile))
 		return false;
+	if (elementCnt > GetFileBytesLeft(pFile) / sizeof(pArray[0]))
+		return false;
 
 	pArray.resize((size_t)elementCnt);
 	if (0 == elementCnt)
@@ -1,5 +1,6 @@
 #include "bitmap_object.h"
 #include "color.h"
+#include "../os/api_wrapper.h"
 #include <stdio.h>
 #include <memory.h>
 #include <assert.h>
@@ -15,7 +16,7 @@ BitmapObject::BitmapObject(void)
 BitmapObject::~BitmapObject(void)
 {
 	if (mAutoFreeMem)
-		delete[] mpData;
+		Interleaved_Free(mpData);
 }
 
 void BitmapObject::SetBitmapData(void* pData, PixelFormat format, UINT32 w, UINT32 h, bool auto_free_mem)
@@ -159,7 +160,9 @@ BitmapObject* BitmapObject::CreateBitmap(UINT32 w, UINT32 h, PixelFormat format,
 	BitmapObject* pBmp = new BitmapObject;
 	pBmp->mFormat = format;
 
-	BYTE* data = (pUserBuf == NULL ? new BYTE[w * h * GetBPPByFormat(pBmp->mFormat)] : (BYTE*)pUserBuf);
+	// The tiles and the texels are read by the threads of all the NUMA nodes
+	BYTE* data = (pUserBuf == NULL ? 
+		(BYTE*)Interleaved_Malloc(w * h * GetBPPByFormat(pBmp->mFormat), 64, NUMA_INTERLEAVE != 0) : (BYTE*)pUserBuf);
 	pBmp->SetBitmapData(data, format, w, h, pUserBuf ? false : true);
 	pBmp->mPitch = w * GetBPPByFormat(pBmp->mFormat);
 	return pBmp;
@@ -242,7 +245,8 @@ bool BitmapObject::Load(const char* filename, std::vector<BitmapObject*>* mipmap
 		mPitch = FreeImage_GetPitch(dib);
 
 		size_t dataSize = mWidth * mHeight * GetBPPByFormat(mFormat);
-		mpData = new BYTE[dataSize];
+		mpData = (BYTE*)Interleaved_Malloc(dataSize, 64, NUMA_INTERLEAVE != 0);
+		mAutoFreeMem = true;
 		memcpy(mpData, bits, dataSize);
 
 		// Generate the mipmap chain
@@ -262,10 +266,8 @@ bool BitmapObject::Load(const char* filename, std::vector<BitmapObject*>* mipmap
 				if (!dib) return false;
 
 				UINT32 bpp = GetBPPByFormat(mFormat);
-				BYTE* data = new BYTE[ww * hh * bpp];
 				bits = FreeImage_GetBits(dib);
-				memcpy(data, bits, bpp*ww*hh);
-				pLevel->SetBitmapData(data, mFormat, ww, hh, true);
+				memcpy(pLevel->mpData, bits, bpp*ww*hh);
 				mipmap_list->push_back(pLevel);
 
 				w >>= 1;
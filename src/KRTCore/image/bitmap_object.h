@@ -19,6 +19,7 @@ public:
 	~BitmapObject(void);
 
 
+	// With auto_free_mem the data must come from Interleaved_Malloc
 	void SetBitmapData(void* pData, PixelFormat format, UINT32 w, UINT32 h, bool auto_free_mem);
 
 	void SetPixelData(void* pPixel, UINT32 x, UINT32 y);
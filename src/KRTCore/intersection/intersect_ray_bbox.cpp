@@ -8,29 +8,28 @@
 //      "An Efficient and Robust Ray-Box Intersection Algorithm"
 //      Journal of graphics tools, 10(1):49-54, 2005
 //		You can get an intersection point by grabbing tmin (if return is true). 
-bool IntersectBBox(const KRay& ray, const KBBox& bbox, double& t0, double& t1)
+bool IntersectBBox(const KRay& ray, const KBBox& bbox, float& t0, float& t1)
 {
-	double tmin = (bbox[ray.mSign[0]][0] - ray.GetOrg()[0]) * ray.mRcpDir[0];
-	double tmax = (bbox[1-ray.mSign[0]][0] - ray.GetOrg()[0]) * ray.mRcpDir[0];
-
-	double tymin = (bbox[ray.mSign[1]][1] - ray.GetOrg()[1]) * ray.mRcpDir[1];
-	double tymax = (bbox[1-ray.mSign[1]][1] - ray.GetOrg()[1]) * ray.mRcpDir[1];
-
-	if (tymin > tmin)
-		tmin = tymin;
-	if (tymax < tmax)
-		tmax = tymax;
-
-	double tzmin = (bbox[ray.mSign[2]][2] - ray.GetOrg()[2]) * ray.mRcpDir[2];
-	double tzmax = (bbox[1-ray.mSign[2]][2] - ray.GetOrg()[2]) * ray.mRcpDir[2];
-
-	if (tzmin > tmin)
-		tmin = tzmin;
-	if (tzmax < tmax)
-		tmax = tzmax;
+	const KVec3& org = ray.GetOrgF();
+	// A zero direction component with the origin on the plane gives a NaN distance, the comparisons
+	// below skip it so that slab doesn't clip the ray. It's what the SSE test of the wide BVH does.
+	float tmin = -FLT_MAX;
+	float tmax = FLT_MAX;
+	for (int axis = 0; axis < 3; ++axis) {
+		float tNear = (bbox[ray.mSign[axis]][axis] - org[axis]) * ray.mRcpDir[axis];
+		float tFar = (bbox[1-ray.mSign[axis]][axis] - org[axis]) * ray.mRcpDir[axis];
+		if (tNear > tmin)
+			tmin = tNear;
+		if (tFar < tmax)
+			tmax = tFar;
+	}
+	// The rounding error of each slab distance is within 2 ulps, see Ize
+	// "Robust BVH Ray Traversal", Journal of Computer Graphics Techniques, 2013. The distances are
+	// negative behind the origin, so the ulps are taken from their magnitudes.
+	tmin -= fabsf(tmin) * 4.0f * FLT_EPSILON;
+	tmax += fabsf(tmax) * 4.0f * FLT_EPSILON;
 	// [Added by Kai] Output the near & far intersection point(if they exist)
 	t0 = tmin;
 	t1 = tmax;
 	return (t1 >= t0);
 }
-
@@ -2,4 +2,6 @@
 
 #include "../base/geometry.h"
 
-bool IntersectBBox(const KRay& ray, const KBBox& bbox, double& t0, double& t1);
+// The near distance is moved down and the far distance up by a few ulps, so that the single precision
+// test never misses a box the ray touches, whether the box is in front of or behind the origin.
+bool IntersectBBox(const KRay& ray, const KBBox& bbox, float& t0, float& t1);
@@ -210,6 +210,64 @@ void RayIntersectStaticTriArray(const float* ray_org, const float* ray_dir, cons
 	}
 }
 
+void RayShear::Init(const float* ray_dir)
+{
+	kz = 0;
+	if (fabs(ray_dir[1]) > fabs(ray_dir[kz])) kz = 1;
+	if (fabs(ray_dir[2]) > fabs(ray_dir[kz])) kz = 2;
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	// Keep the winding of the triangle
+	if (ray_dir[kz] < 0) {
+		int tmp = kx;
+		kx = ky;
+		ky = tmp;
+	}
+
+	s[0] = ray_dir[kx] / ray_dir[kz];
+	s[1] = ray_dir[ky] / ray_dir[kz];
+	s[2] = 1.0f / ray_dir[kz];
+}
+
+void RayIntersectStaticTriArrayWatertight(const float* ray_org, const float* ray_dir, const float* tri_pos, float* tuv, unsigned int cnt)
+{
+	RayShear shear;
+	shear.Init(ray_dir);
+	for (unsigned int tri_i = 0; tri_i < cnt; tri_i = tri_i+1) {
+
+		const float* vert = tri_pos + tri_i * 9;
+		float* out = tuv + tri_i * 3;
+		out[0] = FLT_MAX;
+
+		// Vertices relative to the ray origin in the sheared space
+		float x[3], y[3], z[3];
+		for (int i = 0; i < 3; ++i) {
+			z[i] = vert[i*3 + shear.kz] - ray_org[shear.kz];
+			x[i] = vert[i*3 + shear.kx] - ray_org[shear.kx] - shear.s[0] * z[i];
+			y[i] = vert[i*3 + shear.ky] - ray_org[shear.ky] - shear.s[1] * z[i];
+		}
+
+		// Edge functions, the ray hits the triangle if they have the same sign. The ones of a shared edge
+		// are computed from the same values for both triangles, so no ray passes between them.
+		float e0 = x[2]*y[1] - y[2]*x[1];
+		float e1 = x[0]*y[2] - y[0]*x[2];
+		float e2 = x[1]*y[0] - y[1]*x[0];
+		if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+			continue;
+		float det = e0 + e1 + e2;
+		if (det == 0)
+			continue;
+
+		float inv_det = 1.0f / det;
+		float tmpT = (e0*z[0] + e1*z[1] + e2*z[2]) * shear.s[2] * inv_det;
+		if (tmpT > 0) {
+			out[0] = tmpT;
+			out[1] = e1 * inv_det;
+			out[2] = e2 * inv_det;
+		}
+	}
+}
+
 void RayIntersectAnimTriArray(const float* ray_org, const float* ray_dir, float cur_t, const float* tri_pos, float* tuv, unsigned int cnt)
 {
 	int pos_idx = 0;
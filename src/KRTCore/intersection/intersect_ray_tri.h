@@ -4,5 +4,17 @@
 
 bool RayIntersect(const float* ray_org, const float* ray_dir, const KTriVertPos2& tri, float cur_t, RayTriIntersect& out_info);
 
+// Ray setup of the watertight ray-triangle test, see Woop et al. "Watertight Ray/Triangle Intersection",
+// JCGT 2013. The axes are permuted so that kz is the dominant axis of the ray direction, and the
+// triangle is sheared so that the ray goes along +z.
+struct RayShear
+{
+	int kx, ky, kz;
+	float s[3];	// x and y shear, and the z scale
+
+	void Init(const float* ray_dir);
+};
+
 void RayIntersectStaticTriArray(const float* ray_org, const float* ray_dir, const float* tri_pos, float* tuv, unsigned int cnt);
+void RayIntersectStaticTriArrayWatertight(const float* ray_org, const float* ray_dir, const float* tri_pos, float* tuv, unsigned int cnt);
 void RayIntersectAnimTriArray(const float* ray_org, const float* ray_dir, float cur_t, const float* tri_pos, float* tuv, unsigned int cnt);
\ No newline at end of file
@@ -12,6 +12,56 @@ int TriIntersectBBox(const KVec3 vertPos[3], const KBBox& bbox)
 	return ret;
 }
 
+bool ClipTriangleBBox(const KVec3 vertPos[3], const KBBox& bbox, KBBox& out_bbox)
+{
+	// Sutherland-Hodgman clipping by the 6 planes of the box, each plane adds one vertex at most
+	KVec3 poly[2][9];
+	int polyCnt = 3;
+	int cur = 0;
+	for (int i = 0; i < 3; ++i)
+		poly[0][i] = vertPos[i];
+
+	for (int axis = 0; axis < 3 && polyCnt > 0; ++axis) {
+		for (int side = 0; side < 2 && polyCnt > 0; ++side) {
+			float plane = side ? bbox.mMax[axis] : bbox.mMin[axis];
+			float sign = side ? -1.0f : 1.0f;
+			const KVec3* src = poly[cur];
+			KVec3* dst = poly[1 - cur];
+			int dstCnt = 0;
+			for (int i = 0; i < polyCnt; ++i) {
+				const KVec3& p0 = src[i];
+				const KVec3& p1 = src[(i + 1) % polyCnt];
+				float d0 = sign * (p0[axis] - plane);
+				float d1 = sign * (p1[axis] - plane);
+				if (d0 >= 0)
+					dst[dstCnt++] = p0;
+				if ((d0 < 0 && d1 > 0) || (d0 > 0 && d1 < 0)) {
+					KVec3 p = p0 + (p1 - p0) * (d0 / (d0 - d1));
+					p[axis] = plane;
+					dst[dstCnt++] = p;
+				}
+			}
+			polyCnt = dstCnt;
+			cur = 1 - cur;
+		}
+	}
+
+	if (polyCnt == 0)
+		return false;
+
+	out_bbox.SetEmpty();
+	for (int i = 0; i < polyCnt; ++i)
+		out_bbox.ContainVert(poly[cur][i]);
+
+	// Keep a small margin like KBBox(KTriVertPos2), so that the flat triangles don't get zero thickness bounds
+	KVec3 margin = (out_bbox.mMax - out_bbox.mMin) * 0.0001f;
+	float epsilon = nvmath::length(margin);
+	out_bbox.mMin -= KVec3(epsilon, epsilon, epsilon);
+	out_bbox.mMax += KVec3(epsilon, epsilon, epsilon);
+	out_bbox.ClampBBox(bbox);
+	return true;
+}
+
 
 
 
@@ -1,4 +1,7 @@
 #pragma once
 #include "../base/geometry.h"
 
-int TriIntersectBBox(const KVec3 vertPos[3], const KBBox& bbox);
\ No newline at end of file
+int TriIntersectBBox(const KVec3 vertPos[3], const KBBox& bbox);
+// Clip the triangle by the box and compute the bounds of the remaining polygon, it's tighter than
+// clamping the triangle's bounding box by the box. Returns false if nothing is left.
+bool ClipTriangleBBox(const KVec3 vertPos[3], const KBBox& bbox, KBBox& out_bbox);
\ No newline at end of file
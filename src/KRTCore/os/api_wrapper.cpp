@@ -2,9 +2,17 @@
 
 #ifdef __GNUC__
 	#include <stdio.h>
+	#include <stdlib.h>
+	#include <string.h>
 	#include <sys/time.h>
 	#include <time.h>
 	#include <unistd.h>
+	#include <sched.h>
+	#ifdef __linux__
+		#include <dirent.h>
+		#include <sys/syscall.h>
+		#include <sys/mman.h>
+	#endif
 #else
 	#include <windows.h>
 	#include <intrin.h>
@@ -89,6 +97,232 @@ unsigned long GetCPUCount()
 #endif
 }
 
+// The node of each logical cpu
+struct NumaTopology {
+	std::vector<UINT32> cpu_node;
+	UINT32 node_cnt;
+};
+
+static void ReadNumaTopology(NumaTopology& topology)
+{
+	topology.cpu_node.assign(GetCPUCount(), 0);
+	topology.node_cnt = 1;
+#ifdef __linux__
+	DIR* pDir = opendir("/sys/devices/system/node");
+	if (!pDir)
+		return;
+	struct dirent* pEntry;
+	while ((pEntry = readdir(pDir)) != NULL) {
+		UINT32 node;
+		if (sscanf(pEntry->d_name, "node%u", &node) != 1)
+			continue;
+		char path[256];
+		sprintf(path, "/sys/devices/system/node/node%u/cpulist", node);
+		FILE* pFile = fopen(path, "r");
+		if (!pFile)
+			continue;
+		// The list looks like "0-7,16-23"
+		UINT32 first, last;
+		while (fscanf(pFile, "%u", &first) == 1) {
+			last = first;
+			int c = fgetc(pFile);
+			if (c == '-' && fscanf(pFile, "%u", &last) == 1)
+				c = fgetc(pFile);
+			for (UINT32 cpu = first; cpu <= last; ++cpu) {
+				if (cpu >= topology.cpu_node.size())
+					topology.cpu_node.resize(cpu + 1, 0);
+				topology.cpu_node[cpu] = node;
+			}
+			if (node >= topology.node_cnt)
+				topology.node_cnt = node + 1;
+			if (c != ',')
+				break;
+		}
+		fclose(pFile);
+	}
+	closedir(pDir);
+#elif !defined(__GNUC__)
+	// _WIN32_WINNT is older than the NUMA functions, they are looked up at run time. Only the cpus
+	// of the first processor group are known, like BindThreadToCPUs.
+	typedef BOOL (WINAPI *PFN_GetNumaHighestNodeNumber)(PULONG);
+	typedef BOOL (WINAPI *PFN_GetNumaNodeProcessorMask)(UCHAR, PULONGLONG);
+	HMODULE hKernel = GetModuleHandleA("kernel32.dll");
+	PFN_GetNumaHighestNodeNumber pfnHighestNode = (PFN_GetNumaHighestNodeNumber)GetProcAddress(hKernel, "GetNumaHighestNodeNumber");
+	PFN_GetNumaNodeProcessorMask pfnNodeMask = (PFN_GetNumaNodeProcessorMask)GetProcAddress(hKernel, "GetNumaNodeProcessorMask");
+	ULONG highestNode = 0;
+	if (!pfnHighestNode || !pfnNodeMask || !pfnHighestNode(&highestNode))
+		return;
+	for (UINT32 node = 0; node <= highestNode; ++node) {
+		ULONGLONG mask = 0;
+		if (!pfnNodeMask((UCHAR)node, &mask))
+			continue;
+		for (UINT32 cpu = 0; cpu < 64; ++cpu) {
+			if ((mask & (1ull << cpu)) == 0)
+				continue;
+			if (cpu >= topology.cpu_node.size())
+				topology.cpu_node.resize(cpu + 1, 0);
+			topology.cpu_node[cpu] = node;
+			if (node >= topology.node_cnt)
+				topology.node_cnt = node + 1;
+		}
+	}
+#endif
+}
+
+static const NumaTopology& GetNumaTopology()
+{
+	static NumaTopology s_topology;
+	static SPIN_LOCK_FLAG s_lock = 0;
+	static volatile bool s_ready = false;
+	if (!s_ready) {
+		EnterSpinLockCriticalSection(s_lock);
+		if (!s_ready) {
+			ReadNumaTopology(s_topology);
+			s_ready = true;
+		}
+		LeaveSpinLockCriticalSection(s_lock);
+	}
+	return s_topology;
+}
+
+UINT32 GetNumaNodeCount()
+{
+	return GetNumaTopology().node_cnt;
+}
+
+void GetNumaNodeCPUs(UINT32 node, std::vector<UINT32>& cpus)
+{
+	const NumaTopology& topology = GetNumaTopology();
+	cpus.clear();
+	for (UINT32 i = 0; i < (UINT32)topology.cpu_node.size(); ++i) {
+		if (topology.cpu_node[i] == node)
+			cpus.push_back(i);
+	}
+}
+
+bool BindThreadToCPUs(const std::vector<UINT32>& cpus)
+{
+	if (cpus.empty())
+		return false;
+#ifdef __linux__
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		if (cpus[i] < CPU_SETSIZE)
+			CPU_SET(cpus[i], &cpuSet);
+	}
+	return sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == 0;
+#elif defined(__GNUC__)
+	return false;
+#else
+	DWORD_PTR mask = 0;
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		if (cpus[i] < sizeof(DWORD_PTR) * 8)
+			mask |= (DWORD_PTR)1 << cpus[i];
+	}
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#endif
+}
+
+static size_t GetMemPageSize()
+{
+#ifdef __GNUC__
+	return (size_t)sysconf(_SC_PAGESIZE);
+#else
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#endif
+}
+
+// Maps pages of their own spread over the nodes, so the policy of whole pages doesn't reach other
+// allocations. Returns NULL if the platform can't do it.
+static void* MapInterleavedPages(size_t mapSize, UINT32 nodeCnt)
+{
+#if defined(__linux__)
+	void* pMap = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pMap == MAP_FAILED)
+		return NULL;
+	// Nothing is touched yet, so no page needs to be moved
+	const unsigned long MPOL_INTERLEAVE_MODE = 3;
+	unsigned long nodeMask = 0;
+	for (UINT32 i = 0; i < nodeCnt && i < sizeof(nodeMask) * 8; ++i)
+		nodeMask |= 1ul << i;
+	syscall(SYS_mbind, (unsigned long)pMap, (unsigned long)mapSize, MPOL_INTERLEAVE_MODE, &nodeMask, sizeof(nodeMask) * 8, 0ul);
+	return pMap;
+#elif defined(__GNUC__)
+	return NULL;
+#else
+	// The preferred node of each page is used when the page is first touched
+	typedef LPVOID (WINAPI *PFN_VirtualAllocExNuma)(HANDLE, LPVOID, SIZE_T, DWORD, DWORD, DWORD);
+	PFN_VirtualAllocExNuma pfnAllocNuma = (PFN_VirtualAllocExNuma)GetProcAddress(GetModuleHandleA("kernel32.dll"), "VirtualAllocExNuma");
+	if (!pfnAllocNuma)
+		return NULL;
+	BYTE* pMap = (BYTE*)VirtualAlloc(NULL, mapSize, MEM_RESERVE, PAGE_READWRITE);
+	if (!pMap)
+		return NULL;
+	size_t pageSize = GetMemPageSize();
+	HANDLE hProcess = GetCurrentProcess();
+	for (size_t offset = 0; offset < mapSize; offset += pageSize) {
+		DWORD node = (DWORD)(offset / pageSize % nodeCnt);
+		if (!pfnAllocNuma(hProcess, pMap + offset, pageSize, MEM_COMMIT, PAGE_READWRITE, node)) {
+			VirtualFree(pMap, 0, MEM_RELEASE);
+			return NULL;
+		}
+	}
+	return pMap;
+#endif
+}
+
+static void UnmapPages(void* pMap, size_t mapSize)
+{
+#if defined(__linux__)
+	munmap(pMap, mapSize);
+#elif !defined(__GNUC__)
+	VirtualFree(pMap, 0, MEM_RELEASE);
+#endif
+}
+
+// The two words before the returned pointer keep the header size and the size of the mapping,
+// a zero mapping size means the block came from Aligned_Malloc.
+void* Interleaved_Malloc(size_t size, size_t align, bool interleave)
+{
+	size_t headerSize = align < 64 ? 64 : align;
+	size_t pageSize = GetMemPageSize();
+	UINT32 nodeCnt = interleave ? GetNumaNodeCount() : 1;
+	if (nodeCnt > 1 && headerSize <= pageSize && size + headerSize > pageSize) {
+		size_t mapSize = (size + headerSize + pageSize - 1) / pageSize * pageSize;
+		void* pMap = MapInterleavedPages(mapSize, nodeCnt);
+		if (pMap) {
+			BYTE* ptr = (BYTE*)pMap + headerSize;
+			((size_t*)ptr)[-2] = headerSize;
+			((size_t*)ptr)[-1] = mapSize;
+			return ptr;
+		}
+	}
+
+	BYTE* pBlock = (BYTE*)Aligned_Malloc(size + headerSize, headerSize);
+	if (pBlock == NULL)
+		return NULL;
+	BYTE* ptr = pBlock + headerSize;
+	((size_t*)ptr)[-2] = headerSize;
+	((size_t*)ptr)[-1] = 0;
+	return ptr;
+}
+
+void Interleaved_Free(void* ptr)
+{
+	if (ptr == NULL)
+		return;
+	size_t headerSize = ((size_t*)ptr)[-2];
+	size_t mapSize = ((size_t*)ptr)[-1];
+	BYTE* pBlock = (BYTE*)ptr - headerSize;
+	if (mapSize > 0)
+		UnmapPages(pBlock, mapSize);
+	else
+		Aligned_Free(pBlock);
+}
+
 long atomic_compare_exchange(volatile long* value, long new_val, long old_val)
 {
 #ifdef __GNUC__
@@ -121,7 +355,8 @@ long atomic_exchange_add(volatile long* value, long param)
 #ifdef __GNUC__
 	return __sync_add_and_fetch(value, param);	
 #else
-	return _InterlockedExchangeAdd(value, param);
+	// Return the new value like the other atomic functions
+	return _InterlockedExchangeAdd(value, param) + param;
 #endif
 }
 
@@ -146,7 +381,10 @@ bool atomic_compare_exchange_ptr(void** value, void* new_val, void* old_val)
 void* Aligned_Malloc(size_t size, size_t align)
 {
 #ifdef __GNUC__
-	return posix_memalign(NULL, align, size);
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, align, size) != 0)
+		return NULL;
+	return ptr;
 #else
 	return _aligned_malloc(size, align);
 #endif
@@ -165,7 +403,15 @@ void Aligned_Free(void* ptr)
 void* Aligned_Realloc(void* ptr, size_t size, size_t align)
 {
 #ifdef __GNUC__
-	return posix_memalign(ptr, align, size);
+	// realloc keeps the malloc alignment only, a misaligned block is moved once more
+	void* pNew = realloc(ptr, size);
+	if (pNew == NULL || ((size_t)pNew & (align - 1)) == 0)
+		return pNew;
+	void* pAligned = NULL;
+	if (posix_memalign(&pAligned, align, size) == 0)
+		memcpy(pAligned, pNew, size);
+	free(pNew);
+	return pAligned;
 #else
 	return _aligned_realloc(ptr, size, align);
 #endif
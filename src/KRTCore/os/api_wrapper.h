@@ -27,10 +27,20 @@ bool atomic_compare_exchange_ptr(void** value, void* new_val, void* old_val);
 
 
 unsigned long GetCPUCount();
+// NUMA topology, it's read from sysfs on Linux and from the NUMA API on Windows. Elsewhere all
+// the cpus are in node 0.
+UINT32 GetNumaNodeCount();
+void GetNumaNodeCPUs(UINT32 node, std::vector<UINT32>& cpus);
+// Let the calling thread run only on the cpus
+bool BindThreadToCPUs(const std::vector<UINT32>& cpus);
 void SleepForMS(UINT32 t);
 double GetSystemElapsedTime();
 
 void* Aligned_Malloc(size_t size, size_t align);
 void Aligned_Free(void* ptr);
 void* Aligned_Realloc(void* ptr, size_t size, size_t align);
+// With interleave set and more than one NUMA node, the memory is a mapping of its own and its pages
+// are spread over the nodes. Otherwise it's an aligned heap block. Free it with Interleaved_Free only.
+void* Interleaved_Malloc(size_t size, size_t align, bool interleave);
+void Interleaved_Free(void* ptr);
 // TODO: put thread related OS API here
@@ -0,0 +1,825 @@
+#include "bvh2_scene.h"
+#include "../intersection/intersect_ray_bbox.h"
+#include "../util/helper_func.h"
+#include "../util/triangle_filter.h"
+#include "../intersection/intersect_tri_bbox.h"
+#include "../file_io/file_io_template.h"
+#include <assert.h>
+#include <algorithm>
+
+
+static float BBoxHalfArea(const KBBox& bbox)
+{
+	KVec3 extent = bbox.mMax - bbox.mMin;
+	return extent[0]*extent[1] + extent[1]*extent[2] + extent[2]*extent[0];
+}
+
+// Tells whether the triangle's center falls in a bin before the splitting bin
+class BinPartitionPred
+{
+public:
+	const KVec3* tri_center;
+	int axis;
+	float start_pos;
+	float bin_scale;
+	UINT32 bin_cnt;
+	UINT32 split_bin;
+
+	bool operator() (UINT32 idx) const {
+		int bin = (int)((tri_center[idx][axis] - start_pos) * bin_scale);
+		if (bin < 0) bin = 0;
+		if (bin >= (int)bin_cnt) bin = (int)bin_cnt - 1;
+		return (UINT32)bin < split_bin;
+	}
+};
+
+KAccelStruct_BVH2::KAccelStruct_BVH2(const KScene* scene) :
+	KAccelStruct(scene)
+{
+	m_buildTime = 0;
+	m_buildAccelTriTime = 0;
+	ResetScene();
+}
+
+KAccelStruct_BVH2::~KAccelStruct_BVH2()
+{
+	ResetScene();
+}
+
+void KAccelStruct_BVH2::ResetScene()
+{
+	mSAHParam.traversal_cost = SAH_TRAVERSAL_COST;
+	mSAHParam.intersect_cost = SAH_INTERSECT_COST;
+	mSAHParam.pair_intersect_cost = LEAF_TRI_PAIR ? SAH_PAIR_INTERSECT_COST : 0;
+	mSAHParam.simd_width = (UINT32)KSC_GetSIMDWidth();
+	mSAHParam.bin_cnt = SAH_BIN_CNT;
+	mMaxDepth = MAX_KD_DEPTH;
+	mMaxLeafTriCnt = UINT32((float)LEAF_TRIANGLE_CNT * sqrt((float)mSAHParam.simd_width));
+	mSpatialSplit = (SPATIAL_SPLIT != 0);
+	mSceneBBox.SetEmpty();
+	mSceneEpsilon = 0;
+	mBuildSAHCost = 0;
+	mTopologyHash = 0;
+
+	mBVHNode.clear();
+	mMotionBBox.clear();
+	mTraversalDepth = 0;
+	mAccelLeaves.Clear();
+}
+
+bool KAccelStruct_BVH2::FindBinnedSplit(const UINT32* pRefIdx, UINT32 cnt, const KBBox& centerBox,
+										BuildData& data, int& outAxis, UINT32& outBin, float& outCost, KBBox& outLeft, KBBox& outRight) const
+{
+	UINT32 binCnt = mSAHParam.bin_cnt;
+	if (data.bin_cnt.size() < binCnt) {
+		data.bin_cnt.resize(binCnt);
+		data.bin_bbox.resize(binCnt);
+		data.bin_cost.resize(binCnt);
+		data.bin_right_bbox.resize(binCnt);
+	}
+
+	bool found = false;
+	for (int axis = 0; axis < 3; ++axis) {
+		float startPos = centerBox.mMin[axis];
+		float extent = centerBox.mMax[axis] - startPos;
+		if (extent <= 0)
+			continue;
+		float binScale = (float)binCnt / extent;
+
+		// Step 1: put the references into the bins according to their centers
+		for (UINT32 i = 0; i < binCnt; ++i) {
+			data.bin_cnt[i] = 0;
+			data.bin_bbox[i].SetEmpty();
+		}
+		for (UINT32 i = 0; i < cnt; ++i) {
+			UINT32 idx = pRefIdx[i];
+			int bin = (int)((data.ref_center[idx][axis] - startPos) * binScale);
+			if (bin < 0) bin = 0;
+			if (bin >= (int)binCnt) bin = (int)binCnt - 1;
+			++data.bin_cnt[bin];
+			data.bin_bbox[bin].Add(data.ref_bbox[idx]);
+		}
+
+		// Step 2: sweep from the right side to get the cost of the bins after each boundary
+		KBBox accumBox;
+		UINT32 accumCnt = 0;
+		for (UINT32 i = binCnt - 1; i > 0; --i) {
+			accumBox.Add(data.bin_bbox[i]);
+			accumCnt += data.bin_cnt[i];
+			data.bin_cost[i] = accumCnt ? BBoxHalfArea(accumBox) * CalcuSAHLeafCost(accumCnt, mSAHParam) : 0;
+			data.bin_right_bbox[i] = accumBox;
+		}
+
+		// Step 3: sweep from the left side and evaluate each boundary
+		accumBox.SetEmpty();
+		accumCnt = 0;
+		for (UINT32 i = 1; i < binCnt; ++i) {
+			accumBox.Add(data.bin_bbox[i - 1]);
+			accumCnt += data.bin_cnt[i - 1];
+			if (accumCnt == 0 || accumCnt == cnt)
+				continue;
+			float tCost = BBoxHalfArea(accumBox) * CalcuSAHLeafCost(accumCnt, mSAHParam) + data.bin_cost[i];
+			if (!found || tCost < outCost) {
+				outCost = tCost;
+				outAxis = axis;
+				outBin = i;
+				outLeft = accumBox;
+				outRight = data.bin_right_bbox[i];
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+bool KAccelStruct_BVH2::ClipRefBBox(UINT32 refIdx, const KBBox& bbox, const BuildData& data, KBBox& outBox) const
+{
+	KBBox clampBox = data.ref_bbox[refIdx];
+	clampBox.ClampBBox(bbox);
+	if (clampBox.IsEmpty())
+		return false;
+
+	// The moving triangles sweep a volume, so only the bounding box can be clamped
+	UINT32 tri = data.ref_tri[refIdx];
+	if (data.tri_moving[tri]) {
+		outBox = clampBox;
+		return true;
+	}
+	return ClipTriangleBBox(data.tri_pos[tri].mVertPos, clampBox, outBox);
+}
+
+bool KAccelStruct_BVH2::FindSpatialSplit(const UINT32* pRefIdx, UINT32 cnt, const KBBox& bbox,
+										 BuildData& data, int& outAxis, float& outPos, float& outCost, UINT32& outDupCnt) const
+{
+	UINT32 binCnt = mSAHParam.bin_cnt;
+	if (data.bin_entry.size() < binCnt) {
+		data.bin_cnt.resize(binCnt);
+		data.bin_entry.resize(binCnt);
+		data.bin_exit.resize(binCnt);
+		data.bin_bbox.resize(binCnt);
+		data.bin_cost.resize(binCnt);
+		data.bin_right_bbox.resize(binCnt);
+	}
+
+	bool found = false;
+	for (int axis = 0; axis < 3; ++axis) {
+		float startPos = bbox.mMin[axis];
+		float extent = bbox.mMax[axis] - startPos;
+		if (extent <= 0)
+			continue;
+		float binSize = extent / (float)binCnt;
+		float binScale = (float)binCnt / extent;
+
+		// Step 1: clip each reference by the bins it overlaps, count where it enters and exits
+		for (UINT32 i = 0; i < binCnt; ++i) {
+			data.bin_entry[i] = 0;
+			data.bin_exit[i] = 0;
+			data.bin_bbox[i].SetEmpty();
+		}
+		for (UINT32 i = 0; i < cnt; ++i) {
+			UINT32 idx = pRefIdx[i];
+			const KBBox& refBox = data.ref_bbox[idx];
+			int firstBin = (int)((refBox.mMin[axis] - startPos) * binScale);
+			int lastBin = (int)((refBox.mMax[axis] - startPos) * binScale);
+			firstBin = std::min(std::max(firstBin, 0), (int)binCnt - 1);
+			lastBin = std::min(std::max(lastBin, firstBin), (int)binCnt - 1);
+
+			if (firstBin == lastBin)
+				data.bin_bbox[firstBin].Add(refBox);
+			else {
+				for (int b = firstBin; b <= lastBin; ++b) {
+					KBBox binBox = bbox;
+					binBox.mMin[axis] = startPos + binSize * b;
+					binBox.mMax[axis] = (b == (int)binCnt - 1) ? bbox.mMax[axis] : startPos + binSize * (b + 1);
+					KBBox clipBox;
+					if (ClipRefBBox(idx, binBox, data, clipBox))
+						data.bin_bbox[b].Add(clipBox);
+				}
+			}
+			++data.bin_entry[firstBin];
+			++data.bin_exit[lastBin];
+		}
+
+		// Step 2: sweep from the right side, the references exiting in a bin are on the right of its left boundary
+		KBBox accumBox;
+		UINT32 accumCnt = 0;
+		for (UINT32 i = binCnt - 1; i > 0; --i) {
+			accumBox.Add(data.bin_bbox[i]);
+			accumCnt += data.bin_exit[i];
+			data.bin_cost[i] = accumCnt ? BBoxHalfArea(accumBox) * CalcuSAHLeafCost(accumCnt, mSAHParam) : 0;
+			data.bin_right_bbox[i] = accumBox;
+			data.bin_cnt[i] = accumCnt;
+		}
+
+		// Step 3: sweep from the left side, the references entering before a boundary are on its left
+		accumBox.SetEmpty();
+		accumCnt = 0;
+		for (UINT32 i = 1; i < binCnt; ++i) {
+			accumBox.Add(data.bin_bbox[i - 1]);
+			accumCnt += data.bin_entry[i - 1];
+			UINT32 rightCnt = data.bin_cnt[i];
+			if (accumCnt == 0 || rightCnt == 0 || accumBox.IsEmpty() || data.bin_right_bbox[i].IsEmpty())
+				continue;
+			float tCost = BBoxHalfArea(accumBox) * CalcuSAHLeafCost(accumCnt, mSAHParam) + data.bin_cost[i];
+			if (!found || tCost < outCost) {
+				outCost = tCost;
+				outAxis = axis;
+				outPos = startPos + binSize * i;
+				outDupCnt = accumCnt + rightCnt - cnt;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+void KAccelStruct_BVH2::SpatialPartition(const UINT32* pRefIdx, UINT32 cnt, const KBBox& bbox, int axis, float splitPos,
+										 BuildData& data, std::vector<UINT32>& leftRef, std::vector<UINT32>& rightRef,
+										 KBBox& leftBox, KBBox& rightBox) const
+{
+	KBBox leftHalf = bbox, rightHalf = bbox;
+	leftHalf.mMax[axis] = splitPos;
+	rightHalf.mMin[axis] = splitPos;
+
+	leftRef.reserve(cnt);
+	rightRef.reserve(cnt);
+	for (UINT32 i = 0; i < cnt; ++i) {
+		UINT32 idx = pRefIdx[i];
+		if (data.ref_bbox[idx].mMax[axis] <= splitPos) {
+			leftRef.push_back(idx);
+			leftBox.Add(data.ref_bbox[idx]);
+			continue;
+		}
+		if (data.ref_bbox[idx].mMin[axis] >= splitPos) {
+			rightRef.push_back(idx);
+			rightBox.Add(data.ref_bbox[idx]);
+			continue;
+		}
+
+		// Straddling reference, the clipped parts go to both sides. One of them may turn out
+		// to be empty because of the floating point error, then nothing gets duplicated.
+		KBBox clipLeft, clipRight;
+		bool hasLeft = ClipRefBBox(idx, leftHalf, data, clipLeft);
+		bool hasRight = ClipRefBBox(idx, rightHalf, data, clipRight);
+		if (hasLeft && hasRight) {
+			UINT32 newIdx = (UINT32)data.ref_bbox.size();
+			data.ref_bbox.push_back(clipRight);
+			data.ref_center.push_back(clipRight.Center());
+			data.ref_tri.push_back(data.ref_tri[idx]);
+			--data.dup_budget;
+
+			data.ref_bbox[idx] = clipLeft;
+			data.ref_center[idx] = clipLeft.Center();
+			leftRef.push_back(idx);
+			leftBox.Add(clipLeft);
+			rightRef.push_back(newIdx);
+			rightBox.Add(clipRight);
+		}
+		else if (hasRight) {
+			rightRef.push_back(idx);
+			rightBox.Add(data.ref_bbox[idx]);
+		}
+		else {
+			leftRef.push_back(idx);
+			leftBox.Add(data.ref_bbox[idx]);
+		}
+	}
+}
+
+UINT32 KAccelStruct_BVH2::BuildNode(UINT32* pRefIdx, UINT32 cnt, const KBBox& bbox, UINT32 depth, BuildData& data)
+{
+	UINT32 nodeIdx = (UINT32)mBVHNode.size();
+	mBVHNode.push_back(BVH_Node());
+	mBVHNode[nodeIdx].bbox = bbox;
+
+	KBBox centerBox;
+	for (UINT32 i = 0; i < cnt; ++i)
+		centerBox.ContainVert(data.ref_center[pRefIdx[i]]);
+
+	int splitAxis = 0;
+	UINT32 leftCnt = 0;
+	bool needSplit = false;
+	bool spatialSplit = false;
+	float spatialPos = 0;
+	KBBox leftBox, rightBox;
+	if (cnt > mSAHParam.simd_width && depth < mMaxDepth) {
+		UINT32 splitBin = 0;
+		float splitCost = 0;
+		bool objectSplit = FindBinnedSplit(pRefIdx, cnt, centerBox, data, splitAxis, splitBin, splitCost, leftBox, rightBox);
+
+		// Only look for a spatial split when the children of the object split overlap a lot
+		if (mSpatialSplit && data.dup_budget > 0) {
+			bool trySpatial = !objectSplit;
+			if (objectSplit) {
+				KBBox overlap = leftBox;
+				overlap.ClampBBox(rightBox);
+				trySpatial = !overlap.IsEmpty() && BBoxHalfArea(overlap) > data.root_area * 1.0e-5f;
+			}
+			int spatialAxis = 0;
+			float spatialCost = 0;
+			UINT32 dupCnt = 0;
+			if (trySpatial && FindSpatialSplit(pRefIdx, cnt, bbox, data, spatialAxis, spatialPos, spatialCost, dupCnt) &&
+				(long)dupCnt <= data.dup_budget && (!objectSplit || spatialCost < splitCost)) {
+				spatialSplit = true;
+				splitAxis = spatialAxis;
+				splitCost = spatialCost;
+				objectSplit = true;
+			}
+		}
+
+		if (objectSplit) {
+			float nodeArea = BBoxHalfArea(bbox);
+			splitCost = mSAHParam.traversal_cost + (nodeArea > 0 ? splitCost / nodeArea : 0);
+			if (splitCost < CalcuSAHLeafCost(cnt, mSAHParam) || cnt > mMaxLeafTriCnt) {
+				if (!spatialSplit) {
+					BinPartitionPred pred;
+					pred.tri_center = &data.ref_center[0];
+					pred.axis = splitAxis;
+					pred.start_pos = centerBox.mMin[splitAxis];
+					pred.bin_scale = (float)mSAHParam.bin_cnt / (centerBox.mMax[splitAxis] - centerBox.mMin[splitAxis]);
+					pred.bin_cnt = mSAHParam.bin_cnt;
+					pred.split_bin = splitBin;
+					leftCnt = UINT32(std::partition(pRefIdx, pRefIdx + cnt, pred) - pRefIdx);
+				}
+				needSplit = true;
+			}
+		}
+		else if (cnt > mMaxLeafTriCnt) {
+			// All the centers are at the same position, just split the list in half
+			leftCnt = cnt / 2;
+			needSplit = true;
+		}
+	}
+
+	if (needSplit && spatialSplit) {
+		std::vector<UINT32> leftRef, rightRef;
+		leftBox.SetEmpty();
+		rightBox.SetEmpty();
+		SpatialPartition(pRefIdx, cnt, bbox, splitAxis, spatialPos, data, leftRef, rightRef, leftBox, rightBox);
+		if (!leftRef.empty() && !rightRef.empty()) {
+			BuildNode(&leftRef[0], (UINT32)leftRef.size(), leftBox, depth + 1, data);
+			UINT32 rightIdx = BuildNode(&rightRef[0], (UINT32)rightRef.size(), rightBox, depth + 1, data);
+			mBVHNode[nodeIdx].flag = (UINT32)splitAxis;
+			mBVHNode[nodeIdx].child_leaf = rightIdx;
+			return nodeIdx;
+		}
+		needSplit = false;
+	}
+
+	if (!needSplit || leftCnt == 0 || leftCnt == cnt) {
+		// Several references of one triangle never end up in the same leaf, so just map them back
+		bool hasAnim = false;
+		data.leaf_tri.resize(cnt);
+		for (UINT32 i = 0; i < cnt; ++i) {
+			data.leaf_tri[i] = data.ref_tri[pRefIdx[i]];
+			if (!hasAnim && mpSourceScene->IsTriPosAnimated(GetAccelTriData(data.leaf_tri[i])))
+				hasAnim = true;
+		}
+		mBVHNode[nodeIdx].flag = eBVH_Leaf;
+		mBVHNode[nodeIdx].child_leaf = mAccelLeaves.AddLeaf(bbox, &data.leaf_tri[0], cnt, hasAnim);
+		return nodeIdx;
+	}
+
+	leftBox.SetEmpty();
+	rightBox.SetEmpty();
+	for (UINT32 i = 0; i < leftCnt; ++i)
+		leftBox.Add(data.ref_bbox[pRefIdx[i]]);
+	for (UINT32 i = leftCnt; i < cnt; ++i)
+		rightBox.Add(data.ref_bbox[pRefIdx[i]]);
+
+	BuildNode(pRefIdx, leftCnt, leftBox, depth + 1, data);
+	UINT32 rightIdx = BuildNode(pRefIdx + leftCnt, cnt - leftCnt, rightBox, depth + 1, data);
+	mBVHNode[nodeIdx].flag = (UINT32)splitAxis;
+	mBVHNode[nodeIdx].child_leaf = rightIdx;
+	return nodeIdx;
+}
+
+void KAccelStruct_BVH2::InitAccelData()
+{
+	ResetScene();
+
+	KTimer stop_watch(true);
+	mAccelTriCnt = mpSourceScene->InitAccelTriangleCache(mAccelTriInst);
+	double time_elapse = stop_watch.Stop();
+	m_buildAccelTriTime = DWORD(time_elapse*1000.0);
+
+	stop_watch.Start();
+	UINT32 triCnt = mAccelTriCnt;
+	if (triCnt > 0) {
+		BuildData data;
+		data.ref_bbox.resize(triCnt);
+		data.ref_center.resize(triCnt);
+		data.ref_tri.resize(triCnt);
+		data.ref_idx.resize(triCnt);
+		if (mSpatialSplit) {
+			data.tri_pos.resize(triCnt);
+			data.tri_moving.resize(triCnt);
+		}
+		KTriVertPos2 triVertPos;
+		for (UINT32 i = 0; i < triCnt; ++i) {
+			mpSourceScene->GetAccelTriPos(GetAccelTriData(i), triVertPos);
+			data.ref_bbox[i] = KBBox(triVertPos);
+			data.ref_center[i] = data.ref_bbox[i].Center();
+			data.ref_tri[i] = i;
+			data.ref_idx[i] = i;
+			mSceneBBox.Add(data.ref_bbox[i]);
+			if (mSpatialSplit) {
+				for (int j = 0; j < 3; ++j)
+					data.tri_pos[i].mVertPos[j] = triVertPos.mVertPos[j];
+				data.tri_moving[i] = triVertPos.mIsMoving ? 1 : 0;
+			}
+		}
+		data.dup_budget = long(triCnt * SPATIAL_SPLIT_BUDGET);
+		data.root_area = BBoxHalfArea(mSceneBBox);
+		if (mSpatialSplit) {
+			data.ref_bbox.reserve(triCnt + data.dup_budget);
+			data.ref_center.reserve(triCnt + data.dup_budget);
+			data.ref_tri.reserve(triCnt + data.dup_budget);
+		}
+
+		mBVHNode.reserve(triCnt * 2 / mSAHParam.simd_width + 1);
+		BuildNode(&data.ref_idx[0], triCnt, mSceneBBox, 0, data);
+		mTraversalDepth = ComputeTraversalDepth();
+		mTopologyHash = ComputeTopologyHash();
+		BuildLeafTriData();
+		BuildMotionBBox();
+
+		KVec3 diagnol = mSceneBBox.mMax - mSceneBBox.mMin;
+		mSceneEpsilon = nvmath::length(diagnol) * 1.0E-6f;
+		mBuildSAHCost = ComputeSAHCost();
+	}
+
+	time_elapse = stop_watch.Stop();
+	m_buildTime = DWORD(time_elapse * 1000.0);
+}
+
+bool KAccelStruct_BVH2::GetNodeLink(UINT32 nodeIdx, UINT32& link) const
+{
+	const BVH_Node& node = mBVHNode[nodeIdx];
+	link = node.child_leaf;
+	return !node.IsLeaf();
+}
+
+float KAccelStruct_BVH2::ComputeSAHCost() const
+{
+	float rootArea = BBoxHalfArea(mBVHNode[0].bbox);
+	if (rootArea <= 0)
+		return 0;
+
+	float cost = 0;
+	for (size_t i = 0; i < mBVHNode.size(); ++i) {
+		const BVH_Node& node = mBVHNode[i];
+		float area = BBoxHalfArea(node.bbox);
+		if (node.IsLeaf())
+			cost += area * CalcuSAHLeafCost(mAccelLeaves.tri_cnt[node.child_leaf] & ~LEAF_ANIM_FLAG, mSAHParam);
+		else
+			cost += area * mSAHParam.traversal_cost;
+	}
+	return cost / rootArea;
+}
+
+bool KAccelStruct_BVH2::RefitAccelData()
+{
+	if (mBVHNode.empty())
+		return false;
+
+	// The triangles must stay the same, otherwise the leaves are no longer valid. The count alone
+	// can't tell, the faces may be reindexed or moved to another node with the same total.
+	KTimer stop_watch(true);
+	mAccelTriCnt = mpSourceScene->InitAccelTriangleCache(mAccelTriInst);
+	UINT64 topologyHash = ComputeTopologyHash();
+	double time_elapse = stop_watch.Stop();
+	m_buildAccelTriTime = DWORD(time_elapse*1000.0);
+	if (topologyHash != mTopologyHash)
+		return false;
+
+	// Children are always stored after their parent, so walking backward updates the tree bottom-up
+	stop_watch.Start();
+	KTriVertPos2 triVertPos;
+	for (size_t i = mBVHNode.size(); i > 0; --i) {
+		BVH_Node& node = mBVHNode[i - 1];
+		if (node.IsLeaf()) {
+			UINT32 leafIdx = node.child_leaf;
+			UINT32 triCnt = mAccelLeaves.tri_cnt[leafIdx] & ~LEAF_ANIM_FLAG;
+			const UINT32* pTriIdx = &mAccelLeaves.tri_idx[mAccelLeaves.tri_offset[leafIdx]];
+			KBBox leafBBox;
+			bool hasAnim = false;
+			for (UINT32 j = 0; j < triCnt; ++j) {
+				mpSourceScene->GetAccelTriPos(GetAccelTriData(pTriIdx[j]), triVertPos);
+				leafBBox.Add(KBBox(triVertPos));
+				if (triVertPos.mIsMoving)
+					hasAnim = true;
+			}
+			mAccelLeaves.RefitLeaf(leafIdx, leafBBox, hasAnim);
+			node.bbox = leafBBox;
+		}
+		else {
+			node.bbox = mBVHNode[i].bbox;
+			node.bbox.Add(mBVHNode[node.child_leaf].bbox);
+		}
+	}
+
+	mSceneBBox = mBVHNode[0].bbox;
+	BuildLeafTriData();
+	BuildMotionBBox();
+	KVec3 diagnol = mSceneBBox.mMax - mSceneBBox.mMin;
+	mSceneEpsilon = nvmath::length(diagnol) * 1.0E-6f;
+
+	time_elapse = stop_watch.Stop();
+	m_buildTime = DWORD(time_elapse * 1000.0);
+
+	return ComputeSAHCost() <= mBuildSAHCost * ACCEL_REFIT_THRESHOLD;
+}
+
+void KAccelStruct_BVH2::BuildMotionBBox()
+{
+	mMotionBBox.clear();
+	if (mBVHNode.empty() || !mpSourceScene->HasAnimatedVertex())
+		return;
+
+	// Same bottom-up walk as RefitAccelData, the boxes at both ends come from the start and the end positions
+	mMotionBBox.resize(mBVHNode.size() * 2);
+	KTriVertPos2 triVertPos;
+	for (size_t i = mBVHNode.size(); i > 0; --i) {
+		const BVH_Node& node = mBVHNode[i - 1];
+		KBBox& startBox = mMotionBBox[(i - 1) * 2];
+		KBBox& endBox = mMotionBBox[(i - 1) * 2 + 1];
+		if (node.IsLeaf()) {
+			UINT32 leafIdx = node.child_leaf;
+			UINT32 triCnt = mAccelLeaves.tri_cnt[leafIdx] & ~LEAF_ANIM_FLAG;
+			const UINT32* pTriIdx = &mAccelLeaves.tri_idx[mAccelLeaves.tri_offset[leafIdx]];
+			for (UINT32 j = 0; j < triCnt; ++j) {
+				mpSourceScene->GetAccelTriPos(GetAccelTriData(pTriIdx[j]), triVertPos);
+				bool moving = triVertPos.mIsMoving;
+				triVertPos.mIsMoving = false;
+				KBBox triBox(triVertPos);
+				startBox.Add(triBox);
+				if (moving) {
+					for (int k = 0; k < 3; ++k)
+						triVertPos.mVertPos[k] += triVertPos.mVertPos_Delta[k];
+					triBox = KBBox(triVertPos);
+				}
+				endBox.Add(triBox);
+			}
+		}
+		else {
+			startBox = mMotionBBox[i * 2];
+			startBox.Add(mMotionBBox[node.child_leaf * 2]);
+			endBox = mMotionBBox[i * 2 + 1];
+			endBox.Add(mMotionBBox[node.child_leaf * 2 + 1]);
+		}
+	}
+}
+
+inline const KBBox& KAccelStruct_BVH2::GetNodeBBox(UINT32 nodeIdx, float t, KBBox& tempBox) const
+{
+	if (mMotionBBox.empty())
+		return mBVHNode[nodeIdx].bbox;
+
+	// The linear bounds can be looser than the node box near the ends, e.g. for the clipped references
+	const KBBox& startBox = mMotionBBox[nodeIdx * 2];
+	const KBBox& endBox = mMotionBBox[nodeIdx * 2 + 1];
+	tempBox.mMin = startBox.mMin + (endBox.mMin - startBox.mMin) * t;
+	tempBox.mMax = startBox.mMax + (endBox.mMax - startBox.mMax) * t;
+	tempBox.ClampBBox(mBVHNode[nodeIdx].bbox);
+	return tempBox;
+}
+
+void KAccelStruct_BVH2::GetSceneMotionBBox(KBBox& start, KBBox& end) const
+{
+	if (mMotionBBox.empty())
+		start = end = mSceneBBox;
+	else {
+		start = mMotionBBox[0];
+		end = mMotionBBox[1];
+	}
+}
+
+bool KAccelStruct_BVH2::IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const
+{
+	return Traverse(ray, inst, ctx, false);
+}
+
+bool KAccelStruct_BVH2::IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const
+{
+	IntersectContext ctx;
+	ctx.ray_t = max_t;
+	return Traverse(ray, inst, ctx, true);
+}
+
+bool KAccelStruct_BVH2::Traverse(const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool anyHit) const
+{
+	if (mBVHNode.empty())
+		return false;
+
+	float motionTime = inst->mCameraContext.inMotionTime;
+	KBBox tempBox;
+	float t0 = 0, t1 = FLT_MAX;
+	if (!IntersectBBox(ray, GetNodeBBox(0, motionTime, tempBox), t0, t1) || t1 < 0 || t0 > ctx.ray_t)
+		return false;
+
+	KDTraversalEntry* pStack = &inst->mKDStack[0];
+	UINT32 stackTop = 0;
+	UINT32 nodeIdx = 0;
+	bool ret = false;
+	if (mUseMailbox)
+		inst->BeginMailboxRay();
+
+	while (1) {
+		const BVH_Node& node = mBVHNode[nodeIdx];
+		if (node.IsLeaf()) {
+			if (anyHit) {
+				if (OccludeLeaf(node.child_leaf, ray, inst, ctx.ray_t, mUseMailbox))
+					return true;
+			}
+			else if (IntersectLeaf(node.child_leaf, ray, inst, ctx, mUseMailbox))
+				ret = true;
+		}
+		else {
+			UINT32 child[2] = {nodeIdx + 1, node.child_leaf};
+			float c_t0[2], c_t1[2];
+			bool hit[2];
+			for (int i = 0; i < 2; ++i) {
+				c_t0[i] = 0; c_t1[i] = FLT_MAX;
+				hit[i] = IntersectBBox(ray, GetNodeBBox(child[i], motionTime, tempBox), c_t0[i], c_t1[i]) &&
+					c_t1[i] >= 0 && c_t0[i] <= ctx.ray_t;
+			}
+
+			if (hit[0] && hit[1]) {
+				// Visit the nearer child first, the other one is tested later if the hit is not closer than it
+				int nearSide = (c_t0[0] <= c_t0[1]) ? 0 : 1;
+				assert(stackTop < inst->mKDStack.size());
+				pStack[stackTop].node_idx = child[1 - nearSide];
+				pStack[stackTop].t_min = c_t0[1 - nearSide];
+				pStack[stackTop].t_max = c_t1[1 - nearSide];
+				++stackTop;
+				nodeIdx = child[nearSide];
+				continue;
+			}
+			else if (hit[0] || hit[1]) {
+				nodeIdx = hit[0] ? child[0] : child[1];
+				continue;
+			}
+		}
+
+		bool hasNext = false;
+		while (stackTop > 0) {
+			--stackTop;
+			if (pStack[stackTop].t_min <= ctx.ray_t) {
+				nodeIdx = pStack[stackTop].node_idx;
+				hasNext = true;
+				break;
+			}
+		}
+		if (!hasNext)
+			break;
+	}
+
+	return ret;
+}
+
+UINT32 KAccelStruct_BVH2::IntersectPacket(KRayPacket& packet, UINT32 rayMask, TracingInstance* inst) const
+{
+	if (mBVHNode.empty())
+		return 0;
+
+	// The near child is picked by the direction signs, so the rays only share the order if their signs
+	// match. Otherwise they are traced one by one.
+	int firstRay = -1;
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		if (!(rayMask & (1 << i)))
+			continue;
+		if (firstRay < 0) {
+			firstRay = (int)i;
+			continue;
+		}
+		const KRay& ray0 = packet.rays[firstRay];
+		const KRay& ray = packet.rays[i];
+		if (ray.mSign[0] != ray0.mSign[0] || ray.mSign[1] != ray0.mSign[1] || ray.mSign[2] != ray0.mSign[2])
+			return KAccelStruct::IntersectPacket(packet, rayMask, inst);
+	}
+	if (firstRay < 0)
+		return 0;
+
+	// A node is visited by the rays hitting its box, the first child is always on the lower side of
+	// the split axis. The stack entry keeps the distance of each ray to the far child's box, so the
+	// rays that found a closer hit in the meantime skip it.
+	const KRay& sharedRay = packet.rays[firstRay];
+	KDPacketTraversalEntry* pStack = &inst->mKDPacketStack[0];
+	UINT32 stackTop = 0;
+	UINT32 nodeIdx = 0;
+	UINT32 activeMask = 0;
+	UINT32 hitMask = 0;
+	KBBox tempBox;
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		float t0 = 0, t1 = FLT_MAX;
+		if ((rayMask & (1 << i)) && IntersectBBox(packet.rays[i], GetNodeBBox(0, packet.motion_time[i], tempBox), t0, t1) && 
+			t1 >= 0 && t0 <= packet.ctx[i].ray_t)
+			activeMask |= (1 << i);
+	}
+
+	while (activeMask) {
+		const BVH_Node& node = mBVHNode[nodeIdx];
+		if (node.IsLeaf()) {
+			for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+				if (!(activeMask & (1 << i)))
+					continue;
+				inst->mCameraContext.inMotionTime = packet.motion_time[i];
+				if (IntersectLeaf(node.child_leaf, packet.rays[i], inst, packet.ctx[i], false))
+					hitMask |= (1 << i);
+			}
+		}
+		else {
+			UINT32 child[2] = {nodeIdx + 1, node.child_leaf};
+			UINT32 childMask[2] = {0, 0};
+			float childNear[2][MAX_RAY_PACKET_SIZE];
+			for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+				if (!(activeMask & (1 << i)))
+					continue;
+				for (int c = 0; c < 2; ++c) {
+					float t0 = 0, t1 = FLT_MAX;
+					if (IntersectBBox(packet.rays[i], GetNodeBBox(child[c], packet.motion_time[i], tempBox), t0, t1) && 
+						t1 >= 0 && t0 <= packet.ctx[i].ray_t) {
+						childMask[c] |= (1 << i);
+						childNear[c][i] = t0;
+					}
+				}
+			}
+
+			int nearSide = sharedRay.mSign[node.SplitAxis()] ? 1 : 0;
+			int farSide = 1 - nearSide;
+			if (childMask[nearSide] && childMask[farSide]) {
+				assert(stackTop < inst->mKDPacketStack.size());
+				KDPacketTraversalEntry& farEntry = pStack[stackTop];
+				farEntry.node_idx = child[farSide];
+				farEntry.ray_mask = childMask[farSide];
+				for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+					if (childMask[farSide] & (1 << i))
+						farEntry.t_min[i] = childNear[farSide][i];
+				}
+				++stackTop;
+			}
+			if (childMask[nearSide] || childMask[farSide]) {
+				int side = childMask[nearSide] ? nearSide : farSide;
+				nodeIdx = child[side];
+				activeMask = childMask[side];
+				continue;
+			}
+		}
+
+		activeMask = 0;
+		while (stackTop > 0 && activeMask == 0) {
+			--stackTop;
+			const KDPacketTraversalEntry& entry = pStack[stackTop];
+			for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+				if ((entry.ray_mask & (1 << i)) && entry.t_min[i] <= packet.ctx[i].ray_t)
+					activeMask |= (1 << i);
+			}
+			nodeIdx = entry.node_idx;
+		}
+	}
+
+	return hitMask;
+}
+
+void KAccelStruct_BVH2::GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_accel) const
+{
+	kd_build = m_buildTime;
+	gen_accel = m_buildAccelTriTime;
+}
+
+bool KAccelStruct_BVH2::SaveToFile(FILE* pFile)
+{
+	if (!SaveTypeToFile(mSceneBBox, pFile)) return false;
+	if (!SaveTypeToFile(mSceneEpsilon, pFile)) return false;
+	if (!SaveTypeToFile(mBuildSAHCost, pFile)) return false;
+	if (!SaveArrayToFile(mBVHNode, pFile)) return false;
+	return SaveLeafData(pFile);
+}
+
+bool KAccelStruct_BVH2::LoadFromFile(FILE* pFile)
+{
+	ResetScene();
+	KTimer stop_watch(true);
+
+	bool ret = LoadTypeFromFile(mSceneBBox, pFile) &&
+		LoadTypeFromFile(mSceneEpsilon, pFile) &&
+		LoadTypeFromFile(mBuildSAHCost, pFile) &&
+		LoadArrayFromFile(mBVHNode, pFile) &&
+		LoadLeafData(pFile) && IsNodeLinkValid(false);
+
+	if (ret) {
+		mTraversalDepth = ComputeTraversalDepth();
+		mTopologyHash = ComputeTopologyHash();
+		BuildLeafTriData();
+		BuildMotionBBox();
+	}
+	else {
+		ResetScene();
+		mAccelTriInst.clear();
+		mAccelTriCnt = 0;
+	}
+	m_buildTime = DWORD(stop_watch.Stop() * 1000.0);
+	m_buildAccelTriTime = 0;
+	return ret;
+}
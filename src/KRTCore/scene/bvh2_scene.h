@@ -0,0 +1,96 @@
+#pragma once
+#include "kd_tree_scene.h"
+
+/**
+ * Triangle level bounding volume hierarchy built with binned SAH. It can be used in place of
+ * KAccelStruct_KDTree for a sub-scene, see ACCEL_STRUCT_TYPE. It builds much faster than the kd-tree
+ * and its leaves share the same payload and intersection code.
+ */
+class KAccelStruct_BVH2 : public KAccelStruct
+{
+public:
+	KAccelStruct_BVH2(const KScene* scene);
+	virtual ~KAccelStruct_BVH2();
+
+	enum NodeFlag {
+		eBVH_SplitAxisMask = 0x3,
+		eBVH_Leaf = 0x4
+	};
+	// The nodes are stored depth first, the first child of an inner node is the next node.
+	struct BVH_Node {
+		KBBox bbox;
+		UINT32 child_leaf;	// index of the second child for inner node, or leaf index for leaf node
+		UINT32 flag;
+
+		bool IsLeaf() const {return (flag & eBVH_Leaf) != 0;}
+		UINT32 SplitAxis() const {return flag & eBVH_SplitAxisMask;}
+	};
+
+	virtual bool IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const;
+	virtual bool IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const;
+	virtual UINT32 IntersectPacket(KRayPacket& packet, UINT32 rayMask, TracingInstance* inst) const;
+	virtual void InitAccelData();
+	virtual bool RefitAccelData();
+	virtual void ResetScene();
+
+	virtual float GetSceneEpsilon() const {return mSceneEpsilon;}
+	virtual unsigned long long GetAccelLeafTriCnt() const {return mAccelLeaves.tri_idx.size();}
+	virtual unsigned long long GetAccelNodeCnt() const {return mBVHNode.size();}
+	virtual const KBBox& GetSceneBBox() const {return mSceneBBox;}
+	virtual void GetSceneMotionBBox(KBBox& start, KBBox& end) const;
+	virtual void GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_accel) const;
+	virtual bool SaveToFile(FILE* pFile);
+	virtual bool LoadFromFile(FILE* pFile);
+
+protected:
+	// Temporary data used during building. The nodes are built from references, a reference is a
+	// triangle or the part of it left after the spatial splits, so one triangle may have several.
+	struct BuildData {
+		std::vector<KBBox> ref_bbox;
+		std::vector<KVec3> ref_center;
+		std::vector<UINT32> ref_tri;
+		std::vector<UINT32> ref_idx;
+		std::vector<KTriVertPos1> tri_pos;	// only filled for spatial splits
+		std::vector<BYTE> tri_moving;
+		std::vector<UINT32> bin_cnt;
+		std::vector<KBBox> bin_bbox;
+		std::vector<float> bin_cost;
+		std::vector<KBBox> bin_right_bbox;
+		std::vector<UINT32> bin_entry;
+		std::vector<UINT32> bin_exit;
+		std::vector<UINT32> leaf_tri;
+		long dup_budget;	// how many more references the spatial splits can create
+		float root_area;
+	};
+
+	UINT32 BuildNode(UINT32* pRefIdx, UINT32 cnt, const KBBox& bbox, UINT32 depth, BuildData& data);
+	bool FindBinnedSplit(const UINT32* pRefIdx, UINT32 cnt, const KBBox& centerBox,
+		BuildData& data, int& outAxis, UINT32& outBin, float& outCost, KBBox& outLeft, KBBox& outRight) const;
+	bool FindSpatialSplit(const UINT32* pRefIdx, UINT32 cnt, const KBBox& bbox,
+		BuildData& data, int& outAxis, float& outPos, float& outCost, UINT32& outDupCnt) const;
+	void SpatialPartition(const UINT32* pRefIdx, UINT32 cnt, const KBBox& bbox, int axis, float splitPos,
+		BuildData& data, std::vector<UINT32>& leftRef, std::vector<UINT32>& rightRef, KBBox& leftBox, KBBox& rightBox) const;
+	bool ClipRefBBox(UINT32 refIdx, const KBBox& bbox, const BuildData& data, KBBox& outBox) const;
+	float ComputeSAHCost() const;
+	virtual bool GetNodeLink(UINT32 nodeIdx, UINT32& link) const;
+	bool Traverse(const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool anyHit) const;
+	// Compute the linear bounds of the nodes over the shutter interval, only when the scene has moving vertices
+	void BuildMotionBBox();
+	// Box of the node at time t, tempBox holds it if it's computed from the linear bounds
+	const KBBox& GetNodeBBox(UINT32 nodeIdx, float t, KBBox& tempBox) const;
+
+	std::vector<BVH_Node> mBVHNode;
+	std::vector<KBBox> mMotionBBox;	// start and end box of each node, the node box is the union of them
+	KBBox mSceneBBox;
+	float mSceneEpsilon;
+
+	SAH_Param mSAHParam;
+	UINT32 mMaxDepth;
+	UINT32 mMaxLeafTriCnt;
+	bool mSpatialSplit;
+	float mBuildSAHCost;	// SAH cost right after the build, used to judge the refitted tree
+	UINT64 mTopologyHash;	// the leaves are only valid for the topology they are built from
+
+	DWORD m_buildTime;
+	DWORD m_buildAccelTriTime;
+};
@@ -2,12 +2,17 @@
 #include "../intersection/intersect_ray_bbox.h"
 #include <common/math/Trafo.h>
 #include "../util/helper_func.h"
+#include "../file_io/file_io_template.h"
+#include <assert.h>
+#include <algorithm>
+#include <xmmintrin.h>
+#include <iostream>
 
 
 KAccelStruct_BVH::KAccelStruct_BVH(const KSceneSet* sceneSet)
 {
-	mRootNode = INVALID_INDEX;
-
+	mBuildBBoxNodeCost = 0;
+	mWideDepth = 0;
 	mpSceneSet = NULL;
 	mpSceneSet = sceneSet;
 }
@@ -41,11 +46,28 @@ void KSceneSet::Reset()
 	mpKDScenes.clear();
 }
 
-void KAccelStruct_BVH::TransformRay(KRay& out_ray, const KRay& in_ray, const KSceneSet::KD_SCENE_LEAF& scene_info, float t)
+void KAccelStruct_BVH::TransformRay(KRay& out_ray, const KRay& in_ray, UINT32 scene_node_idx, float t, TracingInstance* inst) const
 {
-	KAnimation::LocalTRSFrame::LclTRS trs;
-	scene_info.scene_trs.Interpolate(t, trs);
-	KAnimation::LocalTRSFrame::TransformRay(out_ray, in_ray, trs);
+	const KSceneSet::KD_SCENE_LEAF& sceneNode = mpSceneSet->mKDSceneNodes[scene_node_idx];
+	if (!sceneNode.scene_trs.IsMoving()) {
+		out_ray.InitTransformed(in_ray, sceneNode.inv_trans);
+		return;
+	}
+
+	// The rays of one camera sample share the motion time, so the secondary and shadow rays of it
+	// keep hitting the same entries.
+	UINT32 timeBits;
+	memcpy(&timeBits, &t, sizeof(timeBits));
+	UINT32 slot = ((scene_node_idx * 2654435761u) ^ timeBits) & (TracingInstance::NODE_TRANSFORM_CACHE_SIZE - 1);
+	TracingInstance::NodeTransformCache& entry = inst->mNodeTransCache[slot];
+	if (entry.node_idx != scene_node_idx || entry.motion_time != t) {
+		KAnimation::LocalTRSFrame::LclTRS trs;
+		sceneNode.scene_trs.Interpolate(t, trs);
+		entry.inv_trans = trs.trs.getInverse();
+		entry.node_idx = scene_node_idx;
+		entry.motion_time = t;
+	}
+	out_ray.InitTransformed(in_ray, entry.inv_trans);
 }
 
 UINT32 KSceneSet::SceneNode_Create(UINT32 scene_idx)
@@ -60,276 +82,570 @@ UINT32 KSceneSet::SceneNode_Create(UINT32 scene_idx)
 void KSceneSet::SceneNodeTM_SetStaticNode(UINT32 node_idx, const KMatrix4& trans)
 {
 	mKDSceneNodes[node_idx].scene_trs.Reset(trans);
+	UpdateNodeInvTransform(node_idx);
 }
 
-void KSceneSet::SceneNodeTM_SetMovingNode(UINT32 node_idx, const KMatrix4& starting, const KMatrix4& ending)
+void KSceneSet::SceneNodeTM_SetMovingNode(UINT32 node_idx, const KMatrix4* frames, UINT32 frame_cnt)
 {
-	mKDSceneNodes[node_idx].scene_trs.Reset(starting, ending);
+	mKDSceneNodes[node_idx].scene_trs.Reset(frames, frame_cnt);
+	UpdateNodeInvTransform(node_idx);
 }
 
-bool KAccelStruct_BVH::IntersectBBoxNode(const KRay& ray, UINT32 idx, IntersectContext& ctx, TracingInstance* inst) const
+void KSceneSet::UpdateNodeInvTransform(UINT32 node_idx)
 {
-	bool res = false;
-	if (!mBBoxNode.empty()) {
-		double t0[2] = {FLT_MAX,FLT_MAX};
-		double t1[2] = {FLT_MAX,FLT_MAX};
-		bool bHit[2];
-		UINT32 order[2] = {0, 1};
-		bHit[0] = IntersectBBox(ray, mBBoxNode[idx].bbox[0], t0[0], t1[0]);
-		bHit[1] = IntersectBBox(ray, mBBoxNode[idx].bbox[1], t0[1], t1[1]);
-		if (t0[0] > t0[1]) {
-			std::swap(t0[0], t0[1]);
-			std::swap(t1[0], t1[1]);
-			std::swap(bHit[0], bHit[1]);
-			std::swap(order[0], order[1]);
-		}
-
-		bool isHit0 = false;
-		bool isHit1 = false;
+	KD_SCENE_LEAF& sceneNode = mKDSceneNodes[node_idx];
+	if (sceneNode.scene_trs.IsMoving())
+		return;
+	KAnimation::LocalTRSFrame::LclTRS trs;
+	sceneNode.scene_trs.Interpolate(0, trs);
+	sceneNode.inv_trans = trs.trs.getInverse();
+}
 
-		if (bHit[0]) {
-			UINT32 child_idx = mBBoxNode[idx].child_node[order[0]];
-			UINT32 child_idx_noMask = (child_idx & ~LEAF_FLAG);
+void KAccelStruct_BVH::ClampMotionBBox(const WIDE_MOTION_NODE& motion, __m128 t, __m128* boxMin, __m128* boxMax)
+{
+	for (int axis = 0; axis < 3; ++axis) {
+		__m128 startMin = _mm_loadu_ps(motion.start_min[axis]);
+		__m128 startMax = _mm_loadu_ps(motion.start_max[axis]);
+		__m128 lo = _mm_add_ps(startMin, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(motion.end_min[axis]), startMin), t));
+		__m128 hi = _mm_add_ps(startMax, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(motion.end_max[axis]), startMax), t));
+		boxMin[axis] = _mm_max_ps(boxMin[axis], lo);
+		boxMax[axis] = _mm_min_ps(boxMax[axis], hi);
+	}
+}
 
-			if (child_idx & LEAF_FLAG)
-				isHit0 = IntersectBBoxLeaf(ray, child_idx_noMask, ctx, inst);
-			else
-				isHit0 = IntersectBBoxNode(ray, child_idx_noMask, ctx, inst);
-		}
+void KAccelStruct_BVH::IntersectWideBBox(const __m128* boxMin, const __m128* boxMax, const __m128* org, const __m128* rcp, const int* sign, __m128& tNear, __m128& tFar)
+{
+	// min/max return their second operand if either one is NaN, which is the interval here
+	for (int axis = 0; axis < 3; ++axis) {
+		__m128 nearPlane = sign[axis] ? boxMax[axis] : boxMin[axis];
+		__m128 farPlane = sign[axis] ? boxMin[axis] : boxMax[axis];
+		tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, org[axis]), rcp[axis]), tNear);
+		tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, org[axis]), rcp[axis]), tFar);
+	}
+}
 
-		if (bHit[1] && ctx.ray_t > t0[1]) {
-			UINT32 child_idx = mBBoxNode[idx].child_node[order[1]];
-			UINT32 child_idx_noMask = (child_idx & ~LEAF_FLAG);
+bool KAccelStruct_BVH::IntersectSceneNode(const KRay& ray, UINT32 scene_node_idx, IntersectContext& ctx, TracingInstance* inst) const
+{
+	UINT32 scene_idx = mpSceneSet->GetNodeSceneIndex(scene_node_idx);
 
-			if (child_idx & LEAF_FLAG)
-				isHit1 = IntersectBBoxLeaf(ray, child_idx_noMask, ctx, inst);
-			else
-				isHit1 = IntersectBBoxNode(ray, child_idx_noMask, ctx, inst);
-		}
+	// transform the ray
+	KRay transRay;
+	TransformRay(transRay, ray, scene_node_idx, inst->mCameraContext.inMotionTime, inst);
+	if (ray.mExcludeBBoxNode != scene_node_idx)
+		transRay.mExcludeTriID = INVALID_INDEX;
+	else
+		transRay.mExcludeTriID = ray.mExcludeTriID;
 
-		res = (isHit0 || isHit1);
+	if (mpAccelStructs[scene_idx]->IntersectRay_KDTree(transRay, inst, ctx)) {
+		ctx.bbox_node_idx = scene_node_idx;
+		return true;
 	}
+	return false;
+}
 
-	return res;
+bool KAccelStruct_BVH::OccludeSceneNode(const KRay& ray, UINT32 scene_node_idx, double max_t, TracingInstance* inst) const
+{
+	UINT32 scene_idx = mpSceneSet->GetNodeSceneIndex(scene_node_idx);
+
+	KRay transRay;
+	TransformRay(transRay, ray, scene_node_idx, inst->mCameraContext.inMotionTime, inst);
+	if (ray.mExcludeBBoxNode != scene_node_idx)
+		transRay.mExcludeTriID = INVALID_INDEX;
+	else
+		transRay.mExcludeTriID = ray.mExcludeTriID;
+
+	return mpAccelStructs[scene_idx]->IsOccluded(transRay, max_t, inst);
 }
 
-bool KAccelStruct_BVH::IntersectBBoxLeaf(const KRay& ray, UINT32 idx, IntersectContext& ctx, TracingInstance* inst) const
+bool KAccelStruct_BVH::IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const
 {
-	UINT32 cur_idx = idx;
+	return Traverse(ray, inst, ctx, false);
+}
+
+bool KAccelStruct_BVH::IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const
+{
+	IntersectContext ctx;
+	ctx.ray_t = max_t;
+	return Traverse(ray, inst, ctx, true);
+}
 
+bool KAccelStruct_BVH::Traverse(const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool anyHit) const
+{
+	if (mBBoxNode.empty())
+		return false;
+
+	const KVec3& rayOrg = ray.GetOrgF();
+	__m128 org[3], rcp[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		org[axis] = _mm_set1_ps(rayOrg[axis]);
+		rcp[axis] = _mm_set1_ps(ray.mRcpDir[axis]);
+	}
+	__m128 zero = _mm_setzero_ps();
+	// Enlarge the far distance a bit to make the float box test conservative
+	__m128 farScale = _mm_set1_ps(1.0f + 4.0f * FLT_EPSILON);
+	__m128 motionTime = _mm_set1_ps(inst->mCameraContext.inMotionTime);
+
+	struct StackEntry {
+		UINT32 node_idx;
+		float t_near;
+	} stack[WIDE_STACK_SIZE];
+	UINT32 stackTop = 1;
+	stack[0].node_idx = 0;
+	stack[0].t_near = 0;
 	bool ret = false;
 
-	do {
-		int scene_cnt = 0;
-		int hit_scene[LEAF_SCENE_CNT];
-		double t0[LEAF_SCENE_CNT], t1[LEAF_SCENE_CNT];
-		bool hit_res[LEAF_SCENE_CNT];
-		for (UINT32 i = 0; i < mBBoxLeaf[cur_idx].scene_cnt; ++i)
-			hit_res[i] = IntersectBBox(ray, mBBoxLeaf[cur_idx].bbox[i], t0[i], t1[i]);
-
-		float* pT0;
-		for (UINT32 i = 0; i < 4; ++i) {
-			if (hit_res[i]) {
-				pT0 = (float*)&t0 + i;
-				break;
+	while (stackTop > 0) {
+		--stackTop;
+		if (stack[stackTop].t_near > ctx.ray_t)
+			continue;
+
+		UINT32 child_idx = stack[stackTop].node_idx;
+		if (child_idx & LEAF_FLAG) {
+			if (anyHit) {
+				if (OccludeSceneNode(ray, child_idx & ~LEAF_FLAG, ctx.ray_t, inst))
+					return true;
 			}
+			else if (IntersectSceneNode(ray, child_idx & ~LEAF_FLAG, ctx, inst))
+				ret = true;
+			continue;
 		}
 
-		for (UINT32 i = 0; i < mBBoxLeaf[cur_idx].scene_cnt; ++i) {
-			if (mBBoxLeaf[cur_idx].scene_node_idx[i] == INVALID_INDEX)
-				break;
-			
-			if (hit_res[i]) {
-				hit_scene[scene_cnt] = i;
-				++scene_cnt;
-			}
+		// Test the ray against the 4 child boxes at once
+		const WIDE_BBOX_NODE& node = mBBoxNode[child_idx];
+		__m128 boxMin[3], boxMax[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			boxMin[axis] = _mm_loadu_ps(node.bbox_min[axis]);
+			boxMax[axis] = _mm_loadu_ps(node.bbox_max[axis]);
 		}
-		
-		// Here I sort the order the the sub-scenes to be tested, doing so could potentially improve
-		// the performance because the nearer sub-scene gets tested first.
-		int scene_order[LEAF_SCENE_CNT] = {0,1,2,3};
-		for (int i = 0; i < scene_cnt; ++i) {
-			for (int j = scene_cnt - 1; j > i; --j) {
-				if (t0[scene_order[j-1]] > t0[scene_order[j]])
-					std::swap(scene_order[j-1], scene_order[j]);
+		if (mMotionNodeIdx[child_idx] != INVALID_INDEX)
+			ClampMotionBBox(mMotionNode[mMotionNodeIdx[child_idx]], motionTime, boxMin, boxMax);
+
+		__m128 tNear = zero;
+		__m128 tFar = _mm_set1_ps(FLT_MAX);
+		IntersectWideBBox(boxMin, boxMax, org, rcp, ray.mSign, tNear, tFar);
+		tFar = _mm_min_ps(_mm_mul_ps(tFar, farScale), _mm_set1_ps((float)ctx.ray_t));
+		int hitMask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+		if (!hitMask)
+			continue;
+
+		float tNearArray[WIDE_NODE_CHILD_CNT];
+		_mm_storeu_ps(tNearArray, tNear);
+
+		// Sort the hit children by distance, the farthest one is pushed first so the nearest one gets popped first
+		UINT32 order[WIDE_NODE_CHILD_CNT];
+		UINT32 hitCnt = 0;
+		for (UINT32 i = 0; i < WIDE_NODE_CHILD_CNT; ++i) {
+			if (!(hitMask & (1 << i)) || node.child_node[i] == INVALID_INDEX)
+				continue;
+			UINT32 j = hitCnt++;
+			while (j > 0 && tNearArray[order[j - 1]] < tNearArray[i]) {
+				order[j] = order[j - 1];
+				--j;
 			}
+			order[j] = i;
 		}
-		
-		for (int i = 0; i < scene_cnt; ++i) {
-			UINT32 scene_node_idx = mBBoxLeaf[cur_idx].scene_node_idx[hit_scene[scene_order[i]]];
-			UINT32 scene_idx = mpSceneSet->GetNodeSceneIndex(scene_node_idx);
-
-			// transform the ray
-			KRay transRay;
-			TransformRay(transRay, ray, mpSceneSet->mKDSceneNodes[scene_node_idx], inst->mCameraContext.inMotionTime);
-			if (ray.mExcludeBBoxNode != scene_node_idx)
-				transRay.mExcludeTriID = INVALID_INDEX;
-			else
-				transRay.mExcludeTriID = ray.mExcludeTriID;
 
-			inst->mCurBVHIndex = scene_node_idx;
-			if (mpAccelStructs[scene_idx]->IntersectRay_KDTree(transRay, inst, ctx)) {
-				ret = true;
-				ctx.bbox_node_idx = scene_node_idx;
-			}
-			
+		assert(stackTop + hitCnt <= WIDE_STACK_SIZE);
+		for (UINT32 i = 0; i < hitCnt; ++i) {
+			stack[stackTop].node_idx = node.child_node[order[i]];
+			stack[stackTop].t_near = tNearArray[order[i]];
+			++stackTop;
 		}
-		cur_idx = mBBoxLeaf[cur_idx].next_leaf_idx;
-	} while (cur_idx != INVALID_INDEX);
+	}
 
 	return ret;
 }
 
 
-bool KAccelStruct_BVH::IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const
+UINT32 KAccelStruct_BVH::IntersectSceneNodePacket(KRayPacket& packet, UINT32 rayMask, UINT32 scene_node_idx, TracingInstance* inst) const
 {
-	UINT32 nearestHitBBoxScene = INVALID_INDEX;
-	if (mRootNode != INVALID_INDEX) {
-		UINT32 rootNode = (mRootNode & ~LEAF_FLAG);
-		if (!mBBoxNode.empty())
-			return IntersectBBoxNode(ray, rootNode, ctx, inst);
+	UINT32 scene_idx = mpSceneSet->GetNodeSceneIndex(scene_node_idx);
+
+	// Gather the rays into the local space of the scene node
+	KRayPacket localPacket;
+	UINT32 rayIdx[MAX_RAY_PACKET_SIZE];
+	localPacket.ray_cnt = 0;
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		if (!(rayMask & (1 << i)))
+			continue;
+		UINT32 j = localPacket.ray_cnt++;
+		const KRay& ray = packet.rays[i];
+		KRay& transRay = localPacket.rays[j];
+		TransformRay(transRay, ray, scene_node_idx, packet.motion_time[i], inst);
+		if (ray.mExcludeBBoxNode != scene_node_idx)
+			transRay.mExcludeTriID = INVALID_INDEX;
 		else
-			return IntersectBBoxLeaf(ray, rootNode, ctx, inst);
+			transRay.mExcludeTriID = ray.mExcludeTriID;
+		localPacket.ctx[j] = packet.ctx[i];
+		localPacket.motion_time[j] = packet.motion_time[i];
+		rayIdx[j] = i;
 	}
-	else
-		return false;
+
+	UINT32 localHit = mpAccelStructs[scene_idx]->IntersectPacket(localPacket, (1 << localPacket.ray_cnt) - 1, inst);
+	UINT32 hitMask = 0;
+	for (UINT32 j = 0; j < localPacket.ray_cnt; ++j) {
+		if (localHit & (1 << j)) {
+			packet.ctx[rayIdx[j]] = localPacket.ctx[j];
+			packet.ctx[rayIdx[j]].bbox_node_idx = scene_node_idx;
+			hitMask |= (1 << rayIdx[j]);
+		}
+	}
+	return hitMask;
 }
 
+UINT32 KAccelStruct_BVH::IntersectPacket(KRayPacket& packet, TracingInstance* inst) const
+{
+	if (mBBoxNode.empty() || packet.ray_cnt == 0)
+		return 0;
+
+	float motionTime = inst->mCameraContext.inMotionTime;
+	UINT32 hitMask = 0;
+	if (packet.ray_cnt == 1 || !packet.IsCoherent()) {
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			inst->mCameraContext.inMotionTime = packet.motion_time[i];
+			if (Traverse(packet.rays[i], inst, packet.ctx[i], false))
+				hitMask |= (1 << i);
+		}
+		inst->mCameraContext.inMotionTime = motionTime;
+		return hitMask;
+	}
+
+	__m128 org[MAX_RAY_PACKET_SIZE][3];
+	__m128 rcp[MAX_RAY_PACKET_SIZE][3];
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		const KVec3& rayOrg = packet.rays[i].GetOrgF();
+		for (int axis = 0; axis < 3; ++axis) {
+			org[i][axis] = _mm_set1_ps(rayOrg[axis]);
+			rcp[i][axis] = _mm_set1_ps(packet.rays[i].mRcpDir[axis]);
+		}
+	}
+	__m128 zero = _mm_setzero_ps();
+	__m128 farScale = _mm_set1_ps(1.0f + 4.0f * FLT_EPSILON);
+
+	// Same as the single ray traversal, the child boxes are tested by each ray of the node's mask
+	struct StackEntry {
+		UINT32 node_idx;
+		UINT32 ray_mask;
+	} stack[WIDE_STACK_SIZE];
+	UINT32 stackTop = 1;
+	stack[0].node_idx = 0;
+	stack[0].ray_mask = (1 << packet.ray_cnt) - 1;
+
+	while (stackTop > 0) {
+		--stackTop;
+		UINT32 child_idx = stack[stackTop].node_idx;
+		UINT32 rayMask = stack[stackTop].ray_mask;
+		if (child_idx & LEAF_FLAG) {
+			hitMask |= IntersectSceneNodePacket(packet, rayMask, child_idx & ~LEAF_FLAG, inst);
+			continue;
+		}
+
+		const WIDE_BBOX_NODE& node = mBBoxNode[child_idx];
+		__m128 boxMin[3], boxMax[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			boxMin[axis] = _mm_loadu_ps(node.bbox_min[axis]);
+			boxMax[axis] = _mm_loadu_ps(node.bbox_max[axis]);
+		}
+		UINT32 motionIdx = mMotionNodeIdx[child_idx];
+
+		UINT32 childMask[WIDE_NODE_CHILD_CNT] = {0, 0, 0, 0};
+		float childNear[WIDE_NODE_CHILD_CNT] = {FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX};
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			if (!(rayMask & (1 << i)))
+				continue;
+			// Each ray of the packet may have its own time
+			__m128 rayBoxMin[3], rayBoxMax[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				rayBoxMin[axis] = boxMin[axis];
+				rayBoxMax[axis] = boxMax[axis];
+			}
+			if (motionIdx != INVALID_INDEX)
+				ClampMotionBBox(mMotionNode[motionIdx], _mm_set1_ps(packet.motion_time[i]), rayBoxMin, rayBoxMax);
+
+			__m128 tNear = zero;
+			__m128 tFar = _mm_set1_ps(FLT_MAX);
+			IntersectWideBBox(rayBoxMin, rayBoxMax, org[i], rcp[i], packet.rays[i].mSign, tNear, tFar);
+			tFar = _mm_min_ps(_mm_mul_ps(tFar, farScale), _mm_set1_ps((float)packet.ctx[i].ray_t));
+			int hit = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+			if (!hit)
+				continue;
+
+			float tNearArray[WIDE_NODE_CHILD_CNT];
+			_mm_storeu_ps(tNearArray, tNear);
+			for (UINT32 c = 0; c < WIDE_NODE_CHILD_CNT; ++c) {
+				if (!(hit & (1 << c)))
+					continue;
+				childMask[c] |= (1 << i);
+				if (tNearArray[c] < childNear[c])
+					childNear[c] = tNearArray[c];
+			}
+		}
+
+		// The child nearest to any ray of the packet is popped first
+		UINT32 order[WIDE_NODE_CHILD_CNT];
+		UINT32 hitCnt = 0;
+		for (UINT32 c = 0; c < WIDE_NODE_CHILD_CNT; ++c) {
+			if (!childMask[c] || node.child_node[c] == INVALID_INDEX)
+				continue;
+			UINT32 j = hitCnt++;
+			while (j > 0 && childNear[order[j - 1]] < childNear[c]) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = c;
+		}
+
+		assert(stackTop + hitCnt <= WIDE_STACK_SIZE);
+		for (UINT32 c = 0; c < hitCnt; ++c) {
+			stack[stackTop].node_idx = node.child_node[order[c]];
+			stack[stackTop].ray_mask = childMask[order[c]];
+			++stackTop;
+		}
+	}
+
+	inst->mCameraContext.inMotionTime = motionTime;
+	return hitMask;
+}
 
-const KTriDesc* KAccelStruct_BVH::GetAccelTriData(UINT32 scene_node_idx, UINT32 tri_idx) const
+KTriDesc KAccelStruct_BVH::GetAccelTriData(UINT32 scene_node_idx, UINT32 tri_idx) const
 {
 	UINT32 scene_idx = mpSceneSet->mKDSceneNodes[scene_node_idx].kd_scene_idx;
 	return mpAccelStructs[scene_idx]->GetAccelTriData(tri_idx);
 }
 
 
-UINT32 KAccelStruct_BVH::SplitBBoxScene(UINT32* pKDSceneIdx, const KBBox* clampBox, UINT32 cnt, UINT32 depth)
+// Sort the scene nodes by the center of their bounding boxes along one axis
+class SceneNodeCenterLess
 {
-	KBBox bbox;
-	UINT32 ret = INVALID_INDEX;
+public:
+	const KBBox* scene_bbox;
+	int axis;
 
-	if (NULL == pKDSceneIdx) {
-		for (size_t i = 0; i < mpAccelStructs.size(); ++i) {
-			bbox.Add(mKDSceneBBox[i]);
-		}
-		cnt = (UINT32)mpAccelStructs.size();
+	bool operator() (UINT32 a, UINT32 b) const {
+		return (scene_bbox[a].mMin[axis] + scene_bbox[a].mMax[axis]) < 
+			(scene_bbox[b].mMin[axis] + scene_bbox[b].mMax[axis]);
 	}
-	else {
-		for (size_t i = 0; i < cnt; ++i) {
-			UINT32 idx = pKDSceneIdx[i];
-			bbox.Add(mKDSceneBBox[idx]);
+};
+
+UINT32 KAccelStruct_BVH::BuildWideNode(UINT32* pSceneNodeIdx, UINT32 cnt, UINT32 depth)
+{
+	UINT32 nodeIdx = (UINT32)mBBoxNode.size();
+	mBBoxNode.push_back(WIDE_BBOX_NODE());
+	if (depth + 1 > mWideDepth)
+		mWideDepth = depth + 1;
+
+	// Split the scene nodes into up to 4 groups, each time the largest group is divided at the median
+	// of the longest axis of its centers. The median split keeps the tree balanced, so the depth is bounded.
+	UINT32 groupStart[WIDE_NODE_CHILD_CNT + 1] = {0, cnt};
+	UINT32 groupCnt = 1;
+	while (groupCnt < WIDE_NODE_CHILD_CNT) {
+		UINT32 largest = 0;
+		for (UINT32 i = 1; i < groupCnt; ++i) {
+			if (groupStart[i + 1] - groupStart[i] > groupStart[largest + 1] - groupStart[largest])
+				largest = i;
 		}
+		UINT32 start = groupStart[largest];
+		UINT32 end = groupStart[largest + 1];
+		if (end - start <= 1)
+			break;
+
+		KBBox centerBox;
+		for (UINT32 i = start; i < end; ++i)
+			centerBox.ContainVert(mKDSceneBBox[pSceneNodeIdx[i]].Center());
+		SceneNodeCenterLess pred;
+		pred.scene_bbox = &mKDSceneBBox[0];
+		pred.axis = centerBox.LongestAxis();
+		UINT32 mid = (start + end) / 2;
+		std::nth_element(pSceneNodeIdx + start, pSceneNodeIdx + mid, pSceneNodeIdx + end, pred);
+
+		for (UINT32 i = groupCnt; i > largest; --i)
+			groupStart[i + 1] = groupStart[i];
+		groupStart[largest + 1] = mid;
+		++groupCnt;
 	}
-	if (clampBox) {
-		bbox.ClampBBox(*clampBox);
-	}
-	bool bAsLeaf = true;
-	if (cnt > LEAF_SCENE_CNT && depth < 20) {
-
-
-		KVec3 det = bbox.mMax - bbox.mMin;
-		float det_value;
-		UINT32 det_axis;
-		KD_BBOX_NODE newBBoxNode;
-		newBBoxNode.bbox[0] = bbox;
-		newBBoxNode.bbox[1] = bbox;
-		if (fabs(det[0]) >= fabs(det[1]) && fabs(det[0]) >= fabs(det[2])) {
-			// Split X axis
-			det_axis = 0;
-		}
-		else if (fabs(det[1]) >= fabs(det[0]) && fabs(det[1]) >= fabs(det[2])) {
-			// Split Y axis
-			det_axis = 1;
-		}
-		else {
-			// Split Z axis
-			det_axis = 2;
-		}
-		det_value = (bbox.mMax[det_axis] + bbox.mMin[det_axis]) * 0.5f;
-		newBBoxNode.bbox[0].mMin[det_axis] = det_value;
-		newBBoxNode.bbox[1].mMax[det_axis] = det_value;
-
-		// Split the bbox scene
-		UINT32* pLeftChild = (UINT32*)malloc(sizeof(UINT32)*cnt);
-		UINT32* pRightChild = (UINT32*)malloc(sizeof(UINT32)*cnt);
-		UINT32 cnt0 = 0;
-		UINT32 cnt1 = 0;
-		KBBox left_bbox;
-		KBBox right_bbox;
-		UINT32 stride_cnt = 0; // triangle count that stride over two sides
-		for (UINT32 i = 0; i < cnt; ++i) {
-			UINT32 idx = (pKDSceneIdx ? pKDSceneIdx[i] : i);
-			if (mKDSceneBBox[idx].mMin[det_axis] > det_value) {
-				// this triangle is in + side
-				pLeftChild[cnt0++] = idx;
-				left_bbox.Add(mKDSceneBBox[idx]);
-			}
-			else if (mKDSceneBBox[idx].mMax[det_axis] < det_value) {
-				// this triangle is in - side
-				pRightChild[cnt1++] = idx;
-				right_bbox.Add(mKDSceneBBox[idx]);
-			}
-			else {
-				// this triangle stride over two sides
-				pLeftChild[cnt0++] = idx;
-				pRightChild[cnt1++] = idx;
-				left_bbox.Add(mKDSceneBBox[idx]);
-				right_bbox.Add(mKDSceneBBox[idx]);
-				++stride_cnt;
-			}
+
+	for (UINT32 i = 0; i < WIDE_NODE_CHILD_CNT; ++i) {
+		KBBox childBBox;
+		UINT32 childIdx = INVALID_INDEX;
+		if (i < groupCnt) {
+			UINT32 start = groupStart[i];
+			UINT32 childCnt = groupStart[i + 1] - start;
+			for (UINT32 j = 0; j < childCnt; ++j)
+				childBBox.Add(mKDSceneBBox[pSceneNodeIdx[start + j]]);
+			if (childCnt == 1)
+				childIdx = pSceneNodeIdx[start] | LEAF_FLAG;
+			else
+				childIdx = BuildWideNode(pSceneNodeIdx + start, childCnt, depth + 1);
 		}
 
-		if (stride_cnt < (cnt/2)) {
-			left_bbox.ClampBBox(newBBoxNode.bbox[0]);
-			right_bbox.ClampBBox(newBBoxNode.bbox[1]);
-			newBBoxNode.bbox[0] = left_bbox;
-			newBBoxNode.bbox[1] = right_bbox;
-			newBBoxNode.child_node[0] = SplitBBoxScene(pLeftChild, &left_bbox, cnt0, depth+1);
-			newBBoxNode.child_node[1] = SplitBBoxScene(pRightChild, &right_bbox, cnt1, depth+1);
-
-			mBBoxNode.push_back(newBBoxNode);
-			ret = UINT32(mBBoxNode.size() - 1);
-			bAsLeaf = false;
+		WIDE_BBOX_NODE& node = mBBoxNode[nodeIdx];
+		node.child_node[i] = childIdx;
+		for (int axis = 0; axis < 3; ++axis) {
+			node.bbox_min[axis][i] = childBBox.mMin[axis];
+			node.bbox_max[axis][i] = childBBox.mMax[axis];
 		}
-		else {
-			free(pLeftChild);
-			free(pRightChild);
+	}
+
+	return nodeIdx;
+}
+
+#define ACCEL_CACHE_MAGIC	0x4341524b	// "KRAC"
+#define ACCEL_CACHE_VERSION	2
+
+UINT64 KAccelStruct_BVH::ComputeCacheKey() const
+{
+	// Everything that changes the built structures goes into the key
+	UINT32 buildParam[] = {ACCEL_CACHE_VERSION, LEAF_TRIANGLE_CNT, MAX_KD_DEPTH, KD_BUILD_MODE, SAH_BIN_CNT,
+		ACCEL_STRUCT_TYPE, SPATIAL_SPLIT, LEAF_TRI_PAIR, (UINT32)KSC_GetSIMDWidth(), 
+		sizeof(KAccelStruct_KDTree::KD_FlatNode), sizeof(KAccelStruct_BVH2::BVH_Node)};
+	// The pair cost only steers the SAH when the leaves are paired, see SAH_Param
+	float sahCost[] = {SAH_TRAVERSAL_COST, SAH_INTERSECT_COST, LEAF_TRI_PAIR ? SAH_PAIR_INTERSECT_COST : 0, SPATIAL_SPLIT_BUDGET};
+	UINT64 key = HashBytes(buildParam, sizeof(buildParam));
+	key = HashBytes(sahCost, sizeof(sahCost), key);
+	for (size_t i = 0; i < mpSceneSet->mpKDScenes.size(); ++i)
+		key = mpSceneSet->mpKDScenes[i]->ComputeHash(key);
+	return key;
+}
+
+bool KAccelStruct_BVH::LoadAccelCache()
+{
+	FILE* pFile = NULL;
+	fopen_s(&pFile, mAccelCacheFile.c_str(), "rb");
+	if (!pFile)
+		return false;
+
+	bool ret = false;
+	bool corrupted = false;
+	do {
+		UINT32 magic = 0;
+		UINT64 key = 0;
+		UINT32 sceneCnt = 0;
+		if (!LoadTypeFromFile(magic, pFile) || magic != ACCEL_CACHE_MAGIC) break;
+		if (!LoadTypeFromFile(key, pFile) || key != ComputeCacheKey()) break;
+		if (!LoadTypeFromFile(sceneCnt, pFile) || sceneCnt != mpAccelStructs.size()) break;
+
+		UINT32 i = 0;
+		for (; i < sceneCnt; ++i) {
+			if (!mpAccelStructs[i]->LoadFromFile(pFile))
+				break;
 		}
+		ret = (i == sceneCnt);
+		corrupted = !ret;
+	} while (0);
+
+	fclose(pFile);
+	if (!ret)
+		std::cout << "Acceleration structure cache \"" << mAccelCacheFile << (corrupted ? "\" is corrupted" : "\" is out of date") << ", rebuilding..." << std::endl;
+	return ret;
+}
 
+bool KAccelStruct_BVH::SaveAccelCache()
+{
+	FILE* pFile = NULL;
+	fopen_s(&pFile, mAccelCacheFile.c_str(), "wb");
+	if (!pFile) {
+		std::cout << "Failed to create acceleration structure cache \"" << mAccelCacheFile << "\"." << std::endl;
+		return false;
 	}
 
-	if (cnt > 0 && bAsLeaf) {
-		KD_BBOX_LEAF bbox_leaf;
-		UINT32 last_idx = INVALID_INDEX;
-
-		UINT32 offset = 0;
-		do {
-			UINT32 cur_cnt = ((cnt - offset) > LEAF_SCENE_CNT) ? LEAF_SCENE_CNT : (cnt - offset);
-				for (UINT32 i = 0; i < cur_cnt; ++i) {
-				UINT32 scene_node_idx = pKDSceneIdx ? pKDSceneIdx[offset+i] : (offset+i);
-				bbox_leaf.bbox[i] = mKDSceneBBox[scene_node_idx];
-				bbox_leaf.scene_node_idx[i] = scene_node_idx;
-			}
-			
-			bbox_leaf.scene_cnt = cur_cnt;
-			for (UINT32 i = cur_cnt; i < LEAF_SCENE_CNT; ++i) {
-				bbox_leaf.scene_node_idx[i] = INVALID_INDEX;
-				bbox_leaf.bbox[i] = bbox_leaf.bbox[cur_cnt - 1];
+	UINT32 magic = ACCEL_CACHE_MAGIC;
+	UINT64 key = ComputeCacheKey();
+	UINT32 sceneCnt = (UINT32)mpAccelStructs.size();
+	bool ret = SaveTypeToFile(magic, pFile) && SaveTypeToFile(key, pFile) && SaveTypeToFile(sceneCnt, pFile);
+	for (UINT32 i = 0; ret && i < sceneCnt; ++i)
+		ret = mpAccelStructs[i]->SaveToFile(pFile);
+
+	fclose(pFile);
+	if (!ret) {
+		// Don't leave a broken cache file
+		remove(mAccelCacheFile.c_str());
+		std::cout << "Failed to write acceleration structure cache \"" << mAccelCacheFile << "\"." << std::endl;
+	}
+	return ret;
+}
+
+void KAccelStruct_BVH::RefitWideNodes()
+{
+	// Child nodes are always added after their parent, so walking backward updates the tree bottom-up
+	std::vector<KBBox> nodeBBox(mBBoxNode.size());
+	for (size_t i = mBBoxNode.size(); i > 0; --i) {
+		WIDE_BBOX_NODE& node = mBBoxNode[i - 1];
+		for (UINT32 j = 0; j < WIDE_NODE_CHILD_CNT; ++j) {
+			UINT32 childIdx = node.child_node[j];
+			if (childIdx == INVALID_INDEX)
+				continue;
+			const KBBox& childBBox = (childIdx & LEAF_FLAG) ? 
+				mKDSceneBBox[childIdx & ~LEAF_FLAG] : nodeBBox[childIdx];
+			for (int axis = 0; axis < 3; ++axis) {
+				node.bbox_min[axis][j] = childBBox.mMin[axis];
+				node.bbox_max[axis][j] = childBBox.mMax[axis];
 			}
-			offset += cur_cnt;
-			bbox_leaf.next_leaf_idx = last_idx;
-			last_idx = (UINT32)mBBoxLeaf.size();
-			mBBoxLeaf.push_back(bbox_leaf);
-		} while (cnt > offset);
-
-		ret = UINT32(mBBoxLeaf.size() - 1);
-		ret |= LEAF_FLAG;
+			nodeBBox[i - 1].Add(childBBox);
+		}
 	}
+}
+
+void KAccelStruct_BVH::BuildMotionNodes()
+{
+	mMotionNodeIdx.assign(mBBoxNode.size(), INVALID_INDEX);
+	mMotionNode.clear();
+
+	// Bottom-up like RefitWideNodes, a node moves if any of its children moves
+	std::vector<KBBox> nodeMotionBBox(mBBoxNode.size() * 2);
+	std::vector<BYTE> nodeMoving(mBBoxNode.size(), 0);
+	for (size_t i = mBBoxNode.size(); i > 0; --i) {
+		const WIDE_BBOX_NODE& node = mBBoxNode[i - 1];
+		WIDE_MOTION_NODE motionNode;
+		memset(&motionNode, 0, sizeof(motionNode));
+		bool moving = false;
+		for (UINT32 j = 0; j < WIDE_NODE_CHILD_CNT; ++j) {
+			UINT32 childIdx = node.child_node[j];
+			if (childIdx == INVALID_INDEX)
+				continue;
+			bool leaf = (childIdx & LEAF_FLAG) != 0;
+			const KBBox* pChildBBox = leaf ? &mKDSceneMotionBBox[(childIdx & ~LEAF_FLAG) * 2] : &nodeMotionBBox[childIdx * 2];
+			if (leaf ? mKDSceneMoving[childIdx & ~LEAF_FLAG] : nodeMoving[childIdx])
+				moving = true;
+			for (int axis = 0; axis < 3; ++axis) {
+				motionNode.start_min[axis][j] = pChildBBox[0].mMin[axis];
+				motionNode.start_max[axis][j] = pChildBBox[0].mMax[axis];
+				motionNode.end_min[axis][j] = pChildBBox[1].mMin[axis];
+				motionNode.end_max[axis][j] = pChildBBox[1].mMax[axis];
+			}
+			nodeMotionBBox[(i - 1) * 2].Add(pChildBBox[0]);
+			nodeMotionBBox[(i - 1) * 2 + 1].Add(pChildBBox[1]);
+		}
 
-	if (pKDSceneIdx)
-		free(pKDSceneIdx);
+		if (moving) {
+			nodeMoving[i - 1] = 1;
+			mMotionNodeIdx[i - 1] = (UINT32)mMotionNode.size();
+			mMotionNode.push_back(motionNode);
+		}
+	}
+}
 
-	return ret;
+float KAccelStruct_BVH::ComputeWideNodeCost() const
+{
+	// Sum of the child box areas relative to the scene box, which is proportional to the
+	// expected number of box tests for a random ray
+	KVec3 sceneExtent = mSceneBBox.mMax - mSceneBBox.mMin;
+	float sceneArea = sceneExtent[0]*sceneExtent[1] + sceneExtent[1]*sceneExtent[2] + sceneExtent[2]*sceneExtent[0];
+	if (sceneArea <= 0)
+		return 0;
+
+	float cost = 0;
+	for (size_t i = 0; i < mBBoxNode.size(); ++i) {
+		const WIDE_BBOX_NODE& node = mBBoxNode[i];
+		for (UINT32 j = 0; j < WIDE_NODE_CHILD_CNT; ++j) {
+			if (node.child_node[j] == INVALID_INDEX)
+				continue;
+			float dx = node.bbox_max[0][j] - node.bbox_min[0][j];
+			float dy = node.bbox_max[1][j] - node.bbox_min[1][j];
+			float dz = node.bbox_max[2][j] - node.bbox_min[2][j];
+			cost += dx*dy + dy*dz + dz*dx;
+		}
+	}
+	return cost / sceneArea;
 }
 
 void KAccelStruct_BVH::GetKDBuildTimeStatistics(KRT_SceneStatistic& sceneStat) const
@@ -338,7 +654,7 @@ void KAccelStruct_BVH::GetKDBuildTimeStatistics(KRT_SceneStatistic& sceneStat) c
 	sceneStat.gen_accel_geom_time = m_buildAccelTriTime;
 	sceneStat.kd_finialize_time = m_kdFinializingTime;
 
-	sceneStat.bbox_leaf_count = (UINT32)mpAccelStructs.size();
+	sceneStat.bbox_leaf_count = (UINT32)mpSceneSet->mKDSceneNodes.size();
 	sceneStat.bbox_node_count = (UINT32)mBBoxNode.size();
 
 	sceneStat.kd_node_count = 0;
@@ -356,6 +672,26 @@ void KAccelStruct_BVH::GetKDBuildTimeStatistics(KRT_SceneStatistic& sceneStat) c
 }
 
 
+KAccelStruct* KAccelStruct_BVH::CreateAccelStruct(const KScene* pScene)
+{
+	KScene::AccelType accelType = pScene->mAccelType;
+	if (accelType == KScene::eAccel_Default) {
+		switch (ACCEL_STRUCT_TYPE) {
+		case 0: accelType = KScene::eAccel_KDTree; break;
+		case 1: accelType = KScene::eAccel_BVH; break;
+		default:
+			// Animated sub-scenes are rebuilt for each frame, so they prefer the faster building BVH
+			accelType = pScene->HasAnimatedVertex() ? KScene::eAccel_BVH : KScene::eAccel_KDTree;
+			break;
+		}
+	}
+
+	if (accelType == KScene::eAccel_BVH)
+		return new KAccelStruct_BVH2(pScene);
+	else
+		return new KAccelStruct_KDTree(pScene);
+}
+
 bool KAccelStruct_BVH::SceneNode_BuildAccelData(const std::list<UINT32>* pDirtiedSubScene)
 {
 	mSceneBBox.SetEmpty();
@@ -364,6 +700,7 @@ bool KAccelStruct_BVH::SceneNode_BuildAccelData(const std::list<UINT32>* pDirtie
 	m_buildAccelTriTime = 0;
 	m_kdFinializingTime = 0;
 
+	bool bTryRefit = (pDirtiedSubScene != NULL && ACCEL_REFIT_THRESHOLD >= 1.0f);
 	std::list<UINT32> tempDirtiedSubScene;
 	if (pDirtiedSubScene == NULL) {
 		// if it's forced to update, all the accellerating structures will be re-computed.
@@ -372,19 +709,24 @@ bool KAccelStruct_BVH::SceneNode_BuildAccelData(const std::list<UINT32>* pDirtie
 		}
 		mpAccelStructs.resize(mpSceneSet->mpKDScenes.size());
 		for (UINT32 i = 0; i < mpSceneSet->mpKDScenes.size(); ++i) {
-			KAccelStruct_KDTree* pAccel = new KAccelStruct_KDTree(mpSceneSet->mpKDScenes[i]);
-			mpAccelStructs[i] = pAccel;
+			mpAccelStructs[i] = CreateAccelStruct(mpSceneSet->mpKDScenes[i]);
 			tempDirtiedSubScene.push_back(i);
 		}
 	}
 	else
 		tempDirtiedSubScene = *pDirtiedSubScene;
 
+	// The cache can only be used when all the sub-scenes are built
+	bool bCacheLoaded = false;
+	if (pDirtiedSubScene == NULL && !mAccelCacheFile.empty())
+		bCacheLoaded = LoadAccelCache();
+
 	// Now build all KD scenes
 	for (std::list<UINT32>::iterator it = tempDirtiedSubScene.begin(); it != tempDirtiedSubScene.end(); ++it) {
 
-		// build the accellerating data strcuture for each KD scene
-		mpAccelStructs[*it]->InitAccelData();
+		// build the accellerating data strcuture for each KD scene, the animated scenes try refitting first
+		if (!bCacheLoaded && (!bTryRefit || !mpAccelStructs[*it]->RefitAccelData()))
+			mpAccelStructs[*it]->InitAccelData();
 
 		// update the scene epsilon(which is be used later for ray intersection)
 		float cur_epsilon = mpAccelStructs[*it]->GetSceneEpsilon();
@@ -398,20 +740,54 @@ bool KAccelStruct_BVH::SceneNode_BuildAccelData(const std::list<UINT32>* pDirtie
 		m_buildAccelTriTime += gen_accel;
 	}
 
+	if (pDirtiedSubScene == NULL && !mAccelCacheFile.empty() && !bCacheLoaded)
+		SaveAccelCache();
+
 	// Now compute the scene epsilon
 	{
 		mSceneEpsilon = FLT_MAX;
 		mKDSceneBBox.resize(mpSceneSet->mKDSceneNodes.size());
+		mKDSceneMotionBBox.resize(mKDSceneBBox.size() * 2);
+		mKDSceneMoving.resize(mKDSceneBBox.size());
 		for (size_t i = 0; i < mKDSceneBBox.size(); ++i) {
-			mpSceneSet->mKDSceneNodes[i].scene_trs.ComputeTotalBBox(mpAccelStructs[mpSceneSet->mKDSceneNodes[i].kd_scene_idx]->GetSceneBBox(), mKDSceneBBox[i]);
+			const KSceneSet::KD_SCENE_LEAF& sceneNode = mpSceneSet->mKDSceneNodes[i];
+			const KAccelStruct* pAccel = mpAccelStructs[sceneNode.kd_scene_idx];
+			sceneNode.scene_trs.ComputeTotalBBox(pAccel->GetSceneBBox(), mKDSceneBBox[i]);
 			mSceneBBox.Add(mKDSceneBBox[i]);
-			float cur_epsilon = mpAccelStructs[mpSceneSet->mKDSceneNodes[i].kd_scene_idx]->GetSceneEpsilon();
+
+			// The moving nodes also get the linear bounds so that a ray only visits them at the times they are there
+			KBBox localStart, localEnd;
+			pAccel->GetSceneMotionBBox(localStart, localEnd);
+			sceneNode.scene_trs.ComputeMotionBBox(localStart, localEnd, mKDSceneMotionBBox[i * 2], mKDSceneMotionBBox[i * 2 + 1]);
+			mKDSceneMoving[i] = (sceneNode.scene_trs.IsMoving() || mpSceneSet->mpKDScenes[sceneNode.kd_scene_idx]->HasAnimatedVertex()) ? 1 : 0;
+
+			float cur_epsilon = pAccel->GetSceneEpsilon();
 			if (mSceneEpsilon > cur_epsilon)
 				mSceneEpsilon = cur_epsilon;
 		}
 
-		mRootNode = SplitBBoxScene(NULL, NULL, 0);
-		mKDSceneBBox.clear();
+		// The scene node set doesn't change when updating the time, so the moving nodes only
+		// need the top level tree to be refitted.
+		bool bRefitted = false;
+		if (bTryRefit && !mBBoxNode.empty()) {
+			RefitWideNodes();
+			bRefitted = (ComputeWideNodeCost() <= mBuildBBoxNodeCost * ACCEL_REFIT_THRESHOLD);
+		}
+
+		if (!bRefitted) {
+			mBBoxNode.clear();
+			mWideDepth = 0;
+			if (!mKDSceneBBox.empty()) {
+				std::vector<UINT32> sceneNodeIdx(mKDSceneBBox.size());
+				for (size_t i = 0; i < sceneNodeIdx.size(); ++i)
+					sceneNodeIdx[i] = (UINT32)i;
+				BuildWideNode(&sceneNodeIdx[0], (UINT32)sceneNodeIdx.size(), 0);
+			}
+			mBuildBBoxNodeCost = ComputeWideNodeCost();
+			// The median split bounds the depth, see WIDE_STACK_SIZE
+			assert(mWideDepth <= MAX_WIDE_DEPTH);
+		}
+		BuildMotionNodes();
 	}
 
 	// Now finalize all the accellerating data structure by copying it into the final buffer.
@@ -476,4 +852,12 @@ const KBBox& KAccelStruct_BVH::GetSceneBBox() const
 	return mSceneBBox;
 }
 
+UINT32 KAccelStruct_BVH::GetMaxTraversalDepth() const
+{
+	UINT32 depth = 0;
+	for (size_t i = 0; i < mpAccelStructs.size(); ++i)
+		depth = std::max(depth, mpAccelStructs[i]->GetTraversalDepth());
+	return depth;
+}
+
 
@@ -1,9 +1,11 @@
 #pragma once
 #include "../base/geometry.h"
 #include "../scene/kd_tree_scene.h"
+#include "../scene/bvh2_scene.h"
 #include "../animation/animated_transform.h"
 #include "../api/KRT_API.h"
 #include "../shader/shader_api.h"
+#include <xmmintrin.h>
 
 class KSceneSet
 {
@@ -15,7 +17,8 @@ public:
 
 	UINT32 SceneNode_Create(UINT32 scene_idx);
 	void SceneNodeTM_SetStaticNode(UINT32 node_idx, const KMatrix4& trans);
-	void SceneNodeTM_SetMovingNode(UINT32 node_idx, const KMatrix4& starting, const KMatrix4& ending);
+	// The key frames are evenly spaced over the shutter interval
+	void SceneNodeTM_SetMovingNode(UINT32 node_idx, const KMatrix4* frames, UINT32 frame_cnt);
 
 	void SetKDSceneCnt(UINT32 cnt);
 	UINT32 GetKDSceneCnt() const;
@@ -27,11 +30,15 @@ public:
 	UINT32 GetNodeSceneIndex(UINT32 scene_node_idx) const;
 	void GetNodeTransform(KAnimation::LocalTRSFrame::LclTRS& out_trs, UINT32 scene_node_idx, float t) const;
 
+private:
+	void UpdateNodeInvTransform(UINT32 node_idx);
+
 public:
 	struct KD_SCENE_LEAF
 	{
 		UINT32 kd_scene_idx;
 		KAnimation::LocalTRSFrame scene_trs;
+		KMatrix4 inv_trans;	// world to local transform, only valid if the node doesn't move
 	};
 
 	std::vector<KScene*> mpKDScenes;
@@ -48,45 +55,79 @@ public:
 	const KSceneSet* GetSource() const;
 
 	bool SceneNode_BuildAccelData(const std::list<UINT32>* pDirtiedSubScene);
+	// If the cache file is set, the full build first tries to load the sub-scene structures from it
+	// and writes it out after building them.
+	void SetAccelCacheFile(const char* fileName) {mAccelCacheFile = fileName ? fileName : "";}
 
-	const KTriDesc* GetAccelTriData(UINT32 scene_node_idx, UINT32 tri_idx) const;
+	KTriDesc GetAccelTriData(UINT32 scene_node_idx, UINT32 tri_idx) const;
 	float GetSceneEpsilon() const {return mSceneEpsilon;}
 	const KBBox& GetSceneBBox() const;
+	// Deepest traversal of all the sub-scene structures, see KAccelStruct::GetTraversalDepth
+	UINT32 GetMaxTraversalDepth() const;
 
 	bool IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const;
+	// Any-hit query for the shadow rays, returns true as soon as something is hit within [0, max_t)
+	bool IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const;
+	// Closest hit of all the rays in the packet, returns the mask of the rays that hit. The packet
+	// shares the traversal if it's coherent, otherwise the rays are traced one by one.
+	UINT32 IntersectPacket(KRayPacket& packet, TracingInstance* inst) const;
 
 	void GetKDBuildTimeStatistics(KRT_SceneStatistic& sceneStat) const;
 
 protected:
 
-	UINT32 SplitBBoxScene(UINT32* pKDSceneIdx, const KBBox* clampBox, UINT32 cnt, UINT32 depth = 0);
+	UINT32 BuildWideNode(UINT32* pSceneNodeIdx, UINT32 cnt, UINT32 depth);
+	void RefitWideNodes();
+	// Fill the linear bounds of the nodes with moving children, it's done after building or refitting
+	void BuildMotionNodes();
+	float ComputeWideNodeCost() const;
+	static KAccelStruct* CreateAccelStruct(const KScene* pScene);
+	UINT64 ComputeCacheKey() const;
+	bool LoadAccelCache();
+	bool SaveAccelCache();
 	
-	bool IntersectBBoxNode(const KRay& ray, UINT32 idx, IntersectContext& ctx, TracingInstance* inst) const;
-	bool IntersectBBoxLeaf(const KRay& ray, UINT32 idx, IntersectContext& ctx, TracingInstance* inst) const;
+	bool IntersectSceneNode(const KRay& ray, UINT32 scene_node_idx, IntersectContext& ctx, TracingInstance* inst) const;
+	bool OccludeSceneNode(const KRay& ray, UINT32 scene_node_idx, double max_t, TracingInstance* inst) const;
+	UINT32 IntersectSceneNodePacket(KRayPacket& packet, UINT32 rayMask, UINT32 scene_node_idx, TracingInstance* inst) const;
+	bool Traverse(const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool anyHit) const;
 
 protected:
-	static const UINT32 LEAF_SCENE_CNT = 4;
-	struct KD_BBOX_LEAF
+	// Each node of the top level BVH has up to 4 children, their bounding boxes are stored in SoA
+	// form so that the 4 boxes can be tested at once with SSE.
+	static const UINT32 WIDE_NODE_CHILD_CNT = 4;
+	// BuildWideNode at least halves the scene nodes at each level, so 2^32 nodes are at most 32 levels
+	// deep. The traversal keeps up to 3 siblings for each level and pushes 4 children at the last one.
+	static const UINT32 MAX_WIDE_DEPTH = 32;
+	static const UINT32 WIDE_STACK_SIZE = 3 * MAX_WIDE_DEPTH + 1;
+	struct WIDE_BBOX_NODE
 	{
-		KBBox bbox[LEAF_SCENE_CNT];// this bbox is transformed by the transform matrix of the kd scene
-		UINT32 scene_cnt;
-		UINT32 next_leaf_idx;
-		UINT32 scene_node_idx[LEAF_SCENE_CNT];
+		float bbox_min[3][WIDE_NODE_CHILD_CNT];	// [axis][child]
+		float bbox_max[3][WIDE_NODE_CHILD_CNT];
+		UINT32 child_node[WIDE_NODE_CHILD_CNT];	// LEAF_FLAG is set for scene node, INVALID_INDEX for the empty slot
 	};
-	std::vector<KD_BBOX_LEAF> mBBoxLeaf;
-
-	struct KD_BBOX_NODE
+	static const UINT32 LEAF_FLAG = 0x80000000;
+	// Linear bounds of the children at the start and the end of the shutter interval, only kept for
+	// the nodes with moving children. The box at the ray's time is clamped by the one of WIDE_BBOX_NODE.
+	struct WIDE_MOTION_NODE
 	{
-		KBBox bbox[2];
-		UINT32 child_node[2];
+		float start_min[3][WIDE_NODE_CHILD_CNT];
+		float start_max[3][WIDE_NODE_CHILD_CNT];
+		float end_min[3][WIDE_NODE_CHILD_CNT];
+		float end_max[3][WIDE_NODE_CHILD_CNT];
 	};
-	static const UINT32 LEAF_FLAG = 0x80000000;
 
 	const KSceneSet* mpSceneSet;
 	std::vector<KAccelStruct*> mpAccelStructs;
 
-	std::vector<KD_BBOX_NODE> mBBoxNode;
+	std::vector<WIDE_BBOX_NODE> mBBoxNode;
+	UINT32 mWideDepth;	// levels of the top level tree, see MAX_WIDE_DEPTH
+	std::vector<UINT32> mMotionNodeIdx;	// index into mMotionNode for each node, INVALID_INDEX if nothing moves
+	std::vector<WIDE_MOTION_NODE> mMotionNode;
 	std::vector<KBBox> mKDSceneBBox;
+	std::vector<KBBox> mKDSceneMotionBBox;	// start and end box of each scene node
+	std::vector<BYTE> mKDSceneMoving;
+	float mBuildBBoxNodeCost;	// cost of the top level tree right after the build
+	std::string mAccelCacheFile;
 	
 	KBBox mSceneBBox;
 	float mSceneEpsilon;
@@ -94,8 +135,13 @@ protected:
 	DWORD m_buildAccelTriTime;
 	DWORD m_kdFinializingTime;
 
-	UINT32 mRootNode;
-
-	static void TransformRay(KRay& out_ray, const KRay& in_ray, const KSceneSet::KD_SCENE_LEAF& scene_info, float t);
+	// The inverse transform of the static node is precomputed, the one of the moving node is cached
+	// by the tracing thread for the motion time.
+	void TransformRay(KRay& out_ray, const KRay& in_ray, UINT32 scene_node_idx, float t, TracingInstance* inst) const;
+	// Clamp the 4 child boxes by their linear bounds at time t
+	static void ClampMotionBBox(const WIDE_MOTION_NODE& motion, __m128 t, __m128* boxMin, __m128* boxMax);
+	// Distances to the 4 child boxes, tNear and tFar hold the interval to clip. The planes are ordered by
+	// the ray signs like IntersectBBox, so a NaN from a zero direction on the plane never limits it.
+	static void IntersectWideBBox(const __m128* boxMin, const __m128* boxMax, const __m128* org, const __m128* rcp, const int* sign, __m128& tNear, __m128& tFar);
 };
 
@@ -7,18 +7,38 @@
 #include "../util/helper_func.h"
 #include "../util/triangle_filter.h"
 #include "../entry/constants.h"
+#include "../file_io/file_io_template.h"
+
+
+KAccelStruct::PFN_RayIntersectStaticTriArray KAccelStruct::s_pPFN_RayIntersectStaticTriArray = NULL;
+KAccelStruct::PFN_RayIntersectAnimTriArray KAccelStruct::s_pPFN_RayIntersectAnimTriArray = NULL;
+KAccelStruct::PFN_RayOccludeStaticTriArray KAccelStruct::s_pPFN_RayOccludeStaticTriArray = NULL;
+KAccelStruct::PFN_RayOccludeAnimTriArray KAccelStruct::s_pPFN_RayOccludeAnimTriArray = NULL;
+KAccelStruct::PFN_RayIntersectStaticTriArrayWT KAccelStruct::s_pPFN_RayIntersectStaticTriArrayWT = NULL;
+KAccelStruct::PFN_RayIntersectAnimTriArrayWT KAccelStruct::s_pPFN_RayIntersectAnimTriArrayWT = NULL;
+KAccelStruct::PFN_RayOccludeStaticTriArrayWT KAccelStruct::s_pPFN_RayOccludeStaticTriArrayWT = NULL;
+KAccelStruct::PFN_RayOccludeAnimTriArrayWT KAccelStruct::s_pPFN_RayOccludeAnimTriArrayWT = NULL;
+KAccelStruct::PFN_RayIntersectStaticTriArray KAccelStruct::s_pPFN_RayIntersectStaticPairArray = NULL;
+KAccelStruct::PFN_RayOccludeStaticTriArray KAccelStruct::s_pPFN_RayOccludeStaticPairArray = NULL;
+KAccelStruct::PFN_RayIntersectStaticTriArrayWT KAccelStruct::s_pPFN_RayIntersectStaticPairArrayWT = NULL;
+KAccelStruct::PFN_RayOccludeStaticTriArrayWT KAccelStruct::s_pPFN_RayOccludeStaticPairArrayWT = NULL;
+
+KAccelStruct::KAccelStruct(const KScene* scene)
+{
+	mpSourceScene = scene;
+	mAccelTriCnt = 0;
+	mUseMailbox = false;
+	mTraversalDepth = 0;
+}
 
-
-KAccelStruct_KDTree::PFN_RayIntersectStaticTriArray KAccelStruct_KDTree::s_pPFN_RayIntersectStaticTriArray = NULL;
-KAccelStruct_KDTree::PFN_RayIntersectAnimTriArray KAccelStruct_KDTree::s_pPFN_RayIntersectAnimTriArray = NULL;
-
-KAccelStruct_KDTree::KAccelStruct_KDTree(const KScene* scene)
+KAccelStruct_KDTree::KAccelStruct_KDTree(const KScene* scene) :
+	KAccelStruct(scene)
 {
 	m_kdBuildTime = 0;
 	m_buildAccelTriTime = 0;
 	mProcessorCnt = GetConfigedThreadCount();
-	mpSourceScene = NULL;
-	mpSourceScene = scene;
+	mpFlatNode = NULL;
+	mFlatNodeCnt = 0;
 	ResetScene();
 }
 
@@ -27,54 +47,56 @@ KAccelStruct_KDTree::~KAccelStruct_KDTree()
 	ResetScene();
 }
 
-const KScene* KAccelStruct_KDTree::GetSource() const
+void SceneSplitTask::Execute(UINT32 worker_idx)
 {
-	return mpSourceScene;
-}
-
-void SceneSplitTask::Execute()
-{
-	bool isLeaf = false;
-	KAccelStruct_KDTree::SplitData splitData;
-	splitData.in_splitThreadIdx = splitThreadIdx;
-	UINT32 ret_value = pKDScene->SplitScene(
+	isLeaf = false;
+	ret_node = pKDScene->SplitScene(
 		triangles, cnt, 
-		needBBox,
-		&clamp_box, 
-		splitData,
+		use_clamp_box ? &clamp_box : NULL, 
+		worker_idx,
 		depth, isLeaf);
-
-	pKDScene->SetKNodeChild(destIndex, ret_value, 
-		(split_flag & KAccelStruct_KDTree::eLeftChild) ? true : false, 
-		isLeaf);
-	pKDScene->mTempDataForKD->NotifySplitThreadComplete(splitThreadIdx);
 }
 
+// Keeps track of the nesting level of SplitScene calls in one worker
+struct NestLevelGuard
+{
+	UINT32& mLevel;
+	NestLevelGuard(UINT32& level) : mLevel(level) {++mLevel;}
+	~NestLevelGuard() {--mLevel;}
+};
 
-UINT32 KAccelStruct_KDTree::SplitScene(UINT32* triangles, UINT32 cnt, 
-								int needBBox,
+KAccelStruct_KDTree::KD_NodeRef KAccelStruct_KDTree::SplitScene(UINT32* triangles, UINT32 cnt, 
 								const KBBox* clamp_box, 
-								const SplitData& splitData,
+								UINT32 worker_idx,
 								int depth, bool& isLeaf)
 {
-	if (cnt == 0) return INVALID_INDEX;
+	KD_NodeRef ret = {worker_idx, INVALID_INDEX};
+	isLeaf = false;
+	if (cnt == 0) return ret;
+
+	ThreadModel::WorkStealingPool& workerPool = *mTempDataForKD->mWorkerPool;
+	DATA_FOR_KD_BUILD::BuildArena& arena = *mTempDataForKD->mArenas[worker_idx];
+	UINT32 nestLevel = arena.nest_level;
+	NestLevelGuard levelGuard(arena.nest_level);
+
 	KD_Node node; 
 	// 1. Calculate the bounding box of this node
 	KBBox bbox;
-	bool bShouldBeLeaf = (cnt <= mLeafTriCnt || depth == mMaxDepth);
-
-	isLeaf = false;
+	bool bUseSAH = (mBuildMode != eBuild_PigeonHole);
+	bool bShouldBeLeaf = (depth == mMaxDepth) || 
+		(bUseSAH ? (cnt <= mSAHParam.simd_width) : (cnt <= mLeafTriCnt));
+	bool bParallelFilter = (cnt >= PARALLEL_FILTER_TRI_CNT && workerPool.GetWorkerCnt() > 1);
 
 	{
 		// Compute the tight bounding box of the triangles
 		if (clamp_box) {
 			assert(triangles != NULL);
 			
-			if (depth < mTempDataForKD->mThreadLimit) {
+			if (bParallelFilter) {
 				FilterByBBox(triangles, cnt, bbox, 
-					*mTempDataForKD->mThreadBucket.get(),
+					workerPool, worker_idx,
 					&mTempDataForKD->mTriBBox[0],
-					this, clamp_box);
+					this, clamp_box, mClipTriBBox);
 
 			}
 			else {
@@ -82,10 +104,14 @@ UINT32 KAccelStruct_KDTree::SplitScene(UINT32* triangles, UINT32 cnt,
 				while (i < cnt) {
 					UINT32 idx = triangles[i];
 					KTriVertPos2 triPos;
-					mpSourceScene->GetAccelTriPos(mAccelTriangle[idx], triPos);
+					mpSourceScene->GetAccelTriPos(GetAccelTriData(idx), triPos);
 
 					if (triPos.mIsMoving || TriIntersectBBox(triPos.mVertPos, *clamp_box)) {
-						bbox.Add(mTempDataForKD->mTriBBox[idx]);
+						KBBox clipBox;
+						if (mClipTriBBox && !triPos.mIsMoving && ClipTriangleBBox(triPos.mVertPos, *clamp_box, clipBox))
+							bbox.Add(clipBox);
+						else
+							bbox.Add(mTempDataForKD->mTriBBox[idx]);
 					}
 					else {
 						std::swap(triangles[i], triangles[cnt - 1]);
@@ -99,9 +125,9 @@ UINT32 KAccelStruct_KDTree::SplitScene(UINT32* triangles, UINT32 cnt,
 			}
 		}
 		else {
-			if (depth < mTempDataForKD->mThreadLimit) {
+			if (bParallelFilter) {
 				CalcuTriangleArrayBBox(triangles, cnt, bbox, 
-					*mTempDataForKD->mThreadBucket.get(), &mTempDataForKD->mTriBBox[0],
+					workerPool, worker_idx, &mTempDataForKD->mTriBBox[0],
 					this);
 				
 			}
@@ -120,64 +146,65 @@ UINT32 KAccelStruct_KDTree::SplitScene(UINT32* triangles, UINT32 cnt,
 		}
 	}
 
-	if (bbox.IsEmpty()) return INVALID_INDEX;
-
-	bool bShrinkBBox = false;
-	if (clamp_box) {
-		bShrinkBBox = !(bbox.IsInside(clamp_box->mMax) && bbox.IsInside(clamp_box->mMin));
-		if (bShrinkBBox) needBBox = 0;
-	}
-
-	node.bbox = bbox;
+	if (bbox.IsEmpty()) return ret;
 
 	bool bForceLeafNode = false;
 	int tryOtherSplitAxis = 0;
 	
 	int det_axis;
 
+	// With SAH the node is terminated when no splitting plane is cheaper than the leaf itself
+	int sah_axis = 0;
+	float sah_pos = 0;
+	if (bUseSAH && !bShouldBeLeaf) {
+		float sah_cost = 0;
+		bool hasSplit;
+		if (mBuildMode == eBuild_SAH_Sweep)
+			hasSplit = CalcuSAHSplitSweep(triangles, cnt, bbox,
+				&mTempDataForKD->mTriBBox[0], mSAHParam,
+				arena.sah_events,
+				sah_axis, sah_pos, sah_cost);
+		else
+			hasSplit = CalcuSAHSplitBinned(triangles, cnt, bbox,
+				&mTempDataForKD->mTriBBox[0], mSAHParam,
+				arena.pigeon_holes,
+				sah_axis, sah_pos, sah_cost);
+		if (!hasSplit)
+			bShouldBeLeaf = true;
+	}
+
 FORCE_LEAF_NODE:
-	node.flag = (!(needBBox % 6) ? 0 : eNoBBox);
-	++needBBox;
+	node.flag = 0;
 	// 2. If the triangle count is less than the limit, then add all the triangle index into leaf node
 	if (bForceLeafNode || bShouldBeLeaf) {
 		isLeaf = true;
-		UINT32* leafTriIdx = NULL;
 		// Create triangle list here
-		if (cnt > 0) {
-			leafTriIdx = (UINT32*)mLeafIdxMemPool.Alloc(sizeof(UINT32)*cnt);
-			if (triangles) {
-				memcpy(leafTriIdx, triangles, sizeof(UINT32)*cnt);
-			}
-			else {
-				for (UINT32 i = 0; i < cnt; ++i)
-					leafTriIdx[i] = i;
-			}
-			KD_LeafData leafData;
-			leafData.bbox = bbox;
-			leafData.box_norm.InitFromBBox(bbox);
-			leafData.tri_cnt = cnt;
-			leafData.tri_list.leaf_triangles = leafTriIdx;
-			leafData.hasAnim = false;
-			// Check whether this tri-leaf node contains animation
-			for (UINT32 i = 0; i < cnt; ++i) {
-				if (mpSourceScene->IsTriPosAnimated(mAccelTriangle[i])) {
-					leafData.hasAnim = true;
-					break;
-				}
-			}
-
-			EnterSpinLockCriticalSection(mTempDataForKD->mLeafAddingCS);
-			mTotalLeafTriCnt += cnt;
-			mKDLeafData.push_back(leafData);
-			UINT32 ret = (UINT32)mKDLeafData.size() - 1;
-
-			LeaveSpinLockCriticalSection(mTempDataForKD->mLeafAddingCS);
-			return ret;
+		UINT32* leafTriIdx = (UINT32*)arena.leaf_idx_pool.Alloc(sizeof(UINT32)*cnt);
+		if (triangles) {
+			memcpy(leafTriIdx, triangles, sizeof(UINT32)*cnt);
 		}
 		else {
-
-			return INVALID_INDEX;
+			for (UINT32 i = 0; i < cnt; ++i)
+				leafTriIdx[i] = i;
+		}
+		KD_LeafData leafData;
+		leafData.bbox = bbox;
+		leafData.box_norm.InitFromBBox(bbox);
+		leafData.tri_cnt = cnt;
+		leafData.tri_list.leaf_triangles = leafTriIdx;
+		leafData.hasAnim = false;
+		// Check whether this tri-leaf node contains animation
+		for (UINT32 i = 0; i < cnt; ++i) {
+			if (mpSourceScene->IsTriPosAnimated(GetAccelTriData(leafTriIdx[i]))) {
+				leafData.hasAnim = true;
+				break;
+			}
 		}
+
+		arena.leaf_tri_cnt += cnt;
+		arena.leaves.push_back(leafData);
+		ret.idx = (UINT32)arena.leaves.size() - 1;
+		return ret;
 	}
 	
 	// 3. According to the bounding box, determine how to split this node
@@ -192,6 +219,9 @@ FORCE_LEAF_NODE:
 			useMiddleSplit = true;
 		}
 	}
+	else if (bUseSAH) {
+		det_axis = sah_axis;
+	}
 	else {
 		
 		if (fabs(det[0]) >= fabs(det[1]) && fabs(det[0]) >= fabs(det[2])) {
@@ -218,54 +248,25 @@ FORCE_LEAF_NODE:
 		// Use the middle plan splitting, may be used for testing
 		if (useMiddleSplit)
 			det_value = (bbox.mMax[det_axis] + bbox.mMin[det_axis]) * 0.5f;
+		else if (bUseSAH)
+			det_value = sah_pos;
 		else {
 			det_value = CalcuSplittingPosition(
 				triangles, cnt, 
 				bbox,
 				&mTempDataForKD->mTriBBox[0],
 				det_axis,
-				mTempDataForKD->mPigeonHoles[splitData.in_splitThreadIdx]);
+				arena.pigeon_holes);
 		}
 	}
 	node.split_value = det_value;
 	left_bbox.mMin[det_axis] = det_value;
 	right_bbox.mMax[det_axis] = det_value;
 
-	// Allocate triangle index buffer for children nodes
-	UINT32* tempTriIdxBuf = NULL;
-	UINT32* left_triangles = NULL;
-	UINT32* right_triangles = NULL;
-	UINT32 addedThreadIdx[2] = {INVALID_INDEX, INVALID_INDEX};
-	// If there're available CPU in thread pool, bNeedSpawnThread will be true
-	bool bNeedSpawnThread = (cnt > (mLeafTriCnt*15) && 
-		splitData.in_splitThreadIdx != 0 &&
-		mTempDataForKD->mActiveSplitThreadCnt < (long)mTempDataForKD->mCPUCnt);
-	bool bIsThreadSplitPoint = (mTempDataForKD->mThreadLimit == depth);
-	bool bKickSubThread = false;
-	if (bIsThreadSplitPoint) {
-		addedThreadIdx[0] = mTempDataForKD->mThreadPool->PopIdleThreadIndex();
-		addedThreadIdx[1] = mTempDataForKD->mThreadPool->PopIdleThreadIndex();
-		assert(addedThreadIdx[0] != INVALID_INDEX && addedThreadIdx[1] != INVALID_INDEX);
-
-		left_triangles = mTempDataForKD->AcquireTempTriIdxBuf(addedThreadIdx[0] + 1, depth, cnt);
-		right_triangles = mTempDataForKD->AcquireTempTriIdxBuf(addedThreadIdx[1] + 1, depth, cnt);
-		bNeedSpawnThread = true;
-
-	} else if (bNeedSpawnThread) {
-		addedThreadIdx[0] = mTempDataForKD->mThreadPool->PopIdleThreadIndex();
-		if (addedThreadIdx[0] != INVALID_INDEX) {
-			left_triangles = mTempDataForKD->AcquireTempTriIdxBuf(addedThreadIdx[0] + 1, depth, cnt);
-			right_triangles = mTempDataForKD->AcquireTempTriIdxBuf(splitData.in_splitThreadIdx, depth, cnt);
-			bKickSubThread = true;
-		}
-		else
-			bNeedSpawnThread = false;
-	}
-	if (!bNeedSpawnThread) {
-		tempTriIdxBuf = mTempDataForKD->AcquireTempTriIdxBuf(splitData.in_splitThreadIdx, depth, cnt*2);
-		left_triangles = tempTriIdxBuf;
-		right_triangles = left_triangles + cnt;
-	}
+	// Allocate triangle index buffer for children nodes, it belongs to the nesting level of this call
+	// so it stays untouched until the spawned child is done, even if the child is stolen by another worker.
+	UINT32* left_triangles = mTempDataForKD->AcquireTempTriIdxBuf(worker_idx, nestLevel, cnt*2);
+	UINT32* right_triangles = left_triangles + cnt;
 
 	UINT32 cnt0 = 0;
 	UINT32 cnt1 = 0;
@@ -290,14 +291,11 @@ FORCE_LEAF_NODE:
 		}
 	}
 
-	if (0 == stride_cnt) {
-		++mPerfectsplitCnt;
-		node.flag |= ePerfectSplit;
-	}
-
 	// If the splitting produces more striding triangles than the threshold, just try several other splitting methods.
 	// If all the splitting methods have been tried and it still cannot pass the threshold, just accept the middle splitting method
-	if ((float)stride_cnt >= (float)cnt * mNodeSplitThreshhold &&
+	// The SAH cost already accounts for the striding triangles.
+	if (!bUseSAH &&
+		(float)stride_cnt >= (float)cnt * mNodeSplitThreshhold &&
 		tryOtherSplitAxis <= 2) {
 		if (cnt <= mLeafTriCnt*10) {
 			bForceLeafNode = true;
@@ -305,136 +303,66 @@ FORCE_LEAF_NODE:
 		else
 			++tryOtherSplitAxis;
 
-		for (int i = 0; i < 2; ++i) {
-			if (addedThreadIdx[i] != INVALID_INDEX) 
-				mTempDataForKD->mThreadPool->ReleaseScheduledThread(addedThreadIdx[i]);
-		}
-
 		goto FORCE_LEAF_NODE;
 	}
 
 	if (cnt0 == cnt || cnt1 == cnt) {
 		// Ok...I surrender
 		bForceLeafNode = true;
-		for (int i = 0; i < 2; ++i) {
-			if (addedThreadIdx[i] != INVALID_INDEX) 
-				mTempDataForKD->mThreadPool->ReleaseScheduledThread(addedThreadIdx[i]);
-		}
-
 		goto FORCE_LEAF_NODE;
 	}
 
-	UINT32 ret;
-	if (bNeedSpawnThread) {
-		
-		AddKDNode(node, ret);
-		SceneSplitTask* pSplitTask = NULL;
-		if (cnt0 > 0) {
-
-			pSplitTask = &mTempDataForKD->mSplitTasks[addedThreadIdx[0]];
-			pSplitTask->pKDScene = this;
-			pSplitTask->triangles = left_triangles;
-			pSplitTask->cnt = cnt0;
-			pSplitTask->split_flag = eLeftChild;
-			pSplitTask->clamp_box = left_bbox;
-			pSplitTask->needBBox = needBBox;
-			pSplitTask->depth = depth + 1;
-			pSplitTask->destIndex = ret;
-			pSplitTask->splitThreadIdx = addedThreadIdx[0] + 1; // Note: this thread is in the pool, main thread isn't.
-			// Notify the split thread started before kick the thread
-			mTempDataForKD->NotifySplitThreadAdded();
-			if (bKickSubThread)
-				mTempDataForKD->mThreadPool->KickIdleThread(addedThreadIdx[0]);
-		}
-		else {
-			mTempDataForKD->mThreadPool->ReleaseScheduledThread(addedThreadIdx[0]);
-			SetKNodeChild(ret, INVALID_INDEX, true, false);
-		}	
+	if (0 == stride_cnt) {
+		++arena.perfect_split_cnt;
+		node.flag |= ePerfectSplit;
+	}
 
-		pSplitTask = NULL;
-		if (cnt1 > 0) {
-			
-			if (addedThreadIdx[1] != INVALID_INDEX) {
-				pSplitTask = &mTempDataForKD->mSplitTasks[addedThreadIdx[1]];
-				pSplitTask->pKDScene = this;
-				pSplitTask->triangles = right_triangles;
-				pSplitTask->cnt = cnt1;
-				pSplitTask->split_flag = eRightChild;
-				pSplitTask->clamp_box = right_bbox;
-				pSplitTask->needBBox = needBBox;
-				pSplitTask->depth = depth + 1;
-				pSplitTask->destIndex = ret;
-				pSplitTask->splitThreadIdx = addedThreadIdx[1] + 1; // Note: this thread is in the pool, main thread isn't.
-				// Notify the split thread started before kick the thread
-				mTempDataForKD->NotifySplitThreadAdded();
-			}
-			else {
-				bool isLeafNode = false;
-				UINT32 right_idx = SplitScene(right_triangles, cnt1, needBBox, &right_bbox, splitData, depth + 1, isLeafNode);
-				SetKNodeChild(ret, right_idx, false, isLeafNode);
-			}
-		}
-		else {
-			if (addedThreadIdx[1] != INVALID_INDEX) 
-				mTempDataForKD->mThreadPool->ReleaseScheduledThread(addedThreadIdx[1]);
-			SetKNodeChild(ret, INVALID_INDEX, false, false);
-		}
+	bool isLeafNode = false;
+	if (cnt > mLeafTriCnt*15 && workerPool.GetWorkerCnt() > 1) {
+		// Spawn the + side so that an idle worker can steal it, and split the - side in this worker
+		SceneSplitTask leftTask;
+		leftTask.pKDScene = this;
+		leftTask.triangles = left_triangles;
+		leftTask.cnt = cnt0;
+		leftTask.clamp_box = left_bbox;
+		leftTask.use_clamp_box = true;
+		leftTask.depth = depth + 1;
+		ThreadModel::TaskGroup taskGroup;
+		workerPool.Spawn(worker_idx, &leftTask, taskGroup);
+
+		node.right_child = SplitScene(right_triangles, cnt1, &right_bbox, worker_idx, depth + 1, isLeafNode);
+		node.flag |= (isLeafNode ? eRightChild : 0);
+
+		workerPool.Wait(worker_idx, taskGroup);
+		node.left_child = leftTask.ret_node;
+		node.flag |= (leftTask.isLeaf ? eLeftChild : 0);
 	}
 	else {
-		bool isLeafNode = false;
-		node.left_child = SplitScene(left_triangles, cnt0, needBBox, &left_bbox, splitData, depth + 1, isLeafNode);
+		node.left_child = SplitScene(left_triangles, cnt0, &left_bbox, worker_idx, depth + 1, isLeafNode);
 		node.flag |= (isLeafNode ? eLeftChild : 0);
-		node.right_child = SplitScene(right_triangles, cnt1, needBBox, &right_bbox, splitData, depth + 1, isLeafNode);
+		node.right_child = SplitScene(right_triangles, cnt1, &right_bbox, worker_idx, depth + 1, isLeafNode);
 		node.flag |= (isLeafNode ? eRightChild : 0);
-		AddKDNode(node, ret);
 	}
 
+	arena.nodes.push_back(node);
+	ret.idx = (UINT32)arena.nodes.size() - 1;
 	return ret;
 }
 
-void KAccelStruct_KDTree::AddKDNode(const KD_Node& node, UINT32& out_idx)
-{
-	EnterSpinLockCriticalSection(mTempDataForKD->mNodeAddingCS);
-
-	UINT32 oldSize = (UINT32)mSceneNode.size();
-	out_idx = oldSize;
-	mSceneNode.resize(oldSize + sizeof(KD_Node_NoBBox));
-	*(KD_Node_NoBBox*)&mSceneNode[oldSize] = node;
-	if (!(node.flag & eNoBBox)) {
-		oldSize = (UINT32)mSceneNode.size();
-		mSceneNode.resize(oldSize + sizeof(KBBox));
-		*(KBBox*)&mSceneNode[oldSize] = node.bbox;
-	}
-
-	LeaveSpinLockCriticalSection(mTempDataForKD->mNodeAddingCS);
-}
-
-void KAccelStruct_KDTree::SetKNodeChild(UINT32 nodeIdx, UINT32 childIdx, bool left_or_right, bool isLeaf)
-{	
-	EnterSpinLockCriticalSection(mTempDataForKD->mNodeAddingCS);
-	KD_Node& node = *(KD_Node*)&mSceneNode[nodeIdx];
-	if (isLeaf)
-		node.flag |= (left_or_right ? eLeftChild : eRightChild);
-
-	if (left_or_right)
-		node.left_child = childIdx;
-	else
-		node.right_child = childIdx;
-	LeaveSpinLockCriticalSection(mTempDataForKD->mNodeAddingCS);
-}
-
 void KAccelStruct_KDTree::PrecomputeTriangleBBox()
 {
 	KTriVertPos2 triVertPos;
-	mTempDataForKD->mTriBBox.resize(mAccelTriangle.size());
-	for (size_t i = 0; i < mAccelTriangle.size(); ++i) {
-		mpSourceScene->GetAccelTriPos(mAccelTriangle[i], triVertPos);
+	mTempDataForKD->mTriBBox.resize(mAccelTriCnt);
+	mSceneBBox.SetEmpty();
+	for (UINT32 i = 0; i < mAccelTriCnt; ++i) {
+		mpSourceScene->GetAccelTriPos(GetAccelTriData(i), triVertPos);
 		KBBox bbox(triVertPos);
 		mTempDataForKD->mTriBBox[i] = bbox;
+		mSceneBBox.Add(bbox);
 	}
 }
 
-int KAccelStruct_KDTree::PrepareKDTree()
+void KAccelStruct_KDTree::PrepareKDTree()
 {
 	// Start build kd-tree...
 	mTotalLeafTriCnt = 0;
@@ -442,143 +370,803 @@ int KAccelStruct_KDTree::PrepareKDTree()
 	double time_elapse;
 
 	KTimer stop_watch(true);
-	mpSourceScene->InitAccelTriangleCache(mAccelTriangle);
+	mAccelTriCnt = mpSourceScene->InitAccelTriangleCache(mAccelTriInst);
 	time_elapse = stop_watch.Stop();
 	m_buildAccelTriTime = DWORD(time_elapse*1000.0);
 
-	UINT32* triangles = NULL;	// Null indicates an array of 0,1,2,3...
 	//---------------Start building kd-tree---------------------
 	stop_watch.Start();
-	size_t apprxmNodeCnt = size_t((float)mAccelTriangle.size() * 0.18f);
-	mSceneNode.reserve(apprxmNodeCnt);
-	mKDLeafData.reserve(apprxmNodeCnt);
-	bool isLeaf = false;
 	{
-		// Split the scene and do the kd-tree building
+		// Split the scene and do the kd-tree building, the root task runs in this thread
 		mTempDataForKD.reset(new DATA_FOR_KD_BUILD);
 		PrecomputeTriangleBBox();
 
-		SplitData splitData;
-		splitData.in_splitThreadIdx = 0; // the main split thread
-		mRootNode = SplitScene(triangles, (UINT32)mAccelTriangle.size(), 0, NULL, splitData, 0, isLeaf);
-		// Clear the temporary memory allocated in main thread
-		//mTempDataForKD->mSplitThreadTriArrayLevel[0].clear();
-		if (mTempDataForKD->mThreadPool.get())
-			mTempDataForKD->mThreadPool->KickScheduledThreads();
-		
-		// Main thread finished
-		mTempDataForKD->NotifySplitThreadComplete(INVALID_INDEX);
-		mTempDataForKD->mSplitThreadTriArrayLevel[0].clear();
-		if (mTempDataForKD->mThreadPool.get())
-			mTempDataForKD->mThreadPool->WaitForAll();
-	
-		mTempDataForKD.reset();
+		SceneSplitTask rootTask;
+		rootTask.pKDScene = this;
+		rootTask.triangles = NULL;	// Null indicates an array of 0,1,2,3...
+		rootTask.cnt = mAccelTriCnt;
+		rootTask.use_clamp_box = false;
+		rootTask.depth = 0;
+		mTempDataForKD->mWorkerPool->Run(&rootTask);
+		mRootNode = rootTask.ret_node;
+		mRootIsLeaf = rootTask.isLeaf;
+
+		for (size_t i = 0; i < mTempDataForKD->mArenas.size(); ++i) {
+			mTotalLeafTriCnt += mTempDataForKD->mArenas[i]->leaf_tri_cnt;
+			mPerfectsplitCnt += mTempDataForKD->mArenas[i]->perfect_split_cnt;
+		}
 	}
 
 	time_elapse = stop_watch.Stop();
 	m_kdBuildTime = DWORD(time_elapse * 1000.0);
 	//---------------End of building kd-tree--------------------
 
-	if (mRootNode != INVALID_INDEX) {
-		if (!mSceneNode.empty()) {
-			const KD_Node* pRootNode = (const KD_Node*)&mSceneNode[mRootNode];
-			assert(!(pRootNode->flag & eNoBBox));
-			mSceneBBox = pRootNode->bbox;
-		}
-		else
-			mSceneBBox = mKDLeafData[mRootNode].bbox;
+	if (mRootNode.idx != INVALID_INDEX) {
 		KVec3 diagnol = mSceneBBox.mMax - mSceneBBox.mMin;
 		mSceneEpsilon = nvmath::length(diagnol) * 1.0E-6f;
 	}
 
-	return mRootNode;
+	stop_watch.Start();
+	FinalizeKDTree();
+	BuildLeafTriData();
+	time_elapse = stop_watch.Stop();
+	m_kdBuildTime += DWORD(time_elapse * 1000.0);
+}
+
+KAccelStruct::AccelLeaves::AccelLeaves()
+{
+	tri_data = NULL;
+	tri_data_size = 0;
+	tri_data_simd = 0;
+	tri_data_quantized = false;
+	tri_data_world = false;
+}
+
+KAccelStruct::AccelLeaves::~AccelLeaves()
+{
+	ClearTriData();
+}
+
+void KAccelStruct::AccelLeaves::Clear()
+{
+	tri_offset.clear();
+	tri_cnt.clear();
+	bbox.clear();
+	box_norm.clear();
+	tri_idx.clear();
+	ClearTriData();
+}
+
+void KAccelStruct::AccelLeaves::ClearTriData()
+{
+	if (tri_data)
+		Interleaved_Free(tri_data);
+	tri_data = NULL;
+	tri_data_size = 0;
+	tri_data_offset.clear();
+	quant_param.clear();
+	pair_prim_cnt.clear();
+	tri_vert_order.clear();
 }
 
-bool KAccelStruct_KDTree::IntersectLeaf(UINT32 idx, const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const
+static bool IsSameVert(const float* v0, const float* v1)
 {
-	const KD_LeafData& leafData = mKDLeafData[idx];
+	return v0[0] == v1[0] && v0[1] == v1[1] && v0[2] == v1[2];
+}
+
+// Slot of the vertex among the 3 vertices of a triangle, 3 if it's not there
+static UINT32 FindTriVert(const float* pTri, const float* pVert)
+{
+	UINT32 i = 0;
+	while (i < 3 && !IsSameVert(pTri + i * 3, pVert))
+		++i;
+	return i;
+}
+
+// Slots of vertex 1 and 2 of the triangle among the 3 vertices the kernel tests
+static BYTE PairVertOrder(const float* pTri, const float* k0, const float* k1, const float* k2)
+{
+	BYTE order = 0;
+	for (int v = 1; v < 3; ++v) {
+		const float* pVert = pTri + v * 3;
+		BYTE slot = IsSameVert(pVert, k0) ? 0 : (IsSameVert(pVert, k1) ? 1 : 2);
+		order |= slot << ((v - 1) * 2);
+	}
+	return order;
+}
+
+// Pair the triangles sharing an edge, mate is INVALID_INDEX for the ones left alone.
+// The positions are compared exactly, so the split vertices of a hard edge still match.
+static UINT32 PairLeafTriangles(const float* pTriPos, UINT32 triCnt, std::vector<UINT32>& mate)
+{
+	mate.assign(triCnt, INVALID_INDEX);
+	std::vector<BYTE> degenerate(triCnt);
+	for (UINT32 i = 0; i < triCnt; ++i) {
+		const float* pTri = pTriPos + i * 9;
+		degenerate[i] = (IsSameVert(pTri, pTri + 3) || IsSameVert(pTri, pTri + 6) || IsSameVert(pTri + 3, pTri + 6)) ? 1 : 0;
+	}
+
+	UINT32 pairCnt = 0;
+	for (UINT32 i = 0; i < triCnt; ++i) {
+		if (mate[i] != INVALID_INDEX || degenerate[i])
+			continue;
+		for (UINT32 j = i + 1; j < triCnt; ++j) {
+			if (mate[j] != INVALID_INDEX || degenerate[j])
+				continue;
+			UINT32 sharedCnt = 0;
+			for (UINT32 v = 0; v < 3; ++v)
+				sharedCnt += (FindTriVert(pTriPos + i * 9, pTriPos + j * 9 + v * 3) < 3) ? 1 : 0;
+			if (sharedCnt == 2) {
+				mate[i] = j;
+				mate[j] = i;
+				++pairCnt;
+				break;
+			}
+		}
+	}
+	return pairCnt;
+}
+
+static void GetQuantRange(const float* pPos, UINT32 valueCnt, float* minPos, float* maxPos)
+{
+	for (int axis = 0; axis < 3; ++axis) {
+		minPos[axis] = FLT_MAX;
+		maxPos[axis] = -FLT_MAX;
+		for (UINT32 j = axis; j < valueCnt; j += 3) {
+			minPos[axis] = pPos[j] < minPos[axis] ? pPos[j] : minPos[axis];
+			maxPos[axis] = pPos[j] > maxPos[axis] ? pPos[j] : maxPos[axis];
+		}
+	}
+}
+
+// Smallest power of two not less than v, 0 for v <= 0
+static float PowerOf2Ceil(float v)
+{
+	if (v <= 0)
+		return 0;
+	int e;
+	float m = frexpf(v, &e);
+	return m == 0.5f ? v : ldexpf(1.0f, e);
+}
+
+// The world space positions of all the static leaves are quantized on one lattice per axis, so a vertex
+// shared by two leaves decodes to the same float in both and the watertight test keeps the edge closed.
+// The step is a power of two covering the largest leaf with 16 bits, every leaf base is a lattice point
+// and the decoded base + q * step stays exact as long as the lattice index fits in the float mantissa.
+void KAccelStruct::AccelLeaves::ComputeQuantLattice(const KScene* scene, const std::vector<KTriInstance>& instances, std::vector<float>& triPos, float* latticeStep) const
+{
+	float maxExtent[3] = {0, 0, 0};
+	float maxAbs[3] = {0, 0, 0};
+	UINT32 leafCnt = LeafCnt();
+	for (UINT32 i = 0; i < leafCnt; ++i) {
+		UINT32 triCnt = tri_cnt[i] & ~LEAF_ANIM_FLAG;
+		if (triCnt == 0 || !IsTriPosQuantized(i))
+			continue;
+		triPos.resize(triCnt * 9);
+		const UINT32* pTriIdx = &tri_idx[tri_offset[i]];
+		for (UINT32 j = 0; j < triCnt; ++j)
+			scene->GetTriPosData(ResolveAccelTriangle(instances, pTriIdx[j]), false, &triPos[j * 9], NULL);
+		float minPos[3], maxPos[3];
+		GetQuantRange(&triPos[0], triCnt * 9, minPos, maxPos);
+		for (int axis = 0; axis < 3; ++axis) {
+			maxExtent[axis] = std::max(maxExtent[axis], maxPos[axis] - minPos[axis]);
+			maxAbs[axis] = std::max(maxAbs[axis], std::max(fabsf(minPos[axis]), fabsf(maxPos[axis])));
+		}
+	}
+	// One code is left for the base rounding down to the lattice
+	for (int axis = 0; axis < 3; ++axis)
+		latticeStep[axis] = std::max(PowerOf2Ceil(maxExtent[axis] / 65534.0f), PowerOf2Ceil(maxAbs[axis] / 8388608.0f));
+}
+
+void KAccelStruct::AccelLeaves::BuildTriData(const KScene* scene, const std::vector<KTriInstance>& instances, UINT32 simdWidth, bool quantize, bool worldSpace, bool pairTriangles)
+{
+	ClearTriData();
+	tri_data_simd = simdWidth;
+	tri_data_quantized = quantize;
+	tri_data_world = worldSpace;
+
+	// Every leaf block starts at the SIMD alignment, the ids are placed first so that the positions stay aligned too.
+	// The size of the triangle layout is an upper bound, a leaf is stored by pairs only if it takes less space.
+	UINT32 alignment = simdWidth * sizeof(float);
+	UINT32 leafCnt = LeafCnt();
+	tri_data_offset.resize(leafCnt);
+	pair_prim_cnt.assign(leafCnt, 0);
+	tri_vert_order.resize(tri_idx.size());
+	if (quantize)
+		quant_param.resize(leafCnt * 6);
+	UINT64 totalSize = 0;
+	for (UINT32 i = 0; i < leafCnt; ++i) {
+		UINT32 triCnt = tri_cnt[i] & ~LEAF_ANIM_FLAG;
+		UINT32 triStep = (tri_cnt[i] & LEAF_ANIM_FLAG) ? 18 : 9;
+		UINT32 paddingCnt = (triCnt + simdWidth - 1) / simdWidth * simdWidth;
+		UINT64 leafSize = paddingCnt * (sizeof(int) + triStep * (IsTriPosQuantized(i) ? sizeof(UINT16) : sizeof(float)));
+		totalSize += (leafSize + alignment - 1) / alignment * alignment;
+	}
+	if (totalSize == 0)
+		return;
+	tri_data = (BYTE*)Interleaved_Malloc((size_t)totalSize, alignment, NUMA_INTERLEAVE != 0);
+
+	std::vector<float> triPos;
+	std::vector<int> triId;
+	float latticeStep[3] = {0, 0, 0};
+	if (quantize && worldSpace)
+		ComputeQuantLattice(scene, instances, triPos, latticeStep);
+
+	std::vector<UINT32> mate;
+	std::vector<float> pairPos;
+	std::vector<int> pairId;
+	std::vector<UINT16> quantPos;
+	UINT64 usedSize = 0;
+	for (UINT32 i = 0; i < leafCnt; ++i) {
+		tri_data_offset[i] = usedSize;
+		UINT32 triCnt = tri_cnt[i] & ~LEAF_ANIM_FLAG;
+		bool hasAnim = (tri_cnt[i] & LEAF_ANIM_FLAG) != 0;
+		UINT32 triStep = hasAnim ? 18 : 9;
+		if (triCnt == 0)
+			continue;
+
+		triPos.resize(triCnt * triStep);
+		triId.resize(triCnt);
+		const UINT32* pTriIdx = &tri_idx[tri_offset[i]];
+		for (UINT32 j = 0; j < triCnt; ++j) {
+			scene->GetTriPosData(ResolveAccelTriangle(instances, pTriIdx[j]), hasAnim, &triPos[j * triStep], worldSpace ? NULL : &box_norm[i]);
+			triId[j] = (int)pTriIdx[j];
+		}
+
+		UINT32 posByte = IsTriPosQuantized(i) ? sizeof(UINT16) : sizeof(float);
+		UINT32 primCnt = triCnt;
+		UINT32 posStep = triStep;
+		UINT32 idStep = 1;
+		const float* pPrimPos = &triPos[0];
+		const int* pPrimId = &triId[0];
+		if (pairTriangles && !hasAnim) {
+			UINT32 pairCnt = PairLeafTriangles(&triPos[0], triCnt, mate);
+			UINT32 pairPrimCnt = triCnt - pairCnt;
+			UINT64 triSize = (triCnt + simdWidth - 1) / simdWidth * simdWidth * (sizeof(int) + 9 * posByte);
+			UINT64 pairSize = (pairPrimCnt + simdWidth - 1) / simdWidth * simdWidth * (2 * sizeof(int) + 12 * posByte);
+			if (pairCnt > 0 && pairSize < triSize) {
+				pairPos.resize(pairPrimCnt * 12);
+				pairId.resize(pairPrimCnt * 2);
+				UINT32 p = 0;
+				for (UINT32 a = 0; a < triCnt; ++a) {
+					UINT32 b = mate[a];
+					if (b != INVALID_INDEX && b < a)
+						continue;
+					const float* pA = &triPos[a * 9];
+					float* pPos = &pairPos[p * 12];
+					if (b == INVALID_INDEX) {
+						// A lone triangle gets a degenerated mate
+						memcpy(pPos, pA, 9 * sizeof(float));
+						memcpy(pPos + 9, pA + 6, 3 * sizeof(float));
+						pairId[p * 2] = triId[a];
+						pairId[p * 2 + 1] = (int)INVALID_INDEX;
+						tri_vert_order[tri_offset[i] + a] = PairVertOrder(pA, pPos, pPos + 3, pPos + 6);
+					}
+					else {
+						// The vertex of A off the shared edge is p1, the rotation keeps the winding of A
+						const float* pB = &triPos[b * 9];
+						UINT32 ja = 0;
+						while (FindTriVert(pB, pA + ja * 3) < 3)
+							++ja;
+						UINT32 jb = 0;
+						while (FindTriVert(pA, pB + jb * 3) < 3)
+							++jb;
+						memcpy(pPos, pA + (ja + 2) % 3 * 3, 3 * sizeof(float));
+						memcpy(pPos + 3, pA + ja * 3, 3 * sizeof(float));
+						memcpy(pPos + 6, pA + (ja + 1) % 3 * 3, 3 * sizeof(float));
+						memcpy(pPos + 9, pB + jb * 3, 3 * sizeof(float));
+						pairId[p * 2] = triId[a];
+						pairId[p * 2 + 1] = triId[b];
+						tri_vert_order[tri_offset[i] + a] = PairVertOrder(pA, pPos, pPos + 3, pPos + 6);
+						tri_vert_order[tri_offset[i] + b] = PairVertOrder(pB, pPos, pPos + 6, pPos + 9);
+					}
+					++p;
+				}
+				pair_prim_cnt[i] = pairPrimCnt;
+				primCnt = pairPrimCnt;
+				posStep = 12;
+				idStep = 2;
+				pPrimPos = &pairPos[0];
+				pPrimId = &pairId[0];
+			}
+		}
+
+		UINT32 paddingCnt = (primCnt + simdWidth - 1) / simdWidth * simdWidth;
+		UINT64 leafSize = paddingCnt * (idStep * sizeof(int) + posStep * posByte);
+		usedSize += (leafSize + alignment - 1) / alignment * alignment;
+		BYTE* pIdData = tri_data + tri_data_offset[i];
+		BYTE* pPosData = pIdData + paddingCnt * idStep * sizeof(int);
+		SwizzleForSIMD((void*)pPrimId, pIdData, simdWidth, sizeof(int), idStep * sizeof(int), primCnt);
+
+		if (!IsTriPosQuantized(i)) {
+			SwizzleForSIMD((void*)pPrimPos, pPosData, simdWidth, sizeof(float), posStep * sizeof(float), primCnt);
+			continue;
+		}
+
+		// The triangles may stick out of the leaf box, so the range comes from the vertices themselves
+		float* pParam = &quant_param[i * 6];
+		UINT32 valueCnt = primCnt * posStep;
+		float minPos[3], maxPos[3];
+		GetQuantRange(pPrimPos, valueCnt, minPos, maxPos);
+		for (int axis = 0; axis < 3; ++axis) {
+			if (worldSpace && latticeStep[axis] > 0) {
+				pParam[axis] = (float)(floor(minPos[axis] / latticeStep[axis]) * latticeStep[axis]);
+				pParam[axis + 3] = latticeStep[axis];
+			}
+			else {
+				pParam[axis] = minPos[axis];
+				pParam[axis + 3] = (maxPos[axis] - minPos[axis]) / 65535.0f;
+			}
+		}
+		quantPos.resize(valueCnt);
+		for (UINT32 j = 0; j < valueCnt; ++j) {
+			int axis = j % 3;
+			float step = pParam[axis + 3];
+			double q = 0;
+			if (worldSpace && step > 0)
+				q = floor((double)pPrimPos[j] / step + 0.5) - floor((double)pParam[axis] / step);
+			else if (step > 0)
+				q = (pPrimPos[j] - pParam[axis]) / step + 0.5f;
+			quantPos[j] = (UINT16)(q > 65535.0 ? 65535.0 : (q < 0 ? 0 : q));
+		}
+		SwizzleForSIMD(&quantPos[0], pPosData, simdWidth, sizeof(UINT16), posStep * sizeof(UINT16), primCnt);
+	}
+
+	// Give back the space saved by the pairs
+	if (usedSize < totalSize) {
+		BYTE* pData = (BYTE*)Interleaved_Malloc((size_t)usedSize, alignment, NUMA_INTERLEAVE != 0);
+		memcpy(pData, tri_data, (size_t)usedSize);
+		Interleaved_Free(tri_data);
+		tri_data = pData;
+	}
+	tri_data_size = usedSize;
+}
+
+KBBox KAccelStruct::AccelLeaves::HitBBox(UINT32 leafIdx) const
+{
+	KBBox box = bbox[leafIdx];
+	if (tri_data_world && IsTriPosQuantized(leafIdx)) {
+		const float* pStep = &quant_param[leafIdx * 6 + 3];
+		for (int axis = 0; axis < 3; ++axis) {
+			box.mMin[axis] -= pStep[axis] * 0.5f;
+			box.mMax[axis] += pStep[axis] * 0.5f;
+		}
+	}
+	return box;
+}
+
+const float* KAccelStruct::AccelLeaves::GetTriPosData(UINT32 leafIdx, float* pScratch) const
+{
+	UINT32 primCnt = PrimCnt(leafIdx);
+	UINT32 paddingCnt = (primCnt + tri_data_simd - 1) / tri_data_simd * tri_data_simd;
+	UINT32 idStep = IsTriPair(leafIdx) ? 2 : 1;
+	const BYTE* pPosData = tri_data + tri_data_offset[leafIdx] + paddingCnt * idStep * sizeof(int);
+	if (!IsTriPosQuantized(leafIdx))
+		return (const float*)pPosData;
+
+	// In the swizzled layout every group of SIMD width values belongs to the same vertex component
+	const UINT16* pQuantPos = (const UINT16*)pPosData;
+	const float* pParam = &quant_param[leafIdx * 6];
+	UINT32 valueCnt = paddingCnt * PrimPosStep(leafIdx);
+	for (UINT32 j = 0; j < valueCnt; ++j) {
+		UINT32 axis = (j / tri_data_simd) % 3;
+		pScratch[j] = pParam[axis] + (float)pQuantPos[j] * pParam[axis + 3];
+	}
+	return pScratch;
+}
+
+void KAccelStruct::AccelLeaves::PairBarycentric(UINT32 leafIdx, UINT32 triId, float& u, float& v) const
+{
+	UINT32 triCnt = tri_cnt[leafIdx] & ~LEAF_ANIM_FLAG;
+	const UINT32* pTriIdx = &tri_idx[tri_offset[leafIdx]];
+	for (UINT32 i = 0; i < triCnt; ++i) {
+		if (pTriIdx[i] != triId)
+			continue;
+		BYTE order = tri_vert_order[tri_offset[leafIdx] + i];
+		float weight[3] = {1.0f - u - v, u, v};
+		u = weight[order & 0x3];
+		v = weight[(order >> 2) & 0x3];
+		return;
+	}
+}
+
+bool KAccelStruct::AccelLeaves::SaveToFile(FILE* pFile)
+{
+	if (!SaveArrayToFile(tri_offset, pFile)) return false;
+	if (!SaveArrayToFile(tri_cnt, pFile)) return false;
+	if (!SaveArrayToFile(bbox, pFile)) return false;
+	if (!SaveArrayToFile(box_norm, pFile)) return false;
+	if (!SaveArrayToFile(tri_idx, pFile)) return false;
+	return true;
+}
+
+bool KAccelStruct::AccelLeaves::LoadFromFile(FILE* pFile)
+{
+	if (!LoadArrayFromFile(tri_offset, pFile)) return false;
+	if (!LoadArrayFromFile(tri_cnt, pFile)) return false;
+	if (!LoadArrayFromFile(bbox, pFile)) return false;
+	if (!LoadArrayFromFile(box_norm, pFile)) return false;
+	if (!LoadArrayFromFile(tri_idx, pFile)) return false;
+	return (tri_offset.size() == tri_cnt.size() && bbox.size() == tri_cnt.size() && box_norm.size() == tri_cnt.size());
+}
+
+bool KAccelStruct::AccelLeaves::IsValid(UINT32 triCnt) const
+{
+	for (UINT32 i = 0; i < LeafCnt(); ++i) {
+		if ((UINT64)tri_offset[i] + (tri_cnt[i] & ~LEAF_ANIM_FLAG) > tri_idx.size())
+			return false;
+	}
+	for (size_t i = 0; i < tri_idx.size(); ++i) {
+		if (tri_idx[i] >= triCnt)
+			return false;
+	}
+	return true;
+}
+
+UINT32 KAccelStruct::AccelLeaves::AddLeaf(const KBBox& leafBBox, const UINT32* pTriIdx, UINT32 cnt, bool hasAnim)
+{
+	UINT32 leafIdx = LeafCnt();
+	tri_offset.push_back((UINT32)tri_idx.size());
+	tri_cnt.push_back(cnt | (hasAnim ? LEAF_ANIM_FLAG : 0));
+	bbox.push_back(leafBBox);
+	KBoxNormalizer norm;
+	norm.InitFromBBox(leafBBox);
+	box_norm.push_back(norm);
+	tri_idx.insert(tri_idx.end(), pTriIdx, pTriIdx + cnt);
+	return leafIdx;
+}
+
+void KAccelStruct::AccelLeaves::RefitLeaf(UINT32 leafIdx, const KBBox& leafBBox, bool hasAnim)
+{
+	tri_cnt[leafIdx] = (tri_cnt[leafIdx] & ~LEAF_ANIM_FLAG) | (hasAnim ? LEAF_ANIM_FLAG : 0);
+	bbox[leafIdx] = leafBBox;
+	box_norm[leafIdx].InitFromBBox(leafBBox);
+}
+
+UINT32 KAccelStruct_KDTree::FlattenKDNode(const KD_NodeRef& ref, bool isLeaf, std::vector<KD_FlatNode>& flatNodes)
+{
+	UINT32 flatIdx = (UINT32)flatNodes.size();
+	flatNodes.push_back(KD_FlatNode());
+
+	if (ref.idx == INVALID_INDEX) {
+		flatNodes[flatIdx].InitLeaf(INVALID_INDEX);
+	}
+	else if (isLeaf) {
+		// Leaves are numbered in depth first order too, so that the leaf payload of neighboring nodes stays close
+		const KD_LeafData& leafData = mTempDataForKD->mArenas[ref.arena]->leaves[ref.idx];
+		UINT32 leafIdx = mAccelLeaves.AddLeaf(leafData.bbox, 
+			leafData.tri_list.leaf_triangles, leafData.tri_cnt, leafData.hasAnim);
+		flatNodes[flatIdx].InitLeaf(leafIdx);
+	}
+	else {
+		const KD_Node& node = mTempDataForKD->mArenas[ref.arena]->nodes[ref.idx];
+		// The + side child(left child) is placed right after its parent
+		FlattenKDNode(node.left_child, (node.flag & eLeftChild) != 0, flatNodes);
+		UINT32 farChild = FlattenKDNode(node.right_child, (node.flag & eRightChild) != 0, flatNodes);
+		assert(farChild < (1u << (32 - eFlatChildShift)));
+		flatNodes[flatIdx].InitInner(node.flag & eSplitAxisMask, farChild, node.split_value);
+	}
+
+	return flatIdx;
+}
+
+void KAccelStruct_KDTree::FinalizeKDTree()
+{
+	// Merge the nodes and leaves built by all the workers
+	size_t leafCnt = 0;
+	size_t nodeCnt = 0;
+	for (size_t i = 0; i < mTempDataForKD->mArenas.size(); ++i) {
+		leafCnt += mTempDataForKD->mArenas[i]->leaves.size();
+		nodeCnt += mTempDataForKD->mArenas[i]->nodes.size();
+	}
+	mAccelLeaves.Clear();
+	mAccelLeaves.tri_offset.reserve(leafCnt);
+	mAccelLeaves.tri_cnt.reserve(leafCnt);
+	mAccelLeaves.bbox.reserve(leafCnt);
+	mAccelLeaves.box_norm.reserve(leafCnt);
+	mAccelLeaves.tri_idx.reserve(mTotalLeafTriCnt);
+
+	std::vector<KD_FlatNode> flatNodes;
+	flatNodes.reserve(nodeCnt * 2 + 1);
+	if (mRootNode.idx != INVALID_INDEX) 
+		FlattenKDNode(mRootNode, mRootIsLeaf, flatNodes);
+
+	if (mpFlatNode)
+		Interleaved_Free(mpFlatNode);
+	mpFlatNode = NULL;
+	mFlatNodeCnt = (UINT32)flatNodes.size();
+	if (mFlatNodeCnt > 0) {
+		// Align to cache line so that a node never spans two lines
+		// The nodes are read by the threads of all the NUMA nodes
+		mpFlatNode = (KD_FlatNode*)Interleaved_Malloc(sizeof(KD_FlatNode) * mFlatNodeCnt, 64, NUMA_INTERLEAVE != 0);
+		memcpy(mpFlatNode, &flatNodes[0], sizeof(KD_FlatNode) * mFlatNodeCnt);
+	}
+	mTraversalDepth = ComputeTraversalDepth();
+
+	// The build-time data is not needed by traversal
+	mTempDataForKD.reset();
+}
+
+bool KAccelStruct_KDTree::GetNodeLink(UINT32 nodeIdx, UINT32& link) const
+{
+	const KD_FlatNode& node = mpFlatNode[nodeIdx];
+	if (node.IsLeaf()) {
+		link = node.leaf_idx;
+		return false;
+	}
+	link = node.FarChild();
+	return true;
+}
+
+bool KAccelStruct::IsNodeLinkValid(bool allowEmptyLeaf) const
+{
+	UINT32 nodeCnt = (UINT32)GetAccelNodeCnt();
+	for (UINT32 i = 0; i < nodeCnt; ++i) {
+		UINT32 link;
+		if (!GetNodeLink(i, link)) {
+			if (link >= mAccelLeaves.LeafCnt() && (link != INVALID_INDEX || !allowEmptyLeaf))
+				return false;
+		}
+		else if (i + 1 >= nodeCnt || link <= i || link >= nodeCnt)
+			return false;
+	}
+	return true;
+}
+
+UINT32 KAccelStruct::ComputeTraversalDepth() const
+{
+	// The children always follow their parent in the depth first layout, a child that doesn't is
+	// not followed so that a broken node array can't loop forever.
+	UINT32 maxDepth = 0;
+	UINT32 nodeCnt = (UINT32)GetAccelNodeCnt();
+	std::vector<std::pair<UINT32, UINT32> > nodeStack;
+	if (nodeCnt > 0)
+		nodeStack.push_back(std::make_pair(0u, 0u));
+	while (!nodeStack.empty()) {
+		UINT32 nodeIdx = nodeStack.back().first;
+		UINT32 depth = nodeStack.back().second;
+		nodeStack.pop_back();
+		UINT32 link;
+		if (!GetNodeLink(nodeIdx, link)) {
+			maxDepth = std::max(maxDepth, depth);
+			continue;
+		}
+		UINT32 child[2] = {nodeIdx + 1, link};
+		for (int i = 0; i < 2; ++i) {
+			if (child[i] > nodeIdx && child[i] < nodeCnt)
+				nodeStack.push_back(std::make_pair(child[i], depth + 1));
+		}
+	}
+	return maxDepth;
+}
+
+bool KAccelStruct::SaveLeafData(FILE* pFile)
+{
+	if (!SaveArrayToFile(mAccelTriInst, pFile)) return false;
+	if (!SaveTypeToFile(mAccelTriCnt, pFile)) return false;
+	return mAccelLeaves.SaveToFile(pFile);
+}
+
+bool KAccelStruct::LoadLeafData(FILE* pFile)
+{
+	return LoadArrayFromFile(mAccelTriInst, pFile) &&
+		LoadTypeFromFile(mAccelTriCnt, pFile) &&
+		mAccelLeaves.LoadFromFile(pFile) &&
+		IsLoadedDataValid();
+}
+
+bool KAccelStruct::IsLoadedDataValid() const
+{
+	std::vector<KTriInstance> sceneInst;
+	UINT32 triCnt = mpSourceScene->InitAccelTriangleCache(sceneInst);
+	if (triCnt != mAccelTriCnt || sceneInst.size() != mAccelTriInst.size())
+		return false;
+	for (size_t i = 0; i < sceneInst.size(); ++i) {
+		if (sceneInst[i].node_idx != mAccelTriInst[i].node_idx || sceneInst[i].mesh_idx != mAccelTriInst[i].mesh_idx ||
+			sceneInst[i].first_tri != mAccelTriInst[i].first_tri)
+			return false;
+	}
+	if (!mAccelLeaves.IsValid(mAccelTriCnt))
+		return false;
+
+	// The animated leaves are tested with the motion data, which only the moving meshes have
+	for (UINT32 i = 0; i < mAccelLeaves.LeafCnt(); ++i) {
+		UINT32 cnt = mAccelLeaves.tri_cnt[i] & ~LEAF_ANIM_FLAG;
+		bool hasAnim = false;
+		for (UINT32 j = 0; j < cnt && !hasAnim; ++j)
+			hasAnim = mpSourceScene->IsTriPosAnimated(GetAccelTriData(mAccelLeaves.tri_idx[mAccelLeaves.tri_offset[i] + j]));
+		if (hasAnim != ((mAccelLeaves.tri_cnt[i] & LEAF_ANIM_FLAG) != 0))
+			return false;
+	}
+	return true;
+}
+
+UINT64 KAccelStruct::ComputeTopologyHash() const
+{
+	UINT64 hash = mpSourceScene->ComputeTopologyHash(HASH_SEED_FNV);
+	if (!mAccelTriInst.empty())
+		hash = HashBytes(&mAccelTriInst[0], mAccelTriInst.size() * sizeof(KTriInstance), hash);
+	return hash;
+}
+
+void KAccelStruct::BuildLeafTriData()
+{
+	mAccelLeaves.BuildTriData(mpSourceScene, mAccelTriInst, (UINT32)KSC_GetSIMDWidth(), LEAF_TRI_QUANTIZE != 0, WATERTIGHT_TRI_TEST != 0, LEAF_TRI_PAIR != 0);
+	// A skipped triangle has been tested with the data of another leaf, which must be the same as its own,
+	// or the edges it shares could open up. The normalized positions differ in each leaf, the world space
+	// ones are the same, quantized too since all the leaves share the lattice.
+	mUseMailbox = LEAF_MAILBOX != 0 && mAccelLeaves.tri_idx.size() > mAccelTriCnt && mAccelLeaves.tri_data_world;
+}
+
+int KAccelStruct::PrepareLeafTriData(UINT32 idx, TracingInstance* inst, bool useMailbox, const float*& pTriData, const int*& pTriIdData) const
+{
+	UINT32 W = (UINT32)inst->mSIMD_Width;
+	UINT32 leafTriCnt = mAccelLeaves.tri_cnt[idx] & ~LEAF_ANIM_FLAG;
+	UINT32 leafPrimCnt = mAccelLeaves.PrimCnt(idx);
+	UINT32 blockCnt = (leafPrimCnt + W - 1) / W;
+	UINT32 idStep = mAccelLeaves.IsTriPair(idx) ? 2 : 1;
+	UINT32 posStep = mAccelLeaves.PrimPosStep(idx);
+	pTriIdData = mAccelLeaves.GetTriIdData(idx);
+
+	// Find the primitives holding a triangle the ray hasn't tested, the lone triangle of a pair has an invalid mate
+	UINT32 testPrimCnt = leafPrimCnt;
+	UINT32 testTriCnt = leafTriCnt;
+	std::vector<UINT32>& testPrim = inst->mMailboxPrim;
+	if (useMailbox) {
+		testPrim.clear();
+		testTriCnt = 0;
+		for (UINT32 p = 0; p < leafPrimCnt; ++p) {
+			const int* pId = pTriIdData + p / W * W * idStep + p % W;
+			UINT32 validCnt = 0;
+			bool tested = true;
+			for (UINT32 k = 0; k < idStep; ++k) {
+				UINT32 triIdx = (UINT32)pId[k * W];
+				if (triIdx == INVALID_INDEX)
+					continue;
+				++validCnt;
+				if (!inst->IsTriInMailbox(triIdx)) {
+					inst->AddTriToMailbox(triIdx);
+					tested = false;
+				}
+			}
+			if (!tested) {
+				testPrim.push_back(p);
+				testTriCnt += validCnt;
+			}
+		}
+		testPrimCnt = (UINT32)testPrim.size();
+		if (testPrimCnt == 0) {
+			inst->mMailboxSkipCnt += leafTriCnt;
+			return 0;
+		}
+	}
+
+	// The quantized positions are decoded into the scratch, the gathered primitives go after them
+	UINT32 testBlockCnt = (testPrimCnt + W - 1) / W;
+	bool gather = testBlockCnt < blockCnt;
+	UINT32 decodeSize = mAccelLeaves.IsTriPosQuantized(idx) ? blockCnt * W * posStep : 0;
+	float* pScratch = NULL;
+	if (decodeSize > 0 || gather)
+		pScratch = inst->AcquireTriPosScratch(decodeSize + (gather ? testBlockCnt * W * (posStep + idStep) : 0));
+	pTriData = mAccelLeaves.GetTriPosData(idx, pScratch);
+	if (!gather) {
+		inst->mLeafTriTestCnt += leafTriCnt;
+		return (int)blockCnt;
+	}
+
+	// Only the SIMD blocks saved are worth the copy, the last block is padded with its last primitive as SwizzleForSIMD does
+	float* pDestPos = pScratch + decodeSize;
+	int* pDestId = (int*)(pDestPos + testBlockCnt * W * posStep);
+	for (UINT32 q = 0; q < testBlockCnt * W; ++q) {
+		UINT32 p = testPrim[q < testPrimCnt ? q : testPrimCnt - 1];
+		const float* pSrcPos = pTriData + p / W * W * posStep + p % W;
+		const int* pSrcId = pTriIdData + p / W * W * idStep + p % W;
+		float* pPos = pDestPos + q / W * W * posStep + q % W;
+		int* pId = pDestId + q / W * W * idStep + q % W;
+		for (UINT32 c = 0; c < posStep; ++c)
+			pPos[c * W] = pSrcPos[c * W];
+		for (UINT32 k = 0; k < idStep; ++k)
+			pId[k * W] = pSrcId[k * W];
+	}
+	pTriData = pDestPos;
+	pTriIdData = pDestId;
+	inst->mLeafTriTestCnt += testTriCnt;
+	inst->mMailboxSkipCnt += leafTriCnt - testTriCnt;
+	return (int)testBlockCnt;
+}
+
+bool KAccelStruct::IntersectLeaf(UINT32 idx, const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool useMailbox) const
+{
+	KBBox leafBBox = mAccelLeaves.HitBBox(idx);
+	const KBoxNormalizer& leafBoxNorm = mAccelLeaves.box_norm[idx];
+	bool leafHasAnim = (mAccelLeaves.tri_cnt[idx] & LEAF_ANIM_FLAG) != 0;
 	bool ret = false;
 
-	double t0 = 0, t1 = FLT_MAX;
-	if (!IntersectBBox(ray, leafData.bbox, t0, t1))
+	float t0 = 0, t1 = FLT_MAX;
+	if (!IntersectBBox(ray, leafBBox, t0, t1))
 		return false;
 	if (t0 < 0) t0 = 0;
 	if (t0 > ctx.ray_t)
 		return false; // ok, the required distance is reached
 
 	// we need to make sure the hit point is inside this node's bounding box
-	// t1 is the possible furthest point
+	// t1 is the possible furthest point, the skipped triangles may have been hit beyond it though
 	double old_t = ctx.ray_t;
-	ctx.ray_t = (old_t < t1 ? old_t : t1);
-
-	KVec3 tempRayOrg = ToVec3f(ray.GetOrg() + ray.GetDir() * t0);
-	KVec3 tempRayDir = ToVec3f(ray.mNormDir);
-	leafData.box_norm.ApplyToRay(tempRayOrg, tempRayDir);
-
-	double tScale = ray.mDirLen * leafData.box_norm.mRcpScaleLen;
-
-#if 0
-	for (UINT32 i = 0; i < leafData.tri_cnt; ++i) {
-		UINT32 tri_idx = leafData.tri_list.leaf_triangles[i];
-		KTriVertPos2 triPos;
-		mpSourceScene->GetAccelTriPos(mAccelTriangle[tri_idx], triPos, &leafData.box_norm);
-		RayIntersect((const float*)&tempRayOrg, (const float*)&tempRayDir, triPos, inst->mCameraContext.inMotionTime, inst->mTmpRayTriIntsct[i]);
-	}
-#else
-
-	UINT32 triStep = leafData.hasAnim ? 18 : 9;
-	int SIMD_tri_cnt = leafData.tri_cnt / inst->mSIMD_Width;
-	if (leafData.tri_cnt % inst->mSIMD_Width != 0)
-		++SIMD_tri_cnt;
-
-	bool needUpdate = true;
-	UINT64 leafId = ((UINT64)inst->mCurBVHIndex << 32) + idx;
-	UINT32 triPosDataSize = leafData.tri_cnt *sizeof(float) * triStep;
-	UINT32 triIdDataSize = leafData.tri_cnt * sizeof(int);
-	UINT32 totalDataSize = triPosDataSize + triIdDataSize;
-	UINT32 paddingTriPosSize = SIMD_tri_cnt * inst->mSIMD_Width * sizeof(float) * triStep;;
-	UINT32 paddingTriIdSize = SIMD_tri_cnt * inst->mSIMD_Width * sizeof(int);
-	BYTE* pSwizzledTriData = (BYTE*)inst->mCachedTriPosData.LRU_OpenEntry(leafId, paddingTriPosSize + paddingTriIdSize, needUpdate);
-	int* pSwizzledTriIdData = (int*)(pSwizzledTriData + paddingTriPosSize);
-	
-
-	if (needUpdate) {
-		if (inst->mTmpTriDataArray.size() < totalDataSize)
-			inst->mTmpTriDataArray.resize(totalDataSize);
-		BYTE* pCachedTriData = &inst->mTmpTriDataArray[0];
-		float* pCachedTriPosData = (float*)pCachedTriData;
-		int* pCacheTriIdData = (int*)(pCachedTriData + triPosDataSize);
+	ctx.ray_t = ((old_t < t1 || useMailbox) ? old_t : t1);
+
+	// World space triangles are tested with the original ray so that every leaf sees the same ray
+	bool worldSpace = mAccelLeaves.tri_data_world;
+	float tOffset = worldSpace ? 0 : t0;
+	KVec3 tempRayOrg = worldSpace ? ray.GetOrgF() : ray.GetOrgF() + ray.GetDirF() * t0;
+	KVec3 tempRayDir = worldSpace ? ray.GetDirF() : ray.mNormDir;
+	if (!worldSpace)
+		leafBoxNorm.ApplyToRay(tempRayOrg, tempRayDir);
+
+	float tScale = worldSpace ? 1.0f : ray.mDirLen * leafBoxNorm.mRcpScaleLen;
+
+	// The triangle data is prebuilt by BuildLeafTriData and shared by all the threads
+	assert(mAccelLeaves.tri_data_simd == (UINT32)inst->mSIMD_Width);
+	bool leafIsPair = mAccelLeaves.IsTriPair(idx);
+	const float* pSwizzledTriData = NULL;
+	const int* pSwizzledTriIdData = NULL;
+	int SIMD_tri_cnt = PrepareLeafTriData(idx, inst, useMailbox, pSwizzledTriData, pSwizzledTriIdData);
+	if (SIMD_tri_cnt == 0) {
+		ctx.ray_t = old_t;
+		return false;
+	}
 
-		float* pCurTriData = pCachedTriPosData;
-		for (UINT32 i = 0; i < leafData.tri_cnt; ++i) {
-			UINT32 tri_idx = leafData.tri_list.leaf_triangles[i];
-			mpSourceScene->GetTriPosData(mAccelTriangle[tri_idx], leafData.hasAnim, pCurTriData, &leafData.box_norm);
-			pCurTriData += triStep;
-			pCacheTriIdData[i] = (int)tri_idx;
+	if (worldSpace) {
+		RayShear shear;
+		shear.Init((const float*)&tempRayDir);
+		if (leafIsPair) {
+			s_pPFN_RayIntersectStaticPairArrayWT(
+				(const float*)&tempRayOrg, shear.s, shear.kx, shear.ky, shear.kz, 
+				pSwizzledTriData, pSwizzledTriIdData, 
+				inst->mpTUV_SIMD, inst->mpHitIdx_SIMD, 
+				SIMD_tri_cnt, (int)ray.mExcludeTriID);
+		}
+		else if (leafHasAnim) {
+			s_pPFN_RayIntersectAnimTriArrayWT(
+				(const float*)&tempRayOrg, shear.s, shear.kx, shear.ky, shear.kz, 
+				inst->mCameraContext.inMotionTime, 
+				pSwizzledTriData, pSwizzledTriIdData, 
+				inst->mpTUV_SIMD, inst->mpHitIdx_SIMD, 
+				SIMD_tri_cnt, (int)ray.mExcludeTriID);
+		}
+		else {
+			s_pPFN_RayIntersectStaticTriArrayWT(
+				(const float*)&tempRayOrg, shear.s, shear.kx, shear.ky, shear.kz, 
+				pSwizzledTriData, pSwizzledTriIdData, 
+				inst->mpTUV_SIMD, inst->mpHitIdx_SIMD, 
+				SIMD_tri_cnt, (int)ray.mExcludeTriID);
 		}
-
-		SwizzleForSIMD(pCachedTriData, pSwizzledTriData, inst->mSIMD_Width, sizeof(float), triStep*sizeof(float), leafData.tri_cnt);
-		SwizzleForSIMD(pCacheTriIdData, pSwizzledTriIdData, inst->mSIMD_Width, sizeof(int), sizeof(int), leafData.tri_cnt);
 	}
-
-	if (leafData.hasAnim) {
+	else if (leafIsPair) {
+		s_pPFN_RayIntersectStaticPairArray(
+			(const float*)&tempRayOrg, (const float*)&tempRayDir, 
+			pSwizzledTriData, pSwizzledTriIdData, 
+			inst->mpTUV_SIMD, inst->mpHitIdx_SIMD, 
+			SIMD_tri_cnt, (int)ray.mExcludeTriID);
+	}
+	else if (leafHasAnim) {
 		s_pPFN_RayIntersectAnimTriArray(
 			(const float*)&tempRayOrg, (const float*)&tempRayDir, 
 			inst->mCameraContext.inMotionTime, 
-			(float*)pSwizzledTriData, pSwizzledTriIdData, 
+			pSwizzledTriData, pSwizzledTriIdData, 
 			inst->mpTUV_SIMD, inst->mpHitIdx_SIMD, 
 			SIMD_tri_cnt, (int)ray.mExcludeTriID);
 	}
 	else {
 		s_pPFN_RayIntersectStaticTriArray(
 			(const float*)&tempRayOrg, (const float*)&tempRayDir, 
-			(float*)pSwizzledTriData, pSwizzledTriIdData, 
+			pSwizzledTriData, pSwizzledTriIdData, 
 			inst->mpTUV_SIMD, inst->mpHitIdx_SIMD, 
 			SIMD_tri_cnt, (int)ray.mExcludeTriID);
 	}
 
-#endif
-	double min_ray_t = (ctx.ray_t - t0) * tScale;
+	// The kernel leaves FLT_MAX in the lanes without hit, the unclamped distance may not fit in a float
+	double normRayT = (ctx.ray_t - tOffset) * tScale;
+	float min_ray_t = normRayT < FLT_MAX ? float(normRayT) : FLT_MAX;
 	int min_idx = INVALID_INDEX;
 	for (int i = 0; i < inst->mSIMD_Width; ++i) {
 		if (inst->mpTUV_SIMD[i] < min_ray_t) {
@@ -590,91 +1178,346 @@ bool KAccelStruct_KDTree::IntersectLeaf(UINT32 idx, const KRay& ray, TracingInst
 
 	// If no triangle get hit, then I should restore it back.
 	if (ret) {
-		ctx.ray_t = t0 + min_ray_t / tScale;
+		ctx.ray_t = tOffset + min_ray_t / tScale;
 		ctx.u = inst->mpTUV_SIMD[inst->mSIMD_Width + min_idx];
 		ctx.v = inst->mpTUV_SIMD[inst->mSIMD_Width*2 + min_idx];
-		ctx.w = 1.0f - ctx.u - ctx.v;
 		ctx.tri_id = inst->mpHitIdx_SIMD[min_idx];
+		if (leafIsPair)
+			mAccelLeaves.PairBarycentric(idx, ctx.tri_id, ctx.u, ctx.v);
+		ctx.w = 1.0f - ctx.u - ctx.v;
 		ctx.kd_leaf_idx = idx;
 	}
-	else { 
-		ctx.walkVec = ToVec3f(ray.GetOrg() + ray.GetDir() * t1);
+	else 
 		ctx.ray_t = old_t;
-	}
 
 	return ret;
 }
 
-bool KAccelStruct_KDTree::IntersectNode(UINT32 idx, const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const
+bool KAccelStruct::OccludeLeaf(UINT32 idx, const KRay& ray, TracingInstance* inst, double max_t, bool useMailbox) const
 {
-	double t0 = 0, t1 = FLT_MAX;
-	const KD_Node_NoBBox& node = *(const KD_Node_NoBBox*)&mSceneNode[idx];
-	UINT32 det_axis = node.flag & eSplitAxisMask;
+	bool leafHasAnim = (mAccelLeaves.tri_cnt[idx] & LEAF_ANIM_FLAG) != 0;
 
-	if (!(node.flag & eNoBBox)) {
-		const KBBox* pNodeBBox = (const KBBox*)&mSceneNode[idx + sizeof(KD_Node_NoBBox)];
-		if (!IntersectBBox(ray, *pNodeBBox, t0, t1))
-			return false;
-	}
+	float t0 = 0, t1 = FLT_MAX;
+	if (!IntersectBBox(ray, mAccelLeaves.HitBBox(idx), t0, t1))
+		return false;
+	if (t0 < 0) t0 = 0;
+	if (t0 >= max_t)
+		return false;
+	// Any hit before max_t occludes, the box only limits it for the triangles tested again in the next leaves
+	if (t1 > max_t || useMailbox) t1 = (float)max_t;
+
+	bool worldSpace = mAccelLeaves.tri_data_world;
+	const KBoxNormalizer& leafBoxNorm = mAccelLeaves.box_norm[idx];
+	KVec3 tempRayOrg = worldSpace ? ray.GetOrgF() : ray.GetOrgF() + ray.GetDirF() * t0;
+	KVec3 tempRayDir = worldSpace ? ray.GetDirF() : ray.mNormDir;
+	if (!worldSpace)
+		leafBoxNorm.ApplyToRay(tempRayOrg, tempRayDir);
+	float maxNormT = worldSpace ? t1 : (t1 - t0) * ray.mDirLen * leafBoxNorm.mRcpScaleLen;
+
+	bool leafIsPair = mAccelLeaves.IsTriPair(idx);
+	const float* pSwizzledTriData = NULL;
+	const int* pSwizzledTriIdData = NULL;
+	int SIMD_tri_cnt = PrepareLeafTriData(idx, inst, useMailbox, pSwizzledTriData, pSwizzledTriIdData);
+	if (SIMD_tri_cnt == 0)
+		return false;
 
-	if (t0 > ctx.ray_t)
-		return false; // ok, the required distance is reached
-		
-	UINT32 next_node0 = INVALID_INDEX;
-	UINT32 next_node1 = INVALID_INDEX;
-	UINT32 child_flag0;
-	UINT32 child_flag1;
-	float det_sign = 1.0f;
-	if (ctx.walkVec[det_axis] >= node.split_value) {
-		next_node0 = node.left_child;
-		child_flag0 = (node.flag & eLeftChild);		
-		if (ray.mSign[det_axis]) {
-			next_node1 = node.right_child;
-			child_flag1 = (node.flag & eRightChild);
+	if (worldSpace) {
+		RayShear shear;
+		shear.Init((const float*)&tempRayDir);
+		if (leafIsPair) {
+			s_pPFN_RayOccludeStaticPairArrayWT(
+				(const float*)&tempRayOrg, shear.s, shear.kx, shear.ky, shear.kz, 
+				maxNormT, 
+				pSwizzledTriData, pSwizzledTriIdData, 
+				inst->mpTUV_SIMD, SIMD_tri_cnt, (int)ray.mExcludeTriID);
 		}
+		else if (leafHasAnim) {
+			s_pPFN_RayOccludeAnimTriArrayWT(
+				(const float*)&tempRayOrg, shear.s, shear.kx, shear.ky, shear.kz, 
+				inst->mCameraContext.inMotionTime, maxNormT, 
+				pSwizzledTriData, pSwizzledTriIdData, 
+				inst->mpTUV_SIMD, SIMD_tri_cnt, (int)ray.mExcludeTriID);
+		}
+		else {
+			s_pPFN_RayOccludeStaticTriArrayWT(
+				(const float*)&tempRayOrg, shear.s, shear.kx, shear.ky, shear.kz, 
+				maxNormT, 
+				pSwizzledTriData, pSwizzledTriIdData, 
+				inst->mpTUV_SIMD, SIMD_tri_cnt, (int)ray.mExcludeTriID);
+		}
+	}
+	else if (leafIsPair) {
+		s_pPFN_RayOccludeStaticPairArray(
+			(const float*)&tempRayOrg, (const float*)&tempRayDir, 
+			maxNormT, 
+			pSwizzledTriData, pSwizzledTriIdData, 
+			inst->mpTUV_SIMD, SIMD_tri_cnt, (int)ray.mExcludeTriID);
+	}
+	else if (leafHasAnim) {
+		s_pPFN_RayOccludeAnimTriArray(
+			(const float*)&tempRayOrg, (const float*)&tempRayDir, 
+			inst->mCameraContext.inMotionTime, maxNormT, 
+			pSwizzledTriData, pSwizzledTriIdData, 
+			inst->mpTUV_SIMD, SIMD_tri_cnt, (int)ray.mExcludeTriID);
 	}
 	else {
-		det_sign = -1.0f;
-		child_flag0 = (node.flag & eRightChild);
-		next_node0 = node.right_child;
-		if (!ray.mSign[det_axis]) {
-			next_node1 = node.left_child;
-			child_flag1 = (node.flag & eLeftChild);
-		}
+		s_pPFN_RayOccludeStaticTriArray(
+			(const float*)&tempRayOrg, (const float*)&tempRayDir, 
+			maxNormT, 
+			pSwizzledTriData, pSwizzledTriIdData, 
+			inst->mpTUV_SIMD, SIMD_tri_cnt, (int)ray.mExcludeTriID);
 	}
 
-	if (next_node0 != INVALID_INDEX) {
-		if (child_flag0) {
-			if (IntersectLeaf(next_node0, ray, inst, ctx))
-				return true;
-		}
-		else if (IntersectNode(next_node0, ray, inst, ctx)) {
+	for (int i = 0; i < inst->mSIMD_Width; ++i) {
+		if (inst->mpTUV_SIMD[i] < maxNormT)
 			return true;
+	}
+	return false;
+}
+
+UINT32 KAccelStruct::IntersectPacket(KRayPacket& packet, UINT32 rayMask, TracingInstance* inst) const
+{
+	UINT32 hitMask = 0;
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		if (!(rayMask & (1 << i)))
+			continue;
+		inst->mCameraContext.inMotionTime = packet.motion_time[i];
+		if (IntersectRay_KDTree(packet.rays[i], inst, packet.ctx[i]))
+			hitMask |= (1 << i);
+	}
+	return hitMask;
+}
+
+UINT32 KAccelStruct_KDTree::IntersectPacket(KRayPacket& packet, UINT32 rayMask, TracingInstance* inst) const
+{
+	if (mFlatNodeCnt == 0)
+		return 0;
+
+	// The rays visit the children in the same order only if they share the origin and the direction signs,
+	// e.g. the primary rays of a pinhole camera. Otherwise they are traced one by one.
+	int firstRay = -1;
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		if (!(rayMask & (1 << i)))
+			continue;
+		if (firstRay < 0) {
+			firstRay = (int)i;
+			continue;
 		}
+		const KRay& ray0 = packet.rays[firstRay];
+		const KRay& ray = packet.rays[i];
+		if (ray.GetOrgF() != ray0.GetOrgF() || ray.mSign[0] != ray0.mSign[0] || 
+			ray.mSign[1] != ray0.mSign[1] || ray.mSign[2] != ray0.mSign[2])
+			return KAccelStruct::IntersectPacket(packet, rayMask, inst);
+	}
+	if (firstRay < 0)
+		return 0;
+
+	float t_min[MAX_RAY_PACKET_SIZE], t_max[MAX_RAY_PACKET_SIZE];
+	UINT32 activeMask = 0;
+	for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+		if (!(rayMask & (1 << i)))
+			continue;
+		t_min[i] = 0; t_max[i] = FLT_MAX;
+		if (!IntersectBBox(packet.rays[i], mSceneBBox, t_min[i], t_max[i]) || t_max[i] < 0)
+			continue;
+		if (t_min[i] < 0) t_min[i] = 0;
+		activeMask |= (1 << i);
 	}
 
-	
-	if (next_node1 != INVALID_INDEX) {
-		if (child_flag1)
-			return IntersectLeaf(next_node1, ray, inst, ctx);
-		else
-			return IntersectNode(next_node1, ray, inst, ctx);
+	const KRay& sharedRay = packet.rays[firstRay];
+	const KVec3& rayOrg = sharedRay.GetOrgF();
+	KDPacketTraversalEntry* pStack = &inst->mKDPacketStack[0];
+	UINT32 stackTop = 0;
+	UINT32 nodeIdx = 0;
+	UINT32 hitMask = 0;
+
+	while (1) {
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			if ((activeMask & (1 << i)) && t_min[i] > packet.ctx[i].ray_t)
+				activeMask &= ~(1 << i);
+		}
+
+		if (activeMask) {
+			const KD_FlatNode& node = mpFlatNode[nodeIdx];
+			if (!node.IsLeaf()) {
+				UINT32 axis = node.SplitAxis();
+				UINT32 nearChild, farChild;
+				bool plusFirst = (rayOrg[axis] > node.split_value) || 
+					(rayOrg[axis] == node.split_value && !sharedRay.mSign[axis]);
+				if (plusFirst) {
+					nearChild = nodeIdx + 1;
+					farChild = node.FarChild();
+				}
+				else {
+					nearChild = node.FarChild();
+					farChild = nodeIdx + 1;
+				}
+
+				// Same as the single ray traversal, but the far intervals are collected into the stack entry
+				assert(stackTop < inst->mKDPacketStack.size());
+				KDPacketTraversalEntry& farEntry = pStack[stackTop];
+				UINT32 nearMask = 0, farMask = 0;
+				for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+					if (!(activeMask & (1 << i)))
+						continue;
+					const KRay& ray = packet.rays[i];
+					float t_split = (ray.GetDirF()[axis] != 0) ? 
+						(node.split_value - rayOrg[axis]) * ray.mRcpDir[axis] : FLT_MAX;
+					if (t_split > t_max[i] || t_split <= 0)
+						nearMask |= (1 << i);
+					else if (t_split < t_min[i]) {
+						farMask |= (1 << i);
+						farEntry.t_min[i] = t_min[i];
+						farEntry.t_max[i] = t_max[i];
+					}
+					else {
+						nearMask |= (1 << i);
+						farMask |= (1 << i);
+						farEntry.t_min[i] = t_split;
+						farEntry.t_max[i] = t_max[i];
+						t_max[i] = t_split;
+					}
+				}
+
+				if (nearMask == 0) {
+					nodeIdx = farChild;
+					activeMask = farMask;
+				}
+				else {
+					if (farMask) {
+						farEntry.node_idx = farChild;
+						farEntry.ray_mask = farMask;
+						++stackTop;
+					}
+					nodeIdx = nearChild;
+					activeMask = nearMask;
+				}
+				continue;
+			}
+
+			// The first leaf hit of a ray is its closest one, see Traverse. The rays of the packet visit
+			// the leaves interleaved, so they can't share the mailbox.
+			if (node.leaf_idx != INVALID_INDEX) {
+				for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+					if (!(activeMask & (1 << i)))
+						continue;
+					inst->mCameraContext.inMotionTime = packet.motion_time[i];
+					if (IntersectLeaf(node.leaf_idx, packet.rays[i], inst, packet.ctx[i], false))
+						hitMask |= (1 << i);
+				}
+			}
+		}
+
+		activeMask = 0;
+		while (stackTop > 0 && activeMask == 0) {
+			--stackTop;
+			activeMask = pStack[stackTop].ray_mask & ~hitMask;
+		}
+		if (activeMask == 0)
+			break;
+		nodeIdx = pStack[stackTop].node_idx;
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			if (activeMask & (1 << i)) {
+				t_min[i] = pStack[stackTop].t_min[i];
+				t_max[i] = pStack[stackTop].t_max[i];
+			}
+		}
 	}
 
-	return false;
+	return hitMask;
 }
 
 bool KAccelStruct_KDTree::IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const
 {
-	ctx.walkVec = ray.GetOrg();
-	if (mRootNode != INVALID_INDEX) {
-		if (!mSceneNode.empty())
-			return IntersectNode(mRootNode, ray, inst, ctx);
-		else
-			return IntersectLeaf(mRootNode, ray, inst, ctx);
-	}
-	else
+	return Traverse(ray, inst, ctx, false);
+}
+
+bool KAccelStruct_KDTree::IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const
+{
+	IntersectContext ctx;
+	ctx.ray_t = max_t;
+	return Traverse(ray, inst, ctx, true);
+}
+
+bool KAccelStruct_KDTree::Traverse(const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool anyHit) const
+{
+	if (mFlatNodeCnt == 0)
+		return false;
+
+	float t_min = 0, t_max = FLT_MAX;
+	if (!IntersectBBox(ray, mSceneBBox, t_min, t_max) || t_max < 0)
 		return false;
+	if (t_min < 0) t_min = 0;
+
+	const KVec3& rayOrg = ray.GetOrgF();
+	const KVec3& rayDir = ray.GetDirF();
+	KDTraversalEntry* pStack = &inst->mKDStack[0];
+	UINT32 stackTop = 0;
+	UINT32 nodeIdx = 0;
+	bool ret = false;
+	if (mUseMailbox)
+		inst->BeginMailboxRay();
+
+	while (1) {
+		// The hit found so far is closer than anything left in this interval
+		if (t_min > ctx.ray_t)
+			return ret;
+
+		const KD_FlatNode& node = mpFlatNode[nodeIdx];
+		if (!node.IsLeaf()) {
+			UINT32 axis = node.SplitAxis();
+			UINT32 nearChild, farChild;
+			bool plusFirst = (rayOrg[axis] > node.split_value) || 
+				(rayOrg[axis] == node.split_value && !ray.mSign[axis]);
+			if (plusFirst) {
+				nearChild = nodeIdx + 1;
+				farChild = node.FarChild();
+			}
+			else {
+				nearChild = node.FarChild();
+				farChild = nodeIdx + 1;
+			}
+
+			float t_split = (rayDir[axis] != 0) ? 
+				(node.split_value - rayOrg[axis]) * ray.mRcpDir[axis] : FLT_MAX;
+			if (t_split > t_max || t_split <= 0)
+				nodeIdx = nearChild;
+			else if (t_split < t_min)
+				nodeIdx = farChild;
+			else {
+				assert(stackTop < inst->mKDStack.size());
+				pStack[stackTop].node_idx = farChild;
+				pStack[stackTop].t_min = t_split;
+				pStack[stackTop].t_max = t_max;
+				++stackTop;
+				nodeIdx = nearChild;
+				t_max = t_split;
+			}
+			continue;
+		}
+
+		// The leaf's triangles are clipped by its bounding box, which lies inside the node's cell,
+		// so the first hit found in front-to-back order is the closest one. With the mailbox the hit
+		// may lie in a later cell, where a triangle not tested yet can still be closer.
+		if (node.leaf_idx != INVALID_INDEX) {
+			if (anyHit) {
+				if (OccludeLeaf(node.leaf_idx, ray, inst, ctx.ray_t, mUseMailbox))
+					return true;
+			}
+			else if (IntersectLeaf(node.leaf_idx, ray, inst, ctx, mUseMailbox)) {
+				ret = true;
+				if (ctx.ray_t <= t_max)
+					return true;
+			}
+		}
+
+		if (stackTop == 0)
+			return ret;
+		--stackTop;
+		nodeIdx = pStack[stackTop].node_idx;
+		t_min = pStack[stackTop].t_min;
+		t_max = pStack[stackTop].t_max;
+	}
 }
 
 
@@ -688,17 +1531,26 @@ void KAccelStruct_KDTree::ResetScene()
 	mNodeSplitThreshhold = 0.6f;
 	mLeafTriCnt = UINT32((float)LEAF_TRIANGLE_CNT * sqrt((float)KSC_GetSIMDWidth()));
 	mMaxDepth = MAX_KD_DEPTH;
-	mRootNode = INVALID_INDEX;
-
-	mLeafIdxMemPool.Reset();
-
-	mKDLeafData.clear();
-	mSceneNode.clear();
-}
-
-const KTriDesc* KAccelStruct::GetAccelTriData(UINT32 tri_idx) const
-{
-	return &mAccelTriangle[tri_idx];
+	mRootNode.arena = 0;
+	mRootNode.idx = INVALID_INDEX;
+	mRootIsLeaf = false;
+
+	mBuildMode = (BuildMode)KD_BUILD_MODE;
+	mSAHParam.traversal_cost = SAH_TRAVERSAL_COST;
+	mSAHParam.intersect_cost = SAH_INTERSECT_COST;
+	mSAHParam.pair_intersect_cost = LEAF_TRI_PAIR ? SAH_PAIR_INTERSECT_COST : 0;
+	mSAHParam.simd_width = (UINT32)KSC_GetSIMDWidth();
+	mSAHParam.bin_cnt = SAH_BIN_CNT;
+	mClipTriBBox = (SPATIAL_SPLIT != 0);
+
+	mTempDataForKD.reset();
+
+	if (mpFlatNode)
+		Interleaved_Free(mpFlatNode);
+	mpFlatNode = NULL;
+	mFlatNodeCnt = 0;
+	mTraversalDepth = 0;
+	mAccelLeaves.Clear();
 }
 
 void KAccelStruct_KDTree::GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_accel) const
@@ -707,56 +1559,80 @@ void KAccelStruct_KDTree::GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_a
 	gen_accel = m_buildAccelTriTime;
 }
 
-KAccelStruct_KDTree::DATA_FOR_KD_BUILD::DATA_FOR_KD_BUILD() 
+bool KAccelStruct_KDTree::SaveToFile(FILE* pFile)
 {
-	mNodeAddingCS = 0; 
-	mLeafAddingCS = 0; 
-	mActiveSplitThreadCnt = 1;	 // the main thread counts for one.
-
-	UINT32 cnt = GetConfigedThreadCount();
-	mCPUCnt = cnt;
-	mSplitThreadTriArrayLevel.resize(cnt + 1);
-	mPigeonHoles.resize(cnt + 1);
-	for (size_t i = 0; i < mSplitThreadTriArrayLevel.size(); ++i) {
-		mSplitThreadTriArrayLevel[i].resize(MAX_KD_DEPTH);
-	}
+	if (!SaveTypeToFile(mSceneBBox, pFile)) return false;
+	if (!SaveTypeToFile(mSceneEpsilon, pFile)) return false;
+	if (!SaveTypeToFile(mTotalLeafTriCnt, pFile)) return false;
+	if (!SaveTypeToFile(mFlatNodeCnt, pFile)) return false;
+	if (mFlatNodeCnt > 0 && mFlatNodeCnt != fwrite(mpFlatNode, sizeof(KD_FlatNode), mFlatNodeCnt, pFile))
+		return false;
+	return SaveLeafData(pFile);
+}
 
-	if (cnt > 1) {
-		mThreadLimit = 0;
+bool KAccelStruct_KDTree::LoadFromFile(FILE* pFile)
+{
+	ResetScene();
+	KTimer stop_watch(true);
 
-		while (cnt >= 4) {
-			++mThreadLimit;
-			cnt >>= 1;
+	bool ret = false;
+	do {
+		if (!LoadTypeFromFile(mSceneBBox, pFile)) break;
+		if (!LoadTypeFromFile(mSceneEpsilon, pFile)) break;
+		if (!LoadTypeFromFile(mTotalLeafTriCnt, pFile)) break;
+		if (!LoadTypeFromFile(mFlatNodeCnt, pFile)) break;
+		if (mFlatNodeCnt > GetFileBytesLeft(pFile) / sizeof(KD_FlatNode)) break;
+		if (mFlatNodeCnt > 0) {
+			mpFlatNode = (KD_FlatNode*)Interleaved_Malloc(mFlatNodeCnt * sizeof(KD_FlatNode), 64, NUMA_INTERLEAVE != 0);
+			if (mFlatNodeCnt != fread(mpFlatNode, sizeof(KD_FlatNode), mFlatNodeCnt, pFile))
+				break;
 		}
-		mSplitTasks.resize(mCPUCnt);
-		mThreadPool.reset(new ThreadModel::ThreadPool(mCPUCnt));
-		mThreadBucket.reset(new ThreadModel::ThreadBucket(mCPUCnt));
-		
-		for (UINT32 i = 0; i < mCPUCnt; ++i)
-			mThreadPool->SetThreadTask(i, &mSplitTasks[i]);
-	}
-	else {
-		mThreadLimit = -1;	// Should use single thread
+		if (!LoadLeafData(pFile) || !IsNodeLinkValid(true)) break;
+		mTraversalDepth = ComputeTraversalDepth();
+		BuildLeafTriData();
+		ret = true;
+	} while (0);
+
+	if (!ret) {
+		ResetScene();
+		mAccelTriInst.clear();
+		mAccelTriCnt = 0;
 	}
+	m_kdBuildTime = DWORD(stop_watch.Stop() * 1000.0);
+	m_buildAccelTriTime = 0;
+	return ret;
 }
 
-KAccelStruct_KDTree::DATA_FOR_KD_BUILD::~DATA_FOR_KD_BUILD() 
+KAccelStruct_KDTree::DATA_FOR_KD_BUILD::DATA_FOR_KD_BUILD() 
 {
+	UINT32 cnt = GetConfigedThreadCount();
+	if (cnt == 0)
+		cnt = 1;
+	mWorkerPool = ThreadModel::WorkStealingPool::GetShared(cnt);
+	mArenas.resize(cnt);
+	for (UINT32 i = 0; i < cnt; ++i) {
+		mArenas[i] = new BuildArena;
+		mArenas[i]->tri_idx_level.resize(MAX_KD_DEPTH + 1);
+		mArenas[i]->nest_level = 0;
+		mArenas[i]->leaf_tri_cnt = 0;
+		mArenas[i]->perfect_split_cnt = 0;
+	}
 }
 
-void KAccelStruct_KDTree::DATA_FOR_KD_BUILD::NotifySplitThreadAdded()
+KAccelStruct_KDTree::DATA_FOR_KD_BUILD::~DATA_FOR_KD_BUILD() 
 {
-	atomic_increment(&mActiveSplitThreadCnt);
+	for (size_t i = 0; i < mArenas.size(); ++i)
+		delete mArenas[i];
 }
 
-void KAccelStruct_KDTree::DATA_FOR_KD_BUILD::NotifySplitThreadComplete(UINT32 thread_idx)
+UINT32* KAccelStruct_KDTree::DATA_FOR_KD_BUILD::AcquireTempTriIdxBuf(UINT32 worker_idx, UINT32 level, UINT32 cnt)
 {
-	atomic_decrement(&mActiveSplitThreadCnt);
-}
+	// The nesting level can exceed the tree depth when a waiting worker runs stolen tasks
+	std::deque<TRI_IDX_ARRAY>& levels = mArenas[worker_idx]->tri_idx_level;
+	while (levels.size() <= level)
+		levels.push_back(TRI_IDX_ARRAY());
 
-UINT32* KAccelStruct_KDTree::DATA_FOR_KD_BUILD::AcquireTempTriIdxBuf(UINT32 threadIdx, int depth, UINT32 cnt)
-{
-	TRI_IDX_ARRAY& tempBuf = mSplitThreadTriArrayLevel[threadIdx][depth];
+	TRI_IDX_ARRAY& tempBuf = levels[level];
 	if (cnt > 0) {
 		tempBuf.Resize(cnt);
 		return tempBuf.pData;
@@ -3,48 +3,14 @@
 #include "../base/geometry.h"
 #include <vector>
 #include <set>
+#include <deque>
 #include "../os/api_wrapper.h"
 #include "../util/memory_pool.h"
 #include "../shader/shader_api.h"
 #include <memory>
 
-class KAccelStruct_KDTree;
-
-class SceneSplitTask : public ThreadModel::IThreadTask 
-{
-public:
-	KAccelStruct_KDTree* pKDScene;
-	UINT32* triangles;
-	UINT32 cnt;
-	UINT32 split_flag;
-	KBBox clamp_box;
-	UINT32 depth;
-	int needBBox;
-	UINT32 destIndex;
-	UINT32 splitThreadIdx;
-
-	virtual void Execute();
-};
-
 class KAccelStruct
 {
-public:
-	virtual bool IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const {return false;}
-	virtual unsigned long long GetAccelLeafTriCnt() const = 0;
-	virtual unsigned long long GetAccelNodeCnt() const = 0;
-	virtual unsigned long long GetAccelLeafCnt() const = 0;
-	virtual void InitAccelData() = 0;
-	virtual float GetSceneEpsilon() const = 0;
-	virtual void GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_accel) const = 0;
-	virtual const KBBox& GetSceneBBox() const = 0;
-
-	const KTriDesc* GetAccelTriData(UINT32 tri_idx) const;
-protected:
-	std::vector<KTriDesc>	mAccelTriangle;
-};
-
-class KAccelStruct_KDTree : public KAccelStruct
-{
 public:
 	typedef void (*PFN_RayIntersectStaticTriArray)(
 		const float* ray_org, const float* ray_dir, 
@@ -59,13 +25,214 @@ public:
 		float* tuv, int* hit_idx, 
 		int cnt, int excluding_id);
 
+	// Any-hit versions used by the occlusion test, hit_t of a lane is less than max_t if it hits
+	typedef void (*PFN_RayOccludeStaticTriArray)(
+		const float* ray_org, const float* ray_dir, 
+		float max_t, 
+		const float* tri_pos, const int* tri_id, 
+		float* hit_t, 
+		int cnt, int excluding_id);
+
+	typedef void (*PFN_RayOccludeAnimTriArray)(
+		const float* ray_org, const float* ray_dir, 
+		float cur_t, float max_t, 
+		const float* tri_pos, const int* tri_id, 
+		float* hit_t, 
+		int cnt, int excluding_id);
+
+	// Watertight versions, the ray axes are permuted and sheared as described by RayShear
+	typedef void (*PFN_RayIntersectStaticTriArrayWT)(
+		const float* ray_org, const float* ray_shear, int kx, int ky, int kz, 
+		const float* tri_pos, const int* tri_id, 
+		float* tuv, int* hit_idx, 
+		int cnt, int excluding_id);
+
+	typedef void (*PFN_RayIntersectAnimTriArrayWT)(
+		const float* ray_org, const float* ray_shear, int kx, int ky, int kz, 
+		float cur_t, 
+		const float* tri_pos, const int* tri_id, 
+		float* tuv, int* hit_idx, 
+		int cnt, int excluding_id);
+
+	typedef void (*PFN_RayOccludeStaticTriArrayWT)(
+		const float* ray_org, const float* ray_shear, int kx, int ky, int kz, 
+		float max_t, 
+		const float* tri_pos, const int* tri_id, 
+		float* hit_t, 
+		int cnt, int excluding_id);
+
+	typedef void (*PFN_RayOccludeAnimTriArrayWT)(
+		const float* ray_org, const float* ray_shear, int kx, int ky, int kz, 
+		float cur_t, float max_t, 
+		const float* tri_pos, const int* tri_id, 
+		float* hit_t, 
+		int cnt, int excluding_id);
+
 	static PFN_RayIntersectStaticTriArray s_pPFN_RayIntersectStaticTriArray;
 	static PFN_RayIntersectAnimTriArray s_pPFN_RayIntersectAnimTriArray;
+	static PFN_RayOccludeStaticTriArray s_pPFN_RayOccludeStaticTriArray;
+	static PFN_RayOccludeAnimTriArray s_pPFN_RayOccludeAnimTriArray;
+	static PFN_RayIntersectStaticTriArrayWT s_pPFN_RayIntersectStaticTriArrayWT;
+	static PFN_RayIntersectAnimTriArrayWT s_pPFN_RayIntersectAnimTriArrayWT;
+	static PFN_RayOccludeStaticTriArrayWT s_pPFN_RayOccludeStaticTriArrayWT;
+	static PFN_RayOccludeAnimTriArrayWT s_pPFN_RayOccludeAnimTriArrayWT;
+	// Triangle pair versions for the static leaves, tri_id holds two ids for each SIMD lane
+	static PFN_RayIntersectStaticTriArray s_pPFN_RayIntersectStaticPairArray;
+	static PFN_RayOccludeStaticTriArray s_pPFN_RayOccludeStaticPairArray;
+	static PFN_RayIntersectStaticTriArrayWT s_pPFN_RayIntersectStaticPairArrayWT;
+	static PFN_RayOccludeStaticTriArrayWT s_pPFN_RayOccludeStaticPairArrayWT;
+public:
+	KAccelStruct(const KScene* scene);
+	virtual ~KAccelStruct() {}
+
+	virtual bool IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const {return false;}
+	// Tells whether anything is hit within [0, max_t), it stops at the first hit found
+	virtual bool IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const {
+		IntersectContext ctx;
+		ctx.ray_t = max_t;
+		return IntersectRay_KDTree(ray, inst, ctx);
+	}
+	// Closest hit of the packet rays selected by rayMask, returns the mask of the rays that hit.
+	// By default the rays are traced one by one.
+	virtual UINT32 IntersectPacket(KRayPacket& packet, UINT32 rayMask, TracingInstance* inst) const;
+	virtual unsigned long long GetAccelLeafTriCnt() const = 0;
+	virtual unsigned long long GetAccelNodeCnt() const = 0;
+	virtual unsigned long long GetAccelLeafCnt() const {return mAccelLeaves.LeafCnt();}
+	virtual void InitAccelData() = 0;
+	// Update the bounds for the deformed geometry without changing the structure. It returns false if
+	// the structure cannot be refitted or its quality degrades too much, then InitAccelData should be called.
+	virtual bool RefitAccelData() {return false;}
+	virtual float GetSceneEpsilon() const = 0;
+	virtual void GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_accel) const = 0;
+	virtual const KBBox& GetSceneBBox() const = 0;
+	// Bounds at the start and the end of the shutter interval, the geometry at time t is inside their lerp
+	virtual void GetSceneMotionBBox(KBBox& start, KBBox& end) const {start = end = GetSceneBBox();}
+	// Serialize the built structure so that it can be reused by the next loading of the same scene,
+	// see KAccelStruct_BVH::LoadAccelCache.
+	virtual bool SaveToFile(FILE* pFile) {return false;}
+	virtual bool LoadFromFile(FILE* pFile) {return false;}
+
+	KTriDesc GetAccelTriData(UINT32 tri_idx) const {return ResolveAccelTriangle(mAccelTriInst, tri_idx);}
+	UINT32 GetAccelTriCnt() const {return mAccelTriCnt;}
+	// Inner nodes on the longest path from the root to a leaf, the traversal pushes at most one entry
+	// for each of them, see TracingInstance::mKDStack.
+	UINT32 GetTraversalDepth() const {return mTraversalDepth;}
+	const KScene* GetSource() const {return mpSourceScene;}
+
+	// Cost terms used by the surface area heuristic
+	struct SAH_Param {
+		float traversal_cost;
+		float intersect_cost;	// per SIMD batch of triangles
+		float pair_intersect_cost;	// per SIMD batch of triangle pairs, 0 if the leaves aren't paired
+		UINT32 simd_width;
+		UINT32 bin_cnt;
+	};
+
+	// Leaf payload in structure-of-arrays form, shared by all the acceleration structures
+	static const UINT32 LEAF_ANIM_FLAG = 0x80000000;
+	struct AccelLeaves {
+		std::vector<UINT32> tri_offset;	// offset into tri_idx
+		std::vector<UINT32> tri_cnt;	// LEAF_ANIM_FLAG is set if the leaf contains animated triangles
+		std::vector<KBBox> bbox;
+		std::vector<KBoxNormalizer> box_norm;
+		std::vector<UINT32> tri_idx;
+
+		// Triangle data of all the leaves swizzled for the JIT kernel, built once and shared by all the
+		// tracing threads. A leaf block holds the triangle ids followed by the positions, the positions of
+		// static leaves are 16-bit quantized if tri_data_quantized is set, see LEAF_TRI_QUANTIZE. The world
+		// space positions share one lattice across the leaves, see ComputeQuantLattice.
+		// The positions are normalized into each leaf's box unless tri_data_world is set, the watertight
+		// test needs world space so that an edge shared by two leaves is the same in both of them.
+		// The static leaves may pack the triangles sharing an edge into pairs, see LEAF_TRI_PAIR. A pair
+		// takes one SIMD lane with 2 ids and 4 vertices, the triangles are (p0, p1, p2) and (p0, p2, p3).
+		std::vector<UINT64> tri_data_offset;
+		std::vector<float> quant_param;	// base and step of each axis, 6 floats per leaf
+		std::vector<UINT32> pair_prim_cnt;	// SIMD primitives of the leaf stored as pairs, 0 if it's stored as triangles
+		std::vector<BYTE> tri_vert_order;	// parallel to tri_idx, slots of vertex 1 and 2 of the triangle in its pair
+		BYTE* tri_data;
+		UINT64 tri_data_size;
+		UINT32 tri_data_simd;
+		bool tri_data_quantized;
+		bool tri_data_world;
+
+		AccelLeaves();
+		~AccelLeaves();
+		void Clear();
+		UINT32 LeafCnt() const {return (UINT32)tri_cnt.size();}
+		UINT32 AddLeaf(const KBBox& leafBBox, const UINT32* pTriIdx, UINT32 cnt, bool hasAnim);
+		void RefitLeaf(UINT32 leafIdx, const KBBox& leafBBox, bool hasAnim);
+		bool SaveToFile(FILE* pFile);
+		bool LoadFromFile(FILE* pFile);
+		// Every leaf's range stays inside tri_idx and every index is below triCnt
+		bool IsValid(UINT32 triCnt) const;
+
+		void BuildTriData(const KScene* scene, const std::vector<KTriInstance>& instances, UINT32 simdWidth, bool quantize, bool worldSpace, bool pairTriangles);
+		void ComputeQuantLattice(const KScene* scene, const std::vector<KTriInstance>& instances, std::vector<float>& triPos, float* latticeStep) const;
+		void ClearTriData();
+		const int* GetTriIdData(UINT32 leafIdx) const {return (const int*)(tri_data + tri_data_offset[leafIdx]);}
+		// Returns the swizzled positions, the quantized ones are decoded into pScratch
+		const float* GetTriPosData(UINT32 leafIdx, float* pScratch) const;
+		bool IsTriPosQuantized(UINT32 leafIdx) const {return tri_data_quantized && (tri_cnt[leafIdx] & LEAF_ANIM_FLAG) == 0;}
+		// The box limiting the hits of the leaf, the quantized world space positions may move a hit half a
+		// lattice step out of the leaf.
+		KBBox HitBBox(UINT32 leafIdx) const;
+		bool IsTriPair(UINT32 leafIdx) const {return pair_prim_cnt[leafIdx] != 0;}
+		UINT32 PrimCnt(UINT32 leafIdx) const {return IsTriPair(leafIdx) ? pair_prim_cnt[leafIdx] : (tri_cnt[leafIdx] & ~LEAF_ANIM_FLAG);}
+		// Floats of one primitive's positions
+		UINT32 PrimPosStep(UINT32 leafIdx) const {return IsTriPair(leafIdx) ? 12 : ((tri_cnt[leafIdx] & LEAF_ANIM_FLAG) ? 18 : 9);}
+		// The barycentric coordinates from the pair kernel follow the vertex order in the pair, this
+		// reorders them for the hit triangle of the leaf.
+		void PairBarycentric(UINT32 leafIdx, UINT32 triId, float& u, float& v) const;
+	private:
+		AccelLeaves(const AccelLeaves&);
+		AccelLeaves& operator=(const AccelLeaves&);
+	};
+
+protected:
+	// Test the ray against the triangles of one leaf with the JIT kernel, the hit is limited
+	// inside the leaf's bounding box. With useMailbox the triangles tested by the ray in the leaves
+	// visited before are skipped, so the hit can't be limited by the box any more and it may lie
+	// beyond the leaf. The ray must be started by TracingInstance::BeginMailboxRay.
+	bool IntersectLeaf(UINT32 idx, const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool useMailbox) const;
+	// Any-hit test of one leaf, no hit information is computed
+	bool OccludeLeaf(UINT32 idx, const KRay& ray, TracingInstance* inst, double max_t, bool useMailbox) const;
+	// Positions and ids of the leaf's SIMD blocks to test. With the mailbox the primitives whose triangles
+	// are all tested are dropped, the rest are added to it. Returns the block count, 0 if nothing is left.
+	int PrepareLeafTriData(UINT32 idx, TracingInstance* inst, bool useMailbox, const float*& pTriData, const int*& pTriIdData) const;
+	// Generate the shared triangle data used by IntersectLeaf, it must be called whenever the leaves change
+	void BuildLeafTriData();
+	// Check the triangle instances and the leaves loaded from the cache against the source scene, the
+	// nodes are checked by the derived structure. A broken cache must be rebuilt instead of traversed.
+	bool IsLoadedDataValid() const;
+	// Hash of the triangle instances and the faces they refer to, see RefitAccelData
+	UINT64 ComputeTopologyHash() const;
+	// The derived structures store their nodes depth first, the first child of an inner node is the
+	// next node. Returns true for an inner node with the index of its other child in link, false for a
+	// leaf with its leaf index in link, INVALID_INDEX for an empty leaf.
+	virtual bool GetNodeLink(UINT32 nodeIdx, UINT32& link) const = 0;
+	// Every link stays inside the nodes or the leaves and the children follow their parent, which also
+	// rules out any cycle. Only the kd-tree has empty leaves.
+	bool IsNodeLinkValid(bool allowEmptyLeaf) const;
+	UINT32 ComputeTraversalDepth() const;
+	// The triangle instances and the leaves, the derived structures save them after their nodes.
+	// Loading checks them against the source scene, see IsLoadedDataValid.
+	bool SaveLeafData(FILE* pFile);
+	bool LoadLeafData(FILE* pFile);
+
+	const KScene* mpSourceScene;
+	// The triangles are referenced by their index in the scene, see KTriInstance
+	std::vector<KTriInstance> mAccelTriInst;
+	UINT32 mAccelTriCnt;
+	AccelLeaves mAccelLeaves;
+	bool mUseMailbox;	// some triangles are referenced by several leaves, see LEAF_MAILBOX
+	UINT32 mTraversalDepth;	// set whenever the nodes are built or loaded
+};
+
+class KAccelStruct_KDTree : public KAccelStruct
+{
 public:
 	KAccelStruct_KDTree(const KScene* scene);
 	virtual ~KAccelStruct_KDTree();
-
-	const KScene* GetSource() const;
 public:
 	friend class SceneSplitTask;
 	typedef struct _KD_LeafData {
@@ -87,19 +254,58 @@ public:
 		eLeftChild		= 0x0010,
 		eRightChild		= 0x0020,
 		ePerfectSplit	= 0x0040,
-		eNoBBox			= 0x0080,
 
 		eSplitAxisMask = 0x000f
 	};
-	// Data structure for each kd node
-	struct KD_Node_NoBBox {
-		long flag;
-		UINT32  left_child;
-		UINT32  right_child;
-		float  split_value;
+	// Every build worker adds the nodes and leaves into its own arena, so a node or leaf is
+	// referenced by the arena index and its index inside that arena.
+	struct KD_NodeRef {
+		UINT32 arena;
+		UINT32 idx;	// INVALID_INDEX for an empty node
 	};
-	struct KD_Node : public KD_Node_NoBBox {
-		KBBox bbox;
+	// Data structure for each kd node during building
+	struct KD_Node {
+		UINT32 flag;
+		float split_value;
+		KD_NodeRef left_child;
+		KD_NodeRef right_child;
+	};
+
+	// Compact node used for traversal, generated from KD_Node by FinalizeKDTree.
+	// The nodes are stored depth first, so the + side child of an inner node is always
+	// the next node, only the index of the - side child is stored.
+	enum FlatNodeFlag {
+		eFlatLeaf = 0x3,
+		eFlatAxisMask = 0x3,
+		eFlatChildShift = 2
+	};
+	struct KD_FlatNode {
+		UINT32 flag_child;	// split axis or eFlatLeaf in the lowest 2 bits, child/leaf index in the others
+		union {
+			float split_value;
+			UINT32 leaf_idx;	// INVALID_INDEX for an empty leaf
+		};
+
+		bool IsLeaf() const {return (flag_child & eFlatAxisMask) == eFlatLeaf;}
+		UINT32 SplitAxis() const {return flag_child & eFlatAxisMask;}
+		UINT32 FarChild() const {return flag_child >> eFlatChildShift;}
+		void InitLeaf(UINT32 leaf) {flag_child = eFlatLeaf; leaf_idx = leaf;}
+		void InitInner(UINT32 axis, UINT32 far_child, float split) {
+			flag_child = (far_child << eFlatChildShift) | axis; split_value = split;
+		}
+	};
+
+	// How the splitting plane of each kd node is chosen, see KD_BUILD_MODE
+	enum BuildMode {
+		eBuild_PigeonHole = 0,
+		eBuild_SAH_Binned = 1,
+		eBuild_SAH_Sweep = 2
+	};
+	// Triangle bound event used by the SAH sweep builder
+	struct SAH_Event {
+		float pos;
+		int is_start;
+		bool operator < (const SAH_Event& rhs) const {return pos < rhs.pos;}
 	};
 	// Statistic info of this kd tree	
 	UINT32 mTotalLeafTriCnt;
@@ -111,34 +317,31 @@ public:
 protected:
 	
 	// All the kd node data is stored here
-	const KScene* mpSourceScene;
 	float mSceneEpsilon;
 
-	std::vector<BYTE>	mSceneNode;
-	std::vector<KD_LeafData> mKDLeafData;
-	GlowableMemPool mLeafIdxMemPool;
+	// Traversal data, the root is always the first node. The leaf payload is in mAccelLeaves.
+	KD_FlatNode* mpFlatNode;
+	UINT32 mFlatNodeCnt;
+	virtual bool GetNodeLink(UINT32 nodeIdx, UINT32& link) const;
 
 	// Limitations when build the kd tree
 	UINT32	mMaxDepth;
 	float	mNodeSplitThreshhold;
 	UINT32	mLeafTriCnt;
+	BuildMode mBuildMode;
+	SAH_Param mSAHParam;
+	bool	mClipTriBBox;	// bound the triangles clipped by the node, see SPATIAL_SPLIT
 	
-	UINT32 mRootNode;	// root node's index
+	KD_NodeRef mRootNode;	// root node's reference, only valid during building
+	bool mRootIsLeaf;
 	UINT32 mProcessorCnt;
-	
-	struct SplitData 
-	{
-		UINT32 in_splitThreadIdx;
-	};
+
+	// Nodes with more triangles than this filter the triangles with several workers
+	static const UINT32 PARALLEL_FILTER_TRI_CNT = 32768;
 
 	class DATA_FOR_KD_BUILD 
 	{
 	public:
-		volatile long mActiveSplitThreadCnt;
-		std::auto_ptr<ThreadModel::ThreadBucket> mThreadBucket;
-		std::auto_ptr<ThreadModel::ThreadPool> mThreadPool;
-		std::vector<SceneSplitTask> mSplitTasks;
-		std::vector<KBBox> mTriBBox;
 		struct TRI_IDX_ARRAY {
 			UINT32 tri_cnt;
 			UINT32* pData;
@@ -152,53 +355,75 @@ protected:
 				}
 			}
 		};
-		typedef std::vector<TRI_IDX_ARRAY> LEVELS_OF_TRI_ARRAY;
-		std::vector<LEVELS_OF_TRI_ARRAY> mSplitThreadTriArrayLevel;
-		std::vector<std::vector<UINT32> > mPigeonHoles;
-		
-		SPIN_LOCK_FLAG		mNodeAddingCS; 
-		SPIN_LOCK_FLAG		mLeafAddingCS; 
+		// Build data owned by one worker, it's never locked. The arenas are merged by FinalizeKDTree.
+		struct BuildArena {
+			std::vector<KD_Node> nodes;
+			std::vector<KD_LeafData> leaves;
+			GlowableMemPool leaf_idx_pool;
+			std::vector<UINT32> pigeon_holes;
+			std::vector<SAH_Event> sah_events;
+			// Temporary triangle lists indexed by the nesting level of SplitScene calls. A stolen task
+			// runs nested inside the waiting call, so it never touches the lists of the outer calls.
+			std::deque<TRI_IDX_ARRAY> tri_idx_level;
+			UINT32 nest_level;
+			UINT32 leaf_tri_cnt;
+			UINT32 perfect_split_cnt;
+		};
 
-		int			mThreadLimit;
-		UINT32		mCPUCnt;
+		ThreadModel::WorkStealingPool* mWorkerPool;	// the shared pool
+		std::vector<BuildArena*> mArenas;
+		std::vector<KBBox> mTriBBox;
 
 		DATA_FOR_KD_BUILD();
 		~DATA_FOR_KD_BUILD();
 		
-		void NotifySplitThreadAdded();
-		void NotifySplitThreadComplete(UINT32 thread_idx);
-		UINT32* AcquireTempTriIdxBuf(UINT32 threadIdx, int depth, UINT32 cnt);
+		UINT32* AcquireTempTriIdxBuf(UINT32 worker_idx, UINT32 level, UINT32 cnt);
 	};
 	std::auto_ptr<DATA_FOR_KD_BUILD> mTempDataForKD;
 
 protected:	
-	UINT32 BuildKDNode4Data(UINT32 idx);
-	bool IntersectNode(UINT32 idx, const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const;
-	bool IntersectLeaf(UINT32 idx, const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const;
-	int PrepareKDTree();
+	void PrepareKDTree();
 	void PrecomputeTriangleBBox();
+	void FinalizeKDTree();
+	UINT32 FlattenKDNode(const KD_NodeRef& ref, bool isLeaf, std::vector<KD_FlatNode>& flatNodes);
+	// Shared by the closest hit and the any-hit queries
+	bool Traverse(const KRay& ray, TracingInstance* inst, IntersectContext& ctx, bool anyHit) const;
 
 public:
-	UINT32 SplitScene(UINT32* triangles, UINT32 cnt, 
-		int needBBox,
+	KD_NodeRef SplitScene(UINT32* triangles, UINT32 cnt, 
 		const KBBox* clamp_box, 
-		const SplitData& splitData,
+		UINT32 worker_idx,
 		int depth, bool& isLeaf);
 	virtual void InitAccelData();
 	virtual void ResetScene();
 
 	bool IntersectRay_KDTree(const KRay& ray, TracingInstance* inst, IntersectContext& ctx) const;
-
-	const KTriDesc* GetAccelTriData(UINT32 tri_idx) const {return &mAccelTriangle[tri_idx];} 
+	virtual bool IsOccluded(const KRay& ray, double max_t, TracingInstance* inst) const;
+	virtual UINT32 IntersectPacket(KRayPacket& packet, UINT32 rayMask, TracingInstance* inst) const;
 
 	virtual float GetSceneEpsilon() const {return mSceneEpsilon;}
 	virtual unsigned long long GetAccelLeafTriCnt() const {return mTotalLeafTriCnt;}
-	virtual unsigned long long GetAccelNodeCnt() const {return mSceneNode.size();}
-	virtual unsigned long long GetAccelLeafCnt() const {return mKDLeafData.size();}
+	virtual unsigned long long GetAccelNodeCnt() const {return mFlatNodeCnt;}
 	virtual const KBBox& GetSceneBBox() const {return mSceneBBox;}
 	virtual void GetKDBuildTimeStatistics(DWORD& kd_build, DWORD& gen_accel) const;
-	
-	// These functions will modify scene, BE CAREFUL!!!
-	void AddKDNode(const KD_Node& node, UINT32& out_idx);
-	void SetKNodeChild(UINT32 nodeIdx, UINT32 childIdx, bool left_or_right, bool isLeaf);
+	virtual bool SaveToFile(FILE* pFile);
+	virtual bool LoadFromFile(FILE* pFile);
+};
+
+// Builds one kd sub-tree, the + side child of a big node is spawned as this task so that
+// the idle workers can steal it.
+class SceneSplitTask : public ThreadModel::IForkJoinTask 
+{
+public:
+	KAccelStruct_KDTree* pKDScene;
+	UINT32* triangles;
+	UINT32 cnt;
+	KBBox clamp_box;
+	bool use_clamp_box;
+	UINT32 depth;
+	// output
+	KAccelStruct_KDTree::KD_NodeRef ret_node;
+	bool isLeaf;
+
+	virtual void Execute(UINT32 worker_idx);
 };
@@ -183,8 +183,7 @@ const BitmapObject* RenderBuffers::GetOutputImagePtr() const
 	return output_image.get();
 }
 
-TracingInstance::TracingInstance(const KAccelStruct_BVH* scene, const RenderBuffers* pBuffers) :
-	mCachedTriPosData(MAX_REFLECTION_BOUNCE * 30 + 11)
+TracingInstance::TracingInstance(const KAccelStruct_BVH* scene, const RenderBuffers* pBuffers)
 {
 	mpScene = scene;
 	mpRenderBuffers = pBuffers;
@@ -206,15 +205,59 @@ TracingInstance::TracingInstance(const KAccelStruct_BVH* scene, const RenderBuff
 
 	mSIMD_Width = KSC_GetSIMDWidth();
 	int simd_data_size = mSIMD_Width * sizeof(float);
-	mCachedTriPosData.SetMemAllocAlignment(simd_data_size);
 	mpHitIdx_SIMD = (int*)Aligned_Malloc(simd_data_size, simd_data_size);
 	mpTUV_SIMD = (float*)Aligned_Malloc(simd_data_size * 3, simd_data_size);
+	mpTriPosScratch = NULL;
+	mTriPosScratchSize = 0;
+	// At most one far child is pushed for each inner node on the path, by the single rays and by the
+	// packets alike. The depth comes from the built structures since a tree loaded from the cache may
+	// have been built with another MAX_KD_DEPTH.
+	UINT32 stackSize = scene->GetMaxTraversalDepth() + 1;
+	mKDStack.resize(stackSize);
+	mKDPacketStack.resize(stackSize);
+	NodeTransformCache emptyTrans;
+	emptyTrans.node_idx = INVALID_INDEX;
+	emptyTrans.motion_time = 0;
+	mNodeTransCache.resize(NODE_TRANSFORM_CACHE_SIZE, emptyTrans);
+	TriMailbox emptyMailbox;
+	emptyMailbox.ray_stamp = 0;
+	emptyMailbox.tri_idx = INVALID_INDEX;
+	mTriMailbox.resize(TRI_MAILBOX_SIZE, emptyMailbox);
+	mMailboxStamp = 0;
+	mLeafTriTestCnt = 0;
+	mMailboxSkipCnt = 0;
+	mSecondaryBatchMode = eBatch_Off;
+	mBatchCursor = 0;
+	mBatchCursorEnd = 0;
 }
 
 TracingInstance::~TracingInstance()
 {
 	Aligned_Free(mpHitIdx_SIMD);
 	Aligned_Free(mpTUV_SIMD);
+	if (mpTriPosScratch)
+		Aligned_Free(mpTriPosScratch);
+}
+
+float* TracingInstance::AcquireTriPosScratch(UINT32 floatCnt)
+{
+	if (floatCnt > mTriPosScratchSize) {
+		if (mpTriPosScratch)
+			Aligned_Free(mpTriPosScratch);
+		mTriPosScratchSize = floatCnt;
+		mpTriPosScratch = (float*)Aligned_Malloc(floatCnt * sizeof(float), mSIMD_Width * sizeof(float));
+	}
+	return mpTriPosScratch;
+}
+
+void TracingInstance::BeginMailboxRay()
+{
+	if (++mMailboxStamp == 0) {
+		// The stamp wraps around, the entries from the rays long ago must not match the new ones
+		for (UINT32 i = 0; i < TRI_MAILBOX_SIZE; ++i)
+			mTriMailbox[i].ray_stamp = 0;
+		mMailboxStamp = 1;
+	}
 }
 
 SurfaceContext& TracingInstance::GetCurrentSurfaceCtxStorage()
@@ -277,6 +320,130 @@ UINT32 TracingInstance::GetBoundDepth() const
 	return mBounceDepth;
 }
 
+void TracingInstance::BeginSecondaryBatch()
+{
+	mSecondaryBatchMode = eBatch_Record;
+	mBatchRays.clear();
+	mBatchMotionTime.clear();
+	mBatchSampleStart.clear();
+}
+
+void TracingInstance::SetSecondaryBatchSample(UINT32 sampleIdx)
+{
+	if (mSecondaryBatchMode == eBatch_Record) {
+		// The samples are recorded in order
+		assert(sampleIdx == mBatchSampleStart.size());
+		mBatchSampleStart.push_back((UINT32)mBatchRays.size());
+	}
+	else if (mSecondaryBatchMode == eBatch_Replay) {
+		mBatchCursor = mBatchSampleStart[sampleIdx];
+		mBatchCursorEnd = (sampleIdx + 1 < mBatchSampleStart.size()) ? 
+			mBatchSampleStart[sampleIdx + 1] : (UINT32)mBatchRays.size();
+	}
+}
+
+void TracingInstance::RecordSecondaryRay(const KRay& ray)
+{
+	assert(mSecondaryBatchMode == eBatch_Record);
+	mBatchRays.push_back(ray);
+	mBatchMotionTime.push_back(mCameraContext.inMotionTime);
+}
+
+static UINT32 SpreadBits10(UINT32 v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+void TracingInstance::TraceSecondaryBatch()
+{
+	assert(mSecondaryBatchMode == eBatch_Record);
+	UINT32 rayCnt = (UINT32)mBatchRays.size();
+	mBatchHits.resize(rayCnt);
+	mBatchIsHit.resize(rayCnt);
+	mBatchOrder.resize(rayCnt);
+
+	// Sort the rays by the direction octant first, then by the Morton code of the origin cell
+	const KBBox& sceneBox = mpScene->GetSceneBBox();
+	KVec3 boxSize = sceneBox.mMax - sceneBox.mMin;
+	KVec3 cellScale;
+	for (int axis = 0; axis < 3; ++axis)
+		cellScale[axis] = boxSize[axis] > 0 ? 1023.0f / boxSize[axis] : 0;
+	for (UINT32 i = 0; i < rayCnt; ++i) {
+		const KRay& ray = mBatchRays[i];
+		KVec3 org = ToVec3f(ray.GetOrg());
+		UINT32 morton = 0;
+		for (int axis = 0; axis < 3; ++axis) {
+			float cell = (org[axis] - sceneBox.mMin[axis]) * cellScale[axis];
+			UINT32 c = cell > 0 ? (UINT32)std::min(cell, 1023.0f) : 0;
+			morton |= SpreadBits10(c) << axis;
+		}
+		UINT32 octant = ray.mSign[0] | (ray.mSign[1] << 1) | (ray.mSign[2] << 2);
+		mBatchOrder[i].first = ((UINT64)octant << 30) | morton;
+		mBatchOrder[i].second = i;
+	}
+	std::sort(mBatchOrder.begin(), mBatchOrder.end());
+
+	// Neighbouring rays in the sorted order share most of the traversal, trace them as packets
+	KRayPacket packet;
+	for (UINT32 start = 0; start < rayCnt; start += RAY_PACKET_SIZE) {
+		packet.ray_cnt = std::min(RAY_PACKET_SIZE, rayCnt - start);
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			UINT32 ri = mBatchOrder[start + i].second;
+			packet.rays[i] = mBatchRays[ri];
+			packet.ctx[i].Reset();
+			packet.motion_time[i] = mBatchMotionTime[ri];
+		}
+
+		UINT32 hitMask = 0;
+		if (packet.ray_cnt == 1) {
+			mCameraContext.inMotionTime = packet.motion_time[0];
+			hitMask = CastRay(packet.rays[0], packet.ctx[0]) ? 1 : 0;
+		}
+		else
+			hitMask = CastRayPacket(packet);
+
+		for (UINT32 i = 0; i < packet.ray_cnt; ++i) {
+			UINT32 ri = mBatchOrder[start + i].second;
+			mBatchHits[ri] = packet.ctx[i];
+			mBatchIsHit[ri] = (hitMask & (1 << i)) ? 1 : 0;
+		}
+	}
+
+	mSecondaryBatchMode = eBatch_Replay;
+	mBatchCursor = 0;
+	mBatchCursorEnd = 0;
+}
+
+bool TracingInstance::FetchSecondaryHit(const KRay& ray, const IntersectContext*& pHit)
+{
+	assert(mSecondaryBatchMode == eBatch_Replay);
+	if (mBatchCursor >= mBatchCursorEnd)
+		return false;
+
+	// The shading of the replay pass should make the same secondary rays as the recording pass,
+	// anything else is traced as usual.
+	const KRay& recorded = mBatchRays[mBatchCursor];
+	if (recorded.GetOrg() != ray.GetOrg() || recorded.GetDir() != ray.GetDir() ||
+		recorded.mExcludeBBoxNode != ray.mExcludeBBoxNode || recorded.mExcludeTriID != ray.mExcludeTriID) {
+		mBatchCursor = mBatchCursorEnd;
+		return false;
+	}
+
+	pHit = mBatchIsHit[mBatchCursor] ? &mBatchHits[mBatchCursor] : NULL;
+	++mBatchCursor;
+	return true;
+}
+
+void TracingInstance::EndSecondaryBatch()
+{
+	mSecondaryBatchMode = eBatch_Off;
+}
+
 KColor TracingInstance::GetBackGroundColor(const KVec3& dir) const
 {
 	return KColor(0,0,0);
@@ -290,10 +457,10 @@ void TracingInstance::CalcuShadingContext(const KRay& hitRay, const IntersectCon
 	pPlainScene->GetNodeTransform(nodeTRS, hit_ctx.bbox_node_idx, mCameraContext.inMotionTime);
 	const nvmath::Mat33f scene_rot = nodeTRS.trs.getRotation();
 	const nvmath::Mat44f scene_trans = nodeTRS.trs.getMatrix();
-	const KTriDesc* pTri = mpScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
-	UINT32 mesh_idx = pTri->GetMeshIdx();
-	UINT32 node_idx = pTri->GetNodeIdx();
-	UINT32 tri_idx = pTri->mTriIdx;
+	KTriDesc triDesc = mpScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
+	UINT32 mesh_idx = triDesc.GetMeshIdx();
+	UINT32 node_idx = triDesc.GetNodeIdx();
+	UINT32 tri_idx = triDesc.mTriIdx;
 	const KTriMesh* pMesh = pKDScene->GetMesh(mesh_idx);
 	const KNode* pNode = pKDScene->GetNode(node_idx);
 	const UINT32* pn_idx = pMesh->mFaces[tri_idx].pn_idx;
@@ -376,8 +543,8 @@ const ISurfaceShader* TracingInstance::GetSurfaceShader(const IntersectContext&
 {
 	const KSceneSet* pPlainScene = mpScene->GetSource();
 	const KScene* pKDScene = pPlainScene->GetNodeKDScene(hit_ctx.bbox_node_idx);
-	const KTriDesc* pTri = mpScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
-	UINT32 node_idx = pTri->GetNodeIdx();
+	KTriDesc triDesc = mpScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
+	UINT32 node_idx = triDesc.GetNodeIdx();
 	const KNode* pNode = pKDScene->GetNode(node_idx);
 	return pNode->mpSurfShader;
 }
@@ -390,10 +557,10 @@ void TracingInstance::CalcuHitInfo(const IntersectContext& hit_ctx, IntersectInf
 	pPlainScene->GetNodeTransform(nodeTRS, hit_ctx.bbox_node_idx, mCameraContext.inMotionTime);
 	const nvmath::Mat33f scene_rot = nodeTRS.trs.getRotation();
 	const nvmath::Mat44f scene_trans = nodeTRS.trs.getMatrix();
-	const KTriDesc* pTri = mpScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
-	UINT32 mesh_idx = pTri->GetMeshIdx();
-	UINT32 node_idx = pTri->GetNodeIdx();
-	UINT32 tri_idx = pTri->mTriIdx;
+	KTriDesc triDesc = mpScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
+	UINT32 mesh_idx = triDesc.GetMeshIdx();
+	UINT32 node_idx = triDesc.GetNodeIdx();
+	UINT32 tri_idx = triDesc.mTriIdx;
 	const KTriMesh* pMesh = pKDScene->GetMesh(mesh_idx);
 	const KNode* pNode = pKDScene->GetNode(node_idx);
 	const nvmath::Mat33f world_rot = nvmath::Mat33f(pNode->GetObjectRot()) * scene_rot;
@@ -440,23 +607,28 @@ bool TracingInstance::CastRay(const KRay& ray, IntersectContext& out_ctx)
 		return false;
 }
 
+UINT32 TracingInstance::CastRayPacket(KRayPacket& packet)
+{
+	return mpScene->IntersectPacket(packet, this);
+}
+
 bool TracingInstance::IsPointOccluded(const KRay& ray, float len)
 {
-	IntersectContext ctx;
-	if (CastRay(ray, ctx)) {
-		double diff = ctx.ray_t - len;
-		float epsilon = mpScene->GetSceneEpsilon();
-		if (diff > epsilon)
-			return false;
-		else
-			return true;
-	}
-	else
+	// The recording pass only needs the secondary rays, its shading result is discarded
+	if (mSecondaryBatchMode == eBatch_Record)
 		return false;
+	// Any hit closer than len plus the scene epsilon occludes the point
+	return mpScene->IsOccluded(ray, (double)len + mpScene->GetSceneEpsilon(), this);
 }
 
 void TracingInstance::ComputeLightTransimission(const KRay& ray, float len, KColor& out_trans)
 {
+	// Most of the shadow rays reach the light, the any-hit test is much cheaper for them
+	if (mSecondaryBatchMode == eBatch_Record || !mpScene->IsOccluded(ray, len, this)) {
+		out_trans = KColor(1,1,1);
+		return;
+	}
+
 	KRay temp_ray = ray;
 	KVec3d temp_pos = temp_ray.GetOrg();
 	KVec3d temp_target_dir = temp_ray.GetDir();
@@ -944,4 +1116,14 @@ void KSC_ShaderWithTexture::Sample2D(Texture::Tex2D* tex, KVec2* uv, KVec4* outS
 	}
 	else
 		*outSample = KVec4(0,0,0,0);
-}
\ No newline at end of file
+}
+
+const char* RenderParam::GetProgressiveLimitError() const
+{
+	// A noise target alone may never be reached, so the samples or the time have to be bounded
+	if (!(time_budget >= 0) || !(noise_target >= 0))
+		return "the time budget and the noise target can't be negative";
+	if (max_spp == 0 && time_budget == 0)
+		return "neither the samples per pixel nor the time is limited";
+	return NULL;
+}
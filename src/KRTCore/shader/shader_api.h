@@ -144,6 +144,8 @@ public:
 	void CalcuHitInfo(const IntersectContext& hit_ctx, IntersectInfo& out_info) const;
 	
 	bool CastRay(const KRay& ray, IntersectContext& out_ctx);
+	// Returns the mask of the rays in the packet that hit something
+	UINT32 CastRayPacket(KRayPacket& packet);
 	bool IsPointOccluded(const KRay& ray, float len);
 	void ComputeLightTransimission(const KRay& ray, float len, KColor& out_trans);
 
@@ -153,15 +155,67 @@ public:
 	void ConvertToTransContext(const IntersectContext& hitCtx, const ShadingContext& shadingCtx, TransContext& transCtx);
 	TransContext& GetCurrentTransCtxStorage();
 
+	// Wavefront tracing of the first bounce secondary rays. The samples are shaded once to record
+	// their secondary rays, the recorded rays are sorted and traced together, then the samples are
+	// shaded again and their secondary rays take the traced hits.
+	enum SecondaryBatchMode {
+		eBatch_Off,
+		eBatch_Record,	// secondary rays are recorded but not traced, no shadow ray is traced either
+		eBatch_Replay
+	};
+	void BeginSecondaryBatch();
+	void SetSecondaryBatchSample(UINT32 sampleIdx);
+	void TraceSecondaryBatch();
+	void EndSecondaryBatch();
+	SecondaryBatchMode GetSecondaryBatchMode() const {return mSecondaryBatchMode;}
+	void RecordSecondaryRay(const KRay& ray);
+	// Returns false if the ray is not the recorded one, pHit is NULL if the recorded ray hits nothing
+	bool FetchSecondaryHit(const KRay& ray, const IntersectContext*& pHit);
+
 public:
 	KCamera::EvalContext mCameraContext;
 
-	KMemCacher mCachedTriPosData;
-	std::vector<BYTE> mTmpTriDataArray;
-	UINT32 mCurBVHIndex;
+	// Decoding buffer for the quantized leaf triangles
+	float* AcquireTriPosScratch(UINT32 floatCnt);
+
 	int mSIMD_Width;
 	int* mpHitIdx_SIMD;
 	float* mpTUV_SIMD;
+	std::vector<KDTraversalEntry> mKDStack;
+	std::vector<KDPacketTraversalEntry> mKDPacketStack;
+
+	// Inverse transforms of the moving scene nodes interpolated lately, see KAccelStruct_BVH::TransformRay
+	static const UINT32 NODE_TRANSFORM_CACHE_SIZE = 64;
+	struct NodeTransformCache {
+		UINT32 node_idx;
+		float motion_time;
+		KMatrix4 inv_trans;
+	};
+	std::vector<NodeTransformCache> mNodeTransCache;
+
+	// Leaf triangles tested by the ray traversing a sub-scene, see KAccelStruct::IntersectLeaf. The
+	// entries are hashed by the triangle index, the ones stamped with an older ray are empty.
+	static const UINT32 TRI_MAILBOX_SIZE = 256;
+	struct TriMailbox {
+		UINT32 ray_stamp;
+		UINT32 tri_idx;
+	};
+	void BeginMailboxRay();
+	bool IsTriInMailbox(UINT32 triIdx) const {
+		const TriMailbox& entry = mTriMailbox[triIdx & (TRI_MAILBOX_SIZE - 1)];
+		return entry.ray_stamp == mMailboxStamp && entry.tri_idx == triIdx;
+	}
+	void AddTriToMailbox(UINT32 triIdx) {
+		TriMailbox& entry = mTriMailbox[triIdx & (TRI_MAILBOX_SIZE - 1)];
+		entry.ray_stamp = mMailboxStamp;
+		entry.tri_idx = triIdx;
+	}
+	std::vector<TriMailbox> mTriMailbox;
+	UINT32 mMailboxStamp;
+	std::vector<UINT32> mMailboxPrim;	// primitives of the current leaf left to test
+	// Triangle tests done by the leaf kernels and the ones skipped by the mailbox
+	UINT64 mLeafTriTestCnt;
+	UINT64 mMailboxSkipCnt;
 	EnvContext mEvnContext;
 
 private:
@@ -174,6 +228,19 @@ private:
 	UINT32 mCurPixel_X;
 	UINT32 mCurPixel_Y;
 	bool mIsPixelSampling;
+
+	float* mpTriPosScratch;
+	UINT32 mTriPosScratchSize;
+
+	SecondaryBatchMode mSecondaryBatchMode;
+	std::vector<KRay> mBatchRays;
+	std::vector<IntersectContext> mBatchHits;
+	std::vector<float> mBatchMotionTime;
+	std::vector<BYTE> mBatchIsHit;
+	std::vector<UINT32> mBatchSampleStart;	// first recorded ray of each sample
+	std::vector<std::pair<UINT64, UINT32> > mBatchOrder;
+	UINT32 mBatchCursor;
+	UINT32 mBatchCursorEnd;
 };
 
 // structure passed to surface shader to light iteration
@@ -211,7 +278,7 @@ public:
 };
 
 struct RenderParam {
-	bool is_refining;
+	bool is_refining;	// progressive rendering, see PROGRESSIVE
 	bool want_motion_blur;
 	bool want_depth_of_field;
 	bool want_global_illumination;
@@ -219,6 +286,13 @@ struct RenderParam {
 	UINT32 sample_cnt_eval;
 	UINT32 sample_cnt_more;
 	UINT32 sample_cnt_edge;
+	// Stop criteria of the progressive rendering, 0 disables one of them. Either max_spp or time_budget
+	// has to be set, Render fails otherwise.
+	UINT32 max_spp;
+	double time_budget;
+	float noise_target;
+	// Returns why the limits above can't be used, NULL if they can
+	const char* GetProgressiveLimitError() const;
 
 	UINT32 image_width;
 	UINT32 image_height;
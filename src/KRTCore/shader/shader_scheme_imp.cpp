@@ -10,9 +10,9 @@ void LightScheme::AdjustHitPos(TracingInstance* pLocalData, const IntersectConte
 {
 	const KAccelStruct_BVH* pScene = pLocalData->GetScenePtr();
 	const KScene* pKDScene = pScene->GetSource()->GetNodeKDScene(hit_ctx.bbox_node_idx);
-	const KTriDesc* pTri = pScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
-	UINT32 mesh_idx = pTri->GetMeshIdx();
-	UINT32 tri_idx = pTri->mTriIdx;
+	KTriDesc triDesc = pScene->GetAccelTriData(hit_ctx.bbox_node_idx, hit_ctx.tri_id);
+	UINT32 mesh_idx = triDesc.GetMeshIdx();
+	UINT32 tri_idx = triDesc.mTriIdx;
 	const KTriMesh* pMesh = pKDScene->GetMesh(mesh_idx);
 	const UINT32* nor_idx = pMesh->mFaces[tri_idx].pn_idx;
 	
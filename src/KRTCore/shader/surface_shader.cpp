@@ -8,15 +8,28 @@
 
 bool CalcuShadingByRay(TracingInstance* pLocalData, const KRay& ray, KColor& out_clr, IntersectContext* out_ctx/* = NULL*/)
 {
-	const LightScheme* pLightScheme = LightScheme::GetInstance();
-	const KAccelStruct_BVH* pScene = pLocalData->GetScenePtr();
-	UINT32 rayBounceDepth = pLocalData->GetBoundDepth();
 	// Check the maximum bounce depth
-	if (rayBounceDepth >= MAX_REFLECTION_BOUNCE) {
+	if (pLocalData->GetBoundDepth() >= MAX_REFLECTION_BOUNCE) {
 		out_clr = pLocalData->GetBackGroundColor(ToVec3f(ray.GetDir()));
 		return false;
 	}
-	pLocalData->IncBounceDepth();
+
+	// The first bounce secondary rays are traced in batch, see TracingInstance::BeginSecondaryBatch
+	if (pLocalData->GetBoundDepth() == 1) {
+		if (pLocalData->GetSecondaryBatchMode() == TracingInstance::eBatch_Record) {
+			pLocalData->RecordSecondaryRay(ray);
+			out_clr.Clear();
+			return false;
+		}
+
+		const IntersectContext* pHit = NULL;
+		if (pLocalData->GetSecondaryBatchMode() == TracingInstance::eBatch_Replay && 
+			pLocalData->FetchSecondaryHit(ray, pHit)) {
+			if (pHit && out_ctx)
+				*out_ctx = *pHit;
+			return CalcuShadingByHit(pLocalData, ray, pHit, out_clr);
+		}
+	}
 
 	IntersectContext hit_ctx;
 	if (out_ctx) {
@@ -24,21 +37,36 @@ bool CalcuShadingByRay(TracingInstance* pLocalData, const KRay& ray, KColor& out
 		hit_ctx.kd_leaf_idx = out_ctx->kd_leaf_idx;
 	}
 
-	bool res = false;
-
 	bool isHit = false;
-	KColor irradiance;
-	
 	if ((pLocalData->CastRay(ray, hit_ctx))) 
 			isHit = true;
+
+	if (isHit && out_ctx)
+		*out_ctx = hit_ctx;
+
+	return CalcuShadingByHit(pLocalData, ray, isHit ? &hit_ctx : NULL, out_clr);
+}
+
+bool CalcuShadingByHit(TracingInstance* pLocalData, const KRay& ray, const IntersectContext* pHit, KColor& out_clr)
+{
+	const LightScheme* pLightScheme = LightScheme::GetInstance();
+	UINT32 rayBounceDepth = pLocalData->GetBoundDepth();
+	// Check the maximum bounce depth
+	if (rayBounceDepth >= MAX_REFLECTION_BOUNCE) {
+		out_clr = pLocalData->GetBackGroundColor(ToVec3f(ray.GetDir()));
+		return false;
+	}
+	pLocalData->IncBounceDepth();
+
+	bool res = false;
+	KColor irradiance;
 	
 	out_clr.Clear();
 
-	if (isHit) {
+	if (pHit) {
 		// This ray hits something, shade the ray sample by surface shader of the hit object.
 		//
-		if (out_ctx)
-			*out_ctx = hit_ctx;
+		const IntersectContext& hit_ctx = *pHit;
 		
 		// Calculate the data in shading context
 		ShadingContext shadingCtx;
@@ -9,6 +9,8 @@
 
 // The main entry function to calculate the shading for the specified ray
 bool CalcuShadingByRay(TracingInstance* pLocalData, const KRay& ray, KColor& out_clr, IntersectContext* out_ctx = NULL);
+// Calculate the shading for the ray that is already traced, pHit is NULL if the ray hits nothing
+bool CalcuShadingByHit(TracingInstance* pLocalData, const KRay& ray, const IntersectContext* pHit, KColor& out_clr);
 bool CalcSecondaryRay(TracingInstance* pLocalData, const KVec3& org, UINT32 excludingBBox, UINT32 excludingTri, const KVec3& ray_dir, KColor& out_clr);
 
 bool CalcReflectedRay(TracingInstance* pLocalData, const ShadingContext& shadingCtx, KColor& reflectColor);
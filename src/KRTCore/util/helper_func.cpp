@@ -135,4 +135,15 @@ void SwizzleForSIMD(void* srcData, void* destData, int SIMD_cc, int SIMD_cw, int
 			memcpy(curDestSIMD_c, curSrcSIMD_c, SIMD_cw);
 		}
 	}
-}
\ No newline at end of file
+}
+
+UINT64 HashBytes(const void* pData, size_t size, UINT64 seed)
+{
+	const BYTE* pByte = (const BYTE*)pData;
+	UINT64 hash = seed;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= pByte[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
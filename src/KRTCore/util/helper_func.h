@@ -26,6 +26,10 @@ bool IsAbsolutePath(const char* path);
 void GetPathDir(const char* path, std::string& out_dir, std::string* filename = NULL);
 void IntToStr(int val, char* buf, int base);
 
+// 64-bit FNV-1a hash, pass the previous result as seed to hash several blocks
+#define HASH_SEED_FNV 0xcbf29ce484222325ULL
+UINT64 HashBytes(const void* pData, size_t size, UINT64 seed = HASH_SEED_FNV);
+
 
 float ComputeWeightAndIndex(UINT32 frameCnt, float cur_t, UINT32& floorIdx, UINT32& ceilingIdx);
 
@@ -20,7 +20,8 @@ int KEvent::Wait()
 {
 	int ret = 0;
 	pthread_mutex_lock(&mMutex);
-	if (mFlag == 0)
+	// The wait may return without a signal
+	while (mFlag <= 0 && ret == 0)
 		ret = pthread_cond_wait(&mCond, &mMutex);
 
 	--mFlag;
@@ -40,377 +41,324 @@ int KEvent::Signal()
 
 namespace ThreadModel {
 
-void* ThreadBucket::TaskFuncion(void* lpParam)
-{
-	TaskParam* pParam = (TaskParam*)lpParam;
-
-	ThreadBucket* pThreadBucket = (ThreadBucket*)pParam->pThreadBucket;
-	while (1) {
-		pThreadBucket->mThreadStartMutex[pParam->task_idx].Wait();
-
-		if (pParam->pTask) {
-			pParam->pTask->Execute();
-			pParam->pTask = NULL;
-		}
-		else if (pThreadBucket->mbInDestory) {
-			pthread_exit((void*)1);
-		}
-
-		pParam->pThreadBucket->NotifyTaskDone(pParam->task_idx);
-	}
-
-	pthread_exit((void*)0);
-	return (void*)0;
-}
-
-ThreadBase::ThreadBase(UINT32 thread_cnt, PFnThreadRoutine pFunc)
+WorkStealingPool::WorkStealingPool(UINT32 thread_cnt)
 {
 	if (thread_cnt == INVALID_INDEX)
 		thread_cnt = GetCPUCount();
-	mTasks.resize(thread_cnt);
-	mpThreadRountine = pFunc;
-}
+	if (thread_cnt == 0)
+		thread_cnt = 1;
 
-bool ThreadBase::InitThreads()
-{
-	// Create joinable threads
+	mIsRunning = 0;
+	mBusyWorkerCnt = 0;
+	mParkedCnt = 0;
+	mAffinityMode = THREAD_AFFINITY;
+	mbInDestory = false;
+	mWorkers.resize(thread_cnt);
+	for (UINT32 i = 0; i < thread_cnt; ++i) {
+		mWorkers[i] = new Worker;
+		mWorkers[i]->mTop = 0;
+		mWorkers[i]->mBottom = 0;
+		mWorkers[i]->mParked = 0;
+		mWorkers[i]->pPool = this;
+		mWorkers[i]->worker_idx = i;
+	}
+
+	// Worker 0 is the thread calling Run, create the others
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-
-	for (UINT32 i = 0; i < (UINT32)mTasks.size(); ++i) {
-		mTasks[i].pThreadBucket = this;
-		mTasks[i].task_idx = i;
-		mTasks[i].pTask = NULL;
-
-		int ret = pthread_create(&mTasks[i].pThreadHandle, &attr, mpThreadRountine, &mTasks[i]);
-
-		if (ret) {
-			// Something wrong when creating thread
-			assert(0);
-			return false;
-		}
+	for (UINT32 i = 1; i < thread_cnt; ++i) {
+		int ret = pthread_create(&mWorkers[i]->thread_handle, &attr, WorkerFunction, mWorkers[i]);
+		assert(ret == 0);
 	}
-
-	// Release the thread arribute object
 	int ret = pthread_attr_destroy(&attr);
 	assert(ret == 0);
-	return true;
 }
 
-ThreadBase::~ThreadBase()
+WorkStealingPool::~WorkStealingPool()
 {
+	mbInDestory = true;
+	for (size_t i = 1; i < mWorkers.size(); ++i)
+		mWorkers[i]->mStartEvent.Signal();
 
-}
-
-void ThreadBase::Destory()
-{
 	void *status;
-	for (UINT32 i = 0; i < (UINT32)mTasks.size(); ++i) {
-		int ret = pthread_join(mTasks[i].pThreadHandle, &status);
+	for (size_t i = 1; i < mWorkers.size(); ++i) {
+		int ret = pthread_join(mWorkers[i]->thread_handle, &status);
 		assert(ret == 0);
 	}
+	for (size_t i = 0; i < mWorkers.size(); ++i)
+		delete mWorkers[i];
 }
 
-UINT32 ThreadBase::GetThreadCnt()
-{
-	return (UINT32)mTasks.size();
-}
-
-void ThreadBase::SetThreadTask(UINT32 idx, IThreadTask* pTask)
-{
-	mTasks[idx].pTask = pTask;
-}
+static WorkStealingPool* s_pSharedPool = NULL;
 
-ThreadBucket::ThreadBucket() :
-	ThreadBase(INVALID_INDEX, TaskFuncion)
+WorkStealingPool* WorkStealingPool::GetShared(UINT32 thread_cnt)
 {
-	mThreadStartMutex = NULL;
-	Init((UINT32)mTasks.size());
+	if (thread_cnt == 0)
+		thread_cnt = 1;
+	if (s_pSharedPool && (s_pSharedPool->GetWorkerCnt() != thread_cnt || s_pSharedPool->mAffinityMode != THREAD_AFFINITY))
+		ReleaseShared();
+	if (!s_pSharedPool)
+		s_pSharedPool = new WorkStealingPool(thread_cnt);
+	return s_pSharedPool;
 }
 
-ThreadBucket::ThreadBucket(UINT32 thread_cnt) :
-	ThreadBase(thread_cnt, TaskFuncion)
+void WorkStealingPool::ReleaseShared()
 {
-	mThreadStartMutex = NULL;
-	Init((UINT32)mTasks.size());
+	delete s_pSharedPool;
+	s_pSharedPool = NULL;
 }
 
-void ThreadBucket::Init(UINT32 thread_cnt)
+bool WorkStealingPool::PushJob(Worker& worker, const Job& job)
 {
-	mbInDestory = false;
-	mSpinLock = 0;
-	mThreadCntInProgress = 0;
-
-	mThreadStartMutex = new KEvent[thread_cnt];
-
-	InitThreads();
-}
-
-ThreadBucket::~ThreadBucket()
-{
-	mbInDestory = true;
-	for (size_t i = 0; i < mTasks.size(); ++i) {
-		mTasks[i].pTask = NULL;
-		// Unlock the mutex so that the threads teminates normally.
-		int ret = mThreadStartMutex[i].Signal();
-		assert(ret == 0);
-	}
-	Destory();
-	delete[] mThreadStartMutex;
+	long b = worker.mBottom;
+	if (b - worker.mTop >= (long)DEQUE_SIZE)
+		return false;
+	worker.mJobs[b & (DEQUE_SIZE - 1)] = job;
+	// The atomic operation makes the job visible before the new bottom
+	atomic_increment(&worker.mBottom);
+	return true;
 }
 
-void ThreadBucket::NotifyTaskDone(UINT32 idx)
+bool WorkStealingPool::PopJob(Worker& worker, Job& job)
 {
-	EnterSpinLockCriticalSection(mSpinLock);
-	atomic_decrement(&mThreadCntInProgress);
-	if (0 == mThreadCntInProgress) {
-		int ret = mFinishEvent.Signal();
-		assert(ret == 0);
+	long b = atomic_decrement(&worker.mBottom);
+	long t = worker.mTop;
+	if (t > b) {
+		// The deque is empty
+		worker.mBottom = b + 1;
+		return false;
 	}
-	LeaveSpinLockCriticalSection(mSpinLock);
-}
-
-bool ThreadBucket::Run()
-{
-	assert(mThreadCntInProgress == 0);
-	if (mTasks.size() == 1)
-		mTasks[0].pTask->Execute();
-	else {
-		mThreadCntInProgress = (long)mTasks.size();
-
-		for (size_t i = 0; i < mTasks.size(); ++i) {
-			int ret = mThreadStartMutex[i].Signal();
-			assert(ret == 0);
-		}
-
-		mFinishEvent.Wait();
 
+	job = worker.mJobs[b & (DEQUE_SIZE - 1)];
+	if (t == b) {
+		// The last job, race with the thieves for it
+		bool won = (atomic_compare_exchange(&worker.mTop, t + 1, t) == t);
+		worker.mBottom = b + 1;
+		return won;
 	}
 	return true;
 }
 
-
-void ThreadPool::Init(UINT32 thread_cnt)
+bool WorkStealingPool::StealJob(Worker& worker, Job& job)
 {
-	mIdleAccessCS = 0;
-	mbInDestory = false;
-	mIdleThreadIdx = thread_cnt;
-	mIdleThreads.resize(thread_cnt);
-	mThreadStartMutex = new KEvent[thread_cnt];
-	for (UINT32 i = 0; i < thread_cnt; ++i)
-		mIdleThreads[i] = i;
-
-	mWaitIssued = 0;
-	InitThreads();
-}
-
-ThreadPool::ThreadPool() :
-	ThreadBase(INVALID_INDEX, TaskFuncion)
-{
-	mThreadStartMutex = NULL;
-	Init((UINT32)mTasks.size());
-}
+	long t = worker.mTop;
+	long b = worker.mBottom;
+	if (t >= b)
+		return false;
 
-ThreadPool::ThreadPool(UINT32 thread_cnt) :
-	ThreadBase(thread_cnt, TaskFuncion)
-{
-	mThreadStartMutex = NULL;
-	Init((UINT32)mTasks.size());
+	job = worker.mJobs[t & (DEQUE_SIZE - 1)];
+	return (atomic_compare_exchange(&worker.mTop, t + 1, t) == t);
 }
 
-ThreadPool::~ThreadPool()
+bool WorkStealingPool::ExecuteOneJob(UINT32 worker_idx)
 {
-	mbInDestory = true;
-	assert(mIdleThreadIdx == (long)mTasks.size());
-	for (size_t i = 0; i < mTasks.size(); ++i) {
-		mTasks[i].pTask = NULL;
-		mThreadStartMutex[i].Signal();
+	Job job;
+	bool found = PopJob(*mWorkers[worker_idx], job);
+	for (UINT32 i = 1; !found && i < (UINT32)mWorkers.size(); ++i) {
+		UINT32 victim = (worker_idx + i) % (UINT32)mWorkers.size();
+		found = StealJob(*mWorkers[victim], job);
 	}
-	Destory();
-	delete[] mThreadStartMutex;
-}
 
-
-void ThreadPool::NotifyTaskDone(UINT32 idx)
-{
-	EnterSpinLockCriticalSection(mIdleAccessCS);
-	mIdleThreads[mIdleThreadIdx++] = idx;
-#ifdef DEBUG
-	for (long i = 0; i < mIdleThreadIdx - 1; ++i) {
-		assert(mIdleThreads[i] != idx);
+	if (found) {
+		job.pTask->Execute(worker_idx);
+		atomic_decrement(&job.pGroup->mPendingCnt);
 	}
-	assert(mBusyThreads.find(idx) == mBusyThreads.end());
-#endif
-	mBusyThreads.erase(idx);
-	if (mWaitIssued && mIdleThreadIdx == (long)mTasks.size()) {
-		mIdleFlag.Signal();
-	}
-	LeaveSpinLockCriticalSection(mIdleAccessCS);
+	return found;
 }
 
-void* ThreadPool::TaskFuncion(void* lpParam)
+void WorkStealingPool::BindWorker(UINT32 worker_idx) const
 {
-	TaskParam* pParam = (TaskParam*)lpParam;
-	ThreadPool* pThreadPool = (ThreadPool*)pParam->pThreadBucket;
-
-	while (1) {
-		pThreadPool->mThreadStartMutex[pParam->task_idx].Wait();
-		if (pParam->pTask) {
-			pParam->pTask->Execute();
-		}
-		else if (pThreadPool->mbInDestory) {
-			pthread_exit((void*)1);
+	// Take the cpus from the nodes in turn, so that a few workers still use the memory of all the nodes
+	UINT32 nodeCnt = GetNumaNodeCount();
+	std::vector<std::vector<UINT32> > nodeCPUs(nodeCnt);
+	size_t cpuCnt = 0;
+	for (UINT32 i = 0; i < nodeCnt; ++i) {
+		GetNumaNodeCPUs(i, nodeCPUs[i]);
+		cpuCnt += nodeCPUs[i].size();
+	}
+	if (cpuCnt == 0)
+		return;
+
+	UINT32 slot = worker_idx % (UINT32)cpuCnt;
+	for (UINT32 round = 0; ; ++round) {
+		for (UINT32 i = 0; i < nodeCnt; ++i) {
+			if (round >= nodeCPUs[i].size())
+				continue;
+			if (slot-- > 0)
+				continue;
+			if (mAffinityMode == 2)
+				BindThreadToCPUs(nodeCPUs[i]);
+			else
+				BindThreadToCPUs(std::vector<UINT32>(1, nodeCPUs[i][round]));
+			return;
 		}
-		pThreadPool->NotifyTaskDone(pParam->task_idx);
 	}
-
-	pthread_exit((void*)0);
-	return (void*)0;
 }
 
-UINT32 ThreadPool::PopIdleThreadIndex()
+bool WorkStealingPool::HasPendingJob() const
 {
-	EnterSpinLockCriticalSection(mIdleAccessCS);
-	
-	UINT32 ret = INVALID_INDEX;
-	if (mIdleThreadIdx != 0) {
-		--mIdleThreadIdx;
-		ret = mIdleThreads[mIdleThreadIdx];
-		mBusyThreads.insert(ret);
+	for (size_t i = 0; i < mWorkers.size(); ++i) {
+		if (mWorkers[i]->mTop < mWorkers[i]->mBottom)
+			return true;
 	}
-	LeaveSpinLockCriticalSection(mIdleAccessCS);
-	return ret;
+	return false;
 }
 
-void ThreadPool::KickIdleThread(UINT32 idx)
+void WorkStealingPool::ParkWorker(Worker& worker)
 {
-#ifdef DEBUG
-	EnterSpinLockCriticalSection(mIdleAccessCS);
-	for (long i = 0; i < mIdleThreadIdx; ++i) {
-		assert(mIdleThreads[i] != idx);
+	atomic_increment(&mParkedCnt);
+	atomic_compare_exchange(&worker.mParked, 1, 0);
+	// Check again after the flag is visible, the jobs pushed from now on will wake this worker
+	if (HasPendingJob() || !mIsRunning) {
+		if (atomic_compare_exchange(&worker.mParked, 0, 1) != 1)
+			worker.mWakeEvent.Wait();	// someone has cleared the flag, take its signal
 	}
-	LeaveSpinLockCriticalSection(mIdleAccessCS);
-#endif
-
-	mThreadStartMutex[idx].Signal();
-
+	else
+		worker.mWakeEvent.Wait();
+	atomic_decrement(&mParkedCnt);
 }
 
-void ThreadPool::KickScheduledThreads()
+void WorkStealingPool::WakeWorkers(UINT32 cnt)
 {
-	EnterSpinLockCriticalSection(mIdleAccessCS);
-
-	if (!mBusyThreads.empty()) {
-
-		for (std::set<UINT32>::iterator it = mBusyThreads.begin(); it != mBusyThreads.end(); ++it) {
-			mThreadStartMutex[*it].Signal();
+	for (size_t i = 1; i < mWorkers.size() && cnt > 0; ++i) {
+		Worker& worker = *mWorkers[i];
+		if (worker.mParked && atomic_compare_exchange(&worker.mParked, 0, 1) == 1) {
+			worker.mWakeEvent.Signal();
+			--cnt;
 		}
 	}
-	else
-		mIdleFlag.Signal();
-
-	LeaveSpinLockCriticalSection(mIdleAccessCS);
 }
 
-void ThreadPool::WaitForAll()
+void WorkStealingPool::Spawn(UINT32 worker_idx, IForkJoinTask* pTask, TaskGroup& group)
 {
-	atomic_increment(&mWaitIssued);
-	if (mIdleThreadIdx < (long)mTasks.size())
-		mIdleFlag.Wait();
-	atomic_decrement(&mWaitIssued);
+	atomic_increment(&group.mPendingCnt);
+	Job job = {pTask, &group};
+	if (!PushJob(*mWorkers[worker_idx], job)) {
+		// The deque is full, just run it in place
+		pTask->Execute(worker_idx);
+		atomic_decrement(&group.mPendingCnt);
+	}
+	else if (mParkedCnt > 0)
+		WakeWorkers(1);
 }
 
-void ThreadPool::SetThreadTask(UINT32 idx, IThreadTask* pTask)
+void WorkStealingPool::Wait(UINT32 worker_idx, TaskGroup& group)
 {
-	mTasks[idx].pTask = pTask;
+	UINT32 idleCnt = 0;
+	while (group.mPendingCnt > 0) {
+		if (ExecuteOneJob(worker_idx))
+			idleCnt = 0;
+		else if (++idleCnt > 0x000000ff)
+			SleepForMS(0);
+	}
 }
 
-void ThreadPool::ReleaseScheduledThread(UINT32 idx)
+void WorkStealingPool::Run(IForkJoinTask* pRootTask)
 {
-	NotifyTaskDone(idx);
-}
+	for (size_t i = 0; i < mWorkers.size(); ++i) {
+		mWorkers[i]->mTop = 0;
+		mWorkers[i]->mBottom = 0;
+	}
 
-TaskQueue::TaskQueue()
-{
-	mIsIdle = 0;
-}
+	mIsRunning = 1;
+	mBusyWorkerCnt = (long)mWorkers.size() - 1;
+	for (size_t i = 1; i < mWorkers.size(); ++i)
+		mWorkers[i]->mStartEvent.Signal();
 
-TaskQueue::~TaskQueue()
-{
-}
+	pRootTask->Execute(0);
 
-bool TaskQueue::IsIdle()
-{
-	return (mIsIdle == 0);
-}
-
-UINT32 TaskQueue::AddTask(IThreadTask* pTask)
-{
-	mTaskList.push_back(pTask);
-	return (UINT32)mTaskList.size() - 1;
+	// The root task has waited for all of its children, let the other workers go to sleep
+	atomic_decrement(&mIsRunning);
+	WakeWorkers((UINT32)mWorkers.size());
+	if (mWorkers.size() > 1)
+		mFinishEvent.Wait();
 }
 
-bool TaskQueue::KickStart()
+void* WorkStealingPool::WorkerFunction(void* lpParam)
 {
-	if (!IsIdle())
-		return false;
+	Worker* pWorker = (Worker*)lpParam;
+	WorkStealingPool* pPool = pWorker->pPool;
+	// Worker 0 is the thread calling Run, it's left as it is
+	if (pPool->mAffinityMode != 0)
+		pPool->BindWorker(pWorker->worker_idx);
 
-	atomic_increment(&mIsIdle);
-	mCurrentTask = mTaskList.begin();
+	while (1) {
+		pWorker->mStartEvent.Wait();
+		if (pPool->mbInDestory)
+			break;
+
+		UINT32 idleCnt = 0;
+		while (pPool->mIsRunning) {
+			if (pPool->ExecuteOneJob(pWorker->worker_idx))
+				idleCnt = 0;
+			else if (++idleCnt > 0x000000ff) {
+				pPool->ParkWorker(*pWorker);
+				idleCnt = 0;
+			}
+		}
 
-	// Create joinable threads
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	pthread_create(&mExecutingThread, &attr, TaskFuncion, (void*)this);
-	// Release the thread arribute object
-	int ret = pthread_attr_destroy(&attr);
-	assert(ret == 0);
+		if (0 == atomic_decrement(&pPool->mBusyWorkerCnt))
+			pPool->mFinishEvent.Signal();
+	}
 
-	return true;
+	pthread_exit((void*)0);
+	return (void*)0;
 }
 
-bool TaskQueue::WaitForAll()
+UINT32 TaskGraph::AddTask(IForkJoinTask* pTask, UINT32 instance_cnt)
 {
-	void *status;
-	if (0 == pthread_join(mExecutingThread, &status))
-		return true;
-	else
-		return false;
+	Node node;
+	node.pGraph = this;
+	node.pTask = pTask;
+	node.instance_cnt = instance_cnt > 0 ? instance_cnt : 1;
+	node.dep_cnt = 0;
+	node.pending_instance = 0;
+	node.pending_dep = 0;
+	mNodes.push_back(node);
+	return (UINT32)mNodes.size() - 1;
 }
 
-IThreadTask* TaskQueue::GetNextTask()
+void TaskGraph::AddDependency(UINT32 before, UINT32 after)
 {
-	IThreadTask* ret = NULL;
-	if (mCurrentTask != mTaskList.end()) {
-		ret = *mCurrentTask;
-		++mCurrentTask;
-	}
-
-	return ret;
+	assert(before < mNodes.size() && after < mNodes.size() && before != after);
+	mNodes[before].successors.push_back(after);
+	++mNodes[after].dep_cnt;
 }
 
-void TaskQueue::NotifyAllDone()
+void TaskGraph::SpawnNode(UINT32 worker_idx, Node& node)
 {
-	mTaskList.clear();
-	atomic_decrement(&mIsIdle);
+	node.pending_instance = (long)node.instance_cnt;
+	for (UINT32 i = 0; i < node.instance_cnt; ++i)
+		mPool.Spawn(worker_idx, &node, mGroup);
 }
 
-void* TaskQueue::TaskFuncion(void* lpParam)
+void TaskGraph::Node::Execute(UINT32 worker_idx)
 {
-	TaskQueue* pTaskQueue = (TaskQueue*)lpParam;
+	pTask->Execute(worker_idx);
+	if (atomic_decrement(&pending_instance) > 0)
+		return;
 
-	IThreadTask* pTask = NULL;
-	while (pTask = pTaskQueue->GetNextTask()) {
-		pTask->Execute();
+	// The last instance releases the nodes after it, they are spawned before this job leaves the
+	// group so the group can't be seen as done in between.
+	for (size_t i = 0; i < successors.size(); ++i) {
+		Node& next = pGraph->mNodes[successors[i]];
+		if (atomic_decrement(&next.pending_dep) == 0)
+			pGraph->SpawnNode(worker_idx, next);
 	}
+}
 
-	pTaskQueue->NotifyAllDone();
+void TaskGraph::Execute(UINT32 worker_idx)
+{
+	mGroup.mPendingCnt = 0;
+	for (size_t i = 0; i < mNodes.size(); ++i)
+		mNodes[i].pending_dep = (long)mNodes[i].dep_cnt;
 
-	pthread_exit((void*)0);
-	return (void*)0;
+	for (size_t i = 0; i < mNodes.size(); ++i) {
+		if (mNodes[i].dep_cnt == 0)
+			SpawnNode(worker_idx, mNodes[i]);
+	}
+	mPool.Wait(worker_idx, mGroup);
 }
 
-
 } // namespace
\ No newline at end of file
@@ -5,8 +5,6 @@
 #include "helper_func.h"
 #include <pthread.h>
 #include <vector>
-#include <set>
-#include <list>
 
 
 class KEvent
@@ -26,111 +24,118 @@ private:
 
 namespace ThreadModel {
 
-	// Interface class that represents tasks
-	class IThreadTask
+	// Task executed by WorkStealingPool, worker_idx tells which worker runs it so that the task
+	// can use per-worker data without locking.
+	class IForkJoinTask
 	{
 	public:
-		virtual void Execute() = 0;
+		virtual void Execute(UINT32 worker_idx) = 0;
 	};
 
-	class ThreadBase;
-	class ThreadBucket;
-
-	struct TaskParam
-	{
-		ThreadBase* pThreadBucket;
-		UINT32 task_idx;
-		IThreadTask* pTask;
-		pthread_t pThreadHandle;
-	};
-	typedef void* (*PFnThreadRoutine)(void* lpThreadParam);
-	class ThreadBase
+	// Counts the spawned tasks that are not finished yet
+	class TaskGroup
 	{
 	public:
-		ThreadBase(UINT32 thread_cnt, PFnThreadRoutine pFunc);
-		virtual ~ThreadBase();
-		virtual void NotifyTaskDone(UINT32 idx) = 0;
-		UINT32 GetThreadCnt();
-		void SetThreadTask(UINT32 idx, IThreadTask* pTask);
-	protected:
-		bool InitThreads();
-		void Destory();
-	protected:
-		PFnThreadRoutine mpThreadRountine;
-		std::vector<TaskParam> mTasks;
-		volatile bool mbInDestory;
+		TaskGroup() {mPendingCnt = 0;}
+		volatile long mPendingCnt;
 	};
-	// A thread bucket is a bunch of threads that are expected to take similiar tasks
-	// and their time consumption will be almost the same. The running function is synchronized
-	// in the calling thread.
-	class ThreadBucket : public ThreadBase
+
+	// Fork-join scheduler. Each worker owns a deque of tasks: the owner pushes and pops at the
+	// bottom, the idle workers steal from the top, so the workers only contend when stealing.
+	// The workers out of tasks park on their own event and Spawn wakes them up.
+	class WorkStealingPool
 	{
 	public:
-		ThreadBucket();
-		ThreadBucket(UINT32 thread_cnt);
-		virtual ~ThreadBucket();
+		// thread_cnt includes the thread calling Run, it's worker 0.
+		WorkStealingPool(UINT32 thread_cnt);
+		~WorkStealingPool();
 
-		bool Run();
-	private:
-		void Init(UINT32 thread_cnt);
-		virtual void NotifyTaskDone(UINT32 idx);
-		static void* TaskFuncion(void* lpParam);
-	protected:
-		KEvent mFinishEvent;
-		volatile long mThreadCntInProgress;
-		KEvent* mThreadStartMutex;
-		SPIN_LOCK_FLAG mSpinLock;
-	};
+		// The pool shared by the rendering passes, the image filters and the accel building. It's
+		// created again when thread_cnt changes, so it's only called when the pool isn't running.
+		static WorkStealingPool* GetShared(UINT32 thread_cnt);
+		static void ReleaseShared();
 
-	class ThreadPool : public ThreadBase
-	{
-	public:
-		ThreadPool();
-		ThreadPool(UINT32 thread_cnt);
-		virtual ~ThreadPool();
-
-		UINT32 PopIdleThreadIndex();
-		void KickIdleThread(UINT32 idx);
-		void KickScheduledThreads();
-		void ReleaseScheduledThread(UINT32 idx);
-		void WaitForAll();
-		void SetThreadTask(UINT32 idx, IThreadTask* pTask);
-	private:
-		void Init(UINT32 thread_cnt);
-		virtual void NotifyTaskDone(UINT32 idx);
-		static void* TaskFuncion(void* lpParam);
-
-	protected:
-		long mIdleThreadIdx;
-		SPIN_LOCK_FLAG mIdleAccessCS;
-		KEvent* mThreadStartMutex;
-		std::vector<UINT32> mIdleThreads;
-		std::set<UINT32> mBusyThreads;
-		KEvent mIdleFlag;
-		volatile long mWaitIssued;;
+		UINT32 GetWorkerCnt() const {return (UINT32)mWorkers.size();}
+		// Execute the root task in the calling thread, the other workers help with the tasks
+		// spawned by it and Run returns when the root task is done.
+		void Run(IForkJoinTask* pRootTask);
+
+		// The two functions can only be called inside the running tasks. Wait executes the
+		// local or stolen tasks until all the tasks of the group are done.
+		void Spawn(UINT32 worker_idx, IForkJoinTask* pTask, TaskGroup& group);
+		void Wait(UINT32 worker_idx, TaskGroup& group);
 
+	private:
+		static const UINT32 DEQUE_SIZE = 4096;	// must be power of 2
+		struct Job {
+			IForkJoinTask* pTask;
+			TaskGroup* pGroup;
+		};
+		struct Worker {
+			volatile long mTop;
+			volatile long mBottom;
+			Job mJobs[DEQUE_SIZE];
+			WorkStealingPool* pPool;
+			UINT32 worker_idx;
+			pthread_t thread_handle;
+			KEvent mStartEvent;
+			KEvent mWakeEvent;
+			volatile long mParked;	// set by the worker before sleeping, cleared by the one waking it
+		};
+
+		bool PushJob(Worker& worker, const Job& job);
+		bool PopJob(Worker& worker, Job& job);
+		bool StealJob(Worker& worker, Job& job);
+		bool ExecuteOneJob(UINT32 worker_idx);
+		bool HasPendingJob() const;
+		// Pin the calling worker thread as THREAD_AFFINITY asks
+		void BindWorker(UINT32 worker_idx) const;
+		void ParkWorker(Worker& worker);
+		void WakeWorkers(UINT32 cnt);
+		static void* WorkerFunction(void* lpParam);
+
+		std::vector<Worker*> mWorkers;
+		volatile long mIsRunning;
+		volatile long mBusyWorkerCnt;
+		volatile long mParkedCnt;
+		UINT32 mAffinityMode;	// THREAD_AFFINITY when the threads are created
+		volatile bool mbInDestory;
+		KEvent mFinishEvent;
 	};
 
-	class TaskQueue
+	// Tasks with dependencies run by WorkStealingPool. A node runs its task instance_cnt times in
+	// parallel, the nodes depending on it are spawned once all the instances are done. So a chain of
+	// passes runs without returning to the calling thread between them.
+	class TaskGraph : public IForkJoinTask
 	{
 	public:
-		TaskQueue();
-		~TaskQueue();
+		TaskGraph(WorkStealingPool& pool) : mPool(pool) {}
 
-		bool IsIdle();
-		UINT32 AddTask(IThreadTask* pTask);
-		bool KickStart();
-		bool WaitForAll();
+		// Returns the index of the node
+		UINT32 AddTask(IForkJoinTask* pTask, UINT32 instance_cnt);
+		void AddDependency(UINT32 before, UINT32 after);
+		// Run all the nodes and return when they are done. It's either the root task of
+		// WorkStealingPool::Run or executed inside a running task.
+		virtual void Execute(UINT32 worker_idx);
 
-		IThreadTask* GetNextTask();
-		void NotifyAllDone();
 	private:
-		static void* TaskFuncion(void* lpParam);
-
-	protected:
-		std::list<IThreadTask*> mTaskList;
-		std::list<IThreadTask*>::iterator mCurrentTask;
-		pthread_t mExecutingThread;
-		volatile long mIsIdle;
+		class Node : public IForkJoinTask
+		{
+		public:
+			virtual void Execute(UINT32 worker_idx);
+
+			TaskGraph* pGraph;
+			IForkJoinTask* pTask;
+			UINT32 instance_cnt;
+			UINT32 dep_cnt;
+			std::vector<UINT32> successors;
+			volatile long pending_instance;
+			volatile long pending_dep;
+		};
+		void SpawnNode(UINT32 worker_idx, Node& node);
+
+		WorkStealingPool& mPool;
+		std::vector<Node> mNodes;
+		TaskGroup mGroup;
 	};
 }
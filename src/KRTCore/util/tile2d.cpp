@@ -1,14 +1,43 @@
 #include "tile2d.h"
+#include <algorithm>
+
+// Tiles each thread gets on average before the costly ones are split
+static const UINT32 TILES_PER_THREAD = 4;
+
+// Position of the d-th cell along the Hilbert curve filling a n x n grid, n is a power of 2
+static void HilbertToXY(UINT32 n, UINT32 d, UINT32& x, UINT32& y)
+{
+	x = y = 0;
+	for (UINT32 s = 1; s < n; s *= 2) {
+		UINT32 rx = 1 & (d / 2);
+		UINT32 ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
 
 Tile2DSet::Tile2DSet()
 {
 	mWidth = 0;
 	mHeight = 0;
 	mTileSize = 0;
+	mMinSize = 0;
+	mThreadCnt = 1;
 
 	mGridX = 0;
 	mGridY = 0;
+	mHasCost = false;
+	mCostTileCnt = 0;
 	mCurGrid = 0;
+	mMaxGridIndex = 0;
 }
 
 Tile2DSet::~Tile2DSet()
@@ -16,19 +45,97 @@ Tile2DSet::~Tile2DSet()
 
 }
 
-void Tile2DSet::Reset(UINT32 w, UINT32 h, UINT32 tile_size)
+void Tile2DSet::Reset(UINT32 w, UINT32 h, UINT32 tile_size, UINT32 min_size, UINT32 thread_cnt)
 {
+	if (min_size == 0) min_size = 1;
+	UINT32 gridX = (w + min_size - 1) / min_size;
+	UINT32 gridY = (h + min_size - 1) / min_size;
+	if (gridX != mGridX || gridY != mGridY || min_size != mMinSize) {
+		mCellCost.assign(gridX * gridY, 0);
+		mHasCost = false;
+	}
+	else if (mCostTileCnt > 0 && mCostTileCnt == mMaxGridIndex) {
+		// Every tile of the last pass is timed
+		mHasCost = true;
+	}
+
 	mWidth = w;
 	mHeight = h;
-	mTileSize = tile_size;
+	mMinSize = min_size;
+	mTileSize = min_size;
+	while (mTileSize * 2 <= tile_size)
+		mTileSize *= 2;
+	mThreadCnt = thread_cnt > 0 ? thread_cnt : 1;
+	mGridX = gridX;
+	mGridY = gridY;
+
+	// Walk the large tiles along the Hilbert curve of the power of 2 grid covering them
+	UINT32 cellCnt = mTileSize / mMinSize;
+	UINT32 tileX = (mGridX + cellCnt - 1) / cellCnt;
+	UINT32 tileY = (mGridY + cellCnt - 1) / cellCnt;
+	UINT32 n = 1;
+	while (n < tileX || n < tileY)
+		n *= 2;
 
-	mGridX = mWidth / tile_size;
-	if (0 != (mWidth % tile_size)) ++mGridX;
-	mGridY = mHeight / tile_size;
-	if (0 != (mHeight % tile_size)) ++mGridY;
+	double totalCost = GetRegionCost(0, 0, n * cellCnt);
+	double targetCost = totalCost / double(mThreadCnt * TILES_PER_THREAD);
+	double remainingCost = totalCost;
+	mTiles.clear();
+	for (UINT32 d = 0; d < n * n; ++d) {
+		UINT32 tx, ty;
+		HilbertToXY(n, d, tx, ty);
+		if (tx < tileX && ty < tileY)
+			AddTile(tx * cellCnt, ty * cellCnt, cellCnt, targetCost, remainingCost);
+	}
 
+	mCostTileCnt = 0;
 	mCurGrid = 0;
-	mMaxGridIndex = mGridX * mGridY;
+	mMaxGridIndex = (long)mTiles.size();
+}
+
+double Tile2DSet::GetRegionCost(UINT32 gx, UINT32 gy, UINT32 cellCnt) const
+{
+	UINT32 endX = std::min(gx + cellCnt, mGridX);
+	UINT32 endY = std::min(gy + cellCnt, mGridY);
+	if (!mHasCost) {
+		UINT32 pixelW = std::min(mWidth, endX * mMinSize) - gx * mMinSize;
+		UINT32 pixelH = std::min(mHeight, endY * mMinSize) - gy * mMinSize;
+		return double(pixelW) * double(pixelH);
+	}
+
+	double cost = 0;
+	for (UINT32 y = gy; y < endY; ++y) {
+		for (UINT32 x = gx; x < endX; ++x)
+			cost += mCellCost[y * mGridX + x];
+	}
+	return cost;
+}
+
+void Tile2DSet::AddTile(UINT32 gx, UINT32 gy, UINT32 cellCnt, double targetCost, double& remainingCost)
+{
+	// Split the tile if it costs more than its share, or if it's too large for the work left after it
+	// to keep the other threads busy. The quarters go in Morton order.
+	double cost = GetRegionCost(gx, gy, cellCnt);
+	if (cellCnt > 1 && (cost > targetCost || cost * mThreadCnt > remainingCost)) {
+		UINT32 half = cellCnt / 2;
+		for (UINT32 i = 0; i < 4; ++i) {
+			UINT32 cx = gx + (i & 1) * half;
+			UINT32 cy = gy + (i >> 1) * half;
+			if (cx < mGridX && cy < mGridY)
+				AddTile(cx, cy, half, targetCost, remainingCost);
+		}
+		return;
+	}
+
+	TileDesc desc;
+	desc.grid_x = gx;
+	desc.grid_y = gy;
+	desc.start_x = gx * mMinSize;
+	desc.start_y = gy * mMinSize;
+	desc.tile_w = std::min(mWidth - desc.start_x, cellCnt * mMinSize);
+	desc.tile_h = std::min(mHeight - desc.start_y, cellCnt * mMinSize);
+	mTiles.push_back(desc);
+	remainingCost -= cost;
 }
 
 bool Tile2DSet::GetNextTile(TileDesc& desc)
@@ -38,13 +145,19 @@ bool Tile2DSet::GetNextTile(TileDesc& desc)
 	if (idx >= mMaxGridIndex)
 		return false;
 
-	long gy = idx / mGridX;
-	long gx = idx % mGridX;
-	desc.grid_x = gx;
-	desc.grid_y = gy;
-	desc.start_x = gx * mTileSize;
-	desc.start_y = gy * mTileSize;
-	desc.tile_w = std::min(mWidth - desc.start_x, mTileSize);
-	desc.tile_h = std::min(mHeight - desc.start_y, mTileSize);
+	desc = mTiles[idx];
 	return true;
-}
\ No newline at end of file
+}
+
+void Tile2DSet::SetTileCost(const TileDesc& desc, double cost)
+{
+	// The tiles don't overlap, so the threads write different cells
+	UINT32 endX = (desc.start_x + desc.tile_w + mMinSize - 1) / mMinSize;
+	UINT32 endY = (desc.start_y + desc.tile_h + mMinSize - 1) / mMinSize;
+	double cellCost = cost / double((endX - desc.grid_x) * (endY - desc.grid_y));
+	for (UINT32 y = desc.grid_y; y < endY; ++y) {
+		for (UINT32 x = desc.grid_x; x < endX; ++x)
+			mCellCost[y * mGridX + x] = cellCost;
+	}
+	atomic_increment(&mCostTileCnt);
+}
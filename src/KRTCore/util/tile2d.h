@@ -1,33 +1,54 @@
 #pragma once
 #include "../base/base_header.h"
 #include "../os/api_wrapper.h"
+#include <vector>
 
+// The tiles of an image handed out to the sampling threads. They follow a Hilbert curve so that the
+// threads working at the same time touch the nearby parts of the scene. The tiles start large, the
+// ones costing more than their share and the ones at the end of the pass are split, so the threads
+// finish at the same time. The cost of each tile is measured in the previous pass with the same set,
+// before that the pixel count is taken instead.
 class Tile2DSet
 {
 public:
 	Tile2DSet();
 	~Tile2DSet();
 
-	void Reset(UINT32 w, UINT32 h, UINT32 tile_size);
-	
+	// tile_size is rounded down to a power of 2 multiple of min_size
+	void Reset(UINT32 w, UINT32 h, UINT32 tile_size, UINT32 min_size, UINT32 thread_cnt);
+
 	struct TileDesc {
 		UINT32 start_x;
 		UINT32 start_y;
 		UINT32 tile_w;
 		UINT32 tile_h;
-		UINT32 grid_x;
+		UINT32 grid_x;	// position in the grid of the smallest tiles
 		UINT32 grid_y;
 	};
 	bool GetNextTile(TileDesc& desc);
+	// Size of the large tiles, each tile lies in one of them
+	UINT32 GetTileSize() const {return mTileSize;}
+	// Record the time spent on a tile for the next pass, it can be called by several threads at once
+	void SetTileCost(const TileDesc& desc, double cost);
 
 protected:
+	double GetRegionCost(UINT32 gx, UINT32 gy, UINT32 cellCnt) const;
+	void AddTile(UINT32 gx, UINT32 gy, UINT32 cellCnt, double targetCost, double& remainingCost);
+
 	UINT32 mWidth;
 	UINT32 mHeight;
 	UINT32 mTileSize;
+	UINT32 mMinSize;
+	UINT32 mThreadCnt;
 
+	// Cost of each cell of the smallest tile size, measured in the last pass
 	UINT32 mGridX;
 	UINT32 mGridY;
+	std::vector<double> mCellCost;
+	LOCK_FREE_LONG mCostTileCnt;	// tiles timed in the current pass
+	bool mHasCost;
 
+	std::vector<TileDesc> mTiles;
 	LOCK_FREE_LONG mCurGrid;
 	long mMaxGridIndex;
-};
\ No newline at end of file
+};
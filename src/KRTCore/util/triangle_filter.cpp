@@ -2,12 +2,16 @@
 #include "thread_model.h"
 #include "../intersection/intersect_tri_bbox.h"
 #include <assert.h>
+#include <algorithm>
 
 
 #define MERGE_DST_OVERFLOW	2
 #define MERGE_SRC_OVERFLOW	0
 #define MERGE_OK			1
-class FilterByBBoxTask : public ThreadModel::IThreadTask
+// Each worker gets several chunks so that the faster workers can steal the remaining ones
+#define CHUNK_CNT_PER_WORKER	4
+
+class FilterByBBoxTask : public ThreadModel::IForkJoinTask
 {
 public:
 	// input/output
@@ -20,18 +24,22 @@ public:
 	const KAccelStruct_KDTree* pscene;
 	const KBBox* clamp_box;
 	const KBBox* triBBox;
+	bool clip_tri_bbox;
 
-	virtual void Execute()
+	virtual void Execute(UINT32 worker_idx)
 	{
 		UINT32 i = 0;
 		output_cnt = input_cnt;
 		while (i < output_cnt) {
 			UINT32 idx = ptri_idx[i];
-			const KTriDesc* pAccelTri = pscene->GetAccelTriData(idx);
 			KTriVertPos2 triPos;
-			pscene->GetSource()->GetAccelTriPos(*pAccelTri, triPos);
+			pscene->GetSource()->GetAccelTriPos(pscene->GetAccelTriData(idx), triPos);
 			if (triPos.mIsMoving || TriIntersectBBox(triPos.mVertPos, *clamp_box)) {
-				bbox.Add(triBBox[idx]);
+				KBBox clipBox;
+				if (clip_tri_bbox && !triPos.mIsMoving && ClipTriangleBBox(triPos.mVertPos, *clamp_box, clipBox))
+					bbox.Add(clipBox);
+				else
+					bbox.Add(triBBox[idx]);
 			}
 			else {
 				std::swap(ptri_idx[i], ptri_idx[output_cnt - 1]);
@@ -68,25 +76,29 @@ public:
 
 
 void FilterByBBox(UINT32* ptri_idx, UINT32& cnt, KBBox& out_bbox, 
-				  ThreadModel::ThreadBucket& thread_bucket, 
+				  ThreadModel::WorkStealingPool& worker_pool, UINT32 worker_idx,
 				  const KBBox* pTriBBox,
-				  const KAccelStruct_KDTree* pscene, const KBBox* clamp_box)
+				  const KAccelStruct_KDTree* pscene, const KBBox* clamp_box, bool clip_tri_bbox)
 {
 	std::vector<FilterByBBoxTask> tasks;
-	UINT32 thread_cnt = thread_bucket.GetThreadCnt();
+	UINT32 thread_cnt = worker_pool.GetWorkerCnt() * CHUNK_CNT_PER_WORKER;
 	tasks.resize(thread_cnt);
 	UINT32 tri_cnt_thread = cnt / thread_cnt;
 	for (UINT32 i = 0; i < thread_cnt; ++i) {
 		tasks[i].pscene = pscene;
 		tasks[i].clamp_box = clamp_box;
 		tasks[i].triBBox = pTriBBox;
+		tasks[i].clip_tri_bbox = clip_tri_bbox;
 		tasks[i].input_cnt = tri_cnt_thread;
 		tasks[i].ptri_idx = (ptri_idx + tri_cnt_thread*i);
-		thread_bucket.SetThreadTask(i, &tasks[i]);
 	}
 	tasks[thread_cnt-1].input_cnt += (cnt % thread_cnt);
 	
-	thread_bucket.Run();
+	ThreadModel::TaskGroup taskGroup;
+	for (UINT32 i = 1; i < thread_cnt; ++i)
+		worker_pool.Spawn(worker_idx, &tasks[i], taskGroup);
+	tasks[0].Execute(worker_idx);
+	worker_pool.Wait(worker_idx, taskGroup);
 
 	cnt = 0;
 	out_bbox.SetEmpty();
@@ -110,7 +122,7 @@ void FilterByBBox(UINT32* ptri_idx, UINT32& cnt, KBBox& out_bbox,
 
 }
 
-class CalcuTriBBoxTask : public ThreadModel::IThreadTask
+class CalcuTriBBoxTask : public ThreadModel::IForkJoinTask
 {
 public:
 	// input/output
@@ -123,7 +135,7 @@ public:
 	const KAccelStruct_KDTree* pscene;
 	const KBBox* triBBox;
 
-	virtual void Execute()
+	virtual void Execute(UINT32 worker_idx)
 	{
 		UINT32 end_idx = start_idx + cnt;
 		if (ptri_idx) {
@@ -140,12 +152,12 @@ public:
 };
 
 void CalcuTriangleArrayBBox(const UINT32* ptri_idx, UINT32 cnt, KBBox& out_bbox, 
-							ThreadModel::ThreadBucket& thread_bucket, 
+							ThreadModel::WorkStealingPool& worker_pool, UINT32 worker_idx,
 							const KBBox* pTriBBox,
 							const KAccelStruct_KDTree* pscene)
 {
 	std::vector<CalcuTriBBoxTask> tasks;
-	UINT32 thread_cnt = thread_bucket.GetThreadCnt();
+	UINT32 thread_cnt = worker_pool.GetWorkerCnt() * CHUNK_CNT_PER_WORKER;
 	tasks.resize(thread_cnt);
 
 	UINT32 tri_cnt_thread = cnt / thread_cnt;
@@ -156,11 +168,14 @@ void CalcuTriangleArrayBBox(const UINT32* ptri_idx, UINT32 cnt, KBBox& out_bbox,
 		tasks[i].ptri_idx = ptri_idx;
 		tasks[i].start_idx = tri_cnt_thread*i;
 		tasks[i].triBBox = pTriBBox;
-		thread_bucket.SetThreadTask(i, &tasks[i]);
 	}
 	tasks[thread_cnt-1].cnt += (cnt % thread_cnt);
 	
-	thread_bucket.Run();
+	ThreadModel::TaskGroup taskGroup;
+	for (UINT32 i = 1; i < thread_cnt; ++i)
+		worker_pool.Spawn(worker_idx, &tasks[i], taskGroup);
+	tasks[0].Execute(worker_idx);
+	worker_pool.Wait(worker_idx, taskGroup);
 
 	out_bbox.SetEmpty();
 	for (UINT32 i = 0; i < thread_cnt; ++i) {
@@ -242,4 +257,171 @@ float CalcuSplittingPosition(const UINT32* ptri_idx, UINT32 cnt,
 		return startPos + (endPos - startPos) * splitRatio;
 	}
 
-}
\ No newline at end of file
+}
+
+float CalcuSAHLeafCost(UINT32 cnt, const KAccelStruct::SAH_Param& param)
+{
+	// The leaf triangles are tested by the JIT kernel in batches of SIMD width
+	UINT32 batchCnt = (cnt + param.simd_width - 1) / param.simd_width;
+	float cost = param.intersect_cost * (float)batchCnt;
+	if (param.pair_intersect_cost > 0) {
+		// The triangles of a mesh mostly find their mate in the same leaf, a batch of pairs holds twice as many
+		UINT32 pairBatchCnt = (cnt + param.simd_width * 2 - 1) / (param.simd_width * 2);
+		float pairCost = param.pair_intersect_cost * (float)pairBatchCnt;
+		if (pairCost < cost)
+			cost = pairCost;
+	}
+	return cost;
+}
+
+// Cost of splitting the box along "axis" at distance "pos" from the box's minimum,
+// with cntMinus triangles on the - side and cntPlus triangles on the + side
+static float EvalSAHCost(const KVec3& extent, float rcpArea, int axis, float pos,
+						 UINT32 cntMinus, UINT32 cntPlus,
+						 const KAccelStruct::SAH_Param& param)
+{
+	float d1 = extent[(axis+1) % 3];
+	float d2 = extent[(axis+2) % 3];
+	float areaMinus = pos * (d1 + d2) + d1 * d2;
+	float areaPlus = (extent[axis] - pos) * (d1 + d2) + d1 * d2;
+	return param.traversal_cost + 
+		(areaMinus * CalcuSAHLeafCost(cntMinus, param) + areaPlus * CalcuSAHLeafCost(cntPlus, param)) * rcpArea;
+}
+
+bool CalcuSAHSplitBinned(const UINT32* ptri_idx, UINT32 cnt, 
+						 const KBBox& bbox, const KBBox* pTriBBox,
+						 const KAccelStruct::SAH_Param& param,
+						 std::vector<UINT32>& bins,
+						 int& outAxis, float& outPos, float& outCost)
+{
+	KVec3 extent = bbox.mMax - bbox.mMin;
+	float halfArea = extent[0]*extent[1] + extent[1]*extent[2] + extent[2]*extent[0];
+	if (halfArea <= 0)
+		return false;
+	float rcpArea = 1.0f / halfArea;
+
+	int binCnt = (int)param.bin_cnt;
+	size_t mem_size = (size_t)binCnt * 2;
+	if (bins.size() < mem_size)
+		bins.resize(mem_size);
+	UINT32* startBins = &bins[0];
+	UINT32* endBins = startBins + binCnt;
+
+	outCost = CalcuSAHLeafCost(cnt, param);
+	bool found = false;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (extent[axis] <= 0)
+			continue;
+		float startPos = bbox.mMin[axis];
+		float stepLen = extent[axis] / (float)binCnt;
+		float rcpStepLen = 1.0f / stepLen;
+
+		// Step 1: bin the start and end position of each triangle
+		for (int i = 0; i < binCnt; ++i) {
+			startBins[i] = 0;
+			endBins[i] = 0;
+		}
+		for (UINT32 i = 0; i < cnt; ++i) {
+			UINT32 idx = (ptri_idx ? ptri_idx[i] : i);
+			int binIdx[2];
+			for (int j = 0; j < 2; ++j) {
+				float tBinIdx = (pTriBBox[idx][j][axis] - startPos) * rcpStepLen;
+				if (tBinIdx < 0) 
+					tBinIdx = 0;
+				else if (tBinIdx >= (float)binCnt)
+					tBinIdx = (float)binCnt - 0.5f;
+				binIdx[j] = (int)tBinIdx;
+			}
+			++startBins[binIdx[0]];
+			++endBins[binIdx[1]];
+		}
+
+		// Step 2: sweep the bin boundaries, the - side holds every triangle started before the plane
+		// and the + side holds every triangle not yet ended.
+		UINT32 cntMinus = 0;
+		UINT32 cntPlus = cnt;
+		for (int i = 0; i < binCnt - 1; ++i) {
+			cntMinus += startBins[i];
+			cntPlus -= endBins[i];
+			if (cntMinus == 0 || cntPlus == 0)
+				continue;
+			float tPos = stepLen * float(i + 1);
+			float tCost = EvalSAHCost(extent, rcpArea, axis, tPos, cntMinus, cntPlus, param);
+			if (tCost < outCost) {
+				outCost = tCost;
+				outAxis = axis;
+				outPos = startPos + tPos;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+bool CalcuSAHSplitSweep(const UINT32* ptri_idx, UINT32 cnt, 
+						const KBBox& bbox, const KBBox* pTriBBox,
+						const KAccelStruct::SAH_Param& param,
+						std::vector<KAccelStruct_KDTree::SAH_Event>& events,
+						int& outAxis, float& outPos, float& outCost)
+{
+	KVec3 extent = bbox.mMax - bbox.mMin;
+	float halfArea = extent[0]*extent[1] + extent[1]*extent[2] + extent[2]*extent[0];
+	if (halfArea <= 0)
+		return false;
+	float rcpArea = 1.0f / halfArea;
+
+	if (events.size() < (size_t)cnt * 2)
+		events.resize((size_t)cnt * 2);
+
+	outCost = CalcuSAHLeafCost(cnt, param);
+	bool found = false;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (extent[axis] <= 0)
+			continue;
+		float minPos = bbox.mMin[axis];
+		float maxPos = bbox.mMax[axis];
+
+		// Step 1: generate the start/end events clamped to the node's bounding box and sort them
+		for (UINT32 i = 0; i < cnt; ++i) {
+			UINT32 idx = (ptri_idx ? ptri_idx[i] : i);
+			float tMin = pTriBBox[idx].mMin[axis];
+			float tMax = pTriBBox[idx].mMax[axis];
+			events[i*2].pos = (tMin < minPos) ? minPos : tMin;
+			events[i*2].is_start = 1;
+			events[i*2 + 1].pos = (tMax > maxPos) ? maxPos : tMax;
+			events[i*2 + 1].is_start = 0;
+		}
+		std::sort(events.begin(), events.begin() + (size_t)cnt * 2);
+
+		// Step 2: sweep each candidate plane, triangles touching the plane go to both sides
+		UINT32 startCnt = 0;
+		UINT32 endCnt = 0;
+		UINT32 i = 0;
+		while (i < cnt * 2) {
+			float tPos = events[i].pos;
+			UINT32 groupStart = 0;
+			UINT32 groupEnd = 0;
+			while (i < cnt * 2 && events[i].pos == tPos) {
+				if (events[i].is_start)
+					++groupStart;
+				else
+					++groupEnd;
+				++i;
+			}
+			UINT32 cntMinus = startCnt + groupStart;
+			UINT32 cntPlus = cnt - endCnt;
+			if (tPos > minPos && tPos < maxPos && cntMinus != 0 && cntPlus != 0) {
+				float tCost = EvalSAHCost(extent, rcpArea, axis, tPos - minPos, cntMinus, cntPlus, param);
+				if (tCost < outCost) {
+					outCost = tCost;
+					outAxis = axis;
+					outPos = tPos;
+					found = true;
+				}
+			}
+			startCnt += groupStart;
+			endCnt += groupEnd;
+		}
+	}
+	return found;
+}
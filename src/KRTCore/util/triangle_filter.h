@@ -4,16 +4,34 @@
 #include "thread_model.h"
 #include "../scene/kd_tree_scene.h"
 
+// The two functions split the triangles into chunks and spawn them in the worker pool, they can
+// only be called by a task running in the pool.
 void FilterByBBox(UINT32* ptri_idx, UINT32& cnt, KBBox& out_bbox, 
-				  ThreadModel::ThreadBucket& thread_bucket, 	
+				  ThreadModel::WorkStealingPool& worker_pool, UINT32 worker_idx,
 				  const KBBox* pTriBBox,
-				  const KAccelStruct_KDTree* pscene, const KBBox* clamp_box);
+				  const KAccelStruct_KDTree* pscene, const KBBox* clamp_box, bool clip_tri_bbox);
 
 void CalcuTriangleArrayBBox(const UINT32* ptri_idx, UINT32 cnt, KBBox& out_bbox, 
-							ThreadModel::ThreadBucket& thread_bucket, 
+							ThreadModel::WorkStealingPool& worker_pool, UINT32 worker_idx,
 							const KBBox* pTriBBox,
 							const KAccelStruct_KDTree* pscene);
 
 float CalcuSplittingPosition(const UINT32* ptri_idx, UINT32 cnt, 
 							 const KBBox& bbox, const KBBox* pTriBBox,
-							 int splitAxis, std::vector<UINT32>& pigeonHoles);
\ No newline at end of file
+							 int splitAxis, std::vector<UINT32>& pigeonHoles);
+
+// Surface area heuristic split selection. Both functions evaluate all three axes and
+// return false if no splitting plane is cheaper than making the node a leaf.
+float CalcuSAHLeafCost(UINT32 cnt, const KAccelStruct::SAH_Param& param);
+
+bool CalcuSAHSplitBinned(const UINT32* ptri_idx, UINT32 cnt, 
+						 const KBBox& bbox, const KBBox* pTriBBox,
+						 const KAccelStruct::SAH_Param& param,
+						 std::vector<UINT32>& bins,
+						 int& outAxis, float& outPos, float& outCost);
+
+bool CalcuSAHSplitSweep(const UINT32* ptri_idx, UINT32 cnt, 
+						const KBBox& bbox, const KBBox* pTriBBox,
+						const KAccelStruct::SAH_Param& param,
+						std::vector<KAccelStruct_KDTree::SAH_Event>& events,
+						int& outAxis, float& outPos, float& outCost);
@@ -0,0 +1,86 @@
+#include "accel_check.h"
+#include "test_scene.h"
+#include <KRTCore/scene/bvh_scene.h>
+#include <stdio.h>
+
+
+// Exposes the key of the cached structures
+class AccelCacheCheck : public KAccelStruct_BVH
+{
+public:
+	AccelCacheCheck(const KSceneSet* sceneSet) : KAccelStruct_BVH(sceneSet) {}
+	using KAccelStruct_BVH::ComputeCacheKey;
+};
+
+UINT32 CheckAccelCacheKey()
+{
+	UINT32 failCnt = 0;
+	KSceneSet sceneSet;
+	UINT32 sceneIdx = 0;
+	AddGridMesh(*sceneSet.AddKDScene(sceneIdx), 16, KVec3(0, 0, 50.0f), 1.5f);
+	UINT32 nodeIdx = sceneSet.SceneNode_Create(sceneIdx);
+	KMatrix4 identity;
+	nvmath::setIdentity(identity);
+	sceneSet.SceneNodeTM_SetStaticNode(nodeIdx, identity);
+	AccelCacheCheck accel(&sceneSet);
+	UINT64 key = accel.ComputeCacheKey();
+
+	// Each setting must change the key and give it back once restored
+	UINT32* pUintParam[] = {&LEAF_TRI_PAIR, &SPATIAL_SPLIT, &KD_BUILD_MODE, &ACCEL_STRUCT_TYPE, &LEAF_TRIANGLE_CNT};
+	const char* uintParamName[] = {"LEAF_TRI_PAIR", "SPATIAL_SPLIT", "KD_BUILD_MODE", "ACCEL_STRUCT_TYPE", "LEAF_TRIANGLE_CNT"};
+	for (UINT32 i = 0; i < sizeof(pUintParam) / sizeof(pUintParam[0]); ++i) {
+		UINT32 value = *pUintParam[i];
+		*pUintParam[i] = (value == 0 ? 1 : value - 1);
+		bool changed = (accel.ComputeCacheKey() != key);
+		*pUintParam[i] = value;
+		if (!changed || accel.ComputeCacheKey() != key) {
+			printf("Accel cache check failed : %s doesn't invalidate the cache.\n", uintParamName[i]);
+			++failCnt;
+		}
+	}
+	float* pFloatParam[] = {&SAH_TRAVERSAL_COST, &SAH_INTERSECT_COST, &SPATIAL_SPLIT_BUDGET};
+	const char* floatParamName[] = {"SAH_TRAVERSAL_COST", "SAH_INTERSECT_COST", "SPATIAL_SPLIT_BUDGET"};
+	for (UINT32 i = 0; i < sizeof(pFloatParam) / sizeof(pFloatParam[0]); ++i) {
+		float value = *pFloatParam[i];
+		*pFloatParam[i] = value + 0.5f;
+		bool changed = (accel.ComputeCacheKey() != key);
+		*pFloatParam[i] = value;
+		if (!changed || accel.ComputeCacheKey() != key) {
+			printf("Accel cache check failed : %s doesn't invalidate the cache.\n", floatParamName[i]);
+			++failCnt;
+		}
+	}
+
+	// The pair cost only matters when the leaves are paired
+	UINT32 triPair = LEAF_TRI_PAIR;
+	float pairCost = SAH_PAIR_INTERSECT_COST;
+	LEAF_TRI_PAIR = 1;
+	UINT64 pairKey = accel.ComputeCacheKey();
+	SAH_PAIR_INTERSECT_COST = pairCost + 0.5f;
+	if (accel.ComputeCacheKey() == pairKey) {
+		printf("Accel cache check failed : SAH_PAIR_INTERSECT_COST doesn't invalidate the cache of the paired leaves.\n");
+		++failCnt;
+	}
+	LEAF_TRI_PAIR = 0;
+	UINT64 noPairKey = accel.ComputeCacheKey();
+	SAH_PAIR_INTERSECT_COST = pairCost;
+	if (accel.ComputeCacheKey() != noPairKey) {
+		printf("Accel cache check failed : SAH_PAIR_INTERSECT_COST invalidates the cache of the unpaired leaves.\n");
+		++failCnt;
+	}
+	LEAF_TRI_PAIR = triPair;
+
+	// So does the geometry
+	KTriMesh* pMesh = sceneSet.GetKDScene(sceneIdx)->GetMesh(0);
+	pMesh->GetVertPN(0)->pos[2] += 1.0f;
+	bool changed = (accel.ComputeCacheKey() != key);
+	pMesh->GetVertPN(0)->pos[2] -= 1.0f;
+	if (!changed) {
+		printf("Accel cache check failed : moving a vertex doesn't invalidate the cache.\n");
+		++failCnt;
+	}
+
+	// The scenes are only freed by Reset
+	sceneSet.Reset();
+	return failCnt;
+}
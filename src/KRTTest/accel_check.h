@@ -0,0 +1,14 @@
+#pragma once
+#include <KRTCore/base/base_header.h>
+
+// Checks of the acceleration structures that can't be seen in the rendered images of the test
+// scenes. Each check prints its failures and returns their count, see main.cpp.
+
+// The SAH build modes cover every triangle and give cheaper trees than the pigeon-hole split
+UINT32 CheckKDBuildSAH();
+// The rays with +0.0 or -0.0 direction components against the scalar and the SSE slab tests
+UINT32 CheckRayBBoxSign();
+// Refitting is refused once the triangles or the instances differ from the built ones
+UINT32 CheckRefitTopology();
+// The settings that change the built structures invalidate the accel cache, the others don't
+UINT32 CheckAccelCacheKey();
@@ -0,0 +1,99 @@
+#include "accel_check.h"
+#include "test_scene.h"
+#include <KRTCore/scene/kd_tree_scene.h>
+#include <KRTCore/util/triangle_filter.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+
+// Exposes the built nodes and leaves of the kd tree
+class KDTreeCheck : public KAccelStruct_KDTree
+{
+public:
+	KDTreeCheck(const KScene* scene) : KAccelStruct_KDTree(scene) {}
+
+	// Expected cost of a ray through the scene box by the surface area heuristic, the triangles
+	// not referenced by any reachable leaf are counted in missingTriCnt.
+	float ComputeSAHCost(UINT32& missingTriCnt) const;
+};
+
+static float SurfaceArea(const KBBox& bbox)
+{
+	float area[3];
+	bbox.GetFaceArea(area);
+	return area[0] + area[1] + area[2];
+}
+
+float KDTreeCheck::ComputeSAHCost(UINT32& missingTriCnt) const
+{
+	std::vector<bool> referenced(mAccelTriCnt, false);
+	float rootArea = SurfaceArea(mSceneBBox);
+	float cost = 0;
+	std::vector<std::pair<UINT32, KBBox> > nodeStack;
+	if (mFlatNodeCnt > 0)
+		nodeStack.push_back(std::make_pair(0u, mSceneBBox));
+	while (!nodeStack.empty()) {
+		UINT32 nodeIdx = nodeStack.back().first;
+		KBBox bbox = nodeStack.back().second;
+		nodeStack.pop_back();
+		float hitProb = SurfaceArea(bbox) / rootArea;
+		const KD_FlatNode& node = mpFlatNode[nodeIdx];
+		if (node.IsLeaf()) {
+			if (node.leaf_idx == INVALID_INDEX)
+				continue;
+			UINT32 triCnt = mAccelLeaves.tri_cnt[node.leaf_idx] & ~LEAF_ANIM_FLAG;
+			const UINT32* pTriIdx = &mAccelLeaves.tri_idx[mAccelLeaves.tri_offset[node.leaf_idx]];
+			for (UINT32 i = 0; i < triCnt; ++i)
+				referenced[pTriIdx[i]] = true;
+			cost += hitProb * CalcuSAHLeafCost(triCnt, mSAHParam);
+			continue;
+		}
+
+		// The + side child is the next node
+		cost += hitProb * mSAHParam.traversal_cost;
+		KBBox plusBox = bbox;
+		KBBox minusBox = bbox;
+		plusBox.mMin[node.SplitAxis()] = node.split_value;
+		minusBox.mMax[node.SplitAxis()] = node.split_value;
+		nodeStack.push_back(std::make_pair(nodeIdx + 1, plusBox));
+		nodeStack.push_back(std::make_pair(node.FarChild(), minusBox));
+	}
+
+	missingTriCnt = (UINT32)std::count(referenced.begin(), referenced.end(), false);
+	return cost;
+}
+
+UINT32 CheckKDBuildSAH()
+{
+	// A coarse height field with a dense one in its corner, the pigeon-hole split doesn't isolate
+	// the dense part as well as the SAH does.
+	KScene scene;
+	AddGridMesh(scene, 16, KVec3(0, 0, 0), 4.0f);
+	AddGridMesh(scene, 32, KVec3(1.0f, 1.0f, 0.5f), 0.05f);
+
+	UINT32 failCnt = 0;
+	const char* modeName[] = {"pigeon-hole", "binned SAH", "SAH sweep"};
+	float cost[3];
+	UINT32 buildMode = KD_BUILD_MODE;
+	for (UINT32 mode = 0; mode < 3; ++mode) {
+		KD_BUILD_MODE = mode;
+		KDTreeCheck accel(&scene);
+		accel.InitAccelData();
+		UINT32 missingTriCnt = 0;
+		cost[mode] = accel.ComputeSAHCost(missingTriCnt);
+		if (missingTriCnt > 0) {
+			printf("KD build check failed : the %s tree misses %u triangles.\n", modeName[mode], missingTriCnt);
+			++failCnt;
+		}
+	}
+	KD_BUILD_MODE = buildMode;
+
+	for (UINT32 mode = 1; mode < 3; ++mode) {
+		if (cost[mode] > cost[0]) {
+			printf("KD build check failed : the %s tree costs %g, the pigeon-hole tree costs %g.\n", modeName[mode], cost[mode], cost[0]);
+			++failCnt;
+		}
+	}
+	return failCnt;
+}
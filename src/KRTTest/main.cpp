@@ -0,0 +1,27 @@
+#include "accel_check.h"
+#include <stdio.h>
+
+typedef UINT32 (*PFN_Check)();
+struct CheckEntry {
+	const char* name;
+	PFN_Check func;
+};
+
+static const CheckEntry s_checks[] = {
+	{"KD build SAH", CheckKDBuildSAH},
+	{"Ray-box sign", CheckRayBBoxSign},
+	{"Refit topology", CheckRefitTopology},
+	{"Accel cache key", CheckAccelCacheKey}
+};
+
+int main(int arg_cnt, const char* args[])
+{
+	UINT32 failCnt = 0;
+	for (UINT32 i = 0; i < sizeof(s_checks) / sizeof(s_checks[0]); ++i) {
+		UINT32 cnt = s_checks[i].func();
+		printf("%-24s : %s\n", s_checks[i].name, cnt ? "failed" : "passed");
+		failCnt += cnt;
+	}
+	printf("%u failure(s).\n", failCnt);
+	return failCnt ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+#include "accel_check.h"
+#include <KRTCore/scene/bvh_scene.h>
+#include <KRTCore/intersection/intersect_ray_bbox.h>
+#include <stdio.h>
+#include <float.h>
+#include <xmmintrin.h>
+
+
+// Exposes the 4-wide slab test of the BVH nodes, it's never instantiated
+class WideBBoxCheck : public KAccelStruct_BVH
+{
+public:
+	using KAccelStruct_BVH::IntersectWideBBox;
+};
+
+UINT32 CheckRayBBoxSign()
+{
+	UINT32 failCnt = 0;
+	KBBox bbox;
+	bbox.mMin = KVec3(0, 0, 0);
+	bbox.mMax = KVec3(1, 1, 1);
+	__m128 boxMin[3], boxMax[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		boxMin[axis] = _mm_set1_ps(0);
+		boxMax[axis] = _mm_set1_ps(1);
+	}
+
+	// The origins are inside, on the faces of and outside the box
+	const float orgValue[] = {-1.0f, 0.0f, 0.5f, 1.0f, 2.0f};
+	const float dirValue[] = {-0.0f, 0.0f, 1.0f, -1.0f, 0.3f};
+	for (UINT32 i = 0; i < 125 * 125; ++i) {
+		UINT32 orgIdx = i / 125;
+		UINT32 dirIdx = i % 125;
+		KVec3d org(orgValue[orgIdx % 5], orgValue[orgIdx / 5 % 5], orgValue[orgIdx / 25]);
+		KVec3d dir(dirValue[dirIdx % 5], dirValue[dirIdx / 5 % 5], dirValue[dirIdx / 25]);
+		if (dir[0] == 0 && dir[1] == 0 && dir[2] == 0)
+			continue;
+
+		KRay ray;
+		ray.Init(org, dir);
+		float t0, t1;
+		bool scalarHit = IntersectBBox(ray, bbox, t0, t1) && t1 >= 0;
+
+		// The same far distance scaling as the BVH traversal
+		__m128 rayOrg[3], rayRcp[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			rayOrg[axis] = _mm_set1_ps(ray.GetOrgF()[axis]);
+			rayRcp[axis] = _mm_set1_ps(ray.mRcpDir[axis]);
+		}
+		__m128 tNear = _mm_setzero_ps();
+		__m128 tFar = _mm_set1_ps(FLT_MAX);
+		WideBBoxCheck::IntersectWideBBox(boxMin, boxMax, rayOrg, rayRcp, ray.mSign, tNear, tFar);
+		tFar = _mm_mul_ps(tFar, _mm_set1_ps(1.0f + 4.0f * FLT_EPSILON));
+		bool wideHit = (_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & 1) != 0;
+
+		// A ray starting inside or on the box always hits it, a ray parallel to a slab it starts
+		// outside of never does.
+		bool inside = true;
+		bool outsideParallel = false;
+		for (int axis = 0; axis < 3; ++axis) {
+			bool outside = (org[axis] < 0 || org[axis] > 1);
+			if (outside)
+				inside = false;
+			if (outside && dir[axis] == 0)
+				outsideParallel = true;
+		}
+		if ((inside && (!scalarHit || !wideHit)) || (outsideParallel && (scalarHit || wideHit))) {
+			if (failCnt < 4)
+				printf("Ray-box check failed : origin (%g %g %g) direction (%g %g %g), hit %d/%d.\n",
+					org[0], org[1], org[2], dir[0], dir[1], dir[2], scalarHit, wideHit);
+			++failCnt;
+		}
+	}
+	return failCnt;
+}
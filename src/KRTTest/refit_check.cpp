@@ -0,0 +1,51 @@
+#include "accel_check.h"
+#include "test_scene.h"
+#include <KRTCore/scene/bvh2_scene.h>
+#include <stdio.h>
+#include <algorithm>
+
+
+UINT32 CheckRefitTopology()
+{
+	UINT32 failCnt = 0;
+	const UINT32 gridSize = 16;
+	KScene scene;
+	AddGridMesh(scene, gridSize, KVec3(0, 0, 50.0f), 1.5f);
+	KAccelStruct_BVH2 accel(&scene);
+	accel.InitAccelData();
+
+	// Moving the vertices keeps the topology
+	KTriMesh* pMesh = scene.GetMesh(0);
+	for (UINT32 i = 0; i < (gridSize + 1) * (gridSize + 1); ++i)
+		pMesh->GetVertPN(i)->pos[2] += 0.5f;
+	if (!accel.RefitAccelData()) {
+		printf("Refit check failed : moved vertices are not refitted.\n");
+		++failCnt;
+	}
+
+	// The same face count with other vertices
+	std::swap(pMesh->mFaces[3].pn_idx[0], pMesh->mFaces[3].pn_idx[1]);
+	pMesh->mFaces[7].pn_idx[2] = 0;
+	if (accel.RefitAccelData()) {
+		printf("Refit check failed : reindexed faces are refitted.\n");
+		++failCnt;
+	}
+
+	accel.InitAccelData();
+	if (!accel.RefitAccelData()) {
+		printf("Refit check failed : the rebuilt structure is not refitted.\n");
+		++failCnt;
+	}
+
+	// Another instance of the same mesh
+	UINT32 nodeIdx = scene.AddNode();
+	scene.GetNode(nodeIdx)->mMesh.push_back(0);
+	KMatrix4 identity;
+	nvmath::setIdentity(identity);
+	scene.SetNodeTM(nodeIdx, identity);
+	if (accel.RefitAccelData()) {
+		printf("Refit check failed : an added instance is refitted.\n");
+		++failCnt;
+	}
+	return failCnt;
+}
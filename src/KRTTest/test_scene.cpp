@@ -0,0 +1,36 @@
+#include "test_scene.h"
+#include <math.h>
+
+
+UINT32 AddGridMesh(KScene& scene, UINT32 gridSize, const KVec3& origin, float spacing)
+{
+	UINT32 meshIdx = scene.AddMesh();
+	KTriMesh* pMesh = scene.GetMesh(meshIdx);
+	UINT32 rowCnt = gridSize + 1;
+	pMesh->SetupPN(rowCnt * rowCnt, false);
+	pMesh->mFaces.resize(gridSize * gridSize * 2);
+	for (UINT32 y = 0; y < rowCnt; ++y) {
+		for (UINT32 x = 0; x < rowCnt; ++x) {
+			float height = sinf(x * 0.9f) * cosf(y * 1.3f) * 1.5f;
+			pMesh->GetVertPN(y * rowCnt + x)->pos = origin + KVec3(x * spacing, y * spacing, height * spacing);
+		}
+	}
+	for (UINT32 y = 0; y < gridSize; ++y) {
+		for (UINT32 x = 0; x < gridSize; ++x) {
+			UINT32 v0 = y * rowCnt + x;
+			UINT32 v1 = v0 + 1;
+			UINT32 v2 = v0 + rowCnt;
+			UINT32 v3 = v2 + 1;
+			KTriangle* pFace = &pMesh->mFaces[(y * gridSize + x) * 2];
+			pFace[0].pn_idx[0] = v0; pFace[0].pn_idx[1] = v1; pFace[0].pn_idx[2] = v3;
+			pFace[1].pn_idx[0] = v0; pFace[1].pn_idx[1] = v3; pFace[1].pn_idx[2] = v2;
+		}
+	}
+
+	UINT32 nodeIdx = scene.AddNode();
+	scene.GetNode(nodeIdx)->mMesh.push_back(meshIdx);
+	KMatrix4 identity;
+	nvmath::setIdentity(identity);
+	scene.SetNodeTM(nodeIdx, identity);
+	return nodeIdx;
+}
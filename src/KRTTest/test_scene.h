@@ -0,0 +1,6 @@
+#pragma once
+#include <KRTCore/base/geometry.h>
+
+// Adds a bumpy height field of gridSize * gridSize quads as a new mesh and node. The heights
+// are a fixed function of the grid position, so every run builds the same structures.
+UINT32 AddGridMesh(KScene& scene, UINT32 gridSize, const KVec3& origin, float spacing);